@@ -0,0 +1,601 @@
+/*
+ * QEmacs, headless benchmark harness
+ *
+ * Copyright (c) 2000-2026 Charlie Gordon.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qe.h"
+
+#include <unistd.h>
+
+/* This module is only linked into `qe-bench` (built with `make bench`).
+ * It replaces the terminal with the dummy display driver, generates a
+ * set of corpora in a temporary directory and runs scripted workloads
+ * on each of them through the regular editor code paths, then exits.
+ * Results are written one JSON object per line:
+ *
+ *   qe-bench -q [--bench-size=KB] [--bench-count=N]
+ *            [--bench-corpus=log,json,c,utf8]
+ *            [--bench-workload=load,scroll,isearch,...]
+ *            [--bench-output=FILE]
+ *
+ * Corpora are generated from a fixed seed so runs are comparable.
+ */
+
+#define BENCH_SHELL_IDLE  2000  /* ms without shell output before giving up */
+
+static int bench_size = 4096;   /* corpus size in KB */
+static int bench_count = 1000;  /* number of operations per workload */
+static const char *bench_corpus_list;
+static const char *bench_workload_list;
+static const char *bench_output;
+
+typedef struct BenchCorpus {
+    const char *name;
+    const char *filename;       /* the extension selects the mode */
+    void (*generate)(EditBuffer *b, int size);
+    const char *isearch_keys;   /* keys typed after C-s */
+    const char *replace_from;
+    const char *replace_to;
+} BenchCorpus;
+
+typedef struct BenchState {
+    QEmacsState *qs;
+    FILE *fp;
+    const BenchCorpus *corpus;
+    char dir[MAX_FILENAME_SIZE];
+    char filename[MAX_FILENAME_SIZE];
+    char tmpfile[MAX_FILENAME_SIZE];    /* removed after the workload */
+    int size, nb_lines;
+    int start_time, stop_time;          /* microseconds */
+    EditBuffer *shell_b;
+    URLTimer *shell_timer;
+    int shell_last_size, shell_last_time;
+} BenchState;
+
+typedef struct BenchWorkload {
+    const char *name;
+    const char *unit;
+    int needs_buffer;   /* run on a freshly loaded corpus */
+    int (*run)(BenchState *bs, EditState *s);
+} BenchWorkload;
+
+/*---------------- corpus generation ----------------*/
+
+static unsigned int bench_seed;
+
+static int bench_rand(int n) {
+    /* xorshift32: deterministic and independent from the libc */
+    bench_seed ^= bench_seed << 13;
+    bench_seed ^= bench_seed >> 17;
+    bench_seed ^= bench_seed << 5;
+    return bench_seed % n;
+}
+
+static void bench_gen_log(EditBuffer *b, int size) {
+    static const char * const levels[] = {
+        "INFO ", "INFO ", "INFO ", "INFO ", "DEBUG", "WARN ", "ERROR",
+    };
+    static const char * const methods[] = {
+        "GET", "GET", "GET", "POST", "PUT", "DELETE",
+    };
+    static const char * const paths[] = {
+        "/api/v2/items", "/api/v2/users", "/static/img", "/login", "/search",
+    };
+    int n, level;
+
+    for (n = 0; b->total_size < size; n++) {
+        level = bench_rand(countof(levels));
+        eb_printf(b, "2026-03-%02d %02d:%02d:%02d.%03d %s [worker-%02d] "
+                  "%s %s/%d status=%d bytes=%d time=%dms trace=%08x\n",
+                  1 + n / 86400 % 28, n / 3600 % 24, n / 60 % 60, n % 60,
+                  bench_rand(1000), levels[level], bench_rand(16),
+                  methods[bench_rand(countof(methods))],
+                  paths[bench_rand(countof(paths))], bench_rand(100000),
+                  level == 6 ? 500 : 200, bench_rand(65536),
+                  bench_rand(2000), bench_rand(1 << 30));
+    }
+}
+
+static void bench_gen_json(EditBuffer *b, int size) {
+    /* a few very long lines, each one a JSON array of records */
+    int line_size = clamp_int(size / 64, 4096, 64 * 1024);
+    int id, start;
+
+    for (id = 0; b->total_size < size;) {
+        start = b->total_size;
+        eb_putc(b, '[');
+        for (;;) {
+            eb_printf(b, "{\"id\":%d,\"name\":\"item-%d\",\"price\":%d.%02d,"
+                      "\"active\":%s,\"tags\":[\"t%d\",\"t%d\"],"
+                      "\"pos\":{\"x\":%d,\"y\":%d}}",
+                      id, id, bench_rand(1000), bench_rand(100),
+                      bench_rand(4) ? "true" : "false",
+                      bench_rand(50), bench_rand(50),
+                      bench_rand(1000), bench_rand(1000));
+            id++;
+            if (b->total_size - start >= line_size)
+                break;
+            eb_putc(b, ',');
+        }
+        eb_puts(b, "]\n");
+    }
+}
+
+static void bench_gen_c_block(EditBuffer *b, int depth) {
+    int i, n = 1 + bench_rand(3);
+
+    for (i = 0; i < n; i++) {
+        /* the first statement always nests until the maximum depth */
+        if (depth < 16 && (i == 0 || bench_rand(3) == 0)) {
+            switch (bench_rand(3)) {
+            case 0:
+                eb_printf(b, "%*sif (counter > %d && name[%d] != '\\0') {\n",
+                          depth * 4, "", bench_rand(1000), depth);
+                break;
+            case 1:
+                eb_printf(b, "%*sfor (int i%d = 0; i%d < %d; i%d++) {\n",
+                          depth * 4, "", depth, depth, bench_rand(100), depth);
+                break;
+            default:
+                eb_printf(b, "%*swhile (counter-- > %d) {\n",
+                          depth * 4, "", bench_rand(100));
+                break;
+            }
+            bench_gen_c_block(b, depth + 1);
+            eb_printf(b, "%*s}\n", depth * 4, "");
+        } else {
+            switch (bench_rand(4)) {
+            case 0:
+                eb_printf(b, "%*s/* adjust the counter for level %d */\n",
+                          depth * 4, "", depth);
+                break;
+            case 1:
+                eb_printf(b, "%*sprintf(\"%%s: %%d\\n\", name, counter); // %d\n",
+                          depth * 4, "", bench_rand(10000));
+                break;
+            default:
+                eb_printf(b, "%*scounter += compute(counter, %d, 0x%04x);\n",
+                          depth * 4, "", bench_rand(1000), bench_rand(65536));
+                break;
+            }
+        }
+    }
+}
+
+static void bench_gen_c(EditBuffer *b, int size) {
+    int n;
+
+    eb_puts(b, "#include <stdio.h>\n\n"
+            "extern int compute(int counter, int a, int b);\n\n");
+    for (n = 0; b->total_size < size; n++) {
+        eb_printf(b, "/* function %d */\n"
+                  "static int func%d(int counter, const char *name)\n{\n",
+                  n, n);
+        bench_gen_c_block(b, 1);
+        eb_puts(b, "    return counter;\n}\n\n");
+    }
+}
+
+static void bench_gen_utf8(EditBuffer *b, int size) {
+    /* double width, combining, non BMP and right to left characters */
+    static const char * const words[] = {
+        "東京", "大阪", "日本語", "漢字かな交じり", "中文字符", "한국어",
+        "ｆｕｌｌｗｉｄｔｈ", "😀", "🚀🚀", "👍🏽", "Ελληνικά", "русский",
+        "café", "naïve", "e\xcc\x81te\xcc\x81", "שלום", "مرحبا",
+        "mark", "ascii", "text", "plain",
+    };
+    int i, n;
+
+    while (b->total_size < size) {
+        n = 8 + bench_rand(12);
+        for (i = 0; i < n; i++) {
+            eb_puts(b, words[bench_rand(countof(words))]);
+            eb_putc(b, i == n - 1 ? '\n' : ' ');
+        }
+    }
+}
+
+static const BenchCorpus bench_corpora[] = {
+    { "log", "huge.log", bench_gen_log,
+      "s t a t u s = 5 0 0", "status=200", "status=OK" },
+    { "json", "long.json", bench_gen_json,
+      "\" a c t i v e \" : f a l s e", "\"active\":true", "\"active\":1" },
+    { "c", "deep.c", bench_gen_c,
+      "r e t u r n", "counter", "count" },
+    { "utf8", "wide.txt", bench_gen_utf8,
+      "m a r k", "東京", "Tokyo" },
+};
+
+/*---------------- workloads ----------------*/
+
+static int bench_load(BenchState *bs, EditState *s) {
+    if (qe_load_file(s, bs->filename, 0, 0) < 0)
+        return -1;
+    qe_display(bs->qs);
+    return bs->nb_lines;
+}
+
+static int bench_scroll(BenchState *bs, EditState *s) {
+    /* page down with redisplay, then page back up as many times */
+    int i, n, offset;
+
+    for (n = 0; n < bench_count / 2;) {
+        offset = s->offset;
+        do_scroll_up_down(s, 2);
+        qe_display(bs->qs);
+        n++;
+        if (s->offset == offset)
+            break;
+    }
+    for (i = 0; i < n; i++) {
+        do_scroll_up_down(s, -2);
+        qe_display(bs->qs);
+    }
+    return 2 * n;
+}
+
+static int bench_isearch(BenchState *bs, EditState *s) {
+    buf_t outbuf, *out;
+    char *keys;
+    int i, size;
+
+    size = strlen(bs->corpus->isearch_keys) + 4 * bench_count + 16;
+    keys = qe_malloc_array(char, size);
+    if (!keys)
+        return -1;
+    out = buf_init(&outbuf, keys, size);
+    buf_puts(out, "C-s ");
+    buf_puts(out, bs->corpus->isearch_keys);
+    for (i = 0; i < bench_count; i++)
+        buf_puts(out, " C-s");
+    buf_puts(out, " RET");
+
+    bs->start_time = get_clock_usec();
+    do_execute_macro_keys(s, keys);
+    qe_display(bs->qs);
+    qe_free(&keys);
+    return bench_count;
+}
+
+static int bench_replace(BenchState *bs, EditState *s) {
+    int offset, found_offset, found_end, n;
+
+    for (n = offset = 0;
+         eb_search_string(s->b, bs->corpus->replace_from, 1,
+                          offset, s->b->total_size, NULL, NULL,
+                          &found_offset, &found_end) > 0;
+         offset = found_end)
+    {
+        n++;
+    }
+    bs->start_time = get_clock_usec();
+    do_replace_string(s, bs->corpus->replace_from, bs->corpus->replace_to, 1);
+    qe_display(bs->qs);
+    return n;
+}
+
+static int bench_colorize(BenchState *bs, EditState *s) {
+    QEColorizeContext cp[1];
+    int offset, offset1, line_num;
+
+    if (!s->colorize_mode)
+        return -1;
+
+    /* discard the colorization states computed by the first display */
+    set_colorize_mode(s, s->colorize_mode);
+    bs->start_time = get_clock_usec();
+    cp_initialize(cp, s);
+    for (offset = line_num = 0; offset < s->b->total_size; line_num++) {
+        get_colorized_line(cp, offset, &offset1, line_num);
+        if (offset1 <= offset)
+            break;
+        offset = offset1;
+    }
+    cp_destroy(cp);
+    return line_num;
+}
+
+static int bench_undo(BenchState *bs, EditState *s) {
+    buf_t outbuf, *out;
+    char *keys;
+    int i, size = 8 * bench_count + 1;
+
+    keys = qe_malloc_array(char, size);
+    if (!keys)
+        return -1;
+    /* scatter single character insertions so each one gets its own
+     * undo record, then undo them all.
+     */
+    out = buf_init(&outbuf, keys, size);
+    for (i = 0; i < bench_count; i++)
+        buf_puts(out, "x M-f ");
+    do_execute_macro_keys(s, keys);
+
+    out = buf_init(&outbuf, keys, size);
+    for (i = 0; i < bench_count; i++)
+        buf_puts(out, "C-_ ");
+    bs->start_time = get_clock_usec();
+    do_execute_macro_keys(s, keys);
+    qe_display(bs->qs);
+    qe_free(&keys);
+    return bench_count;
+}
+
+static int bench_save(BenchState *bs, EditState *s) {
+    makepath(bs->tmpfile, sizeof(bs->tmpfile), bs->dir, "saved-");
+    pstrcat(bs->tmpfile, sizeof(bs->tmpfile), bs->corpus->filename);
+    bs->start_time = get_clock_usec();
+    if (eb_write_buffer(s->b, 0, s->b->total_size, bs->tmpfile) < 0)
+        return -1;
+    return bs->nb_lines;
+}
+
+#if defined(CONFIG_ALL_MODES) && !defined(CONFIG_WIN32)
+static void bench_shell_timer(void *opaque) {
+    BenchState *bs = opaque;
+    EditBuffer *b = bs->shell_b;
+    int now = get_clock_ms();
+
+    if (b->total_size != bs->shell_last_size) {
+        bs->shell_last_size = b->total_size;
+        bs->shell_last_time = now;
+        bs->stop_time = get_clock_usec();
+    }
+    if (b->total_size >= bs->size
+    ||  now - bs->shell_last_time >= BENCH_SHELL_IDLE) {
+        url_exit(bs->qs->up);
+        return;
+    }
+    url_set_timer(bs->qs->up, &bs->shell_timer, 1, bs, bench_shell_timer);
+}
+
+static int bench_shell(BenchState *bs, EditState *s) {
+    /* ingest the corpus through a shell buffer shown in the window */
+    QEmacsState *qs = bs->qs;
+    char cmd[MAX_FILENAME_SIZE + 16];
+
+    snprintf(cmd, sizeof(cmd), "cat '%s'", bs->filename);
+    bs->start_time = get_clock_usec();
+    bs->shell_b = qe_new_shell_buffer(qs, NULL, NULL, "*bench-shell*", NULL,
+                                      bs->dir, cmd, 0);
+    if (!bs->shell_b)
+        return -1;
+    switch_to_buffer(s, bs->shell_b);
+    bs->shell_last_size = 0;
+    bs->shell_last_time = get_clock_ms();
+    url_set_timer(qs->up, &bs->shell_timer, 1, bs, bench_shell_timer);
+    url_main_loop(qs->up);
+    if (bs->shell_b->total_size < bs->size) {
+        fprintf(stderr, "qe-bench: %s: shell ingested %d of %d bytes\n",
+                bs->corpus->name, bs->shell_b->total_size, bs->size);
+    }
+    qe_kill_buffer(qs, bs->shell_b);
+    bs->shell_b = NULL;
+    return bs->nb_lines;
+}
+#endif
+
+static const BenchWorkload bench_workloads[] = {
+    { "load",     "lines",    0, bench_load },
+    { "scroll",   "pages",    1, bench_scroll },
+    { "isearch",  "searches", 1, bench_isearch },
+    { "replace",  "matches",  1, bench_replace },
+    { "colorize", "lines",    1, bench_colorize },
+    { "undo",     "edits",    1, bench_undo },
+    { "save",     "lines",    1, bench_save },
+#if defined(CONFIG_ALL_MODES) && !defined(CONFIG_WIN32)
+    { "shell",    "lines",    0, bench_shell },
+#endif
+};
+
+/*---------------- driver ----------------*/
+
+static int bench_selected(const char *list, const char *name) {
+    const char *p = list;
+
+    if (!list)
+        return 1;
+    while (p) {
+        if (bstr_equal(bstr_token(p, ',', &p), bstr_make(name)))
+            return 1;
+    }
+    return 0;
+}
+
+static int bench_generate(BenchState *bs) {
+    EditBuffer *b;
+    int line_num, col_num, ret;
+
+    b = qe_new_buffer(bs->qs, "*bench-corpus*", BF_SYSTEM | BF_UTF8);
+    if (!b)
+        return -1;
+    bench_seed = 2463534242U;
+    bs->corpus->generate(b, bench_size * 1024);
+    eb_get_pos(b, &line_num, &col_num, b->total_size);
+    bs->size = b->total_size;
+    bs->nb_lines = line_num + (col_num > 0);
+    makepath(bs->filename, sizeof(bs->filename),
+             bs->dir, bs->corpus->filename);
+    ret = eb_write_buffer(b, 0, b->total_size, bs->filename);
+    eb_free(&b);
+    return ret;
+}
+
+static void bench_run_workload(BenchState *bs, const BenchWorkload *wp) {
+    QEmacsState *qs = bs->qs;
+    EditState *s = qs->active_window;
+    EditBuffer *b = NULL;
+    int ops, usec;
+
+    if (wp->needs_buffer) {
+        if (qe_load_file(s, bs->filename, 0, 0) < 0)
+            return;
+        s = qs->active_window;
+        qe_display(qs);
+    }
+    *bs->tmpfile = '\0';
+    bs->stop_time = 0;
+    bs->start_time = get_clock_usec();
+    ops = wp->run(bs, s);
+    usec = (bs->stop_time ? bs->stop_time : get_clock_usec()) - bs->start_time;
+    s = qs->active_window;
+
+    if (ops >= 0) {
+        fprintf(bs->fp, "{\"corpus\":\"%s\",\"workload\":\"%s\","
+                "\"bytes\":%d,\"lines\":%d,\"ops\":%d,\"unit\":\"%s\","
+                "\"usec\":%d,\"ops_per_sec\":%.1f}\n",
+                bs->corpus->name, wp->name, bs->size, bs->nb_lines,
+                ops, wp->unit, usec,
+                usec > 0 ? ops * 1000000.0 / usec : 0.0);
+        fflush(bs->fp);
+    }
+    if (*bs->tmpfile)
+        unlink(bs->tmpfile);
+
+    /* discard the corpus buffer, with its modifications */
+    b = qe_find_buffer_filename(qs, bs->filename);
+    if (b)
+        qe_kill_buffer(qs, b);
+}
+
+static void bench_run(void *opaque) {
+    QEmacsState *qs = opaque;
+    BenchState bs1, *bs = &bs1;
+    const char *tmpdir;
+    int i, j;
+
+    memset(bs, 0, sizeof(*bs));
+    bs->qs = qs;
+    bs->fp = stdout;
+    if (bench_output && !(bs->fp = fopen(bench_output, "w"))) {
+        fprintf(stderr, "qe-bench: cannot create %s: %s\n",
+                bench_output, strerror(errno));
+        goto done;
+    }
+    tmpdir = getenv("TMPDIR");
+    snprintf(bs->dir, sizeof(bs->dir), "%s/qe-bench-XXXXXX",
+             tmpdir && *tmpdir ? tmpdir : "/tmp");
+    if (!mkdtemp(bs->dir)) {
+        fprintf(stderr, "qe-bench: cannot create %s: %s\n",
+                bs->dir, strerror(errno));
+        goto done;
+    }
+    bench_count = max_int(bench_count, 1);
+    bench_size = max_int(bench_size, 1);
+
+    fprintf(bs->fp, "{\"qemacs\":\"%s\",\"display\":\"%dx%d\","
+            "\"size\":%d,\"count\":%d}\n",
+            QE_VERSION, qs->screen->width, qs->screen->height,
+            bench_size * 1024, bench_count);
+
+    for (i = 0; i < countof(bench_corpora); i++) {
+        bs->corpus = &bench_corpora[i];
+        if (!bench_selected(bench_corpus_list, bs->corpus->name))
+            continue;
+        if (bench_generate(bs) < 0) {
+            fprintf(stderr, "qe-bench: cannot write %s\n", bs->filename);
+            continue;
+        }
+        for (j = 0; j < countof(bench_workloads); j++) {
+            if (bench_selected(bench_workload_list, bench_workloads[j].name))
+                bench_run_workload(bs, &bench_workloads[j]);
+        }
+        unlink(bs->filename);
+    }
+    rmdir(bs->dir);
+
+ done:
+    if (bs->fp && bs->fp != stdout)
+        fclose(bs->fp);
+    url_exit(qs->up);
+}
+
+/*---------------- test support ----------------*/
+
+#define BENCH_WAIT_TIMEOUT  10000   /* ms before wait-for-jobs gives up */
+
+static URLTimer *bench_wait_timer;
+
+static void bench_wait_tick(void *opaque) {
+    QEmacsState *qs = opaque;
+
+    url_exit(qs->up);
+}
+
+/* Test scripts are run before the main loop: run it at least once for
+ * the pending bottom halves and until the jobs submitted by the
+ * previous commands have completed, so their results can be checked.
+ */
+static void do_wait_for_jobs(EditState *s) {
+    QEmacsState *qs = s->qs;
+    int start = get_clock_ms();
+
+    do {
+        url_set_timer(qs->up, &bench_wait_timer, 10, qs, bench_wait_tick);
+        url_main_loop(qs->up);
+        url_kill_timer(qs->up, &bench_wait_timer);
+    } while (url_pending_jobs(qs->up) > 0
+         &&  get_clock_ms() - start < BENCH_WAIT_TIMEOUT);
+}
+
+static const CmdDef bench_commands[] = {
+    CMD0( "wait-for-jobs", "",
+          "Run the event loop until all worker jobs have completed",
+          do_wait_for_jobs)
+};
+
+/*---------------- headless display ----------------*/
+
+static QEDisplay bench_dpy;
+
+static int bench_dpy_probe(void) {
+    /* take precedence over the tty */
+    return 2;
+}
+
+static CmdLineOptionDef cmd_options[] = {
+    CMD_LINE_INT_ARG("", "bench-size", "KB", &bench_size,
+                     "set the size of each generated corpus"),
+    CMD_LINE_INT_ARG("", "bench-count", "N", &bench_count,
+                     "set the number of operations per workload"),
+    CMD_LINE_STRING("", "bench-corpus", "LIST", &bench_corpus_list,
+                    "only use these corpora (log,json,c,utf8)"),
+    CMD_LINE_STRING("", "bench-workload", "LIST", &bench_workload_list,
+                    "only run these workloads (load,scroll,isearch,"
+                    "replace,colorize,undo,save,shell)"),
+    CMD_LINE_STRING("", "bench-output", "FILE", &bench_output,
+                    "write the results to FILE instead of stdout"),
+    CMD_LINE_LINK()
+};
+
+static int bench_init(QEmacsState *qs) {
+    bench_dpy = dummy_dpy;
+    bench_dpy.name = "bench";
+    bench_dpy.dpy_probe = bench_dpy_probe;
+    qe_register_cmd_line_options(qs, cmd_options);
+    qe_register_commands(qs, NULL, bench_commands, countof(bench_commands));
+    /* start as soon as the main loop runs */
+    url_add_timer(qs->up, 0, qs, bench_run);
+    return qe_register_display(qs, &bench_dpy);
+}
+
+qe_module_init(bench_init);
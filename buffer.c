@@ -218,7 +218,7 @@ static void eb_insert1(EditBuffer *b, int page_index, const u8 *buf, int size)
 static void eb_insert_lowlevel(EditBuffer *b, int offset,
                                const u8 *buf, int size)
 {
-    int len, len_out, page_index;
+    int len, len_out, page_index, shifted = 0;
     Page *p;
 
     b->total_size += size;
@@ -242,6 +242,7 @@ static void eb_insert_lowlevel(EditBuffer *b, int offset,
             /* First try and shift some of these bytes to the previous pages */
             if (page_index > 0 && p[-1].size < MAX_PAGE_SIZE) {
                 int chunk;
+                shifted = 1;
                 update_page(p - 1);
                 update_page(p);
                 chunk = min_offset(MAX_PAGE_SIZE - p[-1].size, offset);
@@ -299,8 +300,11 @@ static void eb_insert_lowlevel(EditBuffer *b, int offset,
     if (size > 0)
         eb_insert1(b, page_index + 1, buf, size);
 
-    /* the page cache is no longer valid */
-    b->cur_page = NULL;
+    /* the page cache is no longer valid unless the data was inserted
+       in the cached page without changing the page table: keeping it
+       avoids a linear page scan for each append to a large buffer */
+    if (page_index < 0 || shifted || len_out > 0 || size > 0)
+        b->cur_page = NULL;
 }
 
 /* Insert 'size' bytes of 'src' buffer from position 'src_offset' into
@@ -824,6 +828,7 @@ void eb_free(EditBuffer **bp)
             qe_free(&cb);
         }
 
+        url_remove_watch(qs->up, &b->file_watch);
         eb_delete_properties(b, 0, INT_MAX, QE_PROP_ALL);
         eb_cache_remove(b);
         /* eb_clear frees b->log_buffer.
@@ -870,6 +875,104 @@ void eb_free(EditBuffer **bp)
     }
 }
 
+/* Snapshots for worker threads.
+ *
+ * All buffers reachable from the editor state belong to the main
+ * thread: even the read functions update the page cache and the
+ * charset decoder state of the buffer, so jobs running on a worker
+ * thread (see url_submit_job()) must not access them at all.
+ * A job can instead read files into a snapshot buffer.
+ * A snapshot is private to the job: it is not in the buffer list and
+ * has no styles, properties, undo log, callbacks nor mode data. It can
+ * be used by a single thread at a time and only with these functions:
+ *    eb_read_one_byte, eb_read, eb_nextc, eb_prevc, eb_next, eb_prev,
+ *    eb_skip_chars, eb_next_glyph, eb_prev_glyph, eb_skip_accents,
+ *    eb_get_pos, eb_goto_pos, eb_get_char_offset, eb_goto_char,
+ *    eb_get_line, eb_fgets, eb_goto_bol, eb_goto_bol2, eb_goto_eol,
+ *    eb_next_line and eb_is_blank_line.
+ * Any other function may access `b->qs` or modify the buffer.
+ * The snapshot is freed with eb_free_snapshot().
+ */
+
+/* Create a snapshot with the contents of file `filename` decoded as
+ * UTF-8. This function does not access the editor state so it can be
+ * called by a job on a worker thread.
+ * Return NULL if the file cannot be read.
+ */
+EditBuffer *eb_snapshot_file(QEmacsState *qs, const char *filename)
+{
+    EditBuffer *b1;
+
+    b1 = qe_mallocz(EditBuffer);
+    if (!b1)
+        return NULL;
+    b1->qs = qs;
+    b1->flags = BF_SYSTEM | BF_READONLY;
+    pstrcpy(unconst(char *)b1->filename, sizeof(b1->filename), filename);
+    eb_set_charset(b1, &charset_utf8, EOL_UNIX);
+#ifdef CONFIG_MMAP
+    /* the pages are shared with the file mapping */
+    if (eb_mmap_buffer(b1, filename)) {
+        eb_free_snapshot(&b1);
+        return NULL;
+    }
+#else
+    {
+        u8 buf[MAX_PAGE_SIZE];
+        FILE *f;
+        Page *p;
+        int len;
+
+        f = fopen(filename, "rb");
+        if (!f) {
+            eb_free_snapshot(&b1);
+            return NULL;
+        }
+        while ((len = fread(buf, 1, sizeof(buf), f)) > 0) {
+            if (!qe_realloc_array(&b1->page_table, b1->nb_pages + 1))
+                break;
+            p = &b1->page_table[b1->nb_pages];
+            p->flags = 0;
+            p->size = len;
+            p->data = qe_malloc_dup_bytes(buf, len);
+            if (!p->data)
+                break;
+            b1->nb_pages++;
+            b1->total_size += len;
+        }
+        if (ferror(f) || len > 0) {
+            fclose(f);
+            eb_free_snapshot(&b1);
+            return NULL;
+        }
+        fclose(f);
+    }
+#endif
+    return b1;
+}
+
+void eb_free_snapshot(EditBuffer **bp)
+{
+    if (*bp) {
+        EditBuffer *b = *bp;
+        int n;
+
+        for (n = 0; n < b->nb_pages; n++) {
+            if (!(b->page_table[n].flags & PG_READ_ONLY))
+                qe_free(&b->page_table[n].data);
+        }
+        qe_free(&b->page_table);
+#ifdef CONFIG_MMAP
+        eb_munmap_buffer(b);
+        if (b->map_handle > 0)
+            close(b->map_handle);
+#endif
+        if (b->charset)
+            charset_decode_close(&b->charset_state);
+        qe_free(bp);
+    }
+}
+
 EditBuffer *qe_find_buffer_filename(QEmacsState *qs, const char *filename)
 {
     EditBuffer *b;
@@ -1150,28 +1253,11 @@ void eb_style_callback(EditBuffer *b, void *opaque, int arg,
 /************************************************************/
 /* undo buffer */
 
-static void eb_addlog(EditBuffer *b, enum LogOperation op,
-                      int offset, int size)
+/* make room for a new undo record, return -1 if logging failed */
+static int eb_log_reserve(EditBuffer *b)
 {
-    int was_modified, len, size_trailer;
     LogBuffer lb;
-    EditBufferCallbackList *l;
-
-    /* callbacks and logging disabled for composite undo phase */
-    if (b->save_log & 2)
-        return;
-
-    /* call each callback */
-    for (l = b->first_callback; l != NULL; l = l->next) {
-        l->callback(b, l->opaque, l->arg, op, offset, size);
-    }
-
-    was_modified = b->modified;
-    b->modified = 1;
-    b->mtime = get_clock_ms();
-
-    if (!b->save_log)
-        return;
+    int len;
 
     if (!b->log_buffer) {
         char buf[MAX_BUFFERNAME_SIZE];
@@ -1183,7 +1269,7 @@ static void eb_addlog(EditBuffer *b, enum LogOperation op,
         snprintf(buf, sizeof(buf), "*L<%.*s>", MAX_BUFFERNAME_SIZE - 5, b->name);
         b->log_buffer = qe_new_buffer(b->qs, buf, BF_SYSTEM | BF_IS_LOG | BF_RAW);
         if (!b->log_buffer)
-            return;
+            return -1;
         b->log_new_index = 0;
         b->log_current = 0;
         b->last_log = 0;
@@ -1205,6 +1291,31 @@ static void eb_addlog(EditBuffer *b, enum LogOperation op,
             b->log_current -= len;
         b->nb_logs--;
     }
+    return 0;
+}
+
+static void eb_addlog(EditBuffer *b, enum LogOperation op,
+                      int offset, int size)
+{
+    int was_modified, len, size_trailer;
+    LogBuffer lb;
+    EditBufferCallbackList *l;
+
+    /* callbacks and logging disabled for composite undo phase */
+    if (b->save_log & 2)
+        return;
+
+    /* call each callback */
+    for (l = b->first_callback; l != NULL; l = l->next) {
+        l->callback(b, l->opaque, l->arg, op, offset, size);
+    }
+
+    was_modified = b->modified;
+    b->modified = 1;
+    b->mtime = get_clock_ms();
+
+    if (!b->save_log || eb_log_reserve(b))
+        return;
 
     /* If inserting, try and coalesce log record with previous */
     if (op == LOGOP_INSERT && b->last_log == LOGOP_INSERT
@@ -1221,6 +1332,34 @@ static void eb_addlog(EditBuffer *b, enum LogOperation op,
         return;
     }
 
+    /* While a keyboard macro runs, also coalesce contiguous deletions
+     * so undo reverts the macro in fewer steps.
+     */
+    if (op == LOGOP_DELETE && b->last_log == LOGOP_DELETE
+    &&  b->qs->macro_key_index >= 0
+    &&  (size_t)b->log_new_index >= sizeof(lb) + sizeof(int)
+    &&  eb_read(b->log_buffer, b->log_new_index - sizeof(int), &size_trailer,
+                sizeof(int)) == sizeof(int)
+    &&  size_trailer > 0
+    &&  (len = b->log_new_index - (int)sizeof(int) - size_trailer - (int)sizeof(lb)) >= 0
+    &&  eb_read(b->log_buffer, len, &lb, sizeof(lb)) == sizeof(lb)
+    &&  lb.op == LOGOP_DELETE && lb.size == size_trailer
+    &&  (lb.offset == offset || lb.offset == offset + size)) {
+        /* deleted bytes go after the record data when deleting
+         * forward, before it when deleting backward */
+        eb_insert_buffer(b->log_buffer,
+                         len + sizeof(lb) + (lb.offset == offset ? lb.size : 0),
+                         b, offset, size);
+        lb.offset = offset;
+        lb.size += size;
+        eb_write(b->log_buffer, len, &lb, sizeof(lb));
+        b->log_new_index += size;
+        size_trailer = lb.size;
+        eb_write(b->log_buffer, b->log_new_index - sizeof(int), &size_trailer,
+                 sizeof(int));
+        return;
+    }
+
     b->last_log = op;
 
     /* XXX: should check undo record integrity */
@@ -1254,6 +1393,190 @@ static void eb_addlog(EditBuffer *b, enum LogOperation op,
     b->nb_logs++;
 }
 
+/* A LOGOP_REPLACE undo record holds the ranges replaced in a single
+ * operation, sorted by offset: for each range, a ReplaceEntry with its
+ * offset and size after the replacement, followed by its `old_size`
+ * bytes of previous contents.  The record only appears in the log
+ * buffer, callbacks are called for one insertion and one deletion
+ * spanning all the ranges.
+ */
+typedef struct ReplaceEntry {
+    int offset;
+    int size;
+    int old_size;
+} ReplaceEntry;
+
+/* offset maintained by eb_offset_callback in the area rebuilt by
+   eb_replace_list() */
+typedef struct ReplaceOffset {
+    int *ptr;
+    int offset;
+    int edge;
+} ReplaceOffset;
+
+static int replace_offset_cmp(const void *p1, const void *p2) {
+    const ReplaceOffset *a = p1;
+    const ReplaceOffset *b = p2;
+    return (a->offset > b->offset) - (a->offset < b->offset);
+}
+
+/* replace 'nb_ranges' non overlapping ranges of bytes, given as pairs
+ * of sorted offsets in 'ranges', with the same 'size1' bytes from 'buf'
+ * or, if 'src' is not NULL, with the bytes of 'src' given as pairs of
+ * offset and size in 'src_ranges'.
+ * return the offset past the last replacement or -1 on failure.
+ */
+static int eb_replace_list(EditBuffer *b, const int *ranges, int nb_ranges,
+                           EditBuffer *src, const int *src_ranges,
+                           const void *buf, int size1)
+{
+    /* The modified area is rebuilt in a separate buffer by copying the
+     * unchanged spans a page at a time and appending the replacements,
+     * then it is substituted in a single operation.  Callbacks are
+     * called for one insert and one delete instead of once per range,
+     * which avoids the quadratic cost of shifting the page table for
+     * each replacement.  The undo record only holds the replaced
+     * ranges.  Offsets maintained by eb_offset_callback, such as point
+     * and mark, are then moved to their place in the new contents;
+     * other callback based offsets inside the modified area are moved
+     * to its beginning.
+     */
+    EditBuffer *b1;
+    EditBufferCallbackList *l;
+    ReplaceOffset *offsets = NULL;
+    ReplaceEntry re;
+    LogBuffer lb;
+    int i, j, start, end, offset, size, delta, nb_offsets, saved_log;
+
+#define NEW_SIZE(i)  (src ? src_ranges[2 * (i) + 1] : size1)
+
+    b1 = qe_new_buffer(b->qs, "*replace*", BF_SYSTEM | BF_RAW);
+    if (!b1)
+        return -1;
+
+    start = ranges[0];
+    end = ranges[2 * nb_ranges - 1];
+    for (offset = start, i = 0; i < nb_ranges; i++) {
+        eb_insert_buffer(b1, b1->total_size, b, offset, ranges[2 * i] - offset);
+        if (src)
+            eb_insert_buffer(b1, b1->total_size, src, src_ranges[2 * i], NEW_SIZE(i));
+        else
+            eb_insert(b1, b1->total_size, buf, size1);
+        offset = ranges[2 * i + 1];
+    }
+
+    /* compute the new position of offsets inside the modified area */
+    nb_offsets = 0;
+    for (l = b->first_callback; l != NULL; l = l->next) {
+        if (l->callback == eb_offset_callback) {
+            offset = *(int *)l->opaque;
+            nb_offsets += (offset > start && offset <= end);
+        }
+    }
+    if (nb_offsets > 0 && (offsets = qe_malloc_array(ReplaceOffset, nb_offsets)) != NULL) {
+        j = 0;
+        for (l = b->first_callback; l != NULL; l = l->next) {
+            if (l->callback == eb_offset_callback) {
+                offset = *(int *)l->opaque;
+                if (offset > start && offset <= end) {
+                    offsets[j].ptr = l->opaque;
+                    offsets[j].offset = offset;
+                    offsets[j].edge = l->arg;
+                    j++;
+                }
+            }
+        }
+        qsort(offsets, nb_offsets, sizeof(*offsets), replace_offset_cmp);
+        for (i = j = 0, delta = 0; j < nb_offsets; j++) {
+            offset = offsets[j].offset;
+            while (i < nb_ranges && ranges[2 * i + 1] <= offset) {
+                delta += NEW_SIZE(i) - (ranges[2 * i + 1] - ranges[2 * i]);
+                i++;
+            }
+            if (i < nb_ranges && ranges[2 * i] < offset) {
+                /* inside a replaced range: move to the replacement */
+                offset = ranges[2 * i] + (offsets[j].edge ? NEW_SIZE(i) : 0);
+            }
+            offsets[j].offset = offset + delta;
+        }
+    }
+
+    /* log the replaced ranges with their previous contents */
+    if (b->save_log == 1 && !eb_log_reserve(b)) {
+        for (size = i = 0; i < nb_ranges; i++)
+            size += sizeof(re) + ranges[2 * i + 1] - ranges[2 * i];
+        lb.pad1 = '\n';
+        lb.pad2 = ':';
+        lb.op = LOGOP_REPLACE;
+        lb.offset = start;
+        lb.size = size;
+        lb.was_modified = b->modified;
+        eb_write(b->log_buffer, b->log_new_index, &lb, sizeof(lb));
+        b->log_new_index += sizeof(lb);
+        for (i = 0, delta = 0; i < nb_ranges; i++) {
+            re.offset = ranges[2 * i] + delta;
+            re.size = NEW_SIZE(i);
+            re.old_size = ranges[2 * i + 1] - ranges[2 * i];
+            eb_write(b->log_buffer, b->log_new_index, &re, sizeof(re));
+            b->log_new_index += sizeof(re);
+            eb_insert_buffer(b->log_buffer, b->log_new_index, b,
+                             ranges[2 * i], re.old_size);
+            b->log_new_index += re.old_size;
+            delta += re.size - re.old_size;
+        }
+        eb_write(b->log_buffer, b->log_new_index, &size, sizeof(int));
+        b->log_new_index += sizeof(int);
+        b->last_log = LOGOP_REPLACE;
+        b->nb_logs++;
+    }
+#undef NEW_SIZE
+
+    /* insert the new contents after the area before deleting it so
+       offsets after the area move by the size difference */
+    saved_log = b->save_log;
+    b->save_log &= ~1;
+    size = eb_insert_buffer(b, end, b1, 0, b1->total_size);
+    eb_delete(b, start, end - start);
+    b->save_log = saved_log;
+    eb_free(&b1);
+
+    if (offsets) {
+        for (j = 0; j < nb_offsets; j++) {
+            *offsets[j].ptr = offsets[j].offset;
+        }
+        qe_free(&offsets);
+    }
+    return start + size;
+}
+
+/* play the LOGOP_REPLACE record data of `size` bytes at `log_index` */
+static void eb_replay_replace(EditBuffer *b, int log_index, int size)
+{
+    ReplaceEntry re;
+    int *ranges;
+    int i, n, pos, end = log_index + size;
+
+    for (n = 0, pos = log_index; pos < end; n++) {
+        eb_read(b->log_buffer, pos, &re, sizeof(re));
+        pos += sizeof(re) + re.old_size;
+    }
+    if (n == 0 || !(ranges = qe_malloc_array(int, 4 * n)))
+        return;
+    /* ranges to replace followed by the ranges of the log buffer
+       holding their previous contents */
+    for (i = 0, pos = log_index; i < n; i++) {
+        eb_read(b->log_buffer, pos, &re, sizeof(re));
+        pos += sizeof(re);
+        ranges[2 * i] = re.offset;
+        ranges[2 * i + 1] = re.offset + re.size;
+        ranges[2 * n + 2 * i] = pos;
+        ranges[2 * n + 2 * i + 1] = re.old_size;
+        pos += re.old_size;
+    }
+    eb_replace_list(b, ranges, n, b->log_buffer, ranges + 2 * n, NULL, 0);
+    qe_free(&ranges);
+}
+
 void do_undo(EditState *s)
 {
     QEmacsState *qs = s->qs;
@@ -1333,6 +1656,11 @@ void do_undo(EditState *s)
         eb_delete(b, lb.offset, lb.size);
         s->offset = lb.offset;
         break;
+    case LOGOP_REPLACE:
+        /* restore the previous contents, logging the reverse replacement */
+        eb_replay_replace(b, log_index, lb.size);
+        s->offset = lb.offset;
+        break;
     default:
         abort();
     }
@@ -1415,6 +1743,12 @@ void do_redo(EditState *s)
         b->save_log |= 1;
         s->offset = lb.offset;
         break;
+    case LOGOP_REPLACE:
+        b->save_log &= ~1;
+        eb_replay_replace(b, log_index, lb.size);
+        b->save_log |= 1;
+        s->offset = lb.offset;
+        break;
     default:
         abort();
     }
@@ -1942,6 +2276,21 @@ int eb_replace(EditBuffer *b, int offset, int size,
     }
 }
 
+/* replace 'nb_ranges' non overlapping ranges of bytes, given as pairs
+ * of sorted offsets in 'ranges', with the same 'size1' bytes from 'buf'.
+ * The replacement is a single undo step.
+ * return the offset past the last replacement or -1 on failure.
+ */
+int eb_replace_ranges(EditBuffer *b, const int *ranges, int nb_ranges,
+                      const void *buf, int size1)
+{
+    if (b->flags & BF_READONLY)
+        return -1;
+    if (nb_ranges <= 0)
+        return 0;
+    return eb_replace_list(b, ranges, nb_ranges, NULL, NULL, buf, size1);
+}
+
 /************************************************************/
 /* buffer I/O */
 
@@ -3009,6 +3358,7 @@ int eb_save_buffer(EditBuffer *b)
         b->file_mtime = st.st_mtime;
         b->file_size = st.st_size;
     }
+    eb_watch_file(b);
     /* reset log */
     /* CG: should not do this! */
     //eb_free_log_buffer(b);
@@ -27,6 +27,8 @@
 
 /* XXX: Should move this to QEmacsState, and find a way for html2png */
 struct QECharset *first_charset;
+/* charset names and aliases */
+static SymbolTable charset_table = { 0, 0, SYM_XCASE | SYM_COPY, NULL };
 
 #define REP2(x)    x, x
 #define REP4(x)    x, x, x, x
@@ -976,6 +978,8 @@ struct QECharset charset_ucs4be = {
 void qe_register_charset(struct QEmacsState *qs, struct QECharset *charset)
 {
     struct QECharset **pp;
+    char *name;
+    const char *p, *q;
 
     pp = &first_charset;
     while (*pp != NULL) {
@@ -984,6 +988,23 @@ void qe_register_charset(struct QEmacsState *qs, struct QECharset *charset)
         pp = &(*pp)->next;
     }
     *pp = charset;
+
+    /* the first charset registered with a given name or alias wins */
+    symbol_add(&charset_table, charset->name, charset);
+    if (charset->aliases) {
+        for (q = p = charset->aliases;; q++) {
+            if (*q == '\0' || *q == '|') {
+                if (q > p && (name = qe_strndup(p, q - p)) != NULL) {
+                    /* the table keeps its own copy of the name */
+                    symbol_add(&charset_table, name, charset);
+                    qe_free(&name);
+                }
+                if (*q == '\0')
+                    break;
+                p = q + 1;
+            }
+        }
+    }
 }
 
 void charset_complete(CompleteState *cp, CompleteFunc enumerate) {
@@ -1011,18 +1032,10 @@ void charset_complete(CompleteState *cp, CompleteFunc enumerate) {
 
 QECharset *qe_find_charset(struct QEmacsState *qs, const char *name)
 {
-    QECharset *charset;
-
     if (!name)
         return NULL;
 
-    for (charset = first_charset; charset != NULL; charset = charset->next) {
-        if (!strxcmp(charset->name, name)
-        ||  (charset->aliases && strxfind(charset->aliases, name))) {
-            return charset;
-        }
-    }
-    return NULL;
+    return symbol_find(&charset_table, name);
 }
 
 void charset_decode_init(CharsetDecodeState *s, QECharset *charset,
@@ -1620,3 +1633,9 @@ void charset_init(struct QEmacsState *qs) {
     qe_register_charset(qs, &charset_ucs4le);
     qe_register_charset(qs, &charset_ucs4be);
 }
+
+void charset_close(struct QEmacsState *qs) {
+    /* charsets are static, only the name index is allocated */
+    symbol_table_free(&charset_table);
+    first_charset = NULL;
+}
@@ -103,6 +103,7 @@ struct CharsetDecodeState {
 
 struct QEmacsState;
 void charset_init(struct QEmacsState *qs);
+void charset_close(struct QEmacsState *qs);
 int qe_charset_more_init(struct QEmacsState *qs);
 int qe_charset_jis_init(struct QEmacsState *qs);
 
@@ -0,0 +1,962 @@
+/*
+ * QEmacs, line based difference engine
+ *
+ * Copyright (c) 2000-2026 Charlie Gordon.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qe.h"
+
+/* Lines are hashed and interned as small integers. After skipping the
+ * common prefix and suffix, lines that occur exactly once on both sides
+ * are matched along their longest increasing subsequence (patience
+ * diff) and the gaps between these anchors are compared recursively.
+ * Gaps without any unique line are compared with Myers' O(ND)
+ * algorithm, up to a maximum edit distance.
+ * Hash codes may collide: the lines left unchanged are compared byte by
+ * byte, a run at a time, and lines that differ are flagged as changed.
+ */
+
+#define DIFF_MYERS_MAX_COST  (1 << 22)  /* max size of the Myers trace */
+#define DIFF_READ_SIZE       16384
+
+typedef struct DiffContext {
+    EditBuffer *b1, *b2;
+    const int *offsets1, *offsets2;
+    int flags;
+    int nb_lines1, nb_lines2;
+    int *ids1, *ids2;           /* interned line ids */
+    u8 *changed1, *changed2;    /* changed line flags */
+    int nb_ids;
+    uint64_t *hashes;           /* line hash for each id */
+    int *table;                 /* hash table of ids */
+    unsigned int table_mask;
+    int gen;                    /* generation for per id counters */
+    int *stamp, *count1, *count2, *pos1;
+    int *pairs1, *pairs2, *tails, *prev;    /* patience scratch arrays */
+    int *trace;                 /* Myers trace */
+    int trace_size;
+} DiffContext;
+
+/* Compute line offsets and hash codes for a buffer range */
+static int diff_hash_lines(EditBuffer *b, int start, int end, int flags,
+                           int **offsetsp, uint64_t **hashesp)
+{
+    u8 buf[DIFF_READ_SIZE];
+    int *offsets = NULL;
+    uint64_t *hashes = NULL;
+    uint64_t hash = 0xcbf29ce484222325;   /* FNV-1a */
+    int nb_lines = 0, size_lines = 0;
+    int offset, line_start, i, len;
+    u8 c;
+
+    for (offset = line_start = start; offset < end; offset += len) {
+        len = eb_read(b, offset, buf, min_int(end - offset, countof(buf)));
+        if (len <= 0)
+            break;
+        for (i = 0; i < len; i++) {
+            c = buf[i];
+            if (flags & DIFF_IGNORE_CASE)
+                c = qe_tolower(c);
+            if (!(flags & DIFF_IGNORE_SPACES)
+            ||  !(c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v'))
+                hash = (hash ^ c) * 0x100000001b3;
+            if (c == '\n' || (offset + i + 1 == end && i + 1 == len)) {
+                if (nb_lines + 1 >= size_lines) {
+                    int new_size = max_int(size_lines + (size_lines >> 1), 1024);
+                    if (!qe_realloc_array(&offsets, new_size)
+                    ||  !qe_realloc_array(&hashes, new_size)) {
+                        qe_free(&offsets);
+                        qe_free(&hashes);
+                        return -1;
+                    }
+                    size_lines = new_size;
+                }
+                offsets[nb_lines] = line_start;
+                hashes[nb_lines] = hash;
+                nb_lines++;
+                line_start = offset + i + 1;
+                hash = 0xcbf29ce484222325;
+            }
+        }
+    }
+    if (!offsets && !(offsets = qe_malloc_array(int, 1)))
+        return -1;
+    offsets[nb_lines] = end;
+    *offsetsp = offsets;
+    *hashesp = hashes;
+    return nb_lines;
+}
+
+static int diff_intern(DiffContext *dc, uint64_t hash)
+{
+    unsigned int h = (unsigned int)(hash ^ (hash >> 32)) & dc->table_mask;
+    int id;
+
+    while ((id = dc->table[h]) >= 0) {
+        if (dc->hashes[id] == hash)
+            return id;
+        h = (h + 1) & dc->table_mask;
+    }
+    id = dc->nb_ids++;
+    dc->hashes[id] = hash;
+    dc->table[h] = id;
+    return id;
+}
+
+static void diff_mark_changed(DiffContext *dc, int a0, int a1, int b0, int b1)
+{
+    memset(dc->changed1 + a0, 1, a1 - a0);
+    memset(dc->changed2 + b0, 1, b1 - b0);
+}
+
+/* Myers' greedy algorithm on a range without common prefix or suffix */
+static void diff_myers(DiffContext *dc, int a0, int a1, int b0, int b1)
+{
+    const int *A = dc->ids1 + a0;
+    const int *B = dc->ids2 + b0;
+    int n = a1 - a0, m = b1 - b0;
+    int d, k, x, y, pk, *v, *vp;
+
+    /* V[k] for diagonal k is stored at trace[d * d + d + k] for step d */
+    for (d = 0;; d++) {
+        int size = (d + 1) * (d + 1);
+        if (size > dc->trace_size) {
+            int new_size = max_int(size * 2, 1024);
+            if (size > DIFF_MYERS_MAX_COST
+            ||  !qe_realloc_array(&dc->trace, new_size)) {
+                diff_mark_changed(dc, a0, a1, b0, b1);
+                return;
+            }
+            dc->trace_size = new_size;
+        }
+        v = dc->trace + d * d + d;
+        vp = d ? dc->trace + (d - 1) * (d - 1) + (d - 1) : NULL;
+        for (k = -d; k <= d; k += 2) {
+            if (d == 0)
+                x = 0;
+            else
+            if (k == -d || (k != d && vp[k - 1] < vp[k + 1]))
+                x = vp[k + 1];
+            else
+                x = vp[k - 1] + 1;
+            y = x - k;
+            while (x < n && y < m && A[x] == B[y]) {
+                x++;
+                y++;
+            }
+            v[k] = x;
+            if (x >= n && y >= m)
+                goto found;
+        }
+    }
+found:
+    /* backtrack from (n, m) and flag the edited lines */
+    x = n;
+    y = m;
+    for (; d > 0; d--) {
+        vp = dc->trace + (d - 1) * (d - 1) + (d - 1);
+        k = x - y;
+        if (k == -d || (k != d && vp[k - 1] < vp[k + 1])) {
+            pk = k + 1;     /* insertion of B[py] */
+            x = vp[pk];
+            y = x - pk;
+            dc->changed2[b0 + y] = 1;
+        } else {
+            pk = k - 1;     /* deletion of A[px] */
+            x = vp[pk];
+            y = x - pk;
+            dc->changed1[a0 + x] = 1;
+        }
+    }
+}
+
+static void diff_region(DiffContext *dc, int a0, int a1, int b0, int b1)
+{
+    const int *A = dc->ids1;
+    const int *B = dc->ids2;
+    int i, j, k, n, id, gen, *anchors;
+
+    for (;;) {
+        while (a0 < a1 && b0 < b1 && A[a0] == B[b0]) {
+            a0++;
+            b0++;
+        }
+        while (a0 < a1 && b0 < b1 && A[a1 - 1] == B[b1 - 1]) {
+            a1--;
+            b1--;
+        }
+        if (a0 == a1 || b0 == b1) {
+            diff_mark_changed(dc, a0, a1, b0, b1);
+            return;
+        }
+        /* count line occurrences on both sides */
+        gen = ++dc->gen;
+        for (i = a0; i < a1; i++) {
+            id = A[i];
+            if (dc->stamp[id] != gen) {
+                dc->stamp[id] = gen;
+                dc->count1[id] = dc->count2[id] = 0;
+            }
+            dc->count1[id]++;
+            dc->pos1[id] = i;
+        }
+        for (j = b0; j < b1; j++) {
+            id = B[j];
+            if (dc->stamp[id] == gen)
+                dc->count2[id]++;
+        }
+        /* collect unique common lines in B order */
+        for (n = 0, j = b0; j < b1; j++) {
+            id = B[j];
+            if (dc->stamp[id] == gen && dc->count1[id] == 1 && dc->count2[id] == 1) {
+                dc->pairs1[n] = dc->pos1[id];
+                dc->pairs2[n] = j;
+                n++;
+            }
+        }
+        if (n == 0) {
+            diff_myers(dc, a0, a1, b0, b1);
+            return;
+        }
+        /* longest increasing subsequence of A positions (patience sort) */
+        for (k = i = 0; i < n; i++) {
+            int lo = 0, hi = k;
+            while (lo < hi) {
+                int mid = (lo + hi) >> 1;
+                if (dc->pairs1[dc->tails[mid]] < dc->pairs1[i])
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            dc->prev[i] = lo > 0 ? dc->tails[lo - 1] : -1;
+            dc->tails[lo] = i;
+            if (lo == k)
+                k++;
+        }
+        /* scratch arrays are reused by the recursive calls */
+        anchors = qe_malloc_array(int, 2 * k);
+        if (!anchors) {
+            diff_mark_changed(dc, a0, a1, b0, b1);
+            return;
+        }
+        for (i = dc->tails[k - 1], j = k; i >= 0; i = dc->prev[i]) {
+            j--;
+            anchors[2 * j] = dc->pairs1[i];
+            anchors[2 * j + 1] = dc->pairs2[i];
+        }
+        for (j = 0; j < k; j++) {
+            diff_region(dc, a0, anchors[2 * j], b0, anchors[2 * j + 1]);
+            a0 = anchors[2 * j] + 1;
+            b0 = anchors[2 * j + 1] + 1;
+        }
+        qe_free(&anchors);
+        /* iterate on the tail after the last anchor */
+    }
+}
+
+typedef struct DiffReader {
+    EditBuffer *b;
+    int offset, end;
+    int pos, len;
+    u8 buf[256];
+} DiffReader;
+
+/* read the next byte of a line, normalized as for the hash code */
+static int diff_getc(DiffReader *rd, int flags)
+{
+    int c;
+
+    for (;;) {
+        if (rd->pos >= rd->len) {
+            if (rd->offset >= rd->end)
+                return -1;
+            rd->len = eb_read(rd->b, rd->offset, rd->buf,
+                              min_int(rd->end - rd->offset, countof(rd->buf)));
+            if (rd->len <= 0)
+                return -1;
+            rd->offset += rd->len;
+            rd->pos = 0;
+        }
+        c = rd->buf[rd->pos++];
+        if (flags & DIFF_IGNORE_CASE)
+            c = qe_tolower(c);
+        if (!(flags & DIFF_IGNORE_SPACES)
+        ||  !(c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v'))
+            return c;
+    }
+}
+
+static int diff_lines_equal(DiffContext *dc, int line1, int line2)
+{
+    DiffReader rd1, rd2;
+    int c;
+
+    rd1.b = dc->b1;
+    rd1.offset = dc->offsets1[line1];
+    rd1.end = dc->offsets1[line1 + 1];
+    rd1.pos = rd1.len = 0;
+    rd2.b = dc->b2;
+    rd2.offset = dc->offsets2[line2];
+    rd2.end = dc->offsets2[line2 + 1];
+    rd2.pos = rd2.len = 0;
+    do {
+        c = diff_getc(&rd1, dc->flags);
+        if (c != diff_getc(&rd2, dc->flags))
+            return 0;
+    } while (c >= 0);
+    return 1;
+}
+
+/* compare the raw bytes of `count` lines from `line1` and `line2` */
+static int diff_run_equal(DiffContext *dc, int line1, int line2, int count)
+{
+    u8 buf1[4096], buf2[4096];
+    int offset1 = dc->offsets1[line1];
+    int offset2 = dc->offsets2[line2];
+    int end1 = dc->offsets1[line1 + count];
+    int len;
+
+    if (end1 - offset1 != dc->offsets2[line2 + count] - offset2)
+        return 0;
+    for (; offset1 < end1; offset1 += len, offset2 += len) {
+        len = min_int(end1 - offset1, countof(buf1));
+        if (eb_read(dc->b1, offset1, buf1, len) != len
+        ||  eb_read(dc->b2, offset2, buf2, len) != len
+        ||  memcmp(buf1, buf2, len))
+            return 0;
+    }
+    return 1;
+}
+
+/* flag unchanged lines that only have the same hash code as changed */
+static void diff_check_lines(DiffContext *dc)
+{
+    int i, j, k, n1 = dc->nb_lines1, n2 = dc->nb_lines2;
+
+    for (i = j = 0; i < n1 && j < n2;) {
+        if (dc->changed1[i]) {
+            i++;
+            continue;
+        }
+        if (dc->changed2[j]) {
+            j++;
+            continue;
+        }
+        /* compare runs of unchanged lines at once if possible */
+        for (k = 1; i + k < n1 && j + k < n2
+             &&  !dc->changed1[i + k] && !dc->changed2[j + k]; k++)
+            continue;
+        if (dc->flags || !diff_run_equal(dc, i, j, k)) {
+            for (; k > 0; k--, i++, j++) {
+                if (!diff_lines_equal(dc, i, j))
+                    dc->changed1[i] = dc->changed2[j] = 1;
+            }
+        }
+        i += k;
+        j += k;
+    }
+}
+
+static void diff_context_free(DiffContext *dc)
+{
+    qe_free(&dc->ids1);
+    qe_free(&dc->ids2);
+    qe_free(&dc->changed1);
+    qe_free(&dc->changed2);
+    qe_free(&dc->hashes);
+    qe_free(&dc->table);
+    qe_free(&dc->stamp);
+    qe_free(&dc->count1);
+    qe_free(&dc->count2);
+    qe_free(&dc->pos1);
+    qe_free(&dc->pairs1);
+    qe_free(&dc->pairs2);
+    qe_free(&dc->tails);
+    qe_free(&dc->prev);
+    qe_free(&dc->trace);
+}
+
+QEDiff *qe_diff_buffers(EditBuffer *b1, int start1, int end1,
+                        EditBuffer *b2, int start2, int end2, int flags)
+{
+    /*@API diff
+       Compute the line differences between ranges of two buffers.
+       @argument `b1` the original buffer
+       @argument `start1` the start of the range in `b1`
+       @argument `end1` the end of the range in `b1`
+       @argument `b2` the modified buffer
+       @argument `start2` the start of the range in `b2`
+       @argument `end2` the end of the range in `b2`
+       @argument `flags` a combination of `DIFF_IGNORE_SPACES` and
+       `DIFF_IGNORE_CASE`
+       @return a newly allocated `QEDiff` structure with the line offsets
+       and the list of hunks, or `NULL` if memory is exhausted.
+       @note: lines are compared by 64-bit hash of their bytes, then
+       byte by byte, the buffers should use the same charset and end of
+       line convention.
+     */
+    DiffContext dc[1];
+    QEDiff *dp;
+    uint64_t *hashes1 = NULL, *hashes2 = NULL;
+    unsigned int size;
+    int i, j, n1, n2, nmin, size_hunks;
+
+    memset(dc, 0, sizeof(*dc));
+    dp = qe_mallocz(QEDiff);
+    if (!dp)
+        return NULL;
+    dp->b1 = b1;
+    dp->b2 = b2;
+    n1 = diff_hash_lines(b1, start1, max_offset(start1, end1), flags,
+                         &dp->offsets1, &hashes1);
+    n2 = diff_hash_lines(b2, start2, max_offset(start2, end2), flags,
+                         &dp->offsets2, &hashes2);
+    if (n1 < 0 || n2 < 0)
+        goto fail;
+    dp->nb_lines1 = dc->nb_lines1 = n1;
+    dp->nb_lines2 = dc->nb_lines2 = n2;
+    dc->b1 = b1;
+    dc->b2 = b2;
+    dc->offsets1 = dp->offsets1;
+    dc->offsets2 = dp->offsets2;
+    dc->flags = flags;
+
+    /* intern the lines */
+    for (size = 1024; size < 2U * (n1 + n2); size <<= 1)
+        continue;
+    nmin = min_int(n1, n2) + 1;
+    dc->table = qe_malloc_array(int, size);
+    dc->table_mask = size - 1;
+    dc->hashes = qe_malloc_array(uint64_t, n1 + n2 + 1);
+    dc->ids1 = qe_malloc_array(int, n1 + 1);
+    dc->ids2 = qe_malloc_array(int, n2 + 1);
+    dc->changed1 = qe_mallocz_array(u8, n1 + 1);
+    dc->changed2 = qe_mallocz_array(u8, n2 + 1);
+    dc->pairs1 = qe_malloc_array(int, nmin);
+    dc->pairs2 = qe_malloc_array(int, nmin);
+    dc->tails = qe_malloc_array(int, nmin);
+    dc->prev = qe_malloc_array(int, nmin);
+    if (!dc->table || !dc->hashes || !dc->ids1 || !dc->ids2
+    ||  !dc->changed1 || !dc->changed2 || !dc->pairs1 || !dc->pairs2
+    ||  !dc->tails || !dc->prev)
+        goto fail;
+    memset(dc->table, -1, size * sizeof(*dc->table));
+    for (i = 0; i < n1; i++)
+        dc->ids1[i] = diff_intern(dc, hashes1[i]);
+    for (j = 0; j < n2; j++)
+        dc->ids2[j] = diff_intern(dc, hashes2[j]);
+    qe_free(&hashes1);
+    qe_free(&hashes2);
+    qe_free(&dc->table);
+
+    dc->stamp = qe_mallocz_array(int, dc->nb_ids + 1);
+    dc->count1 = qe_malloc_array(int, dc->nb_ids + 1);
+    dc->count2 = qe_malloc_array(int, dc->nb_ids + 1);
+    dc->pos1 = qe_malloc_array(int, dc->nb_ids + 1);
+    if (!dc->stamp || !dc->count1 || !dc->count2 || !dc->pos1)
+        goto fail;
+
+    diff_region(dc, 0, n1, 0, n2);
+    diff_check_lines(dc);
+
+    /* collect the hunks: unchanged lines match in order on both sides */
+    size_hunks = 0;
+    for (i = j = 0; i < n1 || j < n2;) {
+        if (i < n1 && j < n2 && !dc->changed1[i] && !dc->changed2[j]) {
+            i++;
+            j++;
+            continue;
+        }
+        if (dp->nb_hunks >= size_hunks) {
+            size_hunks = max_int(size_hunks * 2, 16);
+            if (!qe_realloc_array(&dp->hunks, size_hunks))
+                goto fail;
+        }
+        dp->hunks[dp->nb_hunks].line1 = i;
+        dp->hunks[dp->nb_hunks].line2 = j;
+        while (i < n1 && dc->changed1[i])
+            i++;
+        while (j < n2 && dc->changed2[j])
+            j++;
+        dp->hunks[dp->nb_hunks].count1 = i - dp->hunks[dp->nb_hunks].line1;
+        dp->hunks[dp->nb_hunks].count2 = j - dp->hunks[dp->nb_hunks].line2;
+        dp->nb_hunks++;
+    }
+    diff_context_free(dc);
+    return dp;
+
+fail:
+    qe_free(&hashes1);
+    qe_free(&hashes2);
+    diff_context_free(dc);
+    qe_diff_free(&dp);
+    return NULL;
+}
+
+void qe_diff_free(QEDiff **dpp)
+{
+    /*@API diff
+       Free a `QEDiff` structure allocated by `qe_diff_buffers`.
+       @argument `dpp` a pointer to the `QEDiff` pointer, set to `NULL`.
+     */
+    if (*dpp) {
+        QEDiff *dp = *dpp;
+        qe_free(&dp->offsets1);
+        qe_free(&dp->offsets2);
+        qe_free(&dp->hunks);
+        qe_free(dpp);
+    }
+}
+
+static void diff_print_lines(EditBuffer *out, EditBuffer *b, const int *offsets,
+                             int from, int to, char32_t prefix)
+{
+    int i, start, end, offset;
+
+    for (i = from; i < to; i++) {
+        start = offsets[i];
+        end = offsets[i + 1];
+        eb_putc(out, prefix);
+        eb_insert_buffer_convert(out, out->total_size, b, start, end - start);
+        if (eb_prevc(b, end, &offset) != '\n' || offset < start)
+            eb_puts(out, "\n\\ No newline at end of file\n");
+    }
+}
+
+static void diff_print_range(EditBuffer *out, char32_t c, int start, int count)
+{
+    if (count == 1)
+        eb_printf(out, "%c%d", c, start + 1);
+    else
+    if (count == 0)
+        eb_printf(out, "%c%d,0", c, start);
+    else
+        eb_printf(out, "%c%d,%d", c, start + 1, count);
+}
+
+int qe_diff_print(EditBuffer *out, const QEDiff *dp, int context)
+{
+    /*@API diff
+       Append the differences in unified format to a buffer.
+       @argument `out` the destination buffer
+       @argument `dp` a valid `QEDiff` structure
+       @argument `context` the number of context lines around hunks
+       @return the number of hunks groups printed.
+       @note: the file header lines are not output.
+     */
+    const QEDiffHunk *hp, *last;
+    int h, h2, i, s1, s2, e1, e2, nb_groups = 0;
+
+    for (h = 0; h < dp->nb_hunks; h = h2) {
+        /* merge hunks whose contexts overlap */
+        for (h2 = h + 1; h2 < dp->nb_hunks; h2++) {
+            last = &dp->hunks[h2 - 1];
+            if (dp->hunks[h2].line1 - (last->line1 + last->count1) > 2 * context)
+                break;
+        }
+        hp = &dp->hunks[h];
+        last = &dp->hunks[h2 - 1];
+        s1 = max_int(hp->line1 - context, 0);
+        s2 = hp->line2 - (hp->line1 - s1);
+        e1 = min_int(last->line1 + last->count1 + context, dp->nb_lines1);
+        e2 = last->line2 + last->count2 + (e1 - last->line1 - last->count1);
+        eb_puts(out, "@@ ");
+        diff_print_range(out, '-', s1, e1 - s1);
+        eb_putc(out, ' ');
+        diff_print_range(out, '+', s2, e2 - s2);
+        eb_puts(out, " @@\n");
+        for (i = s1; h < h2; h++) {
+            hp = &dp->hunks[h];
+            diff_print_lines(out, dp->b1, dp->offsets1, i, hp->line1, ' ');
+            diff_print_lines(out, dp->b1, dp->offsets1,
+                             hp->line1, hp->line1 + hp->count1, '-');
+            diff_print_lines(out, dp->b2, dp->offsets2,
+                             hp->line2, hp->line2 + hp->count2, '+');
+            i = hp->line1 + hp->count1;
+        }
+        diff_print_lines(out, dp->b1, dp->offsets1, i, e1, ' ');
+        nb_groups++;
+    }
+    return nb_groups;
+}
+
+static EditState *diff_show_buffer(EditState *s, EditBuffer *b, const char *caption)
+{
+    EditState *e;
+    ModeDef *m;
+
+    b->data_type_name = "diff";
+    b->flags |= BF_READONLY;
+    b->offset = 0;
+    e = show_popup(s, b, caption);
+    if (e && (m = qe_find_mode(s->qs, "pager", 0)) != NULL)
+        edit_set_mode(e, m);
+    return e;
+}
+
+void qe_diff_buffer_with_file(EditState *s, EditBuffer *b)
+{
+    char bufname[MAX_BUFFERNAME_SIZE];
+    char caption[64 + MAX_FILENAME_SIZE];
+    QEmacsState *qs = s->qs;
+    EditBuffer *fb, *b1;
+    QEDiff *dp;
+    FILE *f;
+    const char *fname = get_basename(b->filename);
+
+    if (s->flags & (WF_POPUP | WF_MINIBUF))
+        return;
+
+    if (!*fname)
+        return;
+
+    f = fopen(b->filename, "r");
+    if (!f) {
+        put_error(s, "Cannot open file %s: %s", b->filename, strerror(errno));
+        return;
+    }
+    /* load the file contents with the buffer encoding */
+    fb = qe_new_buffer(qs, "*diff-file*", BF_SYSTEM | BC_CLEAR);
+    if (!fb) {
+        fclose(f);
+        return;
+    }
+    eb_set_charset(fb, b->charset, b->eol_type);
+    if (eb_raw_buffer_load1(fb, f, 0) < 0) {
+        put_error(s, "Error reading %s", b->filename);
+        fclose(f);
+        eb_free(&fb);
+        return;
+    }
+    fclose(f);
+
+    snprintf(bufname, sizeof(bufname), "*Diff %s*", fname);
+    dp = qe_diff_buffers(fb, 0, fb->total_size, b, 0, b->total_size, 0);
+    b1 = qe_new_buffer(qs, bufname, BC_CLEAR | BF_UTF8);
+    if (!dp || !b1) {
+        put_error(s, "Out of memory");
+        qe_diff_free(&dp);
+        eb_free(&b1);
+        eb_free(&fb);
+        return;
+    }
+    if (dp->nb_hunks == 0) {
+        eb_printf(b1, "Files %s and #<buffer %s> are identical\n",
+                  b->filename, b->name);
+    } else {
+        eb_printf(b1, "--- %s\n+++ #<buffer %s>\n", b->filename, b->name);
+        qe_diff_print(b1, dp, 3);
+    }
+    qe_diff_free(&dp);
+    eb_free(&fb);
+
+    snprintf(caption, sizeof(caption), "Diff buffer %s", fname);
+    diff_show_buffer(s, b1, caption);
+}
+
+static void do_diff_buffer_with_file(EditState *s)
+{
+    qe_diff_buffer_with_file(s, s->b);
+}
+
+/* find the window to compare with, skipping dired panes */
+static EditState *diff_other_window(EditState *s)
+{
+    EditState *s2;
+
+    for (s2 = s;;) {
+        s2 = s2->next_window;
+        if (s2 == NULL)
+            s2 = s->qs->first_window;
+        if (s2 == s)
+            return NULL;
+        if (!(s2->b->flags & BF_DIRED) && !(s2->flags & (WF_POPUP | WF_MINIBUF)))
+            return s2;
+    }
+}
+
+static QEDiff *diff_windows(EditState *s, EditState **s2p)
+{
+    QEmacsState *qs = s->qs;
+    EditState *s2;
+    QEDiff *dp;
+    int flags = 0;
+
+    if (!(s2 = diff_other_window(s))) {
+        put_error(s, "No other window");
+        return NULL;
+    }
+    if (qs->ignore_spaces)
+        flags |= DIFF_IGNORE_SPACES;
+    if (qs->ignore_case)
+        flags |= DIFF_IGNORE_CASE;
+    dp = qe_diff_buffers(s->b, 0, s->b->total_size,
+                         s2->b, 0, s2->b->total_size, flags);
+    if (!dp)
+        put_error(s, "Out of memory");
+    *s2p = s2;
+    return dp;
+}
+
+static void do_diff_windows(EditState *s)
+{
+    char caption[32 + 2 * MAX_BUFFERNAME_SIZE];
+    EditState *s2;
+    EditBuffer *b;
+    QEDiff *dp;
+
+    if (!(dp = diff_windows(s, &s2)))
+        return;
+
+    b = qe_new_buffer(s->qs, "*Diff*", BC_CLEAR | BF_UTF8);
+    if (!b) {
+        qe_diff_free(&dp);
+        return;
+    }
+    if (dp->nb_hunks == 0) {
+        eb_printf(b, "Buffers %s and %s are identical\n", s->b->name, s2->b->name);
+    } else {
+        eb_printf(b, "--- #<buffer %s>\n+++ #<buffer %s>\n", s->b->name, s2->b->name);
+        qe_diff_print(b, dp, 3);
+    }
+    snprintf(caption, sizeof(caption), "Diff %s %s", s->b->name, s2->b->name);
+    put_status(s, "%d hunks", dp->nb_hunks);
+    qe_diff_free(&dp);
+    diff_show_buffer(s, b, caption);
+}
+
+/* hunk list of the last pair of buffers visited by diff-next-hunk,
+   dropped by any modification of either buffer */
+typedef struct DiffCache {
+    EditBuffer *b1, *b2;
+    int flags;
+    QEDiff *dp;
+} DiffCache;
+
+static DiffCache diff_cache;
+
+static void diff_cache_callback(qe__unused__ EditBuffer *b, void *opaque,
+                                qe__unused__ int arg,
+                                qe__unused__ enum LogOperation op,
+                                qe__unused__ int offset,
+                                qe__unused__ int size)
+{
+    DiffCache *dc = opaque;
+
+    qe_diff_free(&dc->dp);
+}
+
+/* buffers may have been freed and reallocated at the same address */
+static int diff_cache_attached(QEmacsState *qs, EditBuffer **bp)
+{
+    EditBufferCallbackList *l;
+
+    if (qe_check_buffer(qs, bp)) {
+        for (l = (*bp)->first_callback; l != NULL; l = l->next) {
+            if (l->callback == diff_cache_callback && l->opaque == &diff_cache)
+                return 1;
+        }
+    }
+    return 0;
+}
+
+static void diff_cache_reset(QEmacsState *qs)
+{
+    DiffCache *dc = &diff_cache;
+
+    if (diff_cache_attached(qs, &dc->b1))
+        eb_free_callback(dc->b1, diff_cache_callback, dc);
+    if (diff_cache_attached(qs, &dc->b2))
+        eb_free_callback(dc->b2, diff_cache_callback, dc);
+    qe_diff_free(&dc->dp);
+    dc->b1 = dc->b2 = NULL;
+}
+
+static QEDiff *diff_windows_cached(EditState *s, EditState **s2p)
+{
+    QEmacsState *qs = s->qs;
+    DiffCache *dc = &diff_cache;
+    EditState *s2;
+    int flags = 0;
+
+    if (qs->ignore_spaces)
+        flags |= DIFF_IGNORE_SPACES;
+    if (qs->ignore_case)
+        flags |= DIFF_IGNORE_CASE;
+    s2 = diff_other_window(s);
+    if (dc->dp && s2 && dc->b1 == s->b && dc->b2 == s2->b
+    &&  dc->flags == flags
+    &&  diff_cache_attached(qs, &dc->b1)
+    &&  diff_cache_attached(qs, &dc->b2)) {
+        *s2p = s2;
+        return dc->dp;
+    }
+    diff_cache_reset(qs);
+    if (!(dc->dp = diff_windows(s, s2p)))
+        return NULL;
+    dc->b1 = s->b;
+    dc->b2 = (*s2p)->b;
+    dc->flags = flags;
+    if (eb_add_callback(dc->b1, diff_cache_callback, dc, 0)
+    ||  eb_add_callback(dc->b2, diff_cache_callback, dc, 0)) {
+        /* cannot track modifications: do not keep the hunk list */
+        diff_cache_reset(qs);
+        put_error(s, "Out of memory");
+        return NULL;
+    }
+    return dc->dp;
+}
+
+static void do_diff_next_hunk(EditState *s, int dir)
+{
+    EditState *s2;
+    QEDiff *dp;
+    const QEDiffHunk *hp;
+    int line1, col1, lo, hi, mid;
+
+    if (!(dp = diff_windows_cached(s, &s2)))
+        return;
+
+    /* find the first hunk starting after the current line */
+    eb_get_pos(s->b, &line1, &col1, s->offset);
+    for (lo = 0, hi = dp->nb_hunks; lo < hi;) {
+        mid = (lo + hi) >> 1;
+        if (dp->hunks[mid].line1 <= line1)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (dir < 0) {
+        /* skip the hunk at point */
+        lo--;
+        if (lo >= 0 && dp->hunks[lo].line1 + max_int(dp->hunks[lo].count1, 1) > line1)
+            lo--;
+    }
+    if (lo < 0 || lo >= dp->nb_hunks) {
+        put_error(s, dp->nb_hunks ? "No more hunks" : "No differences");
+    } else {
+        hp = &dp->hunks[lo];
+        s->offset = dp->offsets1[hp->line1];
+        s2->offset = dp->offsets2[hp->line2];
+        do_center_cursor(s, 0);
+        do_center_cursor(s2, 0);
+        put_status(s, "Hunk %d/%d: -%d +%d lines", lo + 1, dp->nb_hunks,
+                   hp->count1, hp->count2);
+    }
+}
+
+static void diff_bench_flush(EditBuffer *b, buf_t *out, int force)
+{
+    if (force || out->len > out->size - 128) {
+        eb_write(b, b->total_size, out->buf, out->len);
+        buf_init(out, out->buf, out->size);
+    }
+}
+
+static void do_diff_benchmark(EditState *s, int argval)
+{
+    char buf1[16384], buf2[16384];
+    QEmacsState *qs = s->qs;
+    EditBuffer *b1, *b2;
+    buf_t out1[1], out2[1];
+    QEDiff *dp;
+    int i, n, start_time, elapsed_time;
+    unsigned int seed = 1;
+
+    n = (argval == NO_ARG) ? 1000000 : argval;
+    b1 = qe_new_buffer(qs, "*diff-bench-1*", BF_SYSTEM | BF_UTF8 | BC_CLEAR);
+    b2 = qe_new_buffer(qs, "*diff-bench-2*", BF_SYSTEM | BF_UTF8 | BC_CLEAR);
+    if (!b1 || !b2) {
+        eb_free(&b1);
+        eb_free(&b2);
+        return;
+    }
+    /* generate source-like text, edit about one line in 300 */
+    buf_init(out1, buf1, countof(buf1));
+    buf_init(out2, buf2, countof(buf2));
+    for (i = 0; i < n; i++) {
+        int r;
+        seed = seed * 1103515245 + 12345;
+        r = (seed >> 16) % 1000;
+        buf_printf(out1, "    line %d: value = %d;\n", i, i % 97);
+        if (i % 10 == 0)
+            buf_puts(out1, "\n");
+        diff_bench_flush(b1, out1, 0);
+        if (r == 0)
+            continue;   /* deleted line */
+        if (r == 1)
+            buf_printf(out2, "    line %d: value = %d; /* changed */\n", i, i % 97);
+        else
+            buf_printf(out2, "    line %d: value = %d;\n", i, i % 97);
+        if (r == 2)
+            buf_printf(out2, "    inserted line after %d\n", i);
+        if (i % 10 == 0)
+            buf_puts(out2, "\n");
+        diff_bench_flush(b2, out2, 0);
+    }
+    diff_bench_flush(b1, out1, 1);
+    diff_bench_flush(b2, out2, 1);
+
+    start_time = get_clock_ms();
+    dp = qe_diff_buffers(b1, 0, b1->total_size, b2, 0, b2->total_size, 0);
+    elapsed_time = get_clock_ms() - start_time;
+    if (dp) {
+        put_status(s, "Diff of %d and %d lines: %d hunks in %d ms",
+                   dp->nb_lines1, dp->nb_lines2, dp->nb_hunks, elapsed_time);
+    } else {
+        put_error(s, "Out of memory");
+    }
+    qe_diff_free(&dp);
+    eb_free(&b1);
+    eb_free(&b2);
+}
+
+static const CmdDef diff_commands[] = {
+    CMD2( "diff-buffer-with-file", "C-c C-d, C-c =",
+          "Show differences between the buffer in the current window and its file",
+          do_diff_buffer_with_file, ES, "#")
+    CMD2( "diff-windows", "",
+          "Show differences between the buffers in the current and next window",
+          do_diff_windows, ES, "#")
+    CMD3( "diff-next-hunk", "",
+          "Move both windows to the next difference between their buffers",
+          do_diff_next_hunk, ESi, "#" "v", 1)
+    CMD3( "diff-previous-hunk", "",
+          "Move both windows to the previous difference between their buffers",
+          do_diff_next_hunk, ESi, "#" "v", -1)
+    CMD2( "diff-benchmark", "",
+          "Time the difference engine on generated buffers (default 1M lines)",
+          do_diff_benchmark, ESi, "P")
+};
+
+static int diff_init(QEmacsState *qs)
+{
+    qe_register_commands(qs, NULL, diff_commands, countof(diff_commands));
+    return 0;
+}
+
+static void diff_exit(QEmacsState *qs)
+{
+    diff_cache_reset(qs);
+}
+
+qe_module_init(diff_init);
+qe_module_exit(diff_exit);
@@ -104,7 +104,7 @@ static void dummy_dpy_set_clip(qe__unused__ QEditScreen *s,
 {
 }
 
-static QEDisplay const dummy_dpy = {
+QEDisplay const dummy_dpy = {
     "dummy", 1, 1,
     NULL, /* dpy_probe */
     dummy_dpy_init,
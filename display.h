@@ -145,6 +145,9 @@ struct QEditScreen {
     void *priv_data;
 };
 
+/* null display driver used at initialization time and for headless runs */
+extern QEDisplay const dummy_dpy;
+
 int qe_register_display(struct QEmacsState *qs, QEDisplay *dpy);
 QEDisplay *probe_display(void);
 
@@ -193,7 +193,9 @@ static void compare_resync(EditState *s1, EditState *s2,
 {
     EditBuffer *b1 = s1->b;
     EditBuffer *b2 = s2->b;
-    int pos1, pos2, off1, off2;
+    QEmacsState *qs = s1->qs;
+    QEDiff *dp;
+    int pos1, pos2, off1, off2, end1, end2, whole;
     enum { MAX_BYTE_SYNC = 5, MAX_LINE_SYNC = 64 };
     int p1[MAX_LINE_SYNC];
     int p2[MAX_LINE_SYNC];
@@ -254,6 +256,38 @@ static void compare_resync(EditState *s1, EditState *s2,
             }
         }
     }
+    // Use the diff engine on a window of lines, doubled until the first
+    // change is followed by identical lines, so the cost of a resync
+    // depends on the size of the change, not on the rest of the buffers
+    end1 = p1[0];
+    end2 = p2[0];
+    for (n = 4 * MAX_LINE_SYNC;; n *= 2) {
+        for (i = 0; i < n; i++) {
+            end1 = eb_next_line(b1, end1);
+            end2 = eb_next_line(b2, end2);
+        }
+        whole = (end1 >= b1->total_size && end2 >= b2->total_size);
+        dp = qe_diff_buffers(b1, p1[0], end1, b2, p2[0], end2,
+                             (qs->ignore_spaces ? DIFF_IGNORE_SPACES : 0) |
+                             (qs->ignore_case ? DIFF_IGNORE_CASE : 0));
+        if (!dp)
+            break;
+        if (dp->nb_hunks > 0) {
+            QEDiffHunk *hp = &dp->hunks[0];
+            i = hp->line1 + hp->count1;
+            j = hp->line2 + hp->count2;
+            if (whole || (i < dp->nb_lines1 && j < dp->nb_lines2)) {
+                *offset1_ptr = dp->offsets1[i];
+                *offset2_ptr = dp->offsets2[j];
+                put_status(s1, "Skipped %d and %d lines", i, j);
+                qe_diff_free(&dp);
+                return;
+            }
+        }
+        qe_diff_free(&dp);
+        if (whole)
+            break;
+    }
     put_status(s1, "Could not resynchronize");
 }
 
@@ -1381,6 +1415,7 @@ int qe_list_bindings(QEmacsState *qs, const CmdDef *d, ModeDef *mode, int inheri
     buf_t outbuf, *out;
     ModeDef *mode0 = mode;
 
+    qe_load_mode_bindings(qs, mode);
     out = buf_init(&outbuf, buf, size);
     for (;;) {
         KeyDef *kd = mode ? mode->first_key : qs->first_key;
@@ -1511,8 +1546,10 @@ static void mode_wall_chart(EditBuffer *b, ModeDef *mode, ModeDef *mode0, const
     buf_t out[1];
     char buf[32];
     int head, start, stop;
-    KeyDef *kd = mode ? mode->first_key : b->qs->first_key;
+    KeyDef *kd;
 
+    qe_load_mode_bindings(b->qs, mode);
+    kd = mode ? mode->first_key : b->qs->first_key;
     if (!kd)
         return;
 
@@ -2182,6 +2219,7 @@ static void do_describe_buffer(EditState *s, int argval)
     buf_t descbuf, *desc;
     EditBuffer *b = s->b;
     EditBuffer *b1;
+    QEModeData *md;
 
     b1 = new_help_buffer(s);
     if (!b1)
@@ -2365,6 +2403,11 @@ static void do_describe_buffer(EditState *s, int argval)
             eb_putc(b1, '\n');
     }
 
+    for (md = b->mode_data_list; md; md = md->next) {
+        if (md->mode && md->mode->mode_describe)
+            md->mode->mode_describe(b1, b, md);
+    }
+
     if (b->nb_pages) {
         Page *p;
         int i, j;
@@ -2519,6 +2562,132 @@ static void do_describe_screen(EditState *e, int argval)
     show_popup(e, b1, "Screen Description");
 }
 
+/*---------------- performance counters ----------------*/
+
+/* upper bound of the histogram bucket holding the given percentile */
+static int perf_percentile(const QEPerfHist *h, int percent)
+{
+    long long target, n;
+    int i, k, limit;
+
+    if (!h->count)
+        return 0;
+    target = ((long long)h->count * percent + 99) / 100;
+    for (i = 0, n = 0; i < PERF_HIST_SIZE - 1; i++) {
+        n += h->buckets[i];
+        if (n >= target)
+            break;
+    }
+    if (i < 16) {
+        limit = i;
+    } else {
+        k = 4 + (i - 16) / 4;
+        limit = ((5 + (i - 16) % 4) << (k - 2)) - 1;
+    }
+    return min_int(limit, h->max);
+}
+
+static void perf_print_hist(EditBuffer *b, const char *name,
+                            const QEPerfHist *h, long long allocs)
+{
+    int mean = h->count ? h->total / h->count : 0;
+
+    eb_printf(b, "%-24s %7d %7d %7d %7d %7d %9lld",
+              name, h->count, perf_percentile(h, 50), perf_percentile(h, 95),
+              h->max, mean, h->total / 1000);
+    if (allocs >= 0 && h->count)
+        eb_printf(b, " %5lld.%lld", allocs / h->count, allocs * 10 / h->count % 10);
+    eb_putc(b, '\n');
+}
+
+static int perf_command_cmp(const void *a, const void *b)
+{
+    const QEPerfCommand *pa = *(const QEPerfCommand * const *)a;
+    const QEPerfCommand *pb = *(const QEPerfCommand * const *)b;
+
+    if (pa->hist.total != pb->hist.total)
+        return pa->hist.total < pb->hist.total ? 1 : -1;
+    return strcmp(pa->name, pb->name);
+}
+
+static void perf_report(QEmacsState *qs, EditBuffer *b)
+{
+    QEPerfStats *ps = &qs->perf;
+    const SymbolTable *st = &ps->cmd_table;
+    QEPerfCommand **tab;
+    int i, n, elapsed;
+
+    elapsed = get_clock_ms() - ps->reset_time;
+    eb_printf(b, "Performance counters for the last %d.%03d s,"
+              " %llu allocations in total\n",
+              elapsed / 1000, elapsed % 1000, qe_alloc_count_get());
+    eb_printf(b, "Times in microseconds, total in milliseconds,"
+              " allocations per operation\n\n");
+    eb_printf(b, "%-24s %7s %7s %7s %7s %7s %9s %7s\n",
+              "operation", "count", "p50", "p95", "max", "mean",
+              "total", "allocs");
+    perf_print_hist(b, "commands", &ps->commands, ps->command_allocs);
+    perf_print_hist(b, "redisplay", &ps->display, ps->display_allocs);
+    perf_print_hist(b, "  colorize", &ps->colorize, -1);
+    perf_print_hist(b, "  layout", &ps->layout, -1);
+    perf_print_hist(b, "  flush", &ps->flush, -1);
+    perf_print_hist(b, "key to paint", &ps->key_to_paint, -1);
+
+    tab = qe_malloc_array(QEPerfCommand *, st->nb_items);
+    if (!tab)
+        return;
+    for (i = n = 0; i < st->nb_allocated; i++) {
+        if (st->entries[i].name)
+            tab[n++] = st->entries[i].value;
+    }
+    qsort(tab, n, sizeof(*tab), perf_command_cmp);
+    eb_printf(b, "\n%-24s %7s %7s %7s %7s %7s %9s %7s\n",
+              "command", "count", "p50", "p95", "max", "mean",
+              "total", "allocs");
+    for (i = 0; i < n; i++)
+        perf_print_hist(b, tab[i]->name, &tab[i]->hist, tab[i]->allocs);
+    qe_free(&tab);
+}
+
+static void do_show_perf_counters(EditState *s)
+{
+    EditBuffer *b;
+
+    b = qe_new_buffer(s->qs, "*perf*", BC_CLEAR | BF_SYSTEM | BF_UTF8);
+    if (!b)
+        return;
+    perf_report(s->qs, b);
+    b->modified = 0;
+    b->offset = 0;
+    show_popup(s, b, "Performance counters");
+}
+
+static void do_write_perf_counters(EditState *s, const char *filename)
+{
+    char absname[MAX_FILENAME_SIZE];
+    EditBuffer *b;
+    int nb;
+
+    b = qe_new_buffer(s->qs, "*perf-dump*", BF_SYSTEM | BF_UTF8);
+    if (!b)
+        return;
+    perf_report(s->qs, b);
+    canonicalize_absolute_path(s, absname, sizeof(absname), filename);
+    nb = eb_write_buffer(b, 0, b->total_size, absname);
+    eb_free(&b);
+    if (nb < 0) {
+        put_error(s, "Could not write %s", absname);
+    } else {
+        put_status(s, "Wrote performance counters to %s", absname);
+    }
+}
+
+static void do_reset_perf_counters(EditState *s)
+{
+    qe_perf_reset(s->qs);
+    put_status(s, "Performance counters reset");
+}
+
 /*---------------- buffer contents sorting ----------------*/
 
 struct chunk_ctx {
@@ -3056,6 +3225,7 @@ static CompletionDef charname_completion = {
     .print_entry = charname_print_entry,
     .get_entry = charname_get_entry,
     .convert_entry = charname_convert_entry,
+    .flags = CF_CACHE_LIST,
 };
 
 /*---------------- style and color ----------------*/
@@ -3807,6 +3977,16 @@ static const CmdDef extra_commands[] = {
     CMD2( "describe-screen", "C-h s, C-h C-s",
           "Show information about the current screen",
           do_describe_screen, ESi, "p")
+    CMD0( "show-perf-counters", "",
+          "Show command and redisplay latencies in the *perf* buffer",
+          do_show_perf_counters)
+    CMD2( "write-perf-counters", "",
+          "Write command and redisplay latencies to a file",
+          do_write_perf_counters, ESs,
+          "s{Write performance counters to file: }[file]|file|")
+    CMD0( "reset-perf-counters", "",
+          "Reset command and redisplay latency counters",
+          do_reset_perf_counters)
     CMD2( "describe-window", "C-h C-w",
           "Show information about the current window",
           do_describe_window, ESi, "p")
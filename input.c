@@ -137,6 +137,7 @@ void do_switch_input_method(EditState *s)
 static CompletionDef input_completion = {
     .name = "input",
     .enumerate = input_complete,
+    .flags = CF_CACHE_LIST,
 };
 
 void qe_input_methods_init(QEmacsState *qs)
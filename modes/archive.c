@@ -24,6 +24,16 @@
 
 #include "qe.h"
 
+#ifdef CONFIG_ZLIB
+#include <zlib.h>
+#endif
+#ifdef CONFIG_LZMA
+#include <lzma.h>
+#endif
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+
 /*---------------- Archivers ----------------*/
 
 typedef struct ArchiveType ArchiveType;
@@ -213,6 +223,21 @@ static int archive_init(QEmacsState *qs)
 
 /*---------------- Compressors ----------------*/
 
+/* Compressed files are decoded in-process on a worker thread when the
+ * codec library was found by configure. The decoded data is appended to
+ * the buffer from bottom halves in chunks of COMPRESS_CHUNK_SIZE bytes,
+ * so the file can be browsed while it is being expanded.
+ * Other formats are expanded by an external command in a shell buffer.
+ */
+
+enum {
+    COMPRESS_CODEC_NONE,
+    COMPRESS_CODEC_GZIP,        /* zlib */
+    COMPRESS_CODEC_XZ,          /* liblzma */
+    COMPRESS_CODEC_LZMA,        /* liblzma, legacy .lzma format */
+    COMPRESS_CODEC_ZSTD,        /* libzstd */
+};
+
 typedef struct CompressType CompressType;
 
 struct CompressType {
@@ -223,26 +248,28 @@ struct CompressType {
     const char *load_cmd;       /* uncompress file to stdout */
     const char *save_cmd;       /* compress to file from stdin */
     int sf_flags;
+    int codec;                  /* built-in codec if available */
     struct CompressType *next;
 };
 
 static CompressType compress_type_array[] = {
-    { "gzip", NULL, 0, "gz", "gunzip -c $1", "gzip > $1", 0, NULL },
-    { "bzip2", NULL, 0, "bz2|bzip2", "bunzip2 -c $1", "bzip2 > $1", 0, NULL },
-    { "compress", NULL, 0, "Z", "uncompress -c < $1", "compress > $1", 0, NULL },
-    { "LZMA", NULL, 0, "lzma", "unlzma -c $1", "lzma > $1", 0, NULL },
-    { "XZ", NULL, 0, "xz", "unxz -c $1", "xz > $1", 0, NULL },
+    { "gzip", NULL, 0, "gz", "gunzip -c $1", "gzip > $1", 0, COMPRESS_CODEC_GZIP, NULL },
+    { "bzip2", NULL, 0, "bz2|bzip2", "bunzip2 -c $1", "bzip2 > $1", 0, 0, NULL },
+    { "compress", NULL, 0, "Z", "uncompress -c < $1", "compress > $1", 0, 0, NULL },
+    { "LZMA", NULL, 0, "lzma", "unlzma -c $1", "lzma > $1", 0, COMPRESS_CODEC_LZMA, NULL },
+    { "XZ", NULL, 0, "xz", "unxz -c $1", "xz > $1", 0, COMPRESS_CODEC_XZ, NULL },
+    { "zstd", NULL, 0, "zst", "zstd -dc $1", "zstd -q > $1", 0, COMPRESS_CODEC_ZSTD, NULL },
     { "BinHex", NULL, 0, "hqx", "binhex decode -o /tmp/qe-$$ $1 && "
-                       "cat /tmp/qe-$$ ; rm -f /tmp/qe-$$", NULL, 0, NULL },
-    { "sqlite", "SQLite format 3\0", 16, NULL, "sqlite3 $1 .dump", NULL, 0, NULL },
-    { "bplist", "bplist00", 8, "plist", "plutil -p $1", NULL, 0, NULL },
-//    { "bplist", "bplist00", 8, "plist", "plutil -convert xml1 -o - $1", NULL, 0, NULL },
-//    { "jpeg", NULL, 0, "jpg", "jp2a --height=35 --background=dark $1", NULL, SF_COLOR, NULL },
-//    { "image", NULL, 0, "bmp", "img2txt -f utf8 $1", NULL, SF_COLOR, NULL  },
-    { "pdf", NULL, 0, "pdf", "pstotext $1", NULL, 0, NULL },
-    { "zdump", "TZif\0\0\0\0", 8, NULL, "zdump -v $1", NULL, 0, NULL },
+                       "cat /tmp/qe-$$ ; rm -f /tmp/qe-$$", NULL, 0, 0, NULL },
+    { "sqlite", "SQLite format 3\0", 16, NULL, "sqlite3 $1 .dump", NULL, 0, 0, NULL },
+    { "bplist", "bplist00", 8, "plist", "plutil -p $1", NULL, 0, 0, NULL },
+//    { "bplist", "bplist00", 8, "plist", "plutil -convert xml1 -o - $1", NULL, 0, 0, NULL },
+//    { "jpeg", NULL, 0, "jpg", "jp2a --height=35 --background=dark $1", NULL, SF_COLOR, 0, NULL },
+//    { "image", NULL, 0, "bmp", "img2txt -f utf8 $1", NULL, SF_COLOR, 0, NULL  },
+    { "pdf", NULL, 0, "pdf", "pstotext $1", NULL, 0, 0, NULL },
+    { "zdump", "TZif\0\0\0\0", 8, NULL, "zdump -v $1", NULL, 0, 0, NULL },
 #ifdef CONFIG_DARWIN
-    { "dylib", NULL, 0, "dylib", "nm -n $1", NULL, 0, NULL },
+    { "dylib", NULL, 0, "dylib", "nm -n $1", NULL, 0, 0, NULL },
 #endif
 };
 
@@ -266,6 +293,27 @@ static CompressType *find_compress_type(const char *filename,
     return NULL;
 }
 
+static int compress_has_codec(int codec)
+{
+    switch (codec) {
+#ifdef CONFIG_ZLIB
+    case COMPRESS_CODEC_GZIP:
+        return 1;
+#endif
+#ifdef CONFIG_LZMA
+    case COMPRESS_CODEC_XZ:
+    case COMPRESS_CODEC_LZMA:
+        return 1;
+#endif
+#ifdef CONFIG_ZSTD
+    case COMPRESS_CODEC_ZSTD:
+        return 1;
+#endif
+    default:
+        return 0;
+    }
+}
+
 static int compress_mode_probe(ModeDef *mode, ModeProbeData *p)
 {
     CompressType *ctp = find_compress_type(p->filename, p->buf, p->buf_size);
@@ -283,6 +331,442 @@ static int compress_mode_probe(ModeDef *mode, ModeProbeData *p)
     return 0;
 }
 
+#define COMPRESS_IBUF_SIZE   (64 << 10)
+#define COMPRESS_CHUNK_SIZE  (1 << 20)
+#define COMPRESS_MAX_CHUNKS  4      /* decoded chunks waiting for the main thread */
+#define COMPRESS_DISPLAY_MS  100
+
+typedef struct CompressLoader {
+    URLState *up;
+    URLJob *job;
+    EditBuffer *b;          /* NULL once detached from the buffer */
+    CompressType *ctp;
+    char filename[MAX_FILENAME_SIZE];
+    /* fields below are only accessed by the worker thread */
+    u8 *out;                /* pending chunk */
+    int out_len;
+    long long in_pos;       /* compressed bytes read */
+    char error[80];
+} CompressLoader;
+
+typedef struct CompressChunk {
+    CompressLoader *cl;
+    long long in_pos;
+    int size;
+    u8 data[1];
+} CompressChunk;
+
+typedef struct CompressState {
+    QEModeData base;
+    CompressLoader *loader;
+    CompressType *ctp;
+    long long in_size;      /* compressed size */
+    long long in_pos;       /* compressed bytes decoded so far */
+    int start_time;
+    int load_time;          /* in milliseconds, -1 while loading */
+    int display_time;
+    int auto_mode;          /* coding and mode were detected */
+} CompressState;
+
+static ModeDef compress_mode;
+
+static void compress_chunk_cb(void *opaque);
+
+static inline CompressState *compress_get_state(EditBuffer *b)
+{
+    return qe_get_buffer_mode_data(b, &compress_mode, NULL);
+}
+
+/* called on the worker thread: hand the pending output to the main
+   thread, waiting if it has not inserted the previous chunks yet.
+   Return -1 if the job was canceled. */
+static int compress_flush(URLJob *job, CompressLoader *cl)
+{
+    CompressChunk *chunk;
+
+    if (cl->out_len > 0) {
+        chunk = qe_malloc_hack(CompressChunk, cl->out_len);
+        if (!chunk) {
+            snprintf(cl->error, sizeof cl->error, "out of memory");
+            return -1;
+        }
+        chunk->cl = cl;
+        chunk->in_pos = cl->in_pos;
+        chunk->size = cl->out_len;
+        memcpy(chunk->data, cl->out, cl->out_len);
+        cl->out_len = 0;
+        if (url_post_job_bottom_half(job, COMPRESS_MAX_CHUNKS,
+                                     compress_chunk_cb, chunk)) {
+            qe_free(&chunk);
+            snprintf(cl->error, sizeof cl->error, "out of memory");
+            return -1;
+        }
+    }
+    return url_job_canceled(job) ? -1 : 0;
+}
+
+static int compress_read(CompressLoader *cl, FILE *f, u8 *buf)
+{
+    int len = fread(buf, 1, COMPRESS_IBUF_SIZE, f);
+
+    if (len < COMPRESS_IBUF_SIZE && ferror(f)) {
+        snprintf(cl->error, sizeof cl->error, "%s", strerror(errno));
+        return -1;
+    }
+    cl->in_pos += len;
+    return len;
+}
+
+#ifdef CONFIG_ZLIB
+static int compress_inflate_gzip(URLJob *job, CompressLoader *cl,
+                                 FILE *f, u8 *ibuf)
+{
+    z_stream zs;
+    int len, ret, eof = 0;
+
+    memset(&zs, 0, sizeof zs);
+    /* 15 + 32: maximum window size, detect gzip or zlib header */
+    if (inflateInit2(&zs, 15 + 32) != Z_OK) {
+        snprintf(cl->error, sizeof cl->error, "zlib initialization failed");
+        return -1;
+    }
+    for (ret = Z_OK;;) {
+        if (zs.avail_in == 0 && !eof) {
+            if ((len = compress_read(cl, f, ibuf)) < 0)
+                break;
+            zs.next_in = ibuf;
+            zs.avail_in = len;
+            eof = (len == 0);
+        }
+        zs.next_out = cl->out + cl->out_len;
+        zs.avail_out = COMPRESS_CHUNK_SIZE - cl->out_len;
+        ret = inflate(&zs, Z_NO_FLUSH);
+        cl->out_len = COMPRESS_CHUNK_SIZE - zs.avail_out;
+        if (ret == Z_STREAM_END) {
+            if (zs.avail_in == 0 && !eof) {
+                if ((len = compress_read(cl, f, ibuf)) < 0)
+                    break;
+                zs.next_in = ibuf;
+                zs.avail_in = len;
+                eof = (len == 0);
+            }
+            if (zs.avail_in == 0)
+                break;
+            /* concatenated gzip members decode as a single stream */
+            inflateReset(&zs);
+            ret = Z_OK;
+        } else
+        if (ret == Z_BUF_ERROR && eof && zs.avail_out > 0) {
+            snprintf(cl->error, sizeof cl->error, "unexpected end of file");
+            break;
+        } else
+        if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            snprintf(cl->error, sizeof cl->error, "%s",
+                     zs.msg ? zs.msg : "invalid compressed data");
+            break;
+        }
+        if (cl->out_len == COMPRESS_CHUNK_SIZE && compress_flush(job, cl))
+            break;
+    }
+    inflateEnd(&zs);
+    return (ret == Z_STREAM_END && !*cl->error) ? 0 : -1;
+}
+#endif
+
+#ifdef CONFIG_LZMA
+static int compress_decode_xz(URLJob *job, CompressLoader *cl,
+                              FILE *f, u8 *ibuf)
+{
+    lzma_stream strm = LZMA_STREAM_INIT;
+    lzma_action action = LZMA_RUN;
+    lzma_ret ret;
+    int len;
+
+    /* decodes both .xz and legacy .lzma files */
+    ret = lzma_auto_decoder(&strm, UINT64_MAX, LZMA_CONCATENATED);
+    if (ret != LZMA_OK) {
+        snprintf(cl->error, sizeof cl->error, "lzma initialization failed");
+        return -1;
+    }
+    for (;;) {
+        if (strm.avail_in == 0 && action == LZMA_RUN) {
+            if ((len = compress_read(cl, f, ibuf)) < 0)
+                break;
+            strm.next_in = ibuf;
+            strm.avail_in = len;
+            if (len == 0)
+                action = LZMA_FINISH;
+        }
+        strm.next_out = cl->out + cl->out_len;
+        strm.avail_out = COMPRESS_CHUNK_SIZE - cl->out_len;
+        ret = lzma_code(&strm, action);
+        cl->out_len = COMPRESS_CHUNK_SIZE - strm.avail_out;
+        if (ret == LZMA_STREAM_END)
+            break;
+        if (ret != LZMA_OK) {
+            snprintf(cl->error, sizeof cl->error, "%s",
+                     ret == LZMA_BUF_ERROR ? "unexpected end of file" :
+                     ret == LZMA_MEM_ERROR ? "out of memory" :
+                     "invalid compressed data");
+            break;
+        }
+        if (cl->out_len == COMPRESS_CHUNK_SIZE && compress_flush(job, cl))
+            break;
+    }
+    lzma_end(&strm);
+    return (ret == LZMA_STREAM_END && !*cl->error) ? 0 : -1;
+}
+#endif
+
+#ifdef CONFIG_ZSTD
+static int compress_decode_zstd(URLJob *job, CompressLoader *cl,
+                                FILE *f, u8 *ibuf)
+{
+    ZSTD_DStream *ds;
+    ZSTD_inBuffer in = { ibuf, 0, 0 };
+    ZSTD_outBuffer out;
+    size_t ret = 0;
+    int len, status = -1;
+
+    ds = ZSTD_createDStream();
+    if (!ds || ZSTD_isError(ZSTD_initDStream(ds))) {
+        ZSTD_freeDStream(ds);
+        snprintf(cl->error, sizeof cl->error, "zstd initialization failed");
+        return -1;
+    }
+    for (;;) {
+        if (in.pos == in.size) {
+            if ((len = compress_read(cl, f, ibuf)) < 0)
+                break;
+            if (len == 0) {
+                /* a complete frame ends with ret == 0 */
+                if (ret != 0)
+                    snprintf(cl->error, sizeof cl->error,
+                             "unexpected end of file");
+                else
+                    status = 0;
+                break;
+            }
+            in.pos = 0;
+            in.size = len;
+        }
+        out.dst = cl->out;
+        out.size = COMPRESS_CHUNK_SIZE;
+        out.pos = cl->out_len;
+        ret = ZSTD_decompressStream(ds, &out, &in);
+        cl->out_len = out.pos;
+        if (ZSTD_isError(ret)) {
+            snprintf(cl->error, sizeof cl->error, "%s",
+                     ZSTD_getErrorName(ret));
+            break;
+        }
+        if (cl->out_len == COMPRESS_CHUNK_SIZE && compress_flush(job, cl))
+            break;
+    }
+    ZSTD_freeDStream(ds);
+    return status;
+}
+#endif
+
+/* worker thread: must not touch the buffer */
+static void compress_load_run(URLJob *job, void *opaque)
+{
+    CompressLoader *cl = opaque;
+    FILE *f;
+    u8 *ibuf;
+    int ret = -1;
+
+    f = fopen(cl->filename, "rb");
+    if (!f) {
+        snprintf(cl->error, sizeof cl->error, "%s", strerror(errno));
+        return;
+    }
+    ibuf = qe_malloc_array(u8, COMPRESS_IBUF_SIZE);
+    cl->out = qe_malloc_array(u8, COMPRESS_CHUNK_SIZE);
+    if (!ibuf || !cl->out) {
+        snprintf(cl->error, sizeof cl->error, "out of memory");
+    } else {
+        switch (cl->ctp->codec) {
+#ifdef CONFIG_ZLIB
+        case COMPRESS_CODEC_GZIP:
+            ret = compress_inflate_gzip(job, cl, f, ibuf);
+            break;
+#endif
+#ifdef CONFIG_LZMA
+        case COMPRESS_CODEC_XZ:
+        case COMPRESS_CODEC_LZMA:
+            ret = compress_decode_xz(job, cl, f, ibuf);
+            break;
+#endif
+#ifdef CONFIG_ZSTD
+        case COMPRESS_CODEC_ZSTD:
+            ret = compress_decode_zstd(job, cl, f, ibuf);
+            break;
+#endif
+        default:
+            snprintf(cl->error, sizeof cl->error, "unsupported format");
+            break;
+        }
+        /* hand over the output decoded before an error too */
+        compress_flush(job, cl);
+        if (ret < 0 && !*cl->error && url_job_canceled(job))
+            snprintf(cl->error, sizeof cl->error, "canceled");
+    }
+    qe_free(&cl->out);
+    qe_free(&ibuf);
+    fclose(f);
+}
+
+/* set coding and mode from the decoded contents, as the shell
+   buffers do with SF_AUTO_CODING | SF_AUTO_MODE */
+static void compress_auto_mode(CompressState *cs, EditBuffer *b)
+{
+    QEmacsState *qs = cs->base.qs;
+    EditState *e;
+
+    cs->auto_mode = 1;
+    for (e = qs->first_window; e != NULL; e = e->next_window) {
+        if (e->b == b) {
+            do_set_auto_coding(e, 0);
+            qe_set_next_mode(e, 0, 0);
+        }
+    }
+}
+
+static void compress_chunk_cb(void *opaque)
+{
+    CompressChunk *chunk = opaque;
+    EditBuffer *b = chunk->cl->b;
+    CompressState *cs;
+    int saved_log, now;
+
+    if (b && (cs = compress_get_state(b)) != NULL) {
+        /* loading is not an undoable modification */
+        saved_log = b->save_log;
+        b->save_log = 0;
+        b->flags &= ~BF_READONLY;
+        eb_write(b, b->total_size, chunk->data, chunk->size);
+        b->flags |= BF_READONLY;
+        b->save_log = saved_log;
+        b->modified = 0;
+        cs->in_pos = chunk->in_pos;
+        if (!cs->auto_mode)
+            compress_auto_mode(cs, b);
+        now = get_clock_ms();
+        if (now - cs->display_time >= COMPRESS_DISPLAY_MS) {
+            cs->display_time = now;
+            qe_display(cs->base.qs);
+        }
+    }
+    qe_free(&chunk);
+}
+
+static void compress_load_done(void *opaque, int canceled)
+{
+    CompressLoader *cl = opaque;
+    EditBuffer *b = cl->b;
+    CompressState *cs;
+
+    if (b && (cs = compress_get_state(b)) != NULL) {
+        cs->loader = NULL;
+        cs->load_time = get_clock_ms() - cs->start_time;
+        /* the contents can be saved back compressed */
+        b->flags &= ~(BF_LOADING | BF_READONLY);
+        b->modified = 0;
+        /* nothing to detect in an empty buffer: selecting the mode
+           again would reload the file */
+        if (!cs->auto_mode && b->total_size > 0)
+            compress_auto_mode(cs, b);
+        if (*cl->error) {
+            put_error(cs->base.qs->active_window, "Error decoding %s: %s",
+                      cl->filename, cl->error);
+        }
+        qe_display(cs->base.qs);
+    }
+    qe_free(&cl);
+}
+
+/* stop a pending load, the decoded data is discarded */
+static void compress_stop_loader(CompressState *cs)
+{
+    if (cs->loader) {
+        cs->loader->b = NULL;
+        url_cancel_job(cs->loader->up, &cs->loader->job);
+        cs->loader = NULL;
+    }
+}
+
+static int compress_start_loader(EditBuffer *b, CompressType *ctp)
+{
+    QEmacsState *qs = b->qs;
+    ModeDef *default_mode = b->default_mode;
+    CompressState *cs;
+    CompressLoader *cl;
+    struct stat st;
+
+    cs = compress_get_state(b);
+    if (!cs) {
+        cs = (CompressState *)qe_create_buffer_mode_data(b, &compress_mode);
+        if (!cs)
+            return -1;
+        /* keep the mode selected from the decoded contents */
+        b->default_mode = default_mode;
+    }
+    compress_stop_loader(cs);
+
+    cl = qe_mallocz(CompressLoader);
+    if (!cl)
+        return -1;
+    cl->up = qs->up;
+    cl->b = b;
+    cl->ctp = ctp;
+    pstrcpy(cl->filename, sizeof(cl->filename), b->filename);
+
+    cs->ctp = ctp;
+    cs->in_size = stat(b->filename, &st) ? 0 : st.st_size;
+    cs->in_pos = 0;
+    cs->start_time = cs->display_time = get_clock_ms();
+    cs->load_time = -1;
+    cs->auto_mode = 0;
+    cs->loader = cl;
+    b->flags |= BF_LOADING | BF_READONLY;
+    cl->job = url_submit_job(qs->up, compress_load_run, compress_load_done, cl);
+    if (!cl->job) {
+        cs->loader = NULL;
+        b->flags &= ~BF_LOADING;
+        qe_free(&cl);
+        return -1;
+    }
+    return 0;
+}
+
+static void compress_mode_describe(EditBuffer *b1, EditBuffer *b, void *state)
+{
+    CompressState *cs = state;
+
+    if (cs == NULL || !cs->ctp)
+        return;
+
+    eb_style_puts(b1, DESCRIBE_STYLE_HEAD, "\nCompressed file:\n");
+    eb_print_field(b1, "format", "%s\n", cs->ctp->name);
+    eb_print_field(b1, "compressed", "%lld  (%lld%%)\n", cs->in_size,
+                   cs->in_size * 100 / max_int(b->total_size, 1));
+    if (cs->load_time < 0) {
+        eb_print_field(b1, "loading", "%lld%%\n",
+                       cs->in_pos * 100 / (cs->in_size > 0 ? cs->in_size : 1));
+    } else {
+        eb_print_field(b1, "load time", "%d ms\n", cs->load_time);
+    }
+}
+
+static void compress_mode_free(EditBuffer *b, void *state)
+{
+    CompressState *cs = state;
+
+    if (cs)
+        compress_stop_loader(cs);
+}
+
 static int compress_buffer_load(EditBuffer *b, FILE *f)
 {
     /* Launch subprocess to expand compressed contents */
@@ -296,6 +780,13 @@ static int compress_buffer_load(EditBuffer *b, FILE *f)
     if (ctp) {
         b->data_type_name = ctp->name;
         eb_clear(b);
+        if (compress_has_codec(ctp->codec)) {
+            if (compress_start_loader(b, ctp) < 0) {
+                eb_printf(b, "Cannot start decoder\n");
+                return -1;
+            }
+            return 0;
+        }
         qe_shell_subst(cmd, sizeof(cmd), ctp->load_cmd, b->filename, NULL);
         qe_new_shell_buffer(b->qs, b, NULL, get_basename(b->filename), NULL,
                             NULL, cmd,
@@ -311,11 +802,232 @@ static int compress_buffer_load(EditBuffer *b, FILE *f)
     }
 }
 
+/* Write the buffer contents compressed with a built-in codec.
+   Return the number of bytes written or -1 on error. */
+static int compress_encode(EditBuffer *b, int start, int end,
+                           FILE *f, int codec)
+{
+    u8 *ibuf, *obuf;
+    int len, written = 0, ret = -1;
+
+    ibuf = qe_malloc_array(u8, COMPRESS_IBUF_SIZE);
+    obuf = qe_malloc_array(u8, COMPRESS_IBUF_SIZE);
+    if (!ibuf || !obuf)
+        goto done;
+
+    switch (codec) {
+#ifdef CONFIG_ZLIB
+    case COMPRESS_CODEC_GZIP: {
+        z_stream zs;
+        int flush, rc;
+
+        memset(&zs, 0, sizeof zs);
+        /* 15 + 16: maximum window size, gzip header */
+        if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16,
+                         8, Z_DEFAULT_STRATEGY) != Z_OK)
+            break;
+        do {
+            len = min_int(end - start, COMPRESS_IBUF_SIZE);
+            len = eb_read(b, start, ibuf, len);
+            start += len;
+            flush = (start >= end) ? Z_FINISH : Z_NO_FLUSH;
+            zs.next_in = ibuf;
+            zs.avail_in = len;
+            do {
+                zs.next_out = obuf;
+                zs.avail_out = COMPRESS_IBUF_SIZE;
+                rc = deflate(&zs, flush);
+                len = COMPRESS_IBUF_SIZE - zs.avail_out;
+                if (rc == Z_STREAM_ERROR || fwrite(obuf, 1, len, f) != (size_t)len)
+                    goto gzip_fail;
+                written += len;
+            } while (zs.avail_out == 0);
+        } while (flush != Z_FINISH);
+        ret = written;
+    gzip_fail:
+        deflateEnd(&zs);
+        break;
+    }
+#endif
+#ifdef CONFIG_LZMA
+    case COMPRESS_CODEC_XZ:
+    case COMPRESS_CODEC_LZMA: {
+        lzma_stream strm = LZMA_STREAM_INIT;
+        lzma_options_lzma opt;
+        lzma_action action = LZMA_RUN;
+        lzma_ret rc;
+
+        if (codec == COMPRESS_CODEC_XZ) {
+            rc = lzma_easy_encoder(&strm, LZMA_PRESET_DEFAULT,
+                                   LZMA_CHECK_CRC64);
+        } else {
+            if (lzma_lzma_preset(&opt, LZMA_PRESET_DEFAULT))
+                break;
+            rc = lzma_alone_encoder(&strm, &opt);
+        }
+        if (rc != LZMA_OK)
+            break;
+        do {
+            len = min_int(end - start, COMPRESS_IBUF_SIZE);
+            len = eb_read(b, start, ibuf, len);
+            start += len;
+            if (start >= end)
+                action = LZMA_FINISH;
+            strm.next_in = ibuf;
+            strm.avail_in = len;
+            /* stop at the end of the stream even if the output is full */
+            do {
+                strm.next_out = obuf;
+                strm.avail_out = COMPRESS_IBUF_SIZE;
+                rc = lzma_code(&strm, action);
+                len = COMPRESS_IBUF_SIZE - strm.avail_out;
+                if ((rc != LZMA_OK && rc != LZMA_STREAM_END)
+                ||  fwrite(obuf, 1, len, f) != (size_t)len)
+                    goto lzma_fail;
+                written += len;
+            } while (rc != LZMA_STREAM_END
+                 &&  (strm.avail_out == 0 || strm.avail_in > 0));
+        } while (rc != LZMA_STREAM_END);
+        ret = written;
+    lzma_fail:
+        lzma_end(&strm);
+        break;
+    }
+#endif
+#ifdef CONFIG_ZSTD
+    case COMPRESS_CODEC_ZSTD: {
+        ZSTD_CCtx *cctx;
+        ZSTD_inBuffer in;
+        ZSTD_outBuffer out;
+        ZSTD_EndDirective mode;
+        size_t rc;
+
+        cctx = ZSTD_createCCtx();
+        if (!cctx)
+            break;
+        do {
+            len = min_int(end - start, COMPRESS_IBUF_SIZE);
+            len = eb_read(b, start, ibuf, len);
+            start += len;
+            mode = (start >= end) ? ZSTD_e_end : ZSTD_e_continue;
+            in.src = ibuf;
+            in.size = len;
+            in.pos = 0;
+            do {
+                out.dst = obuf;
+                out.size = COMPRESS_IBUF_SIZE;
+                out.pos = 0;
+                rc = ZSTD_compressStream2(cctx, &out, &in, mode);
+                if (ZSTD_isError(rc)
+                ||  fwrite(obuf, 1, out.pos, f) != out.pos)
+                    goto zstd_fail;
+                written += out.pos;
+            } while (mode == ZSTD_e_end ? rc != 0 : in.pos < in.size);
+        } while (mode != ZSTD_e_end);
+        ret = written;
+    zstd_fail:
+        ZSTD_freeCCtx(cctx);
+        break;
+    }
+#endif
+    default:
+        break;
+    }
+done:
+    qe_free(&ibuf);
+    qe_free(&obuf);
+    return ret;
+}
+
+/* Pipe the buffer contents to the external compressor of `ctp`.
+   Return the number of bytes written or -1 on error. */
+static int compress_save_cmd(EditBuffer *b, int start, int end,
+                             const char *filename, CompressType *ctp)
+{
+    char cmd[1024];
+    u8 *buf;
+    FILE *f;
+    int len, written;
+
+    qe_shell_subst(cmd, sizeof(cmd), ctp->save_cmd, filename, NULL);
+    buf = qe_malloc_array(u8, COMPRESS_IBUF_SIZE);
+    if (!buf)
+        return -1;
+    f = popen(cmd, "w");
+    if (!f) {
+        qe_free(&buf);
+        return -1;
+    }
+    written = 0;
+    while (start < end) {
+        len = eb_read(b, start, buf, min_int(end - start, COMPRESS_IBUF_SIZE));
+        if (len <= 0 || fwrite(buf, 1, len, f) != (size_t)len)
+            break;
+        start += len;
+        written += len;
+    }
+    qe_free(&buf);
+    if (pclose(f) != 0 || start < end)
+        return -1;
+    return written;
+}
+
 static int compress_buffer_save(EditBuffer *b, int start, int end,
                                const char *filename)
 {
-    /* XXX: should recompress contents to compressed file */
-    return -1;
+    char tmpname[MAX_FILENAME_SIZE];
+    CompressType *ctp;
+    FILE *f;
+    mode_t mask;
+    int fd, written;
+
+    if (end < start) {
+        int tmp = start;
+        start = end;
+        end = tmp;
+    }
+    start = max_int(start, 0);
+    end = min_int(end, b->total_size);
+
+    /* the target extension selects the format: a plain file name
+       saves the contents uncompressed */
+    ctp = find_compress_type(filename, NULL, 0);
+    if (!ctp)
+        return raw_data_type.buffer_save(b, start, end, filename);
+    if (!compress_has_codec(ctp->codec) && !ctp->save_cmd)
+        return -1;
+
+    /* compress to a temporary file in the same directory and rename it
+       over the target, which is left untouched if compression fails */
+    if (snprintf(tmpname, sizeof(tmpname), "%s.XXXXXX", filename) >= ssizeof(tmpname))
+        return -1;
+    fd = mkstemp(tmpname);
+    if (fd < 0)
+        return -1;
+    /* mkstemp creates the file with mode 0600 */
+    mask = umask(0);
+    umask(mask);
+    fchmod(fd, 0644 & ~mask);
+
+    if (compress_has_codec(ctp->codec)) {
+        written = -1;
+        f = fdopen(fd, "wb");
+        if (!f) {
+            close(fd);
+        } else {
+            written = compress_encode(b, start, end, f, ctp->codec);
+            if (fclose(f) && written >= 0)
+                written = -1;
+        }
+    } else {
+        close(fd);
+        written = compress_save_cmd(b, start, end, tmpname, ctp);
+    }
+    if (written < 0 || rename(tmpname, filename)) {
+        unlink(tmpname);
+        return -1;
+    }
+    return written;
 }
 
 static void compress_buffer_close(EditBuffer *b)
@@ -331,12 +1043,6 @@ static EditBufferDataType compress_data_type = {
     NULL, /* next */
 };
 
-static ModeDef compress_mode = {
-    .name = "compress",
-    .mode_probe = compress_mode_probe,
-    .data_type = &compress_data_type,
-};
-
 static int compress_init(QEmacsState *qs)
 {
     int i;
@@ -347,6 +1053,9 @@ static int compress_init(QEmacsState *qs)
     compress_mode.name = "compress";
     compress_mode.mode_probe = compress_mode_probe;
     compress_mode.data_type = &compress_data_type;
+    compress_mode.buffer_instance_size = sizeof(CompressState);
+    compress_mode.mode_free = compress_mode_free;
+    compress_mode.mode_describe = compress_mode_describe;
 
     for (i = 1; i < countof(compress_type_array); i++) {
         compress_type_array[i - 1].next = compress_type_array + i;
@@ -26,8 +26,12 @@
 #include "qe.h"
 #include "variables.h"
 
+#include <dirent.h>
 #include <grp.h>
 #include <pwd.h>
+#ifndef CONFIG_WIN32
+#include <pthread.h>
+#endif
 
 enum {
     DIRED_SORT_FULLNAME = 0,
@@ -61,12 +65,148 @@ enum time_format {
 
 typedef struct DiredState DiredState;
 typedef struct DiredItem DiredItem;
+typedef struct DiredScan DiredScan;
+typedef struct DiredWatch DiredWatch;
+typedef struct DiredDuEntry DiredDuEntry;
+typedef struct DiredDuFrame DiredDuFrame;
+typedef struct DiredDuJob DiredDuJob;
+typedef struct DiredDuSizes DiredDuSizes;
+
+/* Directories are read from the event loop in time slices. Entries are
+ * stat'ed relative to the directory file descriptor and collected in
+ * DiredState.scan_items. Pending items are sorted and merged into the
+ * sorted item list when the buffer is rebuilt, at increasing intervals
+ * for large directories.
+ */
+#define DIRED_SCAN_SLICE_MS    20
+#define DIRED_SCAN_REFRESH_MS  200
+
+struct DiredScan {
+    DiredScan *next;
+    DIR *dir;
+    DiredItem *dip;     /* directory item being expanded or NULL */
+    int level;
+    int count;
+    char path[MAX_FILENAME_SIZE];
+    char pattern[MAX_FILENAME_SIZE];
+};
+
+/* Expanded directories are watched for changes. The names of the
+ * entries reported are queued and handled after a short delay: each
+ * entry is stat'ed again and its item is added, updated or removed.
+ * The queue is kept while a scan is running, the scan may still read
+ * the reported entries.
+ */
+#define DIRED_WATCH_DELAY_MS   100
+
+struct DiredWatch {
+    DiredWatch *next;
+    DiredState *ds;
+    URLWatch *w;
+    int level;
+    char path[MAX_FILENAME_SIZE];
+    char pattern[MAX_FILENAME_SIZE];
+};
+
+/* Recursive directory sizes are computed by a job on a worker thread,
+ * the sizes are posted back to the main thread in batches. The disk
+ * usage of the files of each directory is cached with the names of its
+ * subdirectories, keyed by device and inode and validated by the
+ * directory mtime: computing the size of a tree again only takes a
+ * stat() per directory. File size changes do not update the directory
+ * mtime, a prefix argument discards the cache. The cache is shared by
+ * the jobs of all dired buffers and protected by a mutex.
+ * Like `du -lx`, hard links are counted for each link and the
+ * computation stays on the same file system.
+ */
+#define DIRED_DU_BATCH         256
+#define DIRED_DU_MAX_POSTS     4    /* batches waiting for the main thread */
+
+struct DiredDuEntry {
+    DiredDuEntry *next;     /* hash chain */
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    long long usage;        /* disk usage of the directory and its files */
+    int nb_subdirs;
+    int names_len;
+    char *names;            /* subdirectory names, '\0' separated */
+};
+
+struct DiredDuFrame {
+    DiredDuFrame *up;
+    DIR *dir;               /* directory being read */
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    long long usage;
+    long long total;        /* usage including the subdirectories done */
+    int nb_subdirs, names_len, names_size, child, name_pos;
+    char *names;
+    char path[MAX_FILENAME_SIZE];
+};
+
+struct DiredDuJob {
+    DiredState *ds;         /* NULL once detached from the dired buffer */
+    URLJob *job;
+    StringArray queue;      /* directories to compute the size of */
+    /* fields below are only accessed by the worker thread */
+    DiredDuFrame *top;
+    long long running;      /* usage seen so far for the current directory */
+    DiredDuSizes *out;      /* pending batch */
+    int flush_time;
+};
+
+/* sizes of directories in DiredDuJob.queue */
+struct DiredDuSizes {
+    DiredDuJob *dj;
+    int nb_sizes;
+    struct {
+        int index;
+        long long size;
+    } sizes[DIRED_DU_BATCH];
+};
+
+static struct {
+    DiredDuEntry **table;
+    int size, count;
+} dired_du_cache;
+
+#ifndef CONFIG_WIN32
+static pthread_mutex_t dired_du_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static inline void dired_du_lock(void) {
+#ifndef CONFIG_WIN32
+    pthread_mutex_lock(&dired_du_mutex);
+#endif
+}
+
+static inline void dired_du_unlock(void) {
+#ifndef CONFIG_WIN32
+    pthread_mutex_unlock(&dired_du_mutex);
+#endif
+}
 
 struct DiredState {
     QEModeData base;    /* derived from QEModeData */
     DiredItem **items;
     int nb_items;
     int nb_allocated;
+    DiredItem **scan_items;     /* items read but not yet merged */
+    int nb_scan_items;
+    int nb_scan_allocated;
+    DiredScan *first_scan;
+    URLTimer *scan_timer;
+    int scan_last_update;
+    int scan_update_time;
+    int scan_target;    /* target not found yet */
+    DiredWatch *first_watch;
+    StringArray watch_events;   /* changed entries, group is the level */
+    URLTimer *watch_timer;
+    int watch_reload;   /* events were lost */
+    DiredDuJob *du_job;
+    int du_last_update;
     enum time_format time_format;
     int show_dot_files;
     int show_ds_store;
@@ -92,7 +232,7 @@ struct DiredState {
     int fnamecol;
     char path[MAX_FILENAME_SIZE]; /* current path */
     char target[MAX_FILENAME_SIZE]; /* current target */
-    char pattern[32]; /* filtering pattern */
+    char pattern[MAX_FILENAME_SIZE]; /* filtering pattern */
 };
 
 /* opaque structure for sorting DiredState.items StringArray */
@@ -110,6 +250,8 @@ struct DiredItem {
 #define DI_ISLNK   1 /* XXX: use bitfields */
 #define DI_BROKEN  2
 #define DI_ISDIR   4
+#define DI_SIZED   8  /* size is the recursive disk usage */
+#define DI_REMOVED 16 /* removed by a change notification */
     u8      level;
     char    hidden; /* XXX: use flag */
     char    mark;
@@ -194,11 +336,70 @@ static const char *dired_get_cur_filename(DiredState *ds, EditState *s,
     return NULL;
 }
 
+static void dired_scan_close(DiredState *ds, DiredScan *sp)
+{
+    DiredScan **spp;
+
+    for (spp = &ds->first_scan; *spp; spp = &(*spp)->next) {
+        if (*spp == sp) {
+            *spp = sp->next;
+            break;
+        }
+    }
+    if (sp->dir)
+        closedir(sp->dir);
+    qe_free(&sp);
+    if (!ds->first_scan)
+        url_kill_timer(ds->base.qs->up, &ds->scan_timer);
+}
+
+static void dired_watch_close(DiredState *ds, DiredWatch *wp)
+{
+    DiredWatch **wpp;
+
+    for (wpp = &ds->first_watch; *wpp; wpp = &(*wpp)->next) {
+        if (*wpp == wp) {
+            *wpp = wp->next;
+            break;
+        }
+    }
+    url_remove_watch(ds->base.qs->up, &wp->w);
+    qe_free(&wp);
+}
+
+/* the job is freed by its `done` callback */
+static void dired_du_stop(DiredState *ds)
+{
+    if (ds->du_job) {
+        ds->du_job->ds = NULL;
+        url_cancel_job(ds->base.qs->up, &ds->du_job->job);
+        ds->du_job = NULL;
+    }
+}
+
 static void dired_free(DiredState *ds)
 {
     if (ds) {
         int i;
 
+        while (ds->first_scan)
+            dired_scan_close(ds, ds->first_scan);
+
+        while (ds->first_watch)
+            dired_watch_close(ds, ds->first_watch);
+        free_strings(&ds->watch_events);
+        url_kill_timer(ds->base.qs->up, &ds->watch_timer);
+        ds->watch_reload = 0;
+
+        dired_du_stop(ds);
+
+        for (i = 0; i < ds->nb_scan_items; i++) {
+            qe_free(&ds->scan_items[i]);
+        }
+        qe_free(&ds->scan_items);
+        ds->nb_scan_items = 0;
+        ds->nb_scan_allocated = 0;
+
         for (i = 0; i < ds->nb_items; i++) {
             qe_free(&ds->items[i]);
         }
@@ -462,26 +663,46 @@ static int format_number(char *buf, int size, int human, off_t number)
     }
 }
 
+/* getpwuid() and getgrgid() may read the system databases on each call:
+   cache the last name looked up, directory entries tend to share owners */
 static int format_gid(char *buf, int size, int nflag, gid_t gid)
 {
     // group_from_gid ?
+    static gid_t last_gid = (gid_t)-1;
+    static char last_name[32];
     struct group *grp;
 
-    if (!nflag && (grp = getgrgid(gid)) != NULL && grp->gr_name)
-        return snprintf(buf, size, "%s", grp->gr_name);
-    else
-        return snprintf(buf, size, "%d", (int)gid);
+    if (!nflag) {
+        if (gid != last_gid) {
+            last_name[0] = '\0';
+            if ((grp = getgrgid(gid)) != NULL && grp->gr_name)
+                pstrcpy(last_name, sizeof(last_name), grp->gr_name);
+            last_gid = gid;
+        }
+        if (*last_name)
+            return snprintf(buf, size, "%s", last_name);
+    }
+    return snprintf(buf, size, "%d", (int)gid);
 }
 
 static int format_uid(char *buf, int size, int nflag, uid_t uid)
 {
     // user_from_uid ?
+    static uid_t last_uid = (uid_t)-1;
+    static char last_name[32];
     struct passwd *pwp;
 
-    if (!nflag && (pwp = getpwuid(uid)) != NULL && pwp->pw_name)
-        return snprintf(buf, size, "%s", pwp->pw_name);
-    else
-        return snprintf(buf, size, "%d", (int)uid);
+    if (!nflag) {
+        if (uid != last_uid) {
+            last_name[0] = '\0';
+            if ((pwp = getpwuid(uid)) != NULL && pwp->pw_name)
+                pstrcpy(last_name, sizeof(last_name), pwp->pw_name);
+            last_uid = uid;
+        }
+        if (*last_name)
+            return snprintf(buf, size, "%s", last_name);
+    }
+    return snprintf(buf, size, "%d", (int)uid);
 }
 
 static int format_size(char *buf, int size, int human,
@@ -963,6 +1184,9 @@ static void dired_update_buffer(DiredState *ds, EditBuffer *b, EditState *s,
                       inflect(ds->total_bytes, "byte", "bytes"));
             seq = ',';
         }
+        if (ds->first_scan) {
+            eb_printf(b, "%c scanning...", seq);
+        } else
         if (ds->ndirs + ds->ndirs_hidden + ds->nfiles + ds->nfiles_hidden == 0) {
             eb_printf(b, "%c empty", seq);
         }
@@ -1236,33 +1460,30 @@ static void dired_set_time_format(EditState *s, int format)
                                 NULL, format);
 }
 
-static DiredItem *dired_add_item(DiredState *ds, const char *name,
-                                 const char *fullname, int level)
+/* Update the file information of `dip`, return -1 if the file does not exist.
+ * `dfd` is a directory file descriptor for `dip->name` or -1 to use
+ * `dip->fullname`.
+ */
+static int dired_stat_item(DiredItem *dip, int dfd)
 {
     struct stat st;
-    DiredItem *dip;
-    size_t fullname_size = strlen(fullname) + 1;
-    size_t name_size = strlen(name) + 1;
-    size_t name_offset = fullname_size;
+    int ret = 0;
 
-    if (lstat(fullname, &st) < 0)
+    if ((dfd >= 0 ? fstatat(dfd, dip->name, &st, AT_SYMLINK_NOFOLLOW) :
+         lstat(dip->fullname, &st)) < 0) {
         memset(&st, 0, sizeof st);
-
-    if (fullname_size >= name_size
-    &&  !memcmp(fullname + fullname_size - name_size, name, name_size)) {
-        /* share space for name and fullname */
-        name_offset = fullname_size - name_size;
-        name_size = 0;
+        ret = -1;
     }
 
-    dip = qe_malloc_hack(DiredItem, fullname_size + name_size);
-    if (!dip)
-        return NULL;
-    dip->flags = 0;
+    /* keep the recursive size of directories */
+    dip->flags &= DI_SIZED;
+    if (!S_ISDIR(st.st_mode))
+        dip->flags = 0;
     if (S_ISLNK(st.st_mode)) {
         struct stat st1;
         dip->flags |= DI_ISLNK;
-        if (!stat(fullname, &st1)) {
+        if (!(dfd >= 0 ? fstatat(dfd, dip->name, &st1, 0) :
+              stat(dip->fullname, &st1))) {
             if (S_ISDIR(st1.st_mode))
                 dip->flags |= DI_ISDIR;
         } else {
@@ -1279,64 +1500,399 @@ static DiredItem *dired_add_item(DiredState *ds, const char *name,
     dip->gid = st.st_gid;
     dip->rdev = st.st_rdev;
     dip->mtime = st.st_mtime;
-    dip->size = st.st_size;
+    if (!(dip->flags & DI_SIZED))
+        dip->size = st.st_size;
+    return ret;
+}
+
+/* `dfd` is a directory file descriptor for `name` or -1 to use `fullname` */
+static DiredItem *dired_add_item(DiredState *ds, const char *name,
+                                 const char *fullname, int level, int dfd)
+{
+    DiredItem *dip;
+    size_t fullname_size = strlen(fullname) + 1;
+    size_t name_size = strlen(name) + 1;
+    size_t name_offset = fullname_size;
+
+    if (fullname_size >= name_size
+    &&  !memcmp(fullname + fullname_size - name_size, name, name_size)) {
+        /* share space for name and fullname */
+        name_offset = fullname_size - name_size;
+        name_size = 0;
+    }
+
+    dip = qe_malloc_hack(DiredItem, fullname_size + name_size);
+    if (!dip)
+        return NULL;
+    memcpy(dip->fullname, fullname, fullname_size);
+    dip->name = dip->fullname + name_offset;
+    memcpy(dip->name, name, name_size);
+    dip->flags = 0;
+    dired_stat_item(dip, dfd);
     dip->hidden = 0;
     dip->mark = ' ';
     dip->tick = ' ';
     dip->level = level;
     if (dip->flags & DI_ISDIR)
         dip->tick = '>';
-    memcpy(dip->fullname, fullname, fullname_size);
-    dip->name = dip->fullname + name_offset;
-    memcpy(dip->name, name, name_size);
 
-    if (ds->nb_items >= ds->nb_allocated) {
-        int n = ds->nb_allocated + (ds->nb_allocated / 2) + 32;
-        if (!qe_realloc_array(&ds->items, n)) {
+    /* new items are pending until merged into the sorted list */
+    if (ds->nb_scan_items >= ds->nb_scan_allocated) {
+        int n = ds->nb_scan_allocated + (ds->nb_scan_allocated / 2) + 32;
+        if (!qe_realloc_array(&ds->scan_items, n)) {
             qe_free(&dip);
             return NULL;
         }
-        ds->nb_allocated = n;
+        ds->nb_scan_allocated = n;
+    }
+    return ds->scan_items[ds->nb_scan_items++] = dip;
+}
+
+/* Sort the pending items and merge them into the sorted item list */
+static void dired_merge_items(DiredState *ds)
+{
+    DiredItem **tmp;
+    int i, j, k, n = ds->nb_scan_items;
+
+    if (n == 0)
+        return;
+
+    if (ds->nb_items + n > ds->nb_allocated) {
+        int size = max_int(ds->nb_items + n, ds->nb_allocated + (ds->nb_allocated / 2) + 32);
+        if (!qe_realloc_array(&ds->items, size))
+            return;
+        ds->nb_allocated = size;
+    }
+    if (ds->sort_mode != dired_sort_mode) {
+        /* sort order changed: sort the whole list */
+        memcpy(ds->items + ds->nb_items, ds->scan_items, n * sizeof(*ds->items));
+        ds->nb_items += n;
+        ds->nb_scan_items = 0;
+        ds->sort_mode = dired_sort_mode;
+        qe_qsort_r(ds->items, ds->nb_items, sizeof(DiredItem *),
+                   ds, dired_sort_func);
+        return;
+    }
+    qe_qsort_r(ds->scan_items, n, sizeof(DiredItem *), ds, dired_sort_func);
+    /* merge from the end, items are moved at most once */
+    tmp = ds->scan_items;
+    i = ds->nb_items - 1;
+    j = n - 1;
+    k = ds->nb_items + n - 1;
+    while (j >= 0) {
+        if (i >= 0 && dired_sort_func(ds, &ds->items[i], &tmp[j]) > 0)
+            ds->items[k--] = ds->items[i--];
+        else
+            ds->items[k--] = tmp[j--];
+    }
+    ds->nb_items += n;
+    ds->nb_scan_items = 0;
+}
+
+/* Read directory entries until `deadline`, return true if scans remain */
+static int dired_scan_run(DiredState *ds, int deadline)
+{
+    char filename[MAX_FILENAME_SIZE];
+    struct dirent *dirent;
+    DiredScan *sp;
+    int n = 0;
+
+    while ((sp = ds->first_scan) != NULL) {
+        while (sp->dir && (dirent = readdir(sp->dir)) != NULL) {
+            const char *name = dirent->d_name;
+            if (*name == '.' && (strequal(name, ".") || strequal(name, "..")))
+                continue;
+            if (!qe_shell_match(name, sp->pattern))
+                continue;
+            makepath(filename, sizeof(filename), sp->path, name);
+            if (dired_add_item(ds, name, filename, sp->level, dirfd(sp->dir)))
+                sp->count++;
+            if ((++n & 63) == 0
+            &&  (get_clock_ms() - deadline >= 0 || is_user_input_pending()))
+                return 1;
+        }
+        if (sp->dip && !sp->count)
+            sp->dip->tick = '-';
+        dired_scan_close(ds, sp);
     }
-    return ds->items[ds->nb_items++] = dip;
+    return 0;
+}
+
+static void dired_update_buffer(DiredState *ds, EditBuffer *b, EditState *s,
+                                int flags);
+static DiredItem *dired_goto_target(DiredState *ds, EditState *s,
+                                    const char *target, int force);
+
+static void dired_scan_slice(void *opaque)
+{
+    DiredState *ds = opaque;
+    QEmacsState *qs = ds->base.qs;
+    EditBuffer *b = ds->base.b;
+    EditState *e;
+    char cur[MAX_FILENAME_SIZE];
+    int i, now, pending;
+
+    pending = dired_scan_run(ds, get_clock_ms() + DIRED_SCAN_SLICE_MS);
+    now = get_clock_ms();
+    /* rebuilding the buffer is linear: refresh less often as it grows */
+    if (!pending
+    ||  now - ds->scan_last_update >= max_int(DIRED_SCAN_REFRESH_MS,
+                                              ds->scan_update_time * 4)) {
+        e = eb_find_window(b, NULL);
+        if (!dired_get_cur_filename(ds, e, cur, sizeof(cur)))
+            *cur = '\0';
+        dired_merge_items(ds);
+        dired_update_buffer(ds, b, e, DIRED_UPDATE_FILTER |
+                            DIRED_UPDATE_COLUMNS | DIRED_UPDATE_REBUILD);
+        if (*cur)
+            dired_goto_target(ds, e, cur, FALSE);
+        if (ds->scan_target) {
+            for (i = 0; i < ds->nb_items; i++) {
+                if (strequal(ds->items[i]->fullname, ds->target)) {
+                    dired_goto_target(ds, e, ds->target, FALSE);
+                    ds->scan_target = 0;
+                    break;
+                }
+            }
+        }
+        ds->scan_last_update = get_clock_ms();
+        ds->scan_update_time = ds->scan_last_update - now;
+        qe_display(qs);
+    }
+    if (pending)
+        url_set_timer(qs->up, &ds->scan_timer, 1, ds, dired_scan_slice);
+    else
+        ds->scan_target = 0;
+}
+
+/* index the items and the pending scan items by full name */
+static void dired_index_items(DiredState *ds, SymbolTable *st)
+{
+    int i;
+
+    symbol_table_free(st);
+    for (i = 0; i < ds->nb_items; i++)
+        symbol_add(st, ds->items[i]->fullname, ds->items[i]);
+    for (i = 0; i < ds->nb_scan_items; i++)
+        symbol_add(st, ds->scan_items[i]->fullname, ds->scan_items[i]);
+}
+
+/* free the items flagged DI_REMOVED in `tab`, return the new count */
+static int dired_purge_items(DiredState *ds, DiredItem **tab, int n)
+{
+    int i, j;
+
+    for (i = j = 0; i < n; i++) {
+        DiredItem *dip = tab[i];
+        if (dip->flags & DI_REMOVED) {
+            if (ds->last_cur == dip)
+                ds->last_cur = NULL;
+            qe_free(&dip);
+        } else {
+            tab[j++] = dip;
+        }
+    }
+    return j;
+}
+
+static int dired_collapse_dir(DiredState *ds, DiredItem *dip0);
+static void dired_build_list(DiredState *ds, const char *path);
+
+/* Apply the queued change notifications.
+ * Items are looked up in an index by full name built for the batch and
+ * removed items are only flagged, then purged in a single pass, so the
+ * cost is linear in the number of items and events.
+ */
+static void dired_watch_update(void *opaque)
+{
+    DiredState *ds = opaque;
+    EditBuffer *b = ds->base.b;
+    EditState *e = eb_find_window(b, NULL);
+    char cur[MAX_FILENAME_SIZE];
+    SymbolTable index = { 0 };
+    DiredItem *dip;
+    struct stat st;
+    int i, start, expanded, reindex = 1, removed = 0;
+
+    if (ds->first_scan) {
+        /* an entry added now could be read again by the scan */
+        url_set_timer(ds->base.qs->up, &ds->watch_timer,
+                      DIRED_WATCH_DELAY_MS, ds, dired_watch_update);
+        return;
+    }
+    start = get_clock_ms();
+    if (!dired_get_cur_filename(ds, e, cur, sizeof(cur)))
+        *cur = '\0';
+
+    if (ds->watch_reload) {
+        /* some notifications were lost: read the directory again */
+        dired_build_list(ds, ds->path);
+    } else {
+        for (i = 0; i < ds->watch_events.nb_items; i++) {
+            StringItem *sip = ds->watch_events.items[i];
+
+            if (reindex) {
+                dired_index_items(ds, &index);
+                reindex = 0;
+            }
+            dip = symbol_find(&index, sip->str);
+            if (!dip) {
+                if (!lstat(sip->str, &st)) {
+                    dip = dired_add_item(ds, get_basename(sip->str), sip->str, sip->group, -1);
+                    if (dip)
+                        symbol_add(&index, dip->fullname, dip);
+                }
+                continue;
+            }
+            expanded = (dip->flags & DI_ISDIR) && (dip->tick == 'v' || dip->tick == '-');
+            if (dired_stat_item(dip, -1) < 0) {
+                if (expanded) {
+                    /* frees the subtree items: index the items again */
+                    dired_collapse_dir(ds, dip);
+                    reindex = 1;
+                }
+                dip->flags |= DI_REMOVED;
+                removed = 1;
+                continue;
+            }
+            if (!(dip->flags & DI_ISDIR)) {
+                if (expanded)
+                    dired_collapse_dir(ds, dip);
+                dip->tick = ' ';
+            } else
+            if (dip->tick == ' ') {
+                dip->tick = '>';
+            }
+        }
+        free_strings(&ds->watch_events);
+        symbol_table_free(&index);
+        if (removed) {
+            ds->nb_items = dired_purge_items(ds, ds->items, ds->nb_items);
+            ds->nb_scan_items = dired_purge_items(ds, ds->scan_items,
+                                                  ds->nb_scan_items);
+        }
+    }
+    dired_merge_items(ds);
+    dired_update_buffer(ds, b, e, DIRED_UPDATE_SORT | DIRED_UPDATE_FILTER |
+                        DIRED_UPDATE_COLUMNS | DIRED_UPDATE_REBUILD);
+    if (*cur)
+        dired_goto_target(ds, e, cur, FALSE);
+    ds->scan_update_time = get_clock_ms() - start;
+    qe_display(ds->base.qs);
+}
+
+static void dired_watch_event(void *opaque, int events, const char *name)
+{
+    DiredWatch *wp = opaque;
+    DiredState *ds = wp->ds;
+    char filename[MAX_FILENAME_SIZE];
+    int n;
+
+    if (events & URL_WATCH_OVERFLOW) {
+        ds->watch_reload = 1;
+    } else
+    if (*name && qe_shell_match(name, wp->pattern)) {
+        makepath(filename, sizeof(filename), wp->path, name);
+        /* a file write usually reports several events */
+        n = ds->watch_events.nb_items;
+        if (n == 0 || !strequal(ds->watch_events.items[n - 1]->str, filename))
+            add_string(&ds->watch_events, filename, wp->level);
+    } else {
+        /* the parent directory reports the removal of subdirectories */
+        return;
+    }
+    if (!ds->watch_timer) {
+        url_set_timer(ds->base.qs->up, &ds->watch_timer,
+                      max_int(DIRED_WATCH_DELAY_MS, ds->scan_update_time * 4),
+                      ds, dired_watch_update);
+    }
+}
+
+static void dired_watch_dir(DiredState *ds, const char *dir, int level,
+                            const char *pattern)
+{
+    DiredWatch *wp;
+
+    for (wp = ds->first_watch; wp; wp = wp->next) {
+        if (strequal(wp->path, dir))
+            return;
+    }
+    wp = qe_mallocz(DiredWatch);
+    if (!wp)
+        return;
+    wp->ds = ds;
+    wp->level = level;
+    pstrcpy(wp->path, sizeof(wp->path), dir);
+    pstrcpy(wp->pattern, sizeof(wp->pattern), pattern);
+    wp->w = url_add_watch(ds->base.qs->up, dir, dired_watch_event, wp);
+    if (!wp->w) {
+        qe_free(&wp);
+        return;
+    }
+    wp->next = ds->first_watch;
+    ds->first_watch = wp;
 }
 
 /* `ds` and `dir` are valid, `dip` and `pattern` may be NULL */
 static int dired_expand_dir(DiredState *ds, DiredItem *dip,
                             const char *dir, const char *pattern)
 {
-    FindFileState *ffst;
-    char filename[MAX_FILENAME_SIZE];
-    int count = 0;
-    int level = dip ? dip->level + 1 : 0;
+    DiredScan *sp, **spp;
 
     /* XXX: should scan directory for subdirectories and filter with
      * pattern only for regular files.
      * XXX: should handle generalized file patterns.
-     * XXX: should use a separate thread to make the scan asynchronous.
      * XXX: should compute recursive size data.
-     * XXX: should track file creation, deletion and modifications.
      */
-    if (!pattern)
-        pattern = "*";
-    ffst = find_file_open(dir, pattern, FF_NOXXDIR);
-    while (!find_file_next(ffst, filename, sizeof(filename))) {
-        if (dired_add_item(ds, get_basename(filename), filename, level))
-            count++;
-    }
-    find_file_close(&ffst);
+    sp = qe_mallocz(DiredScan);
+    if (!sp)
+        return -1;
+    sp->dip = dip;
+    sp->level = dip ? dip->level + 1 : 0;
+    pstrcpy(sp->path, sizeof(sp->path), dir);
+    pstrcpy(sp->pattern, sizeof(sp->pattern), pattern ? pattern : "*");
+    sp->dir = opendir(dir);
+    for (spp = &ds->first_scan; *spp; spp = &(*spp)->next)
+        continue;
+    *spp = sp;
     if (dip)
-        dip->tick = count ? 'v' : '-';
-    return count;
+        dip->tick = 'v';
+    /* watch before reading so no change is missed */
+    dired_watch_dir(ds, dir, sp->level, sp->pattern);
+
+    /* read a first batch synchronously, continue from the event loop */
+    if (dired_scan_run(ds, get_clock_ms() + DIRED_SCAN_SLICE_MS)) {
+        if (!ds->scan_timer)
+            url_set_timer(ds->base.qs->up, &ds->scan_timer, 1, ds, dired_scan_slice);
+    }
+    dired_merge_items(ds);
+    ds->scan_last_update = get_clock_ms();
+    return 0;
 }
 
 static int dired_collapse_dir(DiredState *ds, DiredItem *dip0)
 {
+    DiredScan *sp, *sp_next;
+    DiredWatch *wp, *wp_next;
     int i, j, count = 0;
     size_t len = strlen(dip0->fullname);
 
     if (dip0->flags & DI_ISDIR)
         dip0->tick = '>';
+    /* stop the scans in the collapsed subtree */
+    for (sp = ds->first_scan; sp; sp = sp_next) {
+        sp_next = sp->next;
+        if (!strncmp(dip0->fullname, sp->path, len)
+        &&  (sp->path[len] == '/' || sp->path[len] == '\0'))
+            dired_scan_close(ds, sp);
+    }
+    for (wp = ds->first_watch; wp; wp = wp_next) {
+        wp_next = wp->next;
+        if (!strncmp(dip0->fullname, wp->path, len)
+        &&  (wp->path[len] == '/' || wp->path[len] == '\0'))
+            dired_watch_close(ds, wp);
+    }
+    dired_merge_items(ds);
     // XXX: should hide the whole subtree?
     for (i = j = 0; i < ds->nb_items; i++) {
         DiredItem *dip = ds->items[i];
@@ -1382,13 +1938,368 @@ static void dired_build_list(DiredState *ds, const char *path)
 
     if (ds->header_lines == 1) {
         make_user_path(name, sizeof name, dirname);
-        dip = dired_add_item(ds, name, dirname, 0);
+        dip = dired_add_item(ds, name, dirname, 0, -1);
         dired_expand_dir(ds, dip, dirname, ds->pattern);
     } else {
         dired_expand_dir(ds, NULL, dirname, ds->pattern);
     }
 }
 
+/* must be called with the cache locked */
+static DiredDuEntry *dired_du_find(dev_t dev, ino_t ino)
+{
+    DiredDuEntry *ce;
+
+    if (!dired_du_cache.size)
+        return NULL;
+    ce = dired_du_cache.table[(ino ^ dev) & (dired_du_cache.size - 1)];
+    while (ce && (ce->ino != ino || ce->dev != dev))
+        ce = ce->next;
+    return ce;
+}
+
+/* must be called with the cache locked */
+static void dired_du_store(DiredDuFrame *f)
+{
+    DiredDuEntry *ce, *next;
+    int i, h;
+
+    if (!(ce = dired_du_find(f->dev, f->ino))) {
+        if (dired_du_cache.count >= dired_du_cache.size) {
+            /* grow the hash table and rehash the entries */
+            int size = dired_du_cache.size ? dired_du_cache.size * 2 : 1024;
+            DiredDuEntry **table = qe_mallocz_array(DiredDuEntry *, size);
+            if (!table)
+                return;
+            for (i = 0; i < dired_du_cache.size; i++) {
+                for (ce = dired_du_cache.table[i]; ce; ce = next) {
+                    next = ce->next;
+                    h = (ce->ino ^ ce->dev) & (size - 1);
+                    ce->next = table[h];
+                    table[h] = ce;
+                }
+            }
+            qe_free(&dired_du_cache.table);
+            dired_du_cache.table = table;
+            dired_du_cache.size = size;
+        }
+        if (!(ce = qe_mallocz(DiredDuEntry)))
+            return;
+        ce->dev = f->dev;
+        ce->ino = f->ino;
+        h = (ce->ino ^ ce->dev) & (dired_du_cache.size - 1);
+        ce->next = dired_du_cache.table[h];
+        dired_du_cache.table[h] = ce;
+        dired_du_cache.count++;
+    }
+    qe_free(&ce->names);
+    ce->names = qe_malloc_dup_bytes(f->names, f->names_len);
+    ce->names_len = ce->names ? f->names_len : 0;
+    ce->nb_subdirs = ce->names ? f->nb_subdirs : 0;
+    ce->mtime = f->mtime;
+    ce->usage = f->usage;
+}
+
+static void dired_du_clear_cache(void)
+{
+    DiredDuEntry *ce, *next;
+    int i;
+
+    dired_du_lock();
+    for (i = 0; i < dired_du_cache.size; i++) {
+        for (ce = dired_du_cache.table[i]; ce; ce = next) {
+            next = ce->next;
+            qe_free(&ce->names);
+            qe_free(&ce);
+        }
+    }
+    qe_free(&dired_du_cache.table);
+    dired_du_cache.size = dired_du_cache.count = 0;
+    dired_du_unlock();
+}
+
+/* Start computing the size of directory `path`, return false on error */
+static int dired_du_push(DiredDuJob *dj, const char *path)
+{
+    DiredDuFrame *f;
+    DiredDuEntry *ce;
+    struct stat st;
+
+    if (lstat(path, &st) < 0 || !S_ISDIR(st.st_mode))
+        return 0;
+    if (!(f = qe_mallocz(DiredDuFrame)))
+        return 0;
+    f->dev = st.st_dev;
+    f->ino = st.st_ino;
+    f->mtime = st.st_mtime;
+    pstrcpy(f->path, sizeof(f->path), path);
+    dired_du_lock();
+    ce = dired_du_find(f->dev, f->ino);
+    if (ce && ce->mtime == f->mtime) {
+        /* the names are copied as the cache entry may be updated */
+        f->names = qe_malloc_dup_bytes(ce->names, ce->names_len);
+        if (f->names) {
+            f->names_len = f->names_size = ce->names_len;
+            f->nb_subdirs = ce->nb_subdirs;
+        }
+        f->usage = ce->usage;
+    } else {
+        ce = NULL;
+    }
+    dired_du_unlock();
+    if (!ce) {
+        f->usage = (long long)st.st_blocks * 512;
+        f->dir = opendir(path);
+    }
+    f->total = f->usage;
+    dj->running += f->usage;
+    f->up = dj->top;
+    dj->top = f;
+    return 1;
+}
+
+static void dired_du_pop(DiredDuJob *dj)
+{
+    DiredDuFrame *f = dj->top;
+
+    dj->top = f->up;
+    if (f->dir)
+        closedir(f->dir);
+    qe_free(&f->names);
+    qe_free(&f);
+}
+
+static void dired_du_refresh(DiredState *ds, int done)
+{
+    EditBuffer *b = ds->base.b;
+    EditState *e = eb_find_window(b, NULL);
+    char cur[MAX_FILENAME_SIZE];
+    int now = get_clock_ms();
+
+    if (!dired_get_cur_filename(ds, e, cur, sizeof(cur)))
+        *cur = '\0';
+    dired_merge_items(ds);
+    dired_update_buffer(ds, b, e, (done ? DIRED_UPDATE_SORT : 0) |
+                        DIRED_UPDATE_COLUMNS | DIRED_UPDATE_REBUILD);
+    if (*cur)
+        dired_goto_target(ds, e, cur, FALSE);
+    ds->du_last_update = get_clock_ms();
+    ds->scan_update_time = ds->du_last_update - now;
+    if (done)
+        put_status(e, "Directory sizes computed");
+    qe_display(ds->base.qs);
+}
+
+/* Apply a batch of sizes: the items are looked up in an index by full
+   name built for the batch, the cost is linear like the refresh. */
+static void dired_du_sizes_cb(void *opaque)
+{
+    DiredDuSizes *out = opaque;
+    DiredDuJob *dj = out->dj;
+    DiredState *ds = dj->ds;
+    SymbolTable index = { 0 };
+    DiredItem *dip;
+    int i;
+
+    if (ds) {
+        dired_index_items(ds, &index);
+        for (i = 0; i < out->nb_sizes; i++) {
+            dip = symbol_find(&index, dj->queue.items[out->sizes[i].index]->str);
+            if (dip) {
+                dip->flags |= DI_SIZED;
+                dip->size = out->sizes[i].size;
+            }
+        }
+        symbol_table_free(&index);
+        if (get_clock_ms() - ds->du_last_update >=
+            max_int(DIRED_SCAN_REFRESH_MS, ds->scan_update_time * 4)) {
+            dired_du_refresh(ds, 0);
+        }
+    }
+    qe_free(&out);
+}
+
+/* called on the worker thread: hand the pending sizes to the main
+   thread. Return -1 if the job was canceled. */
+static int dired_du_flush(URLJob *job, DiredDuJob *dj)
+{
+    DiredDuSizes *out = dj->out;
+
+    if (out) {
+        dj->out = NULL;
+        if (url_post_job_bottom_half(job, DIRED_DU_MAX_POSTS,
+                                     dired_du_sizes_cb, out)) {
+            qe_free(&out);
+        }
+    }
+    dj->flush_time = get_clock_ms();
+    return url_job_canceled(job) ? -1 : 0;
+}
+
+static int dired_du_add_size(URLJob *job, DiredDuJob *dj,
+                             int index, long long size)
+{
+    DiredDuSizes *out = dj->out;
+
+    if (!out) {
+        if (!(out = qe_mallocz(DiredDuSizes)))
+            return 0;
+        out->dj = dj;
+        dj->out = out;
+    }
+    out->sizes[out->nb_sizes].index = index;
+    out->sizes[out->nb_sizes].size = size;
+    if (++out->nb_sizes == DIRED_DU_BATCH)
+        return dired_du_flush(job, dj);
+    return 0;
+}
+
+/* worker thread: must only access the job and the cache */
+static void dired_du_run(URLJob *job, void *opaque)
+{
+    DiredDuJob *dj = opaque;
+    char path[MAX_FILENAME_SIZE];
+    struct dirent *dirent;
+    DiredDuFrame *f;
+    struct stat st;
+    const char *name;
+    int n = 0, index = 0, len;
+
+    dj->flush_time = get_clock_ms();
+    for (;;) {
+        if ((++n & 63) == 0
+        &&  get_clock_ms() - dj->flush_time >= DIRED_SCAN_REFRESH_MS) {
+            /* show the partial size of the current directory */
+            if (dj->top && dired_du_add_size(job, dj, index - 1, dj->running))
+                break;
+            if (dired_du_flush(job, dj))
+                break;
+        }
+        if (!(f = dj->top)) {
+            if (index >= dj->queue.nb_items)
+                break;
+            dj->running = 0;
+            dired_du_push(dj, dj->queue.items[index++]->str);
+            continue;
+        }
+        if (f->dir) {
+            if ((dirent = readdir(f->dir)) != NULL) {
+                name = dirent->d_name;
+                if (*name == '.' && (strequal(name, ".") || strequal(name, "..")))
+                    continue;
+                if (fstatat(dirfd(f->dir), name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+                    continue;
+                if (S_ISDIR(st.st_mode)) {
+                    if (st.st_dev != f->dev)
+                        continue;
+                    len = strlen(name) + 1;
+                    if (f->names_len + len > f->names_size) {
+                        int size = max_int(f->names_len + len, f->names_size * 2 + 256);
+                        if (!qe_realloc_bytes(&f->names, size))
+                            continue;
+                        f->names_size = size;
+                    }
+                    memcpy(f->names + f->names_len, name, len);
+                    f->names_len += len;
+                    f->nb_subdirs++;
+                } else {
+                    f->usage += (long long)st.st_blocks * 512;
+                    f->total += (long long)st.st_blocks * 512;
+                    dj->running += (long long)st.st_blocks * 512;
+                }
+                continue;
+            }
+            closedir(f->dir);
+            f->dir = NULL;
+            dired_du_lock();
+            dired_du_store(f);
+            dired_du_unlock();
+        }
+        if (f->child < f->nb_subdirs) {
+            name = f->names + f->name_pos;
+            f->name_pos += strlen(name) + 1;
+            f->child++;
+            makepath(path, sizeof(path), f->path, name);
+            dired_du_push(dj, path);
+            continue;
+        }
+        /* directory done */
+        if (f->up) {
+            f->up->total += f->total;
+        } else
+        if (dired_du_add_size(job, dj, index - 1, f->total)) {
+            break;
+        }
+        dired_du_pop(dj);
+    }
+    while (dj->top)
+        dired_du_pop(dj);
+    dired_du_flush(job, dj);
+}
+
+static void dired_du_done(void *opaque, int canceled)
+{
+    DiredDuJob *dj = opaque;
+    DiredState *ds = dj->ds;
+
+    if (ds) {
+        ds->du_job = NULL;
+        dired_du_refresh(ds, 1);
+    }
+    qe_free(&dj->out);
+    free_strings(&dj->queue);
+    qe_free(&dj);
+}
+
+static int dired_du_level_cmp(void *opaque, const void *p1, const void *p2)
+{
+    const StringItem *sip1 = *(const StringItem * const *)p1;
+    const StringItem *sip2 = *(const StringItem * const *)p2;
+
+    /* compute subdirectories first to reuse their cache entries */
+    return sip2->group - sip1->group;
+}
+
+/* Compute the recursive disk usage of the directories listed */
+static void dired_compute_sizes(EditState *s, int argval)
+{
+    DiredState *ds;
+    DiredDuJob *dj;
+    int i;
+
+    if (!(ds = dired_get_state(s->b, s)))
+        return;
+
+    dired_du_stop(ds);
+    if (argval != NO_ARG)
+        dired_du_clear_cache();
+    if (!(dj = qe_mallocz(DiredDuJob)))
+        return;
+    dired_merge_items(ds);
+    for (i = 0; i < ds->nb_items; i++) {
+        DiredItem *dip = ds->items[i];
+        if ((dip->flags & DI_ISDIR) && !(dip->flags & DI_ISLNK))
+            add_string(&dj->queue, dip->fullname, dip->level);
+    }
+    if (!dj->queue.nb_items) {
+        qe_free(&dj);
+        put_status(s, "No directories");
+        return;
+    }
+    qe_qsort_r(dj->queue.items, dj->queue.nb_items,
+               sizeof(*dj->queue.items), NULL, dired_du_level_cmp);
+    put_status(s, "Computing directory sizes...");
+    ds->du_last_update = get_clock_ms();
+    dj->ds = ds;
+    ds->du_job = dj;
+    dj->job = url_submit_job(s->qs->up, dired_du_run, dired_du_done, dj);
+    if (!dj->job) {
+        ds->du_job = NULL;
+        free_strings(&dj->queue);
+        qe_free(&dj);
+    }
+}
+
 /* select current item */
 static void dired_select(EditState *s, int mode)
 {
@@ -1740,6 +2651,7 @@ void do_dired_path(EditState *s, const char *filename)
     EditBuffer *b;
     EditState *e;
     DiredState *ds;
+    DiredItem *dip;
 
     if ((s->flags & WF_POPLEFT) && (s->b->flags & BF_DIRED)
     &&  (ds = dired_get_state(s->b, NULL)) != NULL) {
@@ -1779,7 +2691,10 @@ new_window:
 has_buffer:
     dired_build_list(ds, filename);
     dired_update_buffer(ds, b, e, DIRED_UPDATE_ALL);
-    dired_goto_target(ds, e, ds->target, TRUE);
+    dip = dired_goto_target(ds, e, ds->target, TRUE);
+    /* keep looking for the target while the directory is scanned */
+    if (ds->first_scan && !(dip && strequal(dip->fullname, ds->target)))
+        ds->scan_target = 1;
 }
 
 /* open dired window on the left. The directory of the current file is used */
@@ -1950,6 +2865,10 @@ static const CmdDef dired_commands[] = {
     CMD0( "dired-toggle-unicode", "U",
           "Toggle display of Unicode characters in filenames",
           dired_toggle_unicode)
+    CMD2( "dired-compute-sizes", "z",
+          "Compute the recursive disk usage of directories "
+          "(with a prefix argument: discard cached sizes)",
+          dired_compute_sizes, ESi, "P")
     CMD2( "dired-summary", "?",
           "Display a summary of dired commands",
           do_apropos, ESs, "@{dired}")
@@ -2188,4 +3107,10 @@ static int filelist_init(QEmacsState *qs)
     return 0;
 }
 
+static void dired_exit(QEmacsState *qs)
+{
+    dired_du_clear_cache();
+}
+
 qe_module_init(dired_init);
+qe_module_exit(dired_exit);
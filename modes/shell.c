@@ -47,6 +47,19 @@ static ModeDef shell_mode, pager_mode, compilation_mode;
 #define MAX_CSI_PARAMS  16
 #define MAX_OSC_SIZE    512 + MAX_FILENAME_SIZE
 
+/* Process output is read in batches limited in size and duration so
+   a fast producer cannot starve user input. The display is refreshed
+   at most every SHELL_DISPLAY_MS, or twice the duration of the last
+   refresh, and reading is suspended when too much output is pending
+   display. */
+#define SHELL_READ_MIN      (16 << 10)  /* initial read buffer size */
+#define SHELL_READ_MAX      (256 << 10) /* maximum read buffer size */
+#define SHELL_BATCH_BYTES   (1 << 20)   /* maximum bytes per batch */
+#define SHELL_BATCH_USEC    20000       /* maximum duration of a batch */
+#define SHELL_DISPLAY_MS    40          /* minimum refresh interval */
+#define SHELL_MAX_BACKLOG   (4 << 20)   /* maximum output pending display */
+#define ERROR_INDEX_SLICE_MS 20         /* error parsing time slice */
+
 enum QETermState {
     QE_TERM_STATE_NORM,
     QE_TERM_STATE_UTF8,
@@ -107,6 +120,17 @@ typedef struct ShellState {
     int last_char;  /* last char sent to the process */
     int cwd_stack_depth;
     ShellCwdEntry cwd_stack[16];
+    u8 *read_buf;
+    int read_buf_size;
+    int read_suspended;
+    int backlog;            /* output bytes not displayed yet */
+    URLTimer *display_timer;
+    int last_display_time, display_duration;
+    /* output statistics */
+    int stat_start_time;
+    int stat_reads, stat_batches, stat_displays, stat_suspended;
+    long long stat_bytes;
+    long long stat_busy_usec;
 } ShellState;
 
 typedef struct ShellError {
@@ -133,6 +157,32 @@ static ShellError error_state = {
     .col_num  = -1,
 };
 
+/* Index of the error locations in an error source buffer. Complete lines
+ * before parsed_offset have been scanned, new lines are parsed as output
+ * is appended. A modification before parsed_offset truncates the index
+ * at the start of the modified line. A large backlog, such as a log
+ * loaded from a file, is parsed in time slices from a timer.
+ */
+typedef struct ErrorEntry {
+    int offset;         /* offset of the error line */
+    int line_num;
+    int col_num;
+    int file_index;     /* index into ErrorIndex.files */
+} ErrorEntry;
+
+typedef struct ErrorIndex {
+    QEModeData base;
+    int attached;       /* modification callback is installed */
+    int parsed_offset;
+    int cur;            /* index of the current error or -1 */
+    int last_file;      /* cache for filename interning */
+    URLTimer *update_timer;
+    int nb_entries, size_entries;
+    ErrorEntry *entries;
+    StringArray files;
+    SymbolTable file_table; /* file index + 1 of filenames */
+} ErrorIndex;
+
 #define SR_UPDATE_SIZE  1
 #define SR_REFRESH      2
 #define SR_SILENT       4
@@ -141,6 +191,9 @@ static void do_shell_refresh(EditState *e, int flags);
 static void shell_close(ShellState *s);
 static int shell_check_curpath(ShellState *s, int offset, int c);
 static int match_error(EditBuffer *b, int start_offset, ShellError *dest);
+static ErrorIndex *error_index_get(EditBuffer *b, int create);
+static int error_index_update(ErrorIndex *ei, int max_ms);
+static void error_index_schedule(ErrorIndex *ei);
 
 static void set_error_offset(EditBuffer *b, int offset)
 {
@@ -2557,41 +2610,132 @@ done:
 /* buffer related functions */
 
 /* called when characters are available from the process */
+static void shell_write_output(ShellState *s, const u8 *buf, int len)
+{
+    QEmacsState *qs = s->base.qs;
+    EditBuffer *b = s->b;
+    int i;
+
+    if (qs->trace_buffer)
+        qe_trace_bytes(qs, buf, len, EB_TRACE_SHELL);
+
+    b->offset = b->total_size;
+    if (s->shell_flags & SF_COLOR) {
+        /* optional terminal emulation (shell, ssh, make, latex, man modes) */
+        for (i = 0; i < len; i++) {
+            qe_term_emulate(s, buf[i]);
+        }
+    } else {
+        int pos = b->total_size;
+        int threshold = 3 << 20;    /* 3MB for large pictures */
+        eb_write(b, b->total_size, buf, len);
+        if (pos < threshold && pos + len >= threshold) {
+            EditState *e;
+            for (e = qs->first_window; e != NULL; e = e->next_window) {
+                if (e->b == b) {
+                    if (s->shell_flags & SF_AUTO_CODING)
+                        do_set_auto_coding(e, 0);
+                    if (s->shell_flags & SF_AUTO_MODE)
+                        qe_set_next_mode(e, 0, 0);
+                }
+            }
+        }
+    }
+}
+
+static void shell_read_cb(void *opaque);
+
+static void shell_redisplay(ShellState *s)
+{
+    QEmacsState *qs = s->base.qs;
+    int start_time = get_clock_ms();
+
+    url_kill_timer(qs->up, &s->display_timer);
+    qe_display(qs);
+    s->last_display_time = get_clock_ms();
+    s->display_duration = s->last_display_time - start_time;
+    s->stat_displays++;
+    s->backlog = 0;
+    if (s->read_suspended) {
+        s->read_suspended = 0;
+        if (s->pty_fd >= 0)
+            url_set_read_handler(qs->up, s->pty_fd, shell_read_cb, s);
+    }
+}
+
+static void shell_display_timer(void *opaque)
+{
+    ShellState *s = opaque;
+
+    shell_redisplay(s);
+}
+
 static void shell_read_cb(void *opaque)
 {
     ShellState *s = opaque;
     QEmacsState *qs;
     EditBuffer *b;
-    unsigned char buf[16 * 1024];
-    int len, i, save_readonly;
-    int prev_offset;
+    int len, total, save_readonly, throttled;
+    int prev_offset, start_time, delay;
 
     if (!s || s->base.mode != &shell_mode)
         return;
 
-    len = read(s->pty_fd, buf, sizeof(buf));
-    if (len <= 0) {
-        if (s->pid == -1)
-            shell_close(s);
-        return;
-    }
-
     b = s->b;
     qs = s->base.qs;
-    if (qs->trace_buffer)
-        qe_trace_bytes(qs, buf, len, EB_TRACE_SHELL);
+
+    if (!s->read_buf) {
+        s->read_buf = qe_malloc_array(u8, SHELL_READ_MIN);
+        if (!s->read_buf)
+            return;
+        s->read_buf_size = SHELL_READ_MIN;
+    }
 
     /* Suspend BF_READONLY flag to allow shell output to readonly buffer */
     save_readonly = b->flags & BF_READONLY;
     b->flags &= ~BF_READONLY;
-    prev_offset = b->offset = b->total_size;
+    prev_offset = b->total_size;
     b->last_log = 0;
 
-    if (s->shell_flags & SF_COLOR) {
-        /* optional terminal emulation (shell, ssh, make, latex, man modes) */
-        for (i = 0; i < len; i++) {
-            qe_term_emulate(s, buf[i]);
+    /* drain the pty until it is empty or the batch budget is exhausted */
+    start_time = get_clock_usec();
+    total = throttled = 0;
+    for (;;) {
+        len = read(s->pty_fd, s->read_buf, s->read_buf_size);
+        if (len <= 0)
+            break;
+        s->stat_reads++;
+        total += len;
+        shell_write_output(s, s->read_buf, len);
+        if (len == s->read_buf_size && s->read_buf_size < SHELL_READ_MAX) {
+            /* the producer is fast: use larger reads */
+            int size = s->read_buf_size * 2;
+            if (qe_realloc_array(&s->read_buf, size))
+                s->read_buf_size = size;
         }
+        if (total >= SHELL_BATCH_BYTES
+        ||  get_clock_usec() - start_time >= SHELL_BATCH_USEC
+        ||  is_user_input_pending()) {
+            throttled = 1;
+            break;
+        }
+    }
+
+    if (save_readonly) {
+        b->modified = 0;
+        b->flags |= BF_READONLY;
+    }
+
+    if (total == 0) {
+        /* end of file or error: the process may be gone */
+        if (len == 0 || (errno != EAGAIN && errno != EINTR)) {
+            if (s->pid == -1)
+                shell_close(s);
+        }
+        return;
+    }
+
+    if (s->shell_flags & SF_COLOR) {
         if (s->last_char == '\000' || s->last_char == '\001'
         ||  s->last_char == '\003'
         ||  s->last_char == '\r' || s->last_char == '\n') {
@@ -2609,25 +2753,6 @@ static void shell_read_cb(void *opaque)
                 b->mark = s->cur_prompt;
             }
         }
-    } else {
-        int pos = b->total_size;
-        int threshold = 3 << 20;    /* 3MB for large pictures */
-        eb_write(b, b->total_size, buf, len);
-        if (pos < threshold && pos + len >= threshold) {
-            EditState *e;
-            for (e = qs->first_window; e != NULL; e = e->next_window) {
-                if (e->b == b) {
-                    if (s->shell_flags & SF_AUTO_CODING)
-                        do_set_auto_coding(e, 0);
-                    if (s->shell_flags & SF_AUTO_MODE)
-                        qe_set_next_mode(e, 0, 0);
-                }
-            }
-        }
-    }
-    if (save_readonly) {
-        b->modified = 0;
-        b->flags |= BF_READONLY;
     }
 
     EditState *e = qs->active_window;
@@ -2636,8 +2761,60 @@ static void shell_read_cb(void *opaque)
             e->offset = b->total_size;
     }
 
+    /* index the error messages from the new output lines */
+    ErrorIndex *ei = error_index_get(b, 0);
+    if (ei && !error_index_update(ei, ERROR_INDEX_SLICE_MS))
+        error_index_schedule(ei);
+
+    s->stat_bytes += total;
+    s->stat_batches++;
+    s->stat_busy_usec += get_clock_usec() - start_time;
+    s->backlog += total;
+
     /* now we do some refresh (should just invalidate?) */
-    qe_display(qs);
+    delay = max_int(SHELL_DISPLAY_MS, 2 * s->display_duration) -
+        (get_clock_ms() - s->last_display_time);
+    if (delay <= 0) {
+        shell_redisplay(s);
+        return;
+    }
+    if (!s->display_timer)
+        url_set_timer(qs->up, &s->display_timer, delay, s, shell_display_timer);
+    if (!s->display_timer) {
+        shell_redisplay(s);
+    } else
+    if (throttled && s->backlog >= SHELL_MAX_BACKLOG) {
+        /* the process produces output faster than it can be displayed:
+           stop polling its output until the next refresh */
+        s->read_suspended = 1;
+        s->stat_suspended++;
+        url_set_read_handler(qs->up, s->pty_fd, NULL, NULL);
+    }
+}
+
+static void shell_mode_describe(EditBuffer *b1, EditBuffer *b, void *state)
+{
+    ShellState *s = state;
+    int elapsed;
+
+    if (s == NULL || !s->stat_start_time)
+        return;
+
+    elapsed = get_clock_ms() - s->stat_start_time;
+    eb_style_puts(b1, DESCRIBE_STYLE_HEAD, "\nShell output:\n");
+    eb_print_field(b1, "pid", "%d  (pty_fd=%d)\n", s->pid, s->pty_fd);
+    eb_print_field(b1, "bytes", "%lld  (%lld KB/s)\n", s->stat_bytes,
+                   s->stat_bytes * 1000 / 1024 / max_int(elapsed, 1));
+    eb_print_field(b1, "reads", "%d  (buffer=%d)\n",
+                   s->stat_reads, s->read_buf_size);
+    eb_print_field(b1, "batches", "%d  (displays=%d)\n",
+                   s->stat_batches, s->stat_displays);
+    eb_print_field(b1, "suspended", "%d%s\n", s->stat_suspended,
+                   s->read_suspended ? "  (now)" : "");
+    eb_print_field(b1, "busy", "%lld ms  (%lld KB/s)\n",
+                   s->stat_busy_usec / 1000,
+                   s->stat_bytes * 1000000 / 1024 /
+                   (s->stat_busy_usec > 0 ? s->stat_busy_usec : 1));
 }
 
 static void shell_mode_free(EditBuffer *b, void *state)
@@ -2674,11 +2851,15 @@ static void shell_mode_free(EditBuffer *b, void *state)
         url_set_pid_handler(b->qs->up, s->pid, NULL, NULL);
         s->pid = -1;
     }
+    url_kill_timer(b->qs->up, &s->display_timer);
+    s->read_suspended = 0;
     if (s->pty_fd >= 0) {
         url_set_read_handler(b->qs->up, s->pty_fd, NULL, NULL);
         close(s->pty_fd);
         s->pty_fd = -1;
     }
+    qe_free(&s->read_buf);
+    s->read_buf_size = 0;
 }
 
 static void shell_pid_cb(void *opaque, int status)
@@ -2886,6 +3067,11 @@ EditBuffer *qe_new_shell_buffer(QEmacsState *qs, EditBuffer *b0, EditState *e,
         return NULL;
     }
 
+    s->stat_start_time = get_clock_ms();
+    s->stat_reads = s->stat_batches = 0;
+    s->stat_displays = s->stat_suspended = 0;
+    s->stat_bytes = s->stat_busy_usec = 0;
+
     /* XXX: ShellState life cycle is bogus */
     url_set_read_handler(qs->up, s->pty_fd, shell_read_cb, s);
     url_set_pid_handler(qs->up, s->pid, shell_pid_cb, s);
@@ -3121,77 +3307,6 @@ static void do_man(EditState *s, const char *arg)
     edit_set_mode(s, &pager_mode);
 }
 
-void qe_diff_buffer_with_file(EditState *s, EditBuffer *b)
-{
-    char bufname[MAX_BUFFERNAME_SIZE];
-    char cmd[64 + 2 * MAX_FILENAME_SIZE];
-    char tmpfile[MAX_FILENAME_SIZE];
-    QEmacsState *qs = s->qs;
-    EditState *e;
-    EditBuffer *b1;
-    const char *fname = get_basename(b->filename);
-    const char *tmpdir = getenv("TMPDIR");
-    int tmpdir_len;
-
-    if (s->flags & (WF_POPUP | WF_MINIBUF))
-        return;
-
-    if (!*fname)
-        return;
-
-    if (!tmpdir || !*tmpdir) tmpdir = "/tmp";
-    tmpdir_len = strlen(tmpdir);
-    if (tmpdir[tmpdir_len - 1] == '/') tmpdir_len--;
-
-    snprintf(tmpfile, sizeof(tmpfile), "%.*s/qe-%d-%s",
-             tmpdir_len, tmpdir, getpid(), fname);
-    eb_write_buffer(b, 0, b->total_size, tmpfile);
-
-    // Pass options to diff command
-    // -s, --report-identical-files
-    //      report when two files are the same
-    // -p, --show-c-function
-    //      show which C function each change is in
-    // --label LABEL   [-L on FreeBSD and OpenBSD]
-    //      use LABEL instead of file name and timestamp (can be repeated)
-    // -t, --expand-tabs
-    //      expand tabs to spaces in output
-    // --color[=WHEN]  [macOS only]
-    //      color output; WHEN is 'never', 'always', or 'auto'; plain
-    //      --color means --color='auto'
-
-#if defined(CONFIG_DARWIN) || defined(CONFIG_LINUX)
-    snprintf(cmd, sizeof(cmd), "diff -s -p -u --label '%s' --label '#<buffer %s>' '%s' '%s'; rm '%s'",
-             b->filename, b->name, b->filename, tmpfile, tmpfile);
-#elif defined(CONFIG_FREEBSD) || defined(CONFIG_OPENBSD)
-    snprintf(cmd, sizeof(cmd), "diff -s -p -u -L '%s' -L '#<buffer %s>' '%s' '%s'; rm '%s'",
-             b->filename, b->name, b->filename, tmpfile, tmpfile);
-#else
-    snprintf(cmd, sizeof(cmd), "diff -s -p -u '%s' '%s'; rm '%s'",
-             b->filename, tmpfile, tmpfile);
-#endif
-    snprintf(bufname, sizeof(bufname), "*Diff %s*", fname);
-
-    b1 = qe_new_shell_buffer(qs, NULL, s, bufname, NULL, NULL, cmd, SF_COLOR | SF_NO_DRAG);
-    if (!b1) {
-        unlink(tmpdir);
-        return;
-    }
-
-    // construct popup caption
-    snprintf(cmd, sizeof(cmd), "Diff buffer %s", fname);
-
-    b1->data_type_name = "diff";
-    e = show_popup(s, b1, cmd);
-    // XXX: Should use patch mode
-    edit_set_mode(e, &pager_mode);
-}
-
-static void do_diff_buffer_with_file(EditState *s)
-{
-    qe_diff_buffer_with_file(s, s->b);
-}
-
 static void do_ssh(EditState *s, const char *arg)
 {
     char bufname[MAX_BUFFERNAME_SIZE];
@@ -3960,6 +4075,297 @@ static void do_compile(EditState *s, const char *cmd)
     set_error_offset(b, 0);
 }
 
+/* Built-in grep: scan a directory tree without spawning a process.
+ * The scan runs as a job on the worker pool: each file is mapped into
+ * a snapshot buffer (see eb_snapshot_file()) and searched with the
+ * buffer search engine. Matches are formatted like `grep -n` output
+ * so `next-error` and `goto-error` work unchanged, and posted in
+ * chunks to the main thread that appends them to the results buffer.
+ */
+
+#define GREP_FLUSH_SIZE   (64 << 10)    /* output posted at once */
+#define GREP_FLUSH_MS     50            /* maximum delay before posting */
+#define GREP_MAX_CHUNKS   8             /* chunks waiting for the main thread */
+#define GREP_MAX_LINE     512           /* truncate long matching lines */
+#define GREP_MAX_ENTRY    (MAX_FILENAME_SIZE + 32 + GREP_MAX_LINE)
+
+typedef struct GrepState {
+    QEmacsState *qs;
+    URLJob *job;            /* NULL once the scan is canceled */
+    EditBuffer *b;          /* results buffer */
+    int nb_files, nb_matches;
+    int start_time;
+    int path_len;           /* length of the directory prefix to strip */
+    char path[MAX_FILENAME_SIZE];
+    char pattern[MAX_FILENAME_SIZE];
+    char search_str[MAX_FILENAME_SIZE];
+    /* fields below are only accessed by the worker thread */
+    char *out;              /* pending output */
+    int out_len;
+    int out_files, out_matches;
+    int flush_time;
+} GrepState;
+
+typedef struct GrepChunk {
+    GrepState *gs;
+    int nb_files, nb_matches;
+    int size;
+    char data[1];
+} GrepChunk;
+
+static GrepState *grep_state;
+
+static void grep_chunk_cb(void *opaque);
+
+/* called on the worker thread: hand the pending output to the main
+   thread. Return -1 if the job was canceled. */
+static int grep_flush(URLJob *job, GrepState *gs)
+{
+    GrepChunk *chunk;
+
+    chunk = qe_malloc_hack(GrepChunk, gs->out_len);
+    if (!chunk)
+        return -1;
+    chunk->gs = gs;
+    chunk->nb_files = gs->out_files;
+    chunk->nb_matches = gs->out_matches;
+    chunk->size = gs->out_len;
+    memcpy(chunk->data, gs->out, gs->out_len);
+    gs->out_len = 0;
+    gs->flush_time = get_clock_ms();
+    if (url_post_job_bottom_half(job, GREP_MAX_CHUNKS, grep_chunk_cb, chunk)) {
+        qe_free(&chunk);
+        return -1;
+    }
+    return url_job_canceled(job) ? -1 : 0;
+}
+
+static int grep_abort(void *opaque)
+{
+    return url_job_canceled(opaque);
+}
+
+/* count the newlines in a range of a snapshot */
+static int grep_count_lines(EditBuffer *fb, int start, int end)
+{
+    u8 buf[4096];
+    const u8 *p;
+    int len, n = 0;
+
+    while (start < end) {
+        len = eb_read(fb, start, buf, min_int(end - start, sizeof(buf)));
+        if (len <= 0)
+            break;
+        for (p = buf; (p = memchr(p, '\n', buf + len - p)) != NULL; p++)
+            n++;
+        start += len;
+    }
+    return n;
+}
+
+/* called on the worker thread: search a file snapshot.
+   Return -1 if the job was canceled. */
+static int grep_scan_file(URLJob *job, GrepState *gs, EditBuffer *fb,
+                          const char *filename)
+{
+    int offset, line_offset, line_num, col_num, p1, p2;
+    int found_offset, found_end;
+
+    offset = line_offset = line_num = 0;
+    while (eb_search_string(fb, gs->search_str, 1, offset, fb->total_size,
+                            grep_abort, job, &found_offset, &found_end) > 0) {
+        /* matches are found in order: count lines incrementally */
+        p1 = eb_goto_bol(fb, found_offset);
+        line_num += grep_count_lines(fb, line_offset, p1);
+        line_offset = p1;
+        for (col_num = 0, offset = p1; offset < found_offset; col_num++)
+            offset = eb_next(fb, offset);
+        p2 = eb_goto_eol(fb, found_offset);
+        if (p2 - p1 > GREP_MAX_LINE)
+            p2 = p1 + GREP_MAX_LINE;
+        gs->out_len += snprintf(gs->out + gs->out_len, GREP_MAX_ENTRY,
+                                "%s:%d:%d: ", filename,
+                                line_num + 1, col_num + 1);
+        gs->out_len += eb_read(fb, p1, gs->out + gs->out_len, p2 - p1);
+        gs->out[gs->out_len++] = '\n';
+        gs->out_matches++;
+        if (gs->out_len >= GREP_FLUSH_SIZE && grep_flush(job, gs))
+            return -1;
+        /* report a single match per line */
+        offset = eb_next_line(fb, max_offset(found_offset, found_end - 1));
+    }
+    return url_job_canceled(job) ? -1 : 0;
+}
+
+static void grep_run(URLJob *job, void *opaque)
+{
+    GrepState *gs = opaque;
+    char filename[MAX_FILENAME_SIZE];
+    FindFileState *ffs;
+    EditBuffer *fb;
+    struct stat st;
+    u8 buf[1024];
+    int len, stop = 0;
+
+    /* room for a complete entry past the flush threshold */
+    gs->out = qe_malloc_array(char, GREP_FLUSH_SIZE + GREP_MAX_ENTRY);
+    ffs = find_file_open(gs->path, gs->pattern,
+                         FF_NODIR | FF_NOXXDIR | FF_NODOT | FF_DEPTH);
+    if (!gs->out || !ffs)
+        goto done;
+    gs->flush_time = get_clock_ms();
+    while (!stop && !find_file_next(ffs, filename, sizeof(filename))) {
+        if (stat(filename, &st) || !S_ISREG(st.st_mode)
+        ||  st.st_size == 0 || st.st_size >= INT_MAX)
+            continue;
+        if (!(fb = eb_snapshot_file(gs->qs, filename)))
+            continue;
+        /* skip binary files, like grep -I */
+        len = eb_read(fb, 0, buf, sizeof(buf));
+        if (!memchr(buf, '\0', len)) {
+            gs->out_files++;
+            stop = grep_scan_file(job, gs, fb, filename + gs->path_len);
+        }
+        eb_free_snapshot(&fb);
+        if (!stop && get_clock_ms() - gs->flush_time >= GREP_FLUSH_MS)
+            stop = grep_flush(job, gs);
+    }
+    if (!stop)
+        grep_flush(job, gs);
+ done:
+    find_file_close(&ffs);
+    qe_free(&gs->out);
+}
+
+static void grep_chunk_cb(void *opaque)
+{
+    GrepChunk *chunk = opaque;
+    GrepState *gs = chunk->gs;
+    QEmacsState *qs = gs->qs;
+    EditBuffer *b;
+    int save_readonly;
+
+    if (gs->job) {
+        if (!(b = qe_check_buffer(qs, &gs->b))) {
+            /* results buffer was killed: abort the scan */
+            url_cancel_job(qs->up, &gs->job);
+        } else {
+            /* Suspend BF_READONLY flag to allow output to compilation buffer */
+            save_readonly = b->flags & BF_READONLY;
+            b->flags &= ~BF_READONLY;
+            eb_write(b, b->total_size, chunk->data, chunk->size);
+            if (save_readonly) {
+                b->modified = 0;
+                b->flags |= BF_READONLY;
+            }
+            gs->nb_files = chunk->nb_files;
+            gs->nb_matches = chunk->nb_matches;
+            put_status(qs->active_window, "&Grep: %d matches in %d files",
+                       gs->nb_matches, gs->nb_files);
+            qe_display(qs);
+        }
+    }
+    qe_free(&chunk);
+}
+
+static void grep_done(void *opaque, int canceled)
+{
+    GrepState *gs = opaque;
+    QEmacsState *qs = gs->qs;
+    EditBuffer *b;
+    int save_readonly;
+
+    if (!canceled && (b = qe_check_buffer(qs, &gs->b)) != NULL) {
+        save_readonly = b->flags & BF_READONLY;
+        b->flags &= ~BF_READONLY;
+        b->offset = b->total_size;
+        eb_printf(b, "\nGrep finished: %d matches in %d files (%d ms)\n",
+                  gs->nb_matches, gs->nb_files,
+                  get_clock_ms() - gs->start_time);
+        if (save_readonly) {
+            b->modified = 0;
+            b->flags |= BF_READONLY;
+        }
+        put_status(qs->active_window, "Grep finished: %d matches in %d files",
+                   gs->nb_matches, gs->nb_files);
+        qe_display(qs);
+    }
+    if (grep_state == gs)
+        grep_state = NULL;
+    qe_free(&gs);
+}
+
+static void do_grep_directory(EditState *s, const char *search_str,
+                              const char *pattern, const char *dir)
+{
+    char path[MAX_FILENAME_SIZE];
+    QEmacsState *qs = s->qs;
+    GrepState *gs;
+    EditBuffer *b;
+    EditState *e;
+
+    if (s->flags & (WF_POPUP | WF_MINIBUF))
+        return;
+
+    if (!*search_str)
+        return;
+
+    if (s->flags & WF_POPLEFT) {
+        /* avoid messing with the dired pane */
+        s = find_window(s, KEY_RIGHT, s);
+        qs->active_window = s;
+    }
+
+    if (!pattern || !*pattern)
+        pattern = "*";
+
+    if (dir && *dir)
+        canonicalize_absolute_buffer_path(s->b, s->offset, path, countof(path), dir);
+    else
+        get_default_path(s->b, s->offset, path, countof(path));
+    append_slash(path, countof(path));
+
+    /* only one scan at a time: the output of the previous scan is
+       discarded, its state is freed when the job completes */
+    if (grep_state) {
+        url_cancel_job(qs->up, &grep_state->job);
+        grep_state = NULL;
+    }
+
+    b = qe_new_buffer(qs, "*grep*", BC_CLEAR | BF_UTF8);
+    if (!b)
+        return;
+
+    gs = qe_mallocz(GrepState);
+    if (!gs)
+        return;
+    gs->qs = qs;
+    gs->b = b;
+    gs->start_time = get_clock_ms();
+    gs->path_len = strlen(path);
+    pstrcpy(gs->path, countof(gs->path), path);
+    pstrcpy(gs->pattern, countof(gs->pattern), pattern);
+    pstrcpy(gs->search_str, countof(gs->search_str), search_str);
+
+    /* make file names relative to the directory scanned */
+    pstrcpy(unconst(char *)b->filename, countof(b->filename), path);
+    b->data_type_name = "grep";
+    eb_printf(b, "Grep \"%s\" in %s%s\n\n", search_str, path, pattern);
+
+    e = eb_find_window(b, NULL);
+    if (!e)
+        e = shell_target_window(s, b);
+    edit_set_mode(e, &compilation_mode);
+    set_error_offset(b, 0);
+
+    grep_state = gs;
+    gs->job = url_submit_job(qs->up, grep_run, grep_done, gs);
+    if (!gs->job) {
+        grep_state = NULL;
+        qe_free(&gs);
+    }
+}
+
 /* Scan a buffer for an error message or a grep location */
 static int match_error(EditBuffer *b, int start_offset, ShellError *dest)
 {
@@ -4034,14 +4440,198 @@ static int match_error(EditBuffer *b, int start_offset, ShellError *dest)
     return 1; // has error
 }
 
+static void error_index_callback(EditBuffer *b, void *opaque, int edge,
+                                 enum LogOperation op, int offset, int size)
+{
+    ErrorIndex *ei = opaque;
+    int lo, hi, mid;
+
+    if (offset >= ei->parsed_offset)
+        return;
+
+    /* called before the modification: drop the entries from the
+       modified line onwards, they will be parsed again */
+    offset = eb_goto_bol(b, offset);
+    for (lo = 0, hi = ei->nb_entries; lo < hi;) {
+        mid = (lo + hi) >> 1;
+        if (ei->entries[mid].offset < offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    ei->nb_entries = lo;
+    ei->parsed_offset = offset;
+    if (ei->cur >= lo)
+        ei->cur = -1;
+}
+
+static void compilation_mode_free(EditBuffer *b, void *state)
+{
+    ErrorIndex *ei = state;
+
+    if (ei->attached)
+        eb_free_callback(b, error_index_callback, ei);
+    url_kill_timer(ei->base.qs->up, &ei->update_timer);
+    qe_free(&ei->entries);
+    free_strings(&ei->files);
+    symbol_table_free(&ei->file_table);
+}
+
+static ErrorIndex *error_index_get(EditBuffer *b, int create)
+{
+    ErrorIndex *ei = qe_get_buffer_mode_data(b, &compilation_mode, NULL);
+
+    if (!ei && create)
+        ei = (ErrorIndex *)qe_create_buffer_mode_data(b, &compilation_mode);
+    if (ei && !ei->attached) {
+        ei->cur = -1;
+        if (eb_add_callback(b, error_index_callback, ei, 0))
+            return NULL;
+        ei->attached = 1;
+    }
+    return ei;
+}
+
+static int error_index_file(ErrorIndex *ei, const char *filename)
+{
+    StringItem *item;
+    intptr_t k;
+
+    /* error messages usually come in runs for the same file */
+    if (ei->last_file < ei->files.nb_items
+    &&  strequal(ei->files.items[ei->last_file]->str, filename))
+        return ei->last_file;
+    k = (intptr_t)symbol_find(&ei->file_table, filename);
+    if (k)
+        return ei->last_file = k - 1;
+    if (!(item = add_string(&ei->files, filename, 0)))
+        return -1;
+    k = ei->files.nb_items;
+    /* the string items are not moved when the array grows */
+    if (symbol_add(&ei->file_table, item->str, (void *)k) < 0)
+        return -1;
+    return ei->last_file = k - 1;
+}
+
+/* Parse the complete lines appended since the last update, for at most
+   `max_ms` milliseconds if positive. Return non zero if the index is
+   complete. */
+static int error_index_update(ErrorIndex *ei, int max_ms)
+{
+    EditBuffer *b = ei->base.b;
+    ShellError err;
+    ErrorEntry *ep;
+    int offset, stop, file_index, lines = 0;
+    int start_time = get_clock_ms();
+
+    stop = eb_goto_bol(b, b->total_size);
+    for (offset = ei->parsed_offset; offset < stop;
+         offset = eb_next_line(b, offset)) {
+        if (max_ms > 0 && (++lines & 255) == 0
+        &&  get_clock_ms() - start_time >= max_ms)
+            break;
+        err.line_num = -1;
+        if (match_error(b, offset, &err) < 2)
+            continue;
+        if (ei->nb_entries >= ei->size_entries) {
+            int new_size = max_int(ei->size_entries * 3 / 2, 64);
+            if (!qe_realloc_array(&ei->entries, new_size))
+                break;
+            ei->size_entries = new_size;
+        }
+        if ((file_index = error_index_file(ei, err.filename)) < 0)
+            break;
+        ep = &ei->entries[ei->nb_entries++];
+        ep->offset = offset;
+        ep->line_num = err.line_num;
+        ep->col_num = err.col_num;
+        ep->file_index = file_index;
+    }
+    ei->parsed_offset = offset;
+    return offset >= stop;
+}
+
+static void error_index_timer(void *opaque)
+{
+    ErrorIndex *ei = opaque;
+
+    if (!error_index_update(ei, ERROR_INDEX_SLICE_MS))
+        error_index_schedule(ei);
+    /* show the updated error count */
+    qe_display(ei->base.qs);
+}
+
+/* Parse the pending lines from a timer so large logs do not stall the
+   redisplay, one time slice per event loop iteration */
+static void error_index_schedule(ErrorIndex *ei)
+{
+    EditBuffer *b = ei->base.b;
+
+    if (!ei->update_timer
+    &&  ei->parsed_offset < eb_goto_bol(b, b->total_size)) {
+        url_set_timer(ei->base.qs->up, &ei->update_timer, 0,
+                      ei, error_index_timer);
+    }
+}
+
+/* Return the index of the error entry for the line at `offset` or -1 */
+static int error_index_lookup(ErrorIndex *ei, int offset)
+{
+    int lo, hi, mid;
+
+    for (lo = 0, hi = ei->nb_entries; lo < hi;) {
+        mid = (lo + hi) >> 1;
+        if (ei->entries[mid].offset < offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < ei->nb_entries && ei->entries[lo].offset == offset)
+        return lo;
+    return -1;
+}
+
+/* Find the error entry to move to from the current error state */
+static int error_index_find(ErrorIndex *ei, ShellError *sep, int dir)
+{
+    ErrorEntry *ep;
+    int i, lo, hi, mid;
+
+    if (ei->cur >= 0 && ei->cur < ei->nb_entries
+    &&  ei->entries[ei->cur].offset == sep->offset) {
+        i = ei->cur + dir;
+    } else {
+        for (lo = 0, hi = ei->nb_entries; lo < hi;) {
+            mid = (lo + hi) >> 1;
+            if (ei->entries[mid].offset <= sep->offset)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        i = (dir > 0) ? lo : lo - 1;
+        if (dir < 0 && i >= 0 && ei->entries[i].offset == sep->offset)
+            i--;
+    }
+    /* skip multiple messages for the current location */
+    for (; i >= 0 && i < ei->nb_entries; i += dir) {
+        ep = &ei->entries[i];
+        if (ep->line_num != sep->line_num
+        ||  ep->col_num != sep->col_num
+        ||  !strequal(ei->files.items[ep->file_index]->str, sep->filename))
+            break;
+    }
+    return i;
+}
+
 static void do_next_error(EditState *s, int arg, int dir)
 {
     char fullname[MAX_FILENAME_SIZE];
     QEmacsState *qs = s->qs;
     ShellError *sep = &error_state;
+    ErrorIndex *ei;
     EditState *e;
     EditBuffer *b;
-    int offset;
+    int i, offset;
     struct stat sb;
 
     if (s->flags & (WF_POPUP | WF_MINIBUF))
@@ -4080,29 +4670,26 @@ static void do_next_error(EditState *s, int arg, int dir)
         set_error_offset(b, -1);
     }
 
-    /* find next/prev error */
-    offset = sep->offset;
+    if ((ei = error_index_get(b, 1)) == NULL) {
+        put_error(s, "Cannot index errors");
+        return;
+    }
+    error_index_update(ei, 0);
 
-    /* CG: should use higher level parsing */
-    for (;;) {
-        if (dir > 0) {
-            offset = eb_next_line(b, offset);
-            if (offset >= b->total_size) {
-                put_error(s, "No more errors");
-                return;
-            }
-        } else {
-            if (offset <= 0) {
-                put_error(s, "No previous error");
-                return;
-            }
-            offset = eb_prev_line(b, offset);
-        }
-        if (match_error(b, offset, sep) > 1) {
-            // found a new error
-            break;
-        }
+    /* find next/prev error */
+    i = error_index_find(ei, sep, dir);
+    if (i >= ei->nb_entries) {
+        put_error(s, "No more errors");
+        return;
     }
+    if (i < 0) {
+        put_error(s, "No previous error");
+        return;
+    }
+    ei->cur = i;
+    offset = ei->entries[i].offset;
+    sep->line_num = -1;
+    match_error(b, offset, sep);
 
     canonicalize_absolute_buffer_path(b, sep->offset, fullname, countof(fullname), sep->filename);
     if ((stat(fullname, &sb) < 0 || !S_ISREG(sb.st_mode))
@@ -4273,6 +4860,28 @@ static int qe_shell_find_mode(QEmacsState *qs, const char *filename) {
     return i;
 }
 
+/* Find the syntax mode for the filename of an error line: the mode is
+   cached per file for the lines already in the error index. */
+static int shell_error_mode(QEColorizeContext *cp, const char *filename)
+{
+    ErrorIndex *ei = qe_get_buffer_mode_data(cp->b, &compilation_mode, NULL);
+    StringItem *item;
+    int i;
+
+    if (ei && cp->offset < ei->parsed_offset
+    &&  (i = error_index_lookup(ei, cp->offset)) >= 0) {
+        item = ei->files.items[ei->entries[i].file_index];
+        if (strequal(item->str, filename)) {
+            if (!item->opaque) {
+                intptr_t mc = qe_shell_find_mode(cp->s->qs, filename);
+                item->opaque = (void *)(mc + 1);
+            }
+            return (intptr_t)item->opaque - 1;
+        }
+    }
+    return qe_shell_find_mode(cp->s->qs, filename);
+}
+
 void shell_colorize_line(QEColorizeContext *cp,
                          const char32_t *str, int n,
                          QETermStyle *sbuf, ModeDef *syn)
@@ -4394,7 +5003,7 @@ void shell_colorize_line(QEColorizeContext *cp,
                         }
                     }
                 } else {
-                    int mc;
+                    int mc, bol = (i == 0);
                     w = shell_grab_filename(str + i, n - i, filename, countof(filename), TRUE);
                     if (i == 0) {
                         char *p = strchr(filename, '@');
@@ -4410,10 +5019,16 @@ void shell_colorize_line(QEColorizeContext *cp,
                         continue;
                     }
                     i += w;
-                    mc = qe_shell_find_mode(cp->s->qs, filename);
+                    c = str[i];
+                    /* only probe the modes for possible error locations */
+                    if (c != '(' && c != ':' && !(c == '-' && qe_isdigit(str[i + 1])))
+                        continue;
+                    if (bol)
+                        mc = shell_error_mode(cp, filename);
+                    else
+                        mc = qe_shell_find_mode(cp->s->qs, filename);
                     if (!mc)
                         continue;
-                    c = str[i];
                     if (c == '(') {
                         /* this is an old style filename position */
                         i += 1;
@@ -4646,6 +5261,12 @@ static const CmdDef shell_global_commands[] = {
           "Run make and display a new buffer with its collected output",
           do_compile, ESs,
           "#" "@{make}")
+    CMD2( "grep-directory", "",
+          "Search files in a directory tree and list the matching lines",
+          do_grep_directory, ESsss,
+          "#" "s{Grep for: }[search]|search|"
+          "s{In files: }|grep-files|"
+          "s{In directory: }[dir]|file|")
     CMD2( "man", "",
           "Run man for a command and display a new buffer with its collected output",
           do_man, ESs,
@@ -4656,9 +5277,6 @@ static const CmdDef shell_global_commands[] = {
     CMD3( "previous-error", "C-x C-p, M-g p, M-g M-p",
           "Move to the previous error from the last shell command output",
           do_next_error, ESii, "#" "P" "v", -1)
-    CMD2( "diff-buffer-with-file", "C-c C-d, C-c =",
-          "Show differences between the buffer in the current window and its file",
-          do_diff_buffer_with_file, ES, "#")
 };
 
 static int shell_mode_probe(ModeDef *mode, ModeProbeData *p)
@@ -4716,6 +5334,22 @@ static int compilation_mode_init(EditState *e, EditBuffer *b, int flags)
     return 0;
 }
 
+static void compilation_mode_line(EditState *s, buf_t *out)
+{
+    ErrorIndex *ei = error_index_get(s->b, 0);
+
+    text_mode_line(s, out);
+    if (ei) {
+        /* the count may be partial while a large log is being parsed */
+        error_index_schedule(ei);
+        if (ei->cur >= 0 && strequal(error_state.buffer, s->b->name))
+            buf_printf(out, "--%d/%d errors", ei->cur + 1, ei->nb_entries);
+        else
+        if (ei->nb_entries)
+            buf_printf(out, "--%d errors", ei->nb_entries);
+    }
+}
+
 static void do_pager_abort(EditState *e)
 {
     EditBuffer *b1;
@@ -4841,6 +5475,7 @@ static int shell_init(QEmacsState *qs)
     shell_mode.buffer_instance_size = sizeof(ShellState);
     shell_mode.mode_init = shell_mode_init;
     shell_mode.mode_free = shell_mode_free;
+    shell_mode.mode_describe = shell_mode_describe;
     shell_mode.display_hook = shell_display_hook;
     shell_mode.move_left_right = shell_move_left_right;
     shell_mode.move_word_left_right = shell_move_word_left_right;
@@ -4879,7 +5514,10 @@ static int shell_init(QEmacsState *qs)
     compilation_mode.name = "compilation";
     compilation_mode.flags |= MODEF_NO_TRAILING_BLANKS;
     compilation_mode.mode_probe = NULL;
+    compilation_mode.buffer_instance_size = sizeof(ErrorIndex);
     compilation_mode.mode_init = compilation_mode_init;
+    compilation_mode.mode_free = compilation_mode_free;
+    compilation_mode.get_mode_line = compilation_mode_line;
     compilation_mode.bindings = compilation_bindings;
     compilation_mode.colorize_func = shell_colorize_line;
     compilation_mode.default_wrap = WRAP_LINE;
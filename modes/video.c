@@ -231,12 +231,12 @@ static void video_refresh_timer(void *opaque)
     if (is->video_st) {
         if (is->pictq_size == 0) {
             /* if no picture, need to wait */
-            is->video_timer = url_add_timer(qs->up, 40, s, video_refresh_timer);
+            url_set_timer(qs->up, &is->video_timer, 40, s, video_refresh_timer);
         } else {
             vp = &is->pictq[is->pictq_rindex];
 
             /* launch timer for next picture */
-            is->video_timer = url_add_timer(qs->up, vp->delay, s, video_refresh_timer);
+            url_set_timer(qs->up, &is->video_timer, vp->delay, s, video_refresh_timer);
 
             /* invalidate window */
             edit_invalidate(s, 0);
@@ -256,7 +256,7 @@ static void video_refresh_timer(void *opaque)
         }
     } else if (is->audio_st) {
         /* draw the next audio frame */
-        is->video_timer = url_add_timer(qs->up, 40, s, video_refresh_timer);
+        url_set_timer(qs->up, &is->video_timer, 40, s, video_refresh_timer);
 
         /* if only audio stream, then display the audio bars (better
            than nothing, just to test the implementation */
@@ -268,7 +268,7 @@ static void video_refresh_timer(void *opaque)
         /* display picture */
         qe_display(qs);
     } else {
-        is->video_timer = url_add_timer(qs->up, 100, s, video_refresh_timer);
+        url_set_timer(qs->up, &is->video_timer, 100, s, video_refresh_timer);
     }
 }
 
@@ -844,7 +844,7 @@ static int video_mode_init(EditState *s, EditBuffer *b, int flags)
         pthread_cond_init(&is->pictq_cond, NULL);
 
         /* add the refresh timer to draw the picture */
-        is->video_timer = url_add_timer(qs->up, 0, s, video_refresh_timer);
+        url_set_timer(qs->up, &is->video_timer, 0, s, video_refresh_timer);
 
         /* if there is already a window with this video playing, then we
            stop this new instance (C-x 2 case) */
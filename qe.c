@@ -75,6 +75,7 @@ int is_player = 1;    /* Start in dired mode when invoked with no arguments */
 #ifndef CONFIG_TINY
 static int free_everything;
 #endif
+static int startup_profile;
 
 /* buffer examination */
 
@@ -123,6 +124,33 @@ int qe_save_buffers(QEmacsState *qs, int flags)
 
 /* mode handling */
 
+/* Key bindings are not parsed at registration time: the mode
+ * bindings array and the default bindings of the command tables are
+ * queued and registered in the same order by qe_load_mode_bindings()
+ * when the bindings are first needed, typically on the first key.
+ */
+struct ModeBindings {
+    struct ModeBindings *next;
+    const CmdDef *cmds;     /* NULL for the mode bindings array */
+    int len;
+};
+
+static int qe_defer_bindings(struct ModeBindings **pp,
+                             const CmdDef *cmds, int len)
+{
+    struct ModeBindings *p;
+
+    while (*pp)
+        pp = &(*pp)->next;
+    p = qe_mallocz(struct ModeBindings);
+    if (!p)
+        return -1;
+    p->cmds = cmds;
+    p->len = len;
+    *pp = p;
+    return 0;
+}
+
 static int default_mode_init(EditState *s, EditBuffer *b, int flags) { return 0; }
 
 static int generic_mode_probe(ModeDef *mode, ModeProbeData *p)
@@ -140,6 +168,10 @@ ModeDef *qe_find_mode(QEmacsState *qs, const char *name, int flags)
     ModeDef *m;
 
     strstart(name, "lang-", &name);
+    m = symbol_find(&qs->mode_table, name);
+    if (m && (m->flags & flags) == flags)
+        return m;
+    /* match extensions and modes with other flags */
     for (m = qs->first_mode; m; m = m->next) {
         if ((m->flags & flags) == flags) {
             if ((m->name && !strcasecmp(m->name, name))
@@ -151,10 +183,166 @@ ModeDef *qe_find_mode(QEmacsState *qs, const char *name, int flags)
     return m;
 }
 
+/* The mode index maps the items of the `extensions`, `filenames` and
+ * `shell_handlers` lists of all registered modes to the modes that
+ * declare them.  A lookup marks the candidate modes with a new serial
+ * number, so that mode probing can skip the modes that only match
+ * on these lists without scanning them.
+ */
+struct ModeIndexLink {
+    struct ModeIndexLink *next;
+    ModeDef *m;
+};
+
+static void qe_mode_index_add(QEmacsState *qs, SymbolTable *st,
+                              const char *name, int len, ModeDef *m)
+{
+    char key[MAX_FILENAME_SIZE];
+    struct ModeIndexLink *p;
+
+    /* longer items cannot match a file name */
+    if (len >= ssizeof(key))
+        return;
+    memcpy(key, name, len);
+    key[len] = '\0';
+    p = qe_mallocz(struct ModeIndexLink);
+    if (!p) {
+        qs->mode_index_failed = 1;
+        return;
+    }
+    p->m = m;
+    p->next = symbol_find(st, key);
+    if (symbol_add(st, key, p) < 0) {
+        qe_free(&p);
+        qs->mode_index_failed = 1;
+    }
+}
+
+/* add the items of a `|` separated list to a mode index table.
+ * Empty items are significant only between two `|` characters as
+ * in match_extension() and memfind(), never for match_filename().
+ */
+static void qe_mode_index_list(QEmacsState *qs, SymbolTable *st,
+                               const char *list, ModeDef *m, int empty_ok)
+{
+    const char *p, *q;
+
+    if (!list)
+        return;
+    for (p = q = list;; p++) {
+        int c = *p;
+        if (c == '|' || c == '\0') {
+            if (p > q || (empty_ok && q != list && c != '\0'))
+                qe_mode_index_add(qs, st, q, p - q, m);
+            if (c == '\0')
+                break;
+            q = p + 1;
+        }
+    }
+}
+
+static void qe_mode_index_mark(QEmacsState *qs, SymbolTable *st,
+                               const char *name, int len)
+{
+    char key[MAX_FILENAME_SIZE];
+    struct ModeIndexLink *p;
+
+    if (len < 0) {
+        p = symbol_find(st, name);
+    } else {
+        if (len >= ssizeof(key))
+            return;
+        memcpy(key, name, len);
+        key[len] = '\0';
+        p = symbol_find(st, key);
+    }
+    for (; p; p = p->next)
+        p->m->probe_serial = qs->mode_probe_serial;
+}
+
+/* mark the modes whose extensions or file names match `filename` and,
+ * if `buf` is not NULL, those whose shell handlers match its `#!` line.
+ */
+static void qe_mode_index_lookup(QEmacsState *qs, const char *filename,
+                                 const char *buf)
+{
+    const char *base, *p;
+
+    qs->mode_probe_serial++;
+
+    /* same matching rules as match_filename() */
+    base = get_basename(filename);
+    if (*base)
+        qe_mode_index_mark(qs, &qs->mode_filename_table, base, -1);
+
+    /* same matching rules as match_extension() */
+    while (*base == '.')
+        base++;
+    for (p = base; *p; p++) {
+        if (*p == '.')
+            qe_mode_index_mark(qs, &qs->mode_extension_table, p + 1, -1);
+    }
+
+    /* same parsing as match_shell_handler() */
+    if (buf && buf[0] == '#' && buf[1] == '!') {
+        for (p = buf + 2; qe_isblank(*p); p++)
+            continue;
+        for (base = p; *p && !qe_isspace(*p); p++) {
+            if (*p == '/')
+                base = p + 1;
+        }
+        qe_mode_index_mark(qs, &qs->mode_shell_table, base, p - base);
+        if (p - base == 3 && !memcmp(base, "env", 3)) {
+            while (*p && *p != '\n') {
+                for (; qe_isblank(*p); p++)
+                    continue;
+                base = p;
+                for (; *p && !qe_isspace(*p); p++)
+                    continue;
+                if (*base != '-') {
+                    qe_mode_index_mark(qs, &qs->mode_shell_table, base, p - base);
+                    break;
+                }
+            }
+        }
+    }
+}
+
+#ifndef CONFIG_TINY
+static void qe_mode_index_free(SymbolTable *st) {
+    int i;
+
+    for (i = 0; i < st->nb_allocated; i++) {
+        if (st->entries[i].name) {
+            struct ModeIndexLink *p = st->entries[i].value;
+            while (p) {
+                struct ModeIndexLink *next = p->next;
+                qe_free(&p);
+                p = next;
+            }
+        }
+    }
+    symbol_table_free(st);
+}
+#endif
+
 ModeDef *qe_find_mode_filename(QEmacsState *qs, const char *filename, int flags)
 {
     ModeDef *m;
 
+    if (!qs->mode_index_failed) {
+        qe_mode_index_lookup(qs, filename, NULL);
+        for (m = qs->first_mode; m; m = m->next) {
+            if (m->probe_serial == qs->mode_probe_serial
+            &&  (m->flags & flags) == flags
+            &&  (match_extension(filename, m->extensions)
+            ||   match_filename(filename, m->filenames))) {
+                break;
+            }
+        }
+        return m;
+    }
+
     for (m = qs->first_mode; m; m = m->next) {
         if ((m->flags & flags) == flags) {
             if (match_extension(filename, m->extensions)
@@ -182,6 +370,15 @@ void qe_register_mode(QEmacsState *qs, ModeDef *m, int flags)
             break;
         }
     }
+    /* the first mode registered with a given name wins */
+    if (m->name)
+        symbol_add(&qs->mode_table, m->name, m);
+    if (m->alt_name)
+        symbol_add(&qs->mode_table, m->alt_name, m);
+
+    qe_mode_index_list(qs, &qs->mode_extension_table, m->extensions, m, 1);
+    qe_mode_index_list(qs, &qs->mode_filename_table, m->filenames, m, 0);
+    qe_mode_index_list(qs, &qs->mode_shell_table, m->shell_handlers, m, 1);
 
     m->flags |= flags;
 
@@ -256,10 +453,14 @@ void qe_register_mode(QEmacsState *qs, ModeDef *m, int flags)
         /* register allocated command */
         qe_register_commands(qs, NULL, def, -1);
     }
+    /* mode key bindings are parsed when the mode is first used */
     if (m->bindings) {
-        int i;
-        for (i = 0; m->bindings[i]; i += 2) {
-            qe_register_bindings(qs, &m->first_key, m->bindings[i + 1], m->bindings[i]);
+        if (m->bindings_loaded
+        ||  qe_defer_bindings(&m->pending_bindings, NULL, 0) < 0) {
+            int i;
+            for (i = 0; m->bindings[i]; i += 2) {
+                qe_register_bindings(qs, &m->first_key, m->bindings[i + 1], m->bindings[i]);
+            }
         }
     }
 }
@@ -278,22 +479,14 @@ void mode_complete(CompleteState *cp, CompleteFunc enumerate) {
 static CompletionDef mode_completion = {
     .name = "mode",
     .enumerate = mode_complete,
+    .flags = CF_CACHE_LIST,
 };
 
 /* commands handling */
 
 const CmdDef *qe_find_cmd(QEmacsState *qs, const char *cmd_name)
 {
-    const CmdDef *d;
-    int i, j;
-
-    for (i = 0; i < qs->cmd_array_count; i++) {
-        for (j = qs->cmd_array[i].count, d = qs->cmd_array[i].array; j-- > 0; d++) {
-            if (strequal(cmd_name, d->name))
-                return d;
-        }
-    }
-    return NULL;
+    return symbol_find(&qs->cmd_table, cmd_name);
 }
 
 void command_complete(CompleteState *cp, CompleteFunc enumerate) {
@@ -355,6 +548,7 @@ static CompletionDef command_completion = {
     .enumerate = command_complete,
     .print_entry = command_print_entry,
     .get_entry = command_get_entry,
+    .flags = CF_CACHE_LIST,
 };
 
 /* key binding handling */
@@ -423,6 +617,8 @@ static int qe_register_command_bindings(QEmacsState *qs, KeyDef **lp, const CmdD
     if (!d)
         return -3;
 
+    if (lp != &qs->first_transient_key)
+        qs->bindings_serial++;
     while (p && *p) {
         nb_keys = strtokeys(p, keys, MAX_KEYS, &p);
         res = qe_register_binding(lp, d, keys, nb_keys);
@@ -438,17 +634,55 @@ int qe_register_transient_binding(QEmacsState *qs, const char *cmd_name, const c
     return qe_register_command_bindings(qs, &qs->first_transient_key, qe_find_cmd(qs, cmd_name), keys);
 }
 
-static void qe_unregister_bindings(KeyDef **lp, const char *keystr) {
+static void qe_unregister_bindings(QEmacsState *qs, KeyDef **lp, const char *keystr) {
     unsigned int keys[MAX_KEYS];
     int nb_keys;
     const char *p = keystr;
 
+    qs->bindings_serial++;
     while (p && *p) {
         nb_keys = strtokeys(p, keys, MAX_KEYS, &p);
         qe_unregister_binding(lp, keys, nb_keys);
     }
 }
 
+static void qe_translate_control_h(KeyDef *kd, int set) {
+    int i;
+
+    for (; kd; kd = kd->next) {
+        for (i = 0; i < kd->nb_keys; i++) {
+            switch (kd->keys[i]) {
+            case KEY_CTRL('h'):
+                kd->keys[i] = set ? KEY_META('h') : KEY_DEL;
+                break;
+            case KEY_DEL:
+                if (set)
+                    kd->keys[i] = KEY_CTRL('h');
+                break;
+            case KEY_META('h'):
+                if (!set)
+                    kd->keys[i] = KEY_CTRL('h');
+                break;
+            }
+        }
+    }
+}
+
+static void qe_register_default_bindings(QEmacsState *qs, ModeDef *m,
+                                         const CmdDef *cmds, int len)
+{
+    const CmdDef *d;
+    int i;
+
+    for (d = cmds, i = len; i-- > 0; d++) {
+        const char *p = d->name + strlen(d->name) + 1;
+        if (*p) {
+            KeyDef **lp = m ? &m->first_key : &qs->first_key;
+            qe_register_command_bindings(qs, lp, d, p);
+        }
+    }
+}
+
 /* if mode is non NULL, the defined keys are only active in this mode */
 int qe_register_commands(QEmacsState *qs, ModeDef *m, const CmdDef *cmds, int len)
 {
@@ -481,24 +715,72 @@ int qe_register_commands(QEmacsState *qs, ModeDef *m, const CmdDef *cmds, int le
         qs->cmd_array[i].count = len;
         qs->cmd_array[i].allocated = allocated;
         qs->cmd_array_count++;
-    }
-    /* register default bindings */
-    for (d = cmds, i = len; i-- > 0; d++) {
-        const char *p = d->name + strlen(d->name) + 1;
-        if (*p) {
-            KeyDef **lp = m ? &m->first_key : &qs->first_key;
-            qe_register_command_bindings(qs, lp, d, p);
+        /* the first command registered with a given name wins */
+        for (d = cmds, i = len; i-- > 0; d++) {
+            symbol_add(&qs->cmd_table, d->name, unconst(CmdDef *)d);
         }
     }
+    if (m ? m->bindings_loaded : qs->bindings_loaded) {
+        qe_register_default_bindings(qs, m, cmds, len);
+    } else
+    if (qe_defer_bindings(m ? &m->pending_bindings : &qs->pending_bindings,
+                          cmds, len) < 0) {
+        /* cannot defer: register the bindings now */
+        qe_register_default_bindings(qs, m, cmds, len);
+    }
     return 0;
 }
 
+static void qe_load_pending_bindings(QEmacsState *qs, ModeDef *m) {
+    struct ModeBindings **pp = m ? &m->pending_bindings : &qs->pending_bindings;
+    KeyDef **lp = m ? &m->first_key : &qs->first_key;
+    struct ModeBindings *p;
+    int i;
+
+    if (m)
+        m->bindings_loaded = 1;
+    else
+        qs->bindings_loaded = 1;
+
+    while ((p = *pp) != NULL) {
+        *pp = p->next;
+        if (p->cmds) {
+            qe_register_default_bindings(qs, m, p->cmds, p->len);
+        } else
+        if (m && m->bindings) {
+            for (i = 0; m->bindings[i]; i += 2) {
+                qe_register_bindings(qs, lp, m->bindings[i + 1], m->bindings[i]);
+            }
+        }
+        qe_free(&p);
+    }
+    /* the binding list was empty: apply the backspace translation */
+    if (qs->backspace_is_control_h)
+        qe_translate_control_h(*lp, 1);
+}
+
+/* register the bindings deferred at registration time for mode `m`,
+ * its fallback modes and the global bindings.
+ */
+void qe_load_mode_bindings(QEmacsState *qs, ModeDef *m)
+{
+    for (; m; m = m->fallback) {
+        if (!m->bindings_loaded)
+            qe_load_pending_bindings(qs, m);
+    }
+    if (!qs->bindings_loaded)
+        qe_load_pending_bindings(qs, NULL);
+}
+
 void do_set_key(EditState *s, const char *keystr,
                 const char *cmd_name, int local)
 {
     QEmacsState *qs = s->qs;
     KeyDef **lp = local ? &s->mode->first_key : &qs->first_key;
-    int res = qe_register_bindings(qs, lp, cmd_name, keystr);
+    int res;
+
+    qe_load_mode_bindings(qs, local ? s->mode : NULL);
+    res = qe_register_bindings(qs, lp, cmd_name, keystr);
     if (res == -2)
         put_error(s, "Invalid keys: %s", keystr);
     if (res == -1)
@@ -507,14 +789,13 @@ void do_set_key(EditState *s, const char *keystr,
 
 void do_unset_key(EditState *s, const char *keystr, int local) {
     KeyDef **lp = local ? &s->mode->first_key : &s->qs->first_key;
-    qe_unregister_bindings(lp, keystr);
+    qe_load_mode_bindings(s->qs, local ? s->mode : NULL);
+    qe_unregister_bindings(s->qs, lp, keystr);
 }
 
 void qe_toggle_control_h(QEmacsState *qs, int set)
 {
     ModeDef *m;
-    KeyDef *kd;
-    int i;
 
     if (set)
         set = (set > 0);
@@ -525,28 +806,13 @@ void qe_toggle_control_h(QEmacsState *qs, int set)
         return;
 
     qs->backspace_is_control_h = set;
+    qs->bindings_serial++;
 
     /* CG: This hack in incompatible with support for multiple
      * concurrent input consoles.
      */
     for (m = qs->first_mode;; m = m->next) {
-        for (kd = m ? m->first_key : qs->first_key; kd; kd = kd->next) {
-            for (i = 0; i < kd->nb_keys; i++) {
-                switch (kd->keys[i]) {
-                case KEY_CTRL('h'):
-                    kd->keys[i] = set ? KEY_META('h') : KEY_DEL;
-                    break;
-                case KEY_DEL:
-                    if (set)
-                        kd->keys[i] = KEY_CTRL('h');
-                    break;
-                case KEY_META('h'):
-                    if (!set)
-                        kd->keys[i] = KEY_CTRL('h');
-                    break;
-                }
-            }
-        }
+        qe_translate_control_h(m ? m->first_key : qs->first_key, set);
         if (!m)
             break;
     }
@@ -608,14 +874,16 @@ static void qe_register_emulation_bindings(QEmacsState *qs, const char * const *
     int i;
     for (i = 0; pp[i]; i += 3) {
         KeyDef **lp = &qs->first_key;
+        ModeDef *mode = NULL;
         if (pp[i + 2]) {
-            ModeDef *mode = qe_find_mode(qs, pp[i + 2], 0);
+            mode = qe_find_mode(qs, pp[i + 2], 0);
             if (!mode)
                 continue;
             lp = &mode->first_key;
         }
+        qe_load_mode_bindings(qs, mode);
         // XXX should only unregister custom bindings
-        qe_unregister_bindings(lp, pp[i]);
+        qe_unregister_bindings(qs, lp, pp[i]);
         if (pp[i + 1])
             qe_register_bindings(qs, lp, pp[i + 1], pp[i]);
     }
@@ -677,6 +945,7 @@ static void trace_complete(CompleteState *cp, CompleteFunc enumerate) {
 static CompletionDef trace_completion = {
     .name = "trace",
     .enumerate = trace_complete,
+    .flags = CF_CACHE_LIST,
 };
 
 void do_set_trace_flags(EditState *s, int flags) {
@@ -847,6 +1116,7 @@ static CompletionDef color_name_completion = {
     color_print_entry,
 #endif
     .sort_func = color_sort_func,
+    .flags = CF_CACHE_LIST,
 };
 
 static CompletionDef color_completion = {
@@ -2003,8 +2273,9 @@ void text_write_char(EditState *s, int key)
         if (s->compose_len == 0)
             s->compose_start_offset = s->offset;
 
-        /* break sequence of insertions */
-        if (key == '\n' || (key != ' ' && s->b->last_log_char == ' ')) {
+        /* break sequence of insertions, except in keyboard macros */
+        if ((key == '\n' || (key != ' ' && s->b->last_log_char == ' '))
+        &&  s->qs->macro_key_index < 0) {
             s->b->last_log = LOGOP_FREE;
         }
         s->b->last_log_char = key;
@@ -2712,7 +2983,7 @@ static int reload_buffer(EditState *s, EditBuffer *b, int reload)
     else
         ret = -1;
 
-    b->file_ignore = 0;
+    b->file_ignore--;
     b->modified = 0;
     b->save_log = saved;
 
@@ -2732,6 +3003,8 @@ static int reload_buffer(EditState *s, EditBuffer *b, int reload)
             b->file_mtime = st.st_mtime;
             b->file_size = st.st_size;
         }
+        if (b->data_type == &raw_data_type)
+            eb_watch_file(b);
         return ret;
     }
 }
@@ -3536,6 +3809,8 @@ void text_mode_line(EditState *s, buf_t *out)
     tag = eb_find_property(s->b, 0, s->offset, QE_PROP_TAG, NULL);
     if (tag)
         buf_printf(out, "--%s", (char*)tag->data);
+    if (s->isearch_state)
+        isearch_mode_line(s, out);
 #if 0
     buf_printf(out, "--[%d]", s->y_disp);
 #endif
@@ -3764,6 +4039,7 @@ static CompletionDef style_name_completion = {
 #ifndef CONFIG_TINY
     .print_entry = style_print_entry,
 #endif
+    .flags = CF_CACHE_LIST,
 };
 
 static CompletionDef style_completion = {
@@ -3805,6 +4081,7 @@ void style_property_complete(CompleteState *cp, CompleteFunc enumerate) {
 static CompletionDef style_property_completion = {
     .name = "style-property",
     .enumerate = style_property_complete,
+    .flags = CF_CACHE_LIST,
 };
 
 int find_style_property(const char *name)
@@ -5158,7 +5435,14 @@ int get_colorized_line(QEColorizeContext *cp,
 
 #ifndef CONFIG_TINY
     if (cp->s->colorize_mode) {
-        len = syntax_get_colorized_line(cp, offset, offsetp, line_num);
+        QEPerfStats *ps = &cp->s->qs->perf;
+        if (ps->in_display) {
+            int start_time = get_clock_usec();
+            len = syntax_get_colorized_line(cp, offset, offsetp, line_num);
+            ps->colorize_time += get_clock_usec() - start_time;
+        } else {
+            len = syntax_get_colorized_line(cp, offset, offsetp, line_num);
+        }
     } else
 #endif
     if (cp->b->b_styles) {
@@ -5566,6 +5850,116 @@ static void generic_text_display(EditState *s)
 #endif
 }
 
+#ifdef CONFIG_TINY
+#define qe_perf_command(qs, d, usec, allocs)  ((void)(usec), (void)(allocs))
+#define qe_perf_free(qs)
+#else
+/*---------------- performance counters ----------------*/
+
+void qe_perf_add(QEPerfHist *h, int usec)
+{
+    int k, bucket;
+
+    if (usec < 16) {
+        bucket = max_int(usec, 0);
+    } else {
+        for (k = 4; usec >> (k + 1); k++)
+            continue;
+        bucket = 16 + (k - 4) * 4 + ((usec >> (k - 2)) & 3);
+    }
+    h->buckets[bucket]++;
+    h->count++;
+    h->total += usec;
+    if (h->max < usec)
+        h->max = usec;
+}
+
+static void qe_perf_command(QEmacsState *qs, const CmdDef *d, int usec,
+                            unsigned long long allocs)
+{
+    QEPerfStats *ps = &qs->perf;
+    QEPerfCommand *pc;
+
+    pc = symbol_find(&ps->cmd_table, d->name);
+    if (!pc) {
+        pc = qe_mallocz_hack(QEPerfCommand, strlen(d->name));
+        if (!pc)
+            return;
+        strcpy(pc->name, d->name);
+        if (symbol_add(&ps->cmd_table, pc->name, pc) <= 0) {
+            qe_free(&pc);
+            return;
+        }
+    }
+    qe_perf_add(&pc->hist, usec);
+    pc->allocs += allocs;
+    if (!ps->cmd_depth) {
+        qe_perf_add(&ps->commands, usec);
+        ps->command_allocs += allocs;
+    }
+}
+
+static void qe_perf_free(QEmacsState *qs)
+{
+    SymbolTable *st = &qs->perf.cmd_table;
+    int i;
+
+    for (i = 0; i < st->nb_allocated; i++) {
+        QEPerfCommand *pc = st->entries[i].value;
+        if (st->entries[i].name)
+            qe_free(&pc);
+    }
+    symbol_table_free(st);
+}
+
+void qe_perf_reset(QEmacsState *qs)
+{
+    QEPerfStats *ps = &qs->perf;
+    QEPerfStats state = *ps;
+
+    /* only clear the statistics: reset-perf-counters itself runs inside
+       a command and a keystroke may still be waiting to be painted */
+    qe_perf_free(qs);
+    memset(ps, 0, sizeof(*ps));
+    ps->key_pending = state.key_pending;
+    ps->key_time = state.key_time;
+    ps->cmd_depth = state.cmd_depth;
+    ps->in_display = state.in_display;
+    ps->colorize_time = state.colorize_time;
+    ps->reset_time = get_clock_ms();
+}
+#endif
+
+/* Keyboard macros are compiled while they are first replayed: each
+ * command dispatched from the macro keys is recorded with its prefix
+ * argument and the arguments read from the minibuffer.  Subsequent
+ * replays dispatch the recorded steps without going through key
+ * lookup and minibuffer editing.
+ */
+typedef struct MacroStep {
+    const CmdDef *d;
+    ModeDef *mode;      /* mode the keys were resolved in */
+    int argval;
+    int key;
+    int key_start;      /* index of the first key of the command */
+    int nb_inputs;
+    unsigned int default_mask;  /* inputs left empty: use the default */
+    unsigned char input_type[MAX_CMD_ARGS];
+    CmdArg inputs[MAX_CMD_ARGS];   /* minibuffer input, strings allocated */
+} MacroStep;
+
+enum {
+    MACRO_UNCOMPILED = 0,   /* compile on next replay */
+    MACRO_COMPILING,
+    MACRO_COMPILED,
+    MACRO_KEYS_ONLY,        /* macro must be replayed as keys */
+};
+
+static void qe_macro_compile_fail(QEmacsState *qs) {
+    if (qs->macro_compile_state == MACRO_COMPILING)
+        qs->macro_compile_state = MACRO_KEYS_ONLY;
+}
+
 typedef struct ExecCmdState {
     EditState *s;
     const CmdDef *d;
@@ -5573,6 +5967,12 @@ typedef struct ExecCmdState {
     int has_arg;
     int argval;
     int key;
+    int cmd_argval;             /* argval as dispatched */
+    int compile;                /* record as a compiled macro step */
+    int nb_inputs;              /* arguments read from the minibuffer */
+    unsigned int input_mask;
+    unsigned int default_mask;  /* arguments set from default_input */
+    const MacroStep *step;      /* compiled macro step being replayed */
     const char *ptype;
     unsigned char args_type[MAX_CMD_ARGS];
     CmdArg args[MAX_CMD_ARGS];
@@ -5580,6 +5980,58 @@ typedef struct ExecCmdState {
     QESaveBufferState ss[1];
 } ExecCmdState;
 
+static void qe_macro_add_step(QEmacsState *qs, ExecCmdState *es) {
+    MacroStep *st;
+    int i;
+
+    if (qs->macro_compile_state != MACRO_COMPILING)
+        return;
+    if (qs->nb_macro_steps >= qs->macro_steps_size) {
+        int new_size = qs->macro_steps_size + (qs->macro_steps_size >> 1) + 16;
+        if (!qe_realloc_array(&qs->macro_steps, new_size)) {
+            qe_macro_compile_fail(qs);
+            return;
+        }
+        qs->macro_steps_size = new_size;
+    }
+    st = &qs->macro_steps[qs->nb_macro_steps++];
+    st->d = es->d;
+    st->mode = es->s->mode;
+    st->argval = es->cmd_argval;
+    st->key = es->key;
+    st->key_start = qs->macro_key_start;
+    st->nb_inputs = 0;
+    st->default_mask = 0;
+    for (i = 0; i < es->nb_args; i++) {
+        if (es->input_mask & (1U << i)) {
+            /* the default depends on the context: recompute it on replay */
+            if (es->default_mask & (1U << i))
+                st->default_mask |= 1U << st->nb_inputs;
+            st->input_type[st->nb_inputs] = es->args_type[i];
+            if (es->args_type[i] == CMD_ARG_STRING)
+                st->inputs[st->nb_inputs].p = qe_strdup(es->args[i].p);
+            else
+                st->inputs[st->nb_inputs].n = es->args[i].n;
+            st->nb_inputs++;
+        }
+    }
+}
+
+static void qe_free_macro_steps(QEmacsState *qs) {
+    int i, j;
+
+    for (i = 0; i < qs->nb_macro_steps; i++) {
+        MacroStep *st = &qs->macro_steps[i];
+        for (j = 0; j < st->nb_inputs; j++) {
+            if (st->input_type[j] == CMD_ARG_STRING)
+                qe_free(&st->inputs[j].p);
+        }
+    }
+    qe_free(&qs->macro_steps);
+    qs->nb_macro_steps = qs->macro_steps_size = 0;
+    qs->macro_compile_state = MACRO_UNCOMPILED;
+}
+
 /* Signature based dispatcher.
    So far 144 qemacs commands have these signatures:
    - void (*)(EditState *); (68)
@@ -5805,6 +6257,17 @@ void exec_command(EditState *s, const CmdDef *d, int argval, int key)
     QEmacsState *qs = s->qs;
     ExecCmdState *es;
     const char *argdesc;
+    const MacroStep *step = qs->macro_step;
+    int compile = 0;
+
+    /* only the top level command takes the replayed step */
+    qs->macro_step = NULL;
+    if (qs->macro_compile_state == MACRO_COMPILING
+    &&  !qs->macro_step_depth && !(s->flags & WF_MINIBUF)) {
+        /* compilation fails unless each of these commands is recorded */
+        qs->macro_nb_cmds++;
+        compile = 1;
+    }
 
     if (qs->trace_buffer)
         qe_trace_bytes(qs, d->name, -1, EB_TRACE_COMMAND);
@@ -5846,6 +6309,9 @@ void exec_command(EditState *s, const CmdDef *d, int argval, int key)
         es->argval = argval;
     }
     es->key = key;
+    es->cmd_argval = argval;
+    es->compile = compile;
+    es->step = step;
     es->nb_args = 0;
 
     /* first argument is always the window */
@@ -5927,6 +6393,40 @@ static void cmd_save_buffer_confirm_cb(void *opaque, char *reply, CompletionDef
     qe_free(&reply);
 }
 
+/* compute the defaults for argument `cas` of the command: the string
+   used if the user enters an empty string is stored to es->default_input
+   and the initial minibuffer contents to `def_input` if not NULL. */
+static void get_default_input(ExecCmdState *es, const CmdArgSpec *cas,
+                              StringArray *hist, char *def_input, int size)
+{
+    EditState *s = es->s;
+    char buf[1024];
+
+    /* XXX: currently, default input is handled non generically */
+    /* XXX: should use completion function for default input? */
+    if (!def_input) {
+        def_input = buf;
+        size = sizeof(buf);
+    }
+    def_input[0] = '\0';
+    es->default_input[0] = '\0';
+    if (strequal(cas->completion, "file") || strequal(cas->completion, "dir")) {
+        get_default_path(s->b, s->offset, def_input, size);
+    } else
+    if (strequal(cas->completion, "buffer")) {
+        EditBuffer *b;
+        if (es->d->action.ESs == do_switch_to_buffer)
+            b = predict_switch_to_buffer(s);
+        else
+            b = s->b;
+        pstrcpy(es->default_input, sizeof(es->default_input), b->name);
+    } else
+    if (strequal(cas->history, "macrokeys")) {
+        if (hist && hist->nb_items)
+            pstrcpy(def_input, size, hist->items[hist->nb_items - 1]->str);
+    }
+}
+
 /* parse as much arguments as possible. ask value to user if possible */
 static void parse_arguments(ExecCmdState *es)
 {
@@ -5937,8 +6437,9 @@ static void parse_arguments(ExecCmdState *es)
     const CmdDef *d = es->d;
     CmdArg *argp;
     CmdArgSpec cas;
-    int ret, rep_count, get_arg, type;
-    int elapsed_time;
+    int ret, rep_count, get_arg, type, nested = 0;
+    int elapsed_time, start_time;
+    unsigned long long allocs;
 
     while ((ret = parse_arg(&es->ptype, &cas)) != 0) {
         if (ret < 0 || es->nb_args >= MAX_CMD_ARGS)
@@ -5985,27 +6486,34 @@ static void parse_arguments(ExecCmdState *es)
         }
         es->nb_args++;
         /* if no argument specified, try to ask it to the user */
+        if (get_arg && cas.prompt[0] != '\0' && es->step) {
+            /* replaying a compiled macro step: use the recorded input */
+            const MacroStep *st = es->step;
+            int i = es->nb_inputs;
+
+            if (i >= st->nb_inputs || st->input_type[i] != type) {
+                qe_stop_macro(qs);
+                goto fail;
+            }
+            if (st->default_mask & (1U << i)) {
+                get_default_input(es, &cas, NULL, NULL, 0);
+                argp->p = qe_strdup(es->default_input);
+            } else
+            if (type == CMD_ARG_STRING)
+                argp->p = qe_strdup(st->inputs[i].p);
+            else
+                argp->n = st->inputs[i].n;
+            es->nb_inputs++;
+            continue;
+        }
         if (get_arg && cas.prompt[0] != '\0') {
             char def_input[1024];
             StringArray *hist = qe_get_history(qs, cas.history);
-            /* XXX: currently, default input is handled non generically */
-            /* XXX: should use completion function for default input? */
-            def_input[0] = '\0';
-            es->default_input[0] = '\0';
-            if (strequal(cas.completion, "file") || strequal(cas.completion, "dir")) {
-                get_default_path(s->b, s->offset, def_input, sizeof(def_input));
-            } else
-            if (strequal(cas.completion, "buffer")) {
-                EditBuffer *b;
-                if (d->action.ESs == do_switch_to_buffer)
-                    b = predict_switch_to_buffer(s);
-                else
-                    b = s->b;
-                pstrcpy(es->default_input, sizeof(es->default_input), b->name);
-            } else
-            if (strequal(cas.history, "macrokeys")) {
-                if (hist && hist->nb_items)
-                    pstrcpy(def_input, sizeof(def_input), hist->items[hist->nb_items - 1]->str);
+            get_default_input(es, &cas, hist, def_input, sizeof(def_input));
+            if (def_input[0] != '\0' && es->compile) {
+                /* the initial minibuffer contents depend on the context
+                   and may be edited by the macro keys: replay the keys */
+                qe_macro_compile_fail(qs);
             }
             if (es->default_input[0] != '\0') {
                 pstrcat(cas.prompt, sizeof(cas.prompt), "(default ");
@@ -6064,8 +6572,20 @@ static void parse_arguments(ExecCmdState *es)
     }
     // XXX: reset es->argval?
 
+    if (es->compile) {
+        qe_macro_add_step(qs, es);
+        es->compile = 0;
+        nested = 1;
+    }
+    qs->macro_step_depth += nested;
+
     qs->this_cmd_func = d->action.func;
     qs->cmd_start_time = get_clock_ms();
+    start_time = get_clock_usec();
+    allocs = qe_alloc_count_get();
+#ifndef CONFIG_TINY
+    qs->perf.cmd_depth++;
+#endif
 
     while (rep_count --> 0) {
         /* special case for hex mode */
@@ -6099,6 +6619,12 @@ static void parse_arguments(ExecCmdState *es)
         /* CG: This doesn't work if the function needs input */
         /* CG: Should test for abort condition */
     }
+    qs->macro_step_depth -= nested;
+#ifndef CONFIG_TINY
+    qs->perf.cmd_depth--;
+#endif
+    qe_perf_command(qs, d, get_clock_usec() - start_time,
+                    qe_alloc_count_get() - allocs);
 
     if (save_buffers_request_flags) {
         es->ss->flags = save_buffers_request_flags;
@@ -6169,15 +6695,19 @@ static void arg_edit_cb(void *opaque, char *str, CompletionDef *completion)
             goto fail;
         }
         es->args[index].n = val;
+        qe_free(&str);
         break;
     case CMD_ARG_STRING:
         if (str[0] == '\0' && es->default_input[0] != '\0') {
             qe_free(&str);
             str = qe_strdup(es->default_input);
+            es->default_mask |= 1U << index;
         }
         es->args[index].p = str; /* will be freed at end of the command */
         break;
     }
+    es->input_mask |= 1U << index;
+    es->nb_inputs++;
     /* now we can parse the following arguments */
     parse_arguments(es);
 }
@@ -6235,11 +6765,21 @@ void qe_display(QEmacsState *qs)
     EditState *s;
     int has_popups, has_minibuf;
     int start_time, elapsed_time;
+#ifndef CONFIG_TINY
+    int perf_start, flush_start;
+    unsigned long long allocs;
+#endif
     int invalidate_popups = qs->complete_refresh;
     static int last_popup_time;
     QEColor term_bg_color, term_fg_color;
 
     start_time = get_clock_ms();
+#ifndef CONFIG_TINY
+    perf_start = get_clock_usec();
+    allocs = qe_alloc_count_get();
+    qs->perf.in_display = 1;
+    qs->perf.colorize_time = 0;
+#endif
 
     if (qs->active_window)
         qs->active_window->b->atime = start_time;
@@ -6342,7 +6882,27 @@ void qe_display(QEmacsState *qs)
         put_status(qs->active_window, "|qe_display: %dms", elapsed_time);
 
     qs->complete_refresh = 0;
+#ifndef CONFIG_TINY
+    flush_start = get_clock_usec();
+    dpy_flush(qs->screen);
+    {
+        QEPerfStats *ps = &qs->perf;
+        int now = get_clock_usec();
+
+        ps->in_display = 0;
+        qe_perf_add(&ps->display, now - perf_start);
+        qe_perf_add(&ps->colorize, ps->colorize_time);
+        qe_perf_add(&ps->layout, flush_start - perf_start - ps->colorize_time);
+        qe_perf_add(&ps->flush, now - flush_start);
+        ps->display_allocs += qe_alloc_count_get() - allocs;
+        if (ps->key_pending) {
+            ps->key_pending = 0;
+            qe_perf_add(&ps->key_to_paint, now - ps->key_time);
+        }
+    }
+#else
     dpy_flush(qs->screen);
+#endif
 }
 
 /*---------------- Keyboard macros ----------------*/
@@ -6356,6 +6916,7 @@ void qe_display(QEmacsState *qs)
  */
 
 static void qe_clear_macro(QEmacsState *qs) {
+    qe_free_macro_steps(qs);
     qe_free(&qs->macro_keys);
     qs->macro_keys_size = 0;
     qs->nb_macro_keys = 0;
@@ -6634,15 +7195,105 @@ void do_end_kbd_macro(EditState *s)
     put_status(s, "Keyboard macro defined");
 }
 
-void do_call_last_kbd_macro(EditState *s, int argval)
-{
-    /*@CMD call-last-kbd-macro
-       ### `call-last-kbd-macro(argval)`
+static int qe_dispatch_command(QEmacsState *qs, EditState *s,
+                               const CmdDef *d, int argval, int key);
 
-       Run the last keyboard macro recorded by `start-kbd-macro`.
-       Repeat `argval` times.
-     */
-    QEmacsState *qs = s->qs;
+/* replay the macro keys from index `start`.
+   Return -1 if the macro was stopped. */
+static int qe_run_macro_keys(QEmacsState *qs, int start)
+{
+    /* CG: should share code with do_execute_macro */
+    for (qs->macro_key_index = start;
+         qs->macro_key_index < qs->nb_macro_keys;
+         qs->macro_key_index++)
+    {
+        qe_key_process(qs, qs->macro_keys[qs->macro_key_index]);
+        if (qs->macro_key_index < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* run the last keyboard macro once, using the compiled steps if
+   available.  Return -1 if the macro was stopped. */
+static int qe_run_macro(QEmacsState *qs)
+{
+    QEKeyContext *c = &qs->key_ctx;
+    EditState *s;
+    int i, ret;
+
+    if (qs->macro_compile_state == MACRO_UNCOMPILED) {
+        /* compile the macro while replaying its keys */
+        qe_free_macro_steps(qs);
+        qs->macro_compile_state = MACRO_COMPILING;
+        qs->macro_nb_cmds = 0;
+        qs->macro_key_start = 0;
+        ret = qe_run_macro_keys(qs, 0);
+        if (ret == 0 && qs->macro_compile_state == MACRO_COMPILING
+        &&  qs->macro_nb_cmds == qs->nb_macro_steps
+        &&  qs->nb_macro_steps > 0 && !c->nb_keys && !c->has_arg) {
+            /* bindings may have been loaded while compiling */
+            qs->macro_bindings_serial = qs->bindings_serial;
+            qs->macro_compile_state = MACRO_COMPILED;
+        } else {
+            /* retry after an abort, fall back to the keys otherwise */
+            int state = (ret < 0) ? MACRO_UNCOMPILED : MACRO_KEYS_ONLY;
+            qe_free_macro_steps(qs);
+            qs->macro_compile_state = state;
+        }
+        return ret;
+    }
+    if (qs->macro_compile_state != MACRO_COMPILED)
+        return qe_run_macro_keys(qs, 0);
+
+    qs->macro_key_index = 0;
+    for (i = 0; i < qs->nb_macro_steps; i++) {
+        const MacroStep *st = &qs->macro_steps[i];
+
+        s = qs->active_window;
+        if (!s || s->mode != st->mode || (s->flags & WF_MINIBUF)
+        ||  s->multi_cursor_active || c->grab_key_cb || c->nb_keys
+        ||  qs->bindings_serial != qs->macro_bindings_serial) {
+            /* the keys may no longer run the same commands */
+            int start = st->key_start;
+            qe_free_macro_steps(qs);
+            qs->macro_compile_state = MACRO_KEYS_ONLY;
+            return qe_run_macro_keys(qs, start);
+        }
+        qs->macro_step = st;
+        ret = qe_dispatch_command(qs, s, st->d, st->argval, st->key);
+        qs->macro_step = NULL;
+        if (ret < 0 || qs->macro_key_index < 0)
+            return -1;
+        if ((qs->active_window && (qs->active_window->flags & WF_MINIBUF))
+        ||  c->grab_key_cb) {
+            /* the command now expects input that the steps do not have */
+            qe_stop_macro(qs);
+            return -1;
+        }
+        if (qs->ungot_key != -1) {
+            int key = qs->ungot_key;
+            qs->ungot_key = -1;
+            qe_key_process(qs, key);
+        }
+    }
+    return 0;
+}
+
+void do_call_last_kbd_macro(EditState *s, int argval)
+{
+    /*@CMD call-last-kbd-macro
+       ### `call-last-kbd-macro(argval)`
+
+       Run the last keyboard macro recorded by `start-kbd-macro`.
+       Repeat `argval` times.
+
+       The first replay compiles the macro to the commands it runs,
+       subsequent replays dispatch these commands directly.  The screen
+       is updated after the last repetition and the number of commands
+       per second is reported for long runs.
+     */
+    QEmacsState *qs = s->qs;
     int set_repeat = (qs->last_key == 'e');
 
     if (qs->defining_macro) {
@@ -6653,22 +7304,23 @@ void do_call_last_kbd_macro(EditState *s, int argval)
     }
 
     if (qs->nb_macro_keys > 0) {
+        int start_time = get_clock_usec();
+        int elapsed;
+
+        qs->macro_cmd_count = 0;
         while (argval-- > 0) {
-            /* CG: should share code with do_execute_macro */
-            for (qs->macro_key_index = 0;
-                 qs->macro_key_index < qs->nb_macro_keys;
-                 qs->macro_key_index++)
-            {
-                int key = qs->macro_keys[qs->macro_key_index];
-                qe_key_process(qs, key);
-                if (qs->macro_key_index < 0) {
-                    // After 0 kbd macro iterations: Keyboard macro terminated by a command ringing the bell
-                    argval = 0;
-                    break;
-                }
+            if (qe_run_macro(qs) < 0) {
+                // After 0 kbd macro iterations: Keyboard macro terminated by a command ringing the bell
+                break;
             }
         }
         qs->macro_key_index = -1;
+        elapsed = get_clock_usec() - start_time;
+        if (elapsed >= 100000) {
+            put_status(s, "Keyboard macro: %d commands in %d ms, %lld commands/s",
+                       qs->macro_cmd_count, elapsed / 1000,
+                       qs->macro_cmd_count * 1000000LL / elapsed);
+        }
         qe_free_bindings(&qs->first_transient_key);
         if (set_repeat)
             qe_register_transient_binding(qs, "call-last-kbd-macro", "e");
@@ -6958,6 +7610,8 @@ void qe_grab_keys(QEmacsState *qs, void (*cb)(QEmacsState *qs, void *opaque, int
 {
     QEKeyContext *c = &qs->key_ctx;
 
+    /* keys grabbed during the replay cannot be compiled */
+    qe_macro_compile_fail(qs);
     /* CG: Should free previous grab? */
     /* CG: Should grabing be window dependent ? */
     c->grab_key_cb = cb;
@@ -7011,6 +7665,162 @@ KeyDef *qe_find_binding(unsigned int *keys, int nb_keys, KeyDef *kd, int exact)
     return kd;
 }
 
+/* Compiled key bindings: the binding lists of a mode, of its fallback
+ * modes and the global bindings are merged into a trie of key
+ * sequences. Each node caches the result of the linear lookup for its
+ * sequence, so a key sequence is resolved with one binary search per
+ * key. The tries are rebuilt lazily when qs->bindings_serial changes.
+ */
+typedef struct KeyTrieNode {
+    unsigned int key;
+    int first_child;    /* children are contiguous, sorted by key */
+    int nb_children;
+    KeyDef *kd;         /* first binding starting with this sequence */
+    KeyDef *kd_exact;   /* first binding for exactly this sequence */
+} KeyTrieNode;
+
+struct KeyTrie {
+    int serial;
+    int nb_nodes;
+    KeyTrieNode nodes[1];   /* nodes[0] is the root */
+};
+
+typedef struct KeyTrieEntry {
+    KeyDef *kd;
+    int prio;           /* position in the linear lookup order */
+} KeyTrieEntry;
+
+static void qe_free_key_trie(struct KeyTrie **tp) {
+    qe_free(tp);
+}
+
+static int key_trie_entry_cmp(const void *p1, const void *p2) {
+    const KeyTrieEntry *e1 = p1;
+    const KeyTrieEntry *e2 = p2;
+    int i, n = min_int(e1->kd->nb_keys, e2->kd->nb_keys);
+
+    for (i = 0; i < n; i++) {
+        if (e1->kd->keys[i] != e2->kd->keys[i])
+            return (e1->kd->keys[i] < e2->kd->keys[i]) ? -1 : 1;
+    }
+    /* shorter sequences first, then in lookup order */
+    if (e1->kd->nb_keys != e2->kd->nb_keys)
+        return e1->kd->nb_keys - e2->kd->nb_keys;
+    return e1->prio - e2->prio;
+}
+
+/* build the children of `node` from the sorted entries [lo, hi) that
+   share the same first `depth` keys */
+static void key_trie_build(struct KeyTrie *t, int node,
+                           const KeyTrieEntry *tab, int lo, int hi, int depth)
+{
+    int i, j, k, n, child;
+
+    /* skip the bindings for the node sequence itself */
+    while (lo < hi && tab[lo].kd->nb_keys == depth)
+        lo++;
+
+    for (n = 0, i = lo; i < hi; n++) {
+        for (j = i + 1; j < hi && tab[j].kd->keys[depth] == tab[i].kd->keys[depth]; j++)
+            continue;
+        i = j;
+    }
+    child = t->nb_nodes;
+    t->nodes[node].first_child = child;
+    t->nodes[node].nb_children = n;
+    t->nb_nodes += n;
+
+    for (i = lo; i < hi; i = j, child++) {
+        KeyTrieNode *p = &t->nodes[child];
+        p->key = tab[i].kd->keys[depth];
+        p->first_child = p->nb_children = 0;
+        /* exact bindings sort first, by lookup order */
+        p->kd_exact = (tab[i].kd->nb_keys == depth + 1) ? tab[i].kd : NULL;
+        k = i;
+        for (j = i + 1; j < hi && tab[j].kd->keys[depth] == p->key; j++) {
+            if (tab[j].prio < tab[k].prio)
+                k = j;
+        }
+        p->kd = tab[k].kd;
+        key_trie_build(t, child, tab, i, j, depth + 1);
+    }
+}
+
+static struct KeyTrie *qe_compile_bindings(QEmacsState *qs, ModeDef *m0) {
+    struct KeyTrie **tp = m0 ? &m0->key_trie : &qs->key_trie;
+    struct KeyTrie *t = *tp;
+    KeyTrieEntry *tab;
+    ModeDef *m;
+    KeyDef *kd;
+    int n, nb_nodes;
+
+    if (t && t->serial == qs->bindings_serial)
+        return t;
+
+    qe_free_key_trie(tp);
+    n = 0;
+    nb_nodes = 1;
+    for (m = m0;; m = m->fallback) {
+        for (kd = m ? m->first_key : qs->first_key; kd; kd = kd->next) {
+            nb_nodes += kd->nb_keys;
+            n++;
+        }
+        if (!m)
+            break;
+    }
+    tab = qe_malloc_array(KeyTrieEntry, n + 1);
+    if (!tab)
+        return NULL;
+    /* collect bindings in the order of the linear lookup */
+    n = 0;
+    for (m = m0;; m = m->fallback) {
+        for (kd = m ? m->first_key : qs->first_key; kd; kd = kd->next) {
+            tab[n].kd = kd;
+            tab[n].prio = n;
+            n++;
+        }
+        if (!m)
+            break;
+    }
+    qsort(tab, n, sizeof(*tab), key_trie_entry_cmp);
+
+    t = qe_malloc_hack(struct KeyTrie, (nb_nodes - 1) * sizeof(t->nodes[0]));
+    if (t) {
+        t->serial = qs->bindings_serial;
+        t->nb_nodes = 1;
+        t->nodes[0].key = 0;
+        t->nodes[0].kd = t->nodes[0].kd_exact = NULL;
+        key_trie_build(t, 0, tab, 0, n, 0);
+        *tp = t;
+    }
+    qe_free(&tab);
+    return t;
+}
+
+static KeyDef *qe_find_compiled_binding(struct KeyTrie *t, unsigned int *keys,
+                                        int nb_keys, int exact)
+{
+    const KeyTrieNode *node = &t->nodes[0];
+    int i, lo, hi, mid;
+
+    for (i = 0; i < nb_keys; i++) {
+        lo = node->first_child;
+        hi = lo + node->nb_children;
+        while (lo < hi) {
+            mid = (lo + hi) >> 1;
+            if (t->nodes[mid].key < keys[i])
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo == node->first_child + node->nb_children
+        ||  t->nodes[lo].key != keys[i])
+            return NULL;
+        node = &t->nodes[lo];
+    }
+    return exact ? node->kd_exact : node->kd;
+}
+
 KeyDef *qe_find_current_binding(QEmacsState *qs, unsigned int *keys, int nb_keys, ModeDef *m, int exact)
 {
     KeyDef *kd;
@@ -7023,6 +7833,15 @@ KeyDef *qe_find_current_binding(QEmacsState *qs, unsigned int *keys, int nb_keys
         qe_free_bindings(&qs->first_transient_key);
     }
 
+    qe_load_mode_bindings(qs, m);
+
+    if (exact >= 0 && nb_keys > 0) {
+        /* fall back to the linear lookup if compilation fails */
+        struct KeyTrie *t = qe_compile_bindings(qs, m);
+        if (t)
+            return qe_find_compiled_binding(t, keys, nb_keys, exact);
+    }
+
     for (; m; m = m->fallback) {
         kd = qe_find_binding(keys, nb_keys, m->first_key, exact);
         if (kd != NULL)
@@ -7031,6 +7850,90 @@ KeyDef *qe_find_current_binding(QEmacsState *qs, unsigned int *keys, int nb_keys
     return qe_find_binding(keys, nb_keys, qs->first_key, exact);
 }
 
+/* dispatch command `d` bound to `key` in window `s`.
+   Return -1 if no window is left. */
+static int qe_dispatch_command(QEmacsState *qs, EditState *s,
+                               const CmdDef *d, int argval, int key)
+{
+    int multi_cursor_active = s->multi_cursor_active;
+    EditBuffer *this_buffer = s->b;
+
+    if (d->action.ESi != do_repeat) {
+        qs->last_cmd = d;
+        qs->last_argval = argval;
+        qs->last_key = key;
+    }
+    if (qs->macro_key_index >= 0) {
+        qs->macro_cmd_count++;
+        if (multi_cursor_active)
+            qe_macro_compile_fail(qs);
+    }
+    exec_command(s, d, argval, key);
+    if (s != qs->active_window || s->b != this_buffer) {
+        if (!qs->active_window && !(qs->active_window = qs->first_window)) {
+            /* no window left: nothing further to do */
+            return -1;
+        }
+        if (qe_check_window(qs, &s)) {
+            /* end multi-cursor session upon window or buffer change */
+            s->multi_cursor_active = 0;
+        }
+        s = qs->active_window;
+        if (!(s->flags & (WF_MINIBUF | WF_POPUP))) {
+            /* update active window flag */
+            EditState *e;
+            for (e = qs->first_window; e; e = e->next_window) {
+                if (e->flags & WF_ACTIVE) {
+                    e->flags &= ~WF_ACTIVE;
+                    e->borders_invalid = 1;
+                }
+            }
+            s->flags |= WF_ACTIVE;
+            s->borders_invalid = 1;
+        }
+        if (!qs->key_ctx.grab_key_cb) {
+            qe_check_buffer_file(s->b, CBF_CHECK);
+        }
+    } else
+    if (multi_cursor_active) {
+        // dispatch the command to all cursors if multi_cursor was already active
+        int i;
+        s->multi_cursor[0].offset = s->offset;
+        for (i = 1; s->multi_cursor_active && i < s->multi_cursor_len; i++) {
+            swap_int(&s->b->mark, &s->multi_cursor[i].mark);
+            swap_int(&s->offset, &s->multi_cursor[i].offset);
+            s->multi_cursor_cur = i;
+            /* prevent append-next-kill */
+            if (s->qs->last_cmd_func == (CmdFunc)do_append_next_kill)
+                qs->last_cmd_func = NULL;
+            exec_command(s, d, argval, key);
+            if (!qe_check_window(qs, &s))
+                break;
+            s->multi_cursor_cur = 0;
+            swap_int(&s->b->mark, &s->multi_cursor[i].mark);
+            swap_int(&s->offset, &s->multi_cursor[i].offset);
+            if (s != qs->active_window) {
+                // TODO: notify user?
+                s->multi_cursor_active = 0;
+            }
+        }
+    }
+    if (qs->macro_key_index >= 0) {
+        /* macros defer redisplay: keep the window start close to the
+           cursor so display based motions do not scan from a stale
+           position */
+        CursorContext cm;
+
+        s = qs->active_window;
+        if (s->offset < s->offset_top
+        ||  (get_cursor_pos(s, &cm), cm.xc == NO_CURSOR || cm.yc >= s->height)) {
+            s->offset_top = s->mode->backward_offset(s, s->offset);
+            s->y_disp = 0;
+        }
+    }
+    return 0;
+}
+
 static void qe_key_process(QEmacsState *qs, int key)
 {
     QEKeyContext *c = &qs->key_ctx;
@@ -7065,6 +7968,12 @@ static void qe_key_process(QEmacsState *qs, int key)
         return;
     }
 
+    if (qs->macro_compile_state == MACRO_COMPILING
+    &&  c->nb_keys == 0 && !c->has_arg && !qs->macro_step_depth
+    &&  qs->active_window && !(qs->active_window->flags & WF_MINIBUF)) {
+        /* a new command starts: keep its first key for the fallback */
+        qs->macro_key_start = qs->macro_key_index;
+    }
     c->keys[c->nb_keys++] = key;
     s = qs->active_window;
     if (s == NULL) {
@@ -7162,8 +8071,6 @@ static void qe_key_process(QEmacsState *qs, int key)
             goto next;
         } else {
             int argval = c->argval;
-            int multi_cursor_active = s->multi_cursor_active;
-            EditBuffer *this_buffer = s->b;
 
             if (c->has_arg & HAS_ARG_NEGATIVE)
                 argval = -argval;
@@ -7177,70 +8084,19 @@ static void qe_key_process(QEmacsState *qs, int key)
              * dispatching the command
              */
             qe_key_init(c);
-            if (d->action.ESi != do_repeat) {
-                qs->last_cmd = d;
-                qs->last_argval = argval;
-                qs->last_key = key;
-            }
-            exec_command(s, d, argval, key);
-            if (s != qs->active_window || s->b != this_buffer) {
-                if (!qs->active_window && !(qs->active_window = qs->first_window)) {
-                    /* no window left: nothing further to do */
-                    return;
-                }
-                if (qe_check_window(qs, &s)) {
-                    /* end multi-cursor session upon window or buffer change */
-                    s->multi_cursor_active = 0;
-                }
-                s = qs->active_window;
-                if (!(s->flags & (WF_MINIBUF | WF_POPUP))) {
-                    /* update active window flag */
-                    EditState *e;
-                    for (e = qs->first_window; e; e = e->next_window) {
-                        if (e->flags & WF_ACTIVE) {
-                            e->flags &= ~WF_ACTIVE;
-                            e->borders_invalid = 1;
-                        }
-                    }
-                    s->flags |= WF_ACTIVE;
-                    s->borders_invalid = 1;
-                }
-                if (!qs->key_ctx.grab_key_cb) {
-                    qe_check_buffer_file(s->b, CBF_CHECK);
-                }
-            } else
-            if (multi_cursor_active) {
-                // dispatch the command to all cursors if multi_cursor was already active
-                int i;
-                s->multi_cursor[0].offset = s->offset;
-                for (i = 1; s->multi_cursor_active && i < s->multi_cursor_len; i++) {
-                    swap_int(&s->b->mark, &s->multi_cursor[i].mark);
-                    swap_int(&s->offset, &s->multi_cursor[i].offset);
-                    s->multi_cursor_cur = i;
-                    /* prevent append-next-kill */
-                    if (s->qs->last_cmd_func == (CmdFunc)do_append_next_kill)
-                        qs->last_cmd_func = NULL;
-                    exec_command(s, d, argval, key);
-                    if (!qe_check_window(qs, &s))
-                        break;
-                    s->multi_cursor_cur = 0;
-                    swap_int(&s->b->mark, &s->multi_cursor[i].mark);
-                    swap_int(&s->offset, &s->multi_cursor[i].offset);
-                    if (s != qs->active_window) {
-                        // TODO: notify user?
-                        s->multi_cursor_active = 0;
-                    }
-                }
-            }
+            if (qe_dispatch_command(qs, s, d, argval, key) < 0)
+                return;
         }
         if (qs->defining_macro) {
             qs->nb_macro_keys_run = qs->nb_macro_keys;
         }
         qe_key_init(c);
-        // XXX: should delay until after macro execution
-        qe_display(qs);
+        /* keyboard macros redisplay after their last command */
+        if (qs->macro_key_index < 0 && !qs->executing_macro)
+            qe_display(qs);
         /* CG: should move ungot key handling to generic event dispatch */
         if (qs->ungot_key != -1) {
+            qe_macro_compile_fail(qs);
             key = qs->ungot_key;
             qs->ungot_key = -1;
             goto again;
@@ -7736,6 +8592,218 @@ static const char *file_completion_ignore_extensions = {
     "|"
 };
 
+/* number of directory listings kept for file completion */
+#define FILE_COMPLETION_DIRS  16
+/* directories read ahead of time by a worker thread: the matching
+   subdirectories, and the sibling directories when the parent directory
+   is not cached yet */
+#define FILE_PREFETCH_DIRS  4
+#define FILE_PREFETCH_MAX   (2 * FILE_PREFETCH_DIRS)
+
+typedef struct FilePrefetch {
+    QEmacsState *qs;    /* NULL if the prefetch was canceled */
+    URLJob *job;
+    int nb_dirs;        /* matching subdirectories to read */
+    int nb_paths;       /* updated by the job with the siblings found */
+    char paths[FILE_PREFETCH_MAX][MAX_FILENAME_SIZE];
+    DirListing *listings[FILE_PREFETCH_MAX];
+    char path[MAX_FILENAME_SIZE];   /* directory being completed */
+    char parent[MAX_FILENAME_SIZE]; /* its parent directory or empty */
+    DirListing *parent_listing;
+} FilePrefetch;
+
+static int file_completion_ignore(const char *base) {
+    int len = strlen(base);
+
+    /* ignore known backup files (hardcoded test for *~) */
+    if (!len || base[len - 1] == '~')
+        return 1;
+    /* ignore known binary file extensions */
+    if (match_extension(base, file_completion_ignore_extensions))
+        return 1;
+    if (*base == '.') {
+        if (strequal(base, ".DS_Store"))
+            return 1;
+    }
+    return 0;
+}
+
+/* called on a worker thread: only reads the file system */
+static void file_prefetch_run(URLJob *job, void *opaque)
+{
+    FilePrefetch *fp = opaque;
+    const StringArray *entries;
+    const StringItem *item;
+    char *dir;
+    int i;
+
+    for (i = 0; i < fp->nb_dirs && !url_job_canceled(job); i++)
+        fp->listings[i] = dir_listing_read(fp->paths[i]);
+    if (!*fp->parent || url_job_canceled(job))
+        return;
+    fp->parent_listing = dir_listing_read(fp->parent);
+    if (!fp->parent_listing)
+        return;
+    /* the user may go up one level and into one of the siblings */
+    entries = dir_listing_entries(fp->parent_listing);
+    for (i = 0; i < entries->nb_items && fp->nb_paths < FILE_PREFETCH_MAX; i++) {
+        item = entries->items[i];
+        if (!(item->group & DL_DIR) || (item->group & DL_LINK)
+        ||  *item->str == '.' || url_job_canceled(job))
+            continue;
+        dir = fp->paths[fp->nb_paths];
+        makepath(dir, MAX_FILENAME_SIZE, fp->parent, item->str);
+        pstrcat(dir, MAX_FILENAME_SIZE, "/");
+        if (strequal(dir, fp->path))
+            continue;
+        if ((fp->listings[fp->nb_paths] = dir_listing_read(dir)) != NULL)
+            fp->nb_paths++;
+    }
+}
+
+static void file_prefetch_done(void *opaque, int canceled)
+{
+    FilePrefetch *fp = opaque;
+    QEmacsState *qs = fp->qs;
+    int i;
+
+    if (qs)
+        qs->file_prefetch = NULL;
+    if (fp->parent_listing) {
+        if (qs && !canceled) {
+            dir_listing_add(&qs->dir_listings, fp->parent_listing,
+                            FILE_COMPLETION_DIRS);
+        } else {
+            dir_listing_free(&fp->parent_listing);
+        }
+    }
+    /* the matching subdirectories are added last, as most recently used */
+    for (i = fp->nb_paths; i-- > 0;) {
+        if (qs && !canceled && fp->listings[i]) {
+            dir_listing_add(&qs->dir_listings, fp->listings[i],
+                            FILE_COMPLETION_DIRS);
+        } else {
+            dir_listing_free(&fp->listings[i]);
+        }
+    }
+    qe_free(&fp);
+}
+
+static void file_prefetch_stop(QEmacsState *qs)
+{
+    FilePrefetch *fp = qs->file_prefetch;
+
+    if (fp) {
+        fp->qs = NULL;
+        url_cancel_job(qs->up, &fp->job);
+        qs->file_prefetch = NULL;
+    }
+}
+
+/* read the directories the user is likely to go to next while the
+   completion popup is displayed: the matching subdirectories `dirs` of
+   directory `path` and the siblings of `path` */
+static void file_prefetch_start(QEmacsState *qs, const char *path,
+                                const StringArray *dirs)
+{
+#ifndef CONFIG_WIN32
+    FilePrefetch *fp, *fp0 = qs->file_prefetch;
+    char buf[MAX_FILENAME_SIZE];
+    int i, j;
+
+    if (dirs->nb_items > FILE_PREFETCH_DIRS)
+        return;
+    fp = qe_mallocz(FilePrefetch);
+    if (!fp)
+        return;
+    fp->qs = qs;
+    for (i = j = 0; i < dirs->nb_items; i++) {
+        if (!dir_listing_cached(qs->dir_listings, dirs->items[i]->str))
+            pstrcpy(fp->paths[j++], MAX_FILENAME_SIZE, dirs->items[i]->str);
+    }
+    fp->nb_dirs = fp->nb_paths = j;
+    pstrcpy(fp->path, sizeof(fp->path), path);
+    pstrcpy(buf, sizeof(buf), path);
+    remove_slash(buf);
+    splitpath(fp->parent, sizeof(fp->parent), NULL, 0, buf);
+    if (strequal(fp->parent, path)
+    ||  dir_listing_cached(qs->dir_listings, fp->parent)) {
+        *fp->parent = '\0';
+    }
+    if (j == 0 && !*fp->parent) {
+        qe_free(&fp);
+        return;
+    }
+    if (fp0 && fp0->nb_dirs == fp->nb_dirs
+    &&  strequal(fp0->path, fp->path) && strequal(fp0->parent, fp->parent)) {
+        /* keep the pending job if it reads the same directories */
+        for (i = 0; i < fp->nb_dirs; i++) {
+            if (!strequal(fp0->paths[i], fp->paths[i]))
+                break;
+        }
+        if (i == fp->nb_dirs) {
+            qe_free(&fp);
+            return;
+        }
+    }
+    file_prefetch_stop(qs);
+    qs->file_prefetch = fp;
+    fp->job = url_submit_job(qs->up, file_prefetch_run, file_prefetch_done, fp);
+    if (!fp->job) {
+        qs->file_prefetch = NULL;
+        qe_free(&fp);
+    }
+#endif
+}
+
+static void file_complete_dir(CompleteState *cp, CompleteFunc enumerate,
+                              const char *path, const char *pattern,
+                              int depth, StringArray *matching_dirs)
+{
+    QEmacsState *qs = cp->s->qs;
+    char filename[MAX_FILENAME_SIZE];
+    StringArray subdirs = NULL_STRINGARRAY;
+    const StringArray *entries;
+    DirListing *dl;
+    int i;
+
+    /* the directory is only read again if it was modified */
+    dl = dir_listing_get(&qs->dir_listings, path, FILE_COMPLETION_DIRS);
+    if (!dl)
+        return;
+    entries = dir_listing_entries(dl);
+    for (i = 0; i < entries->nb_items; i++) {
+        const StringItem *item = entries->items[i];
+        int isdir = item->group & DL_DIR;
+
+        if (isdir && depth > 0 && !(item->group & DL_LINK)) {
+            /* list subdirectories after this one: reading them may
+               evict the current listing from the cache */
+            add_string(&subdirs, item->str, 0);
+            continue;
+        }
+        if (!isdir && (cp->completion->flags & CF_DIRNAME))
+            continue;
+        if (!qe_shell_match(item->str, pattern)
+        ||  file_completion_ignore(item->str))
+            continue;
+        makepath(filename, sizeof(filename), path, item->str);
+        /* add a slash to directories to speed up typing long paths */
+        if (isdir) {
+            pstrcat(filename, sizeof(filename), "/");
+            /* same path as file_complete() will get for the directory */
+            if (matching_dirs)
+                add_string(matching_dirs, filename, 0);
+        }
+        (*enumerate)(cp, filename, CT_SET);
+    }
+    for (i = 0; i < subdirs.nb_items; i++) {
+        makepath(filename, sizeof(filename), path, subdirs.items[i]->str);
+        file_complete_dir(cp, enumerate, filename, pattern, depth - 1, NULL);
+    }
+    free_strings(&subdirs);
+}
+
 void file_complete(CompleteState *cp, CompleteFunc enumerate)
 {
     char path[MAX_FILENAME_SIZE];
@@ -7743,8 +8811,6 @@ void file_complete(CompleteState *cp, CompleteFunc enumerate)
     char filename[MAX_FILENAME_SIZE];
     char *current;
     FindFileState *ffst;
-    const char *base;
-    int len;
 
     current = cp->current;
     if (*current == '\0' || !is_abs_path(current)) {
@@ -7758,42 +8824,24 @@ void file_complete(CompleteState *cp, CompleteFunc enumerate)
     if (cp->completion->flags & CF_RESOURCE) {
         QEmacsState *qs = cp->s->qs;
         ffst = find_file_open(qs->res_path, file, FF_PATH | FF_NOXXDIR);
-    } else {
-        int flags = FF_NOXXDIR;
-        if (cp->completion->flags & CF_DIRNAME)
-            flags |= FF_ONLYDIR;
-        if (cp->fuzzy)
-            flags |= 1;  // recursion level
-        ffst = find_file_open(*path ? path : ".", file, flags);
-    }
-    while (find_file_next(ffst, filename, sizeof(filename)) == 0) {
-        struct stat sb;
-
-        base = get_basename(filename);
-        /* ignore known backup files (hardcoded test for *~) */
-        len = strlen(base);
-        if (!len || base[len - 1] == '~')
-            continue;
-        /* ignore known binary file extensions */
-        if (match_extension(base, file_completion_ignore_extensions))
-            continue;
-        if (*base == '.') {
-            if (strequal(base, ".DS_Store"))
+        while (find_file_next(ffst, filename, sizeof(filename)) == 0) {
+            if (file_completion_ignore(get_basename(filename)))
                 continue;
+            if (is_directory(filename))
+                pstrcat(filename, sizeof(filename), "/");
+            (*enumerate)(cp, filename, CT_SET);
         }
-        /* stat the file to find out if it's a directory.
-         * In this case add a slash to speed up typing long paths
-         */
-        if (!stat(filename, &sb) && S_ISDIR(sb.st_mode))
-            pstrcat(filename, sizeof(filename), "/");
-        if (sb.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH)) {
-            /* XXX: if the file has no extension and is executable,
-             * should check and ignore binary executable files.
-             */
-        }
-        (*enumerate)(cp, filename, CT_SET);
+        find_file_close(&ffst);
+    } else
+    if (cp->fuzzy) {
+        /* the fuzzy stage also lists the subdirectories */
+        file_complete_dir(cp, enumerate, *path ? path : ".", file, 1, NULL);
+    } else {
+        StringArray dirs = NULL_STRINGARRAY;
+        file_complete_dir(cp, enumerate, *path ? path : ".", file, 0, &dirs);
+        file_prefetch_start(cp->s->qs, *path ? path : ".", &dirs);
+        free_strings(&dirs);
     }
-    find_file_close(&ffst);
 }
 
 static CompletionDef file_completion = {
@@ -7883,6 +8931,7 @@ void qe_register_completion(QEmacsState *qs, CompletionDef *cp)
             break;
         }
     }
+    symbol_add(&qs->completion_table, cp->name, cp);
     if (!cp->print_entry)
         cp->print_entry = default_completion_window_print_entry;
     if (!cp->get_entry)
@@ -7893,14 +8942,8 @@ void qe_register_completion(QEmacsState *qs, CompletionDef *cp)
 
 static CompletionDef *qe_find_completion(QEmacsState *qs, const char *name)
 {
-    CompletionDef *p;
-
-    if (name[0] != '\0') {
-        for (p = qs->first_completion; p != NULL; p = p->next) {
-            if (strequal(p->name, name))
-                return p;
-        }
-    }
+    if (name[0] != '\0')
+        return symbol_find(&qs->completion_table, name);
     return NULL;
 }
 
@@ -7916,35 +8959,59 @@ static void complete_start(CompleteState *cp, EditState *s, int start, int end,
                                      cp->current, sizeof(cp->current), 0);
 }
 
-static void complete_test(CompleteState *cp, const char *str, int mode) {
-    int fuzzy = 0;
+/* match groups: exact prefix, prefix ignoring case, then fuzzy matches
+   from best to worst score */
+#define COMPLETION_GROUP_FUZZY  2
+
+static int complete_match(CompleteState *cp, const char *str, int mode) {
+    int score;
 
     switch (mode) {
     case CT_GLOB:
-        if (!strmatch_pat(str, cp->current, 1))
-            return;
+        if (strmatch_pat(str, cp->current, 1))
+            return 0;
         break;
     case CT_IGLOB:
-        if (!utf8_strimatch_pat(str, cp->current, 1))
-            return;
+        if (utf8_strimatch_pat(str, cp->current, 1))
+            return 0;
         break;
     case CT_STRX:
-        if (!strxstart(str, cp->current, NULL))
-            return;
+        if (strxstart(str, cp->current, NULL))
+            return 0;
         break;
     case CT_TEST:
-        if (memcmp(str, cp->current, cp->len)) {
-            if (!qe_memicmp(str, cp->current, cp->len))
-                fuzzy = 1;
-            else
-            if (cp->fuzzy && strmem(str, cp->current, cp->len))
-                fuzzy = 2;
-            else
-                return;
-        }
+        if (!memcmp(str, cp->current, cp->len))
+            return 0;
+        if (!qe_memicmp(str, cp->current, cp->len))
+            return 1;
         break;
+    default:
+        return 0;
     }
-    add_string(&cp->cs, str, fuzzy);
+    if (cp->fuzzy && (score = fuzzy_match(str, cp->current, cp->len)) > 0)
+        return COMPLETION_GROUP_FUZZY + 100 - score;
+    return -1;
+}
+
+static void complete_test(CompleteState *cp, const char *str, int mode) {
+    int group = complete_match(cp, str, mode);
+    if (group >= 0)
+        add_string(&cp->cs, str, group);
+}
+
+static void complete_collect(CompleteState *cp, const char *str, int mode) {
+    /* keep the test mode with the candidate for later filtering */
+    StringItem *item = add_string(&cp->cs, str, 0);
+    if (item)
+        item->opaque = (void *)(intptr_t)mode;
+}
+
+static int complete_cache_sort_func(const void *p1, const void *p2)
+{
+    const StringItem * const *pp1 = (const StringItem * const *)p1;
+    const StringItem * const *pp2 = (const StringItem * const *)p2;
+
+    return qe_strcollate((*pp1)->str, (*pp2)->str);
 }
 
 static void complete_end(CompleteState *cp)
@@ -7968,6 +9035,12 @@ typedef struct MinibufState {
     int completion_count;
     CompletionDef *completion;
     StringArray completion_list;
+    /* CF_CACHE_LIST: candidates enumerated once per session */
+    StringArray completion_cache;
+    StringItem **completion_hits;   /* cached candidates matching pattern */
+    int completion_nb_hits;
+    int completion_fuzzy;
+    char *completion_pattern;
 
     StringArray *history;
     int history_index;
@@ -8002,11 +9075,84 @@ static int match_strings(const char *s1, const char *s2, int len) {
     return len;
 }
 
+static StringItem **complete_cached(MinibufState *mb, CompleteState *cp,
+                                    int *countp)
+{
+    StringArray *cache = &mb->completion_cache;
+    StringItem **items, **hits, **outputs;
+    int i, j, nb_items, count, group, incremental, pos[256 + 1];
+
+    if (!cache->nb_items) {
+        (*mb->completion->enumerate)(cp, complete_collect);
+        *cache = cp->cs;
+        memset(&cp->cs, 0, sizeof(cp->cs));
+        qe_free(&mb->completion_hits);
+        qe_free(&mb->completion_pattern);
+        mb->completion_hits = qe_malloc_array(StringItem *, cache->nb_items + 1);
+        if (!mb->completion_hits)
+            return NULL;
+    }
+    /* if the pattern was extended, only the previous matches can match */
+    incremental = (mb->completion_pattern && mb->completion_fuzzy == cp->fuzzy
+                   && strstart(cp->current, mb->completion_pattern, NULL)
+                   && !strpbrk(mb->completion_pattern, "[\\"));
+    if (incremental) {
+        items = mb->completion_hits;
+        nb_items = mb->completion_nb_hits;
+    } else {
+        items = cache->items;
+        nb_items = cache->nb_items;
+    }
+    hits = mb->completion_hits;
+    for (i = count = 0; i < nb_items; i++) {
+        StringItem *item = items[i];
+        group = complete_match(cp, item->str, (int)(intptr_t)item->opaque);
+        if (group >= 0) {
+            item->group = group;
+            hits[count++] = item;
+        }
+    }
+    if (!incremental && count > 1) {
+        /* keep the matches in collation order without duplicates,
+           filtering preserves this order */
+        qsort(hits, count, sizeof(*hits), complete_cache_sort_func);
+        for (i = j = 1; i < count; i++) {
+            if (strcmp(hits[i]->str, hits[j - 1]->str))
+                hits[j++] = hits[i];
+        }
+        count = j;
+    }
+    mb->completion_nb_hits = count;
+    mb->completion_fuzzy = cp->fuzzy;
+    qe_free(&mb->completion_pattern);
+    mb->completion_pattern = qe_strdup(cp->current);
+
+    outputs = qe_malloc_array(StringItem *, count + 1);
+    if (!outputs)
+        return NULL;
+    if (mb->completion->sort_func == completion_sort_func) {
+        /* a stable distribution on the match group yields the sorted
+           list without further comparisons */
+        memset(pos, 0, sizeof pos);
+        for (i = 0; i < count; i++)
+            pos[(u8)hits[i]->group + 1]++;
+        for (i = 1; i <= 256; i++)
+            pos[i] += pos[i - 1];
+        for (i = 0; i < count; i++)
+            outputs[pos[(u8)hits[i]->group]++] = hits[i];
+    } else {
+        memcpy(outputs, hits, count * sizeof(*outputs));
+        qsort(outputs, count, sizeof(*outputs), mb->completion->sort_func);
+    }
+    *countp = count;
+    return outputs;
+}
+
 void do_minibuffer_complete(EditState *s, int type, int key, int argval) {
     QEmacsState *qs = s->qs;
     int count, i, match_len, start, end;
     CompleteState cs;
-    StringItem **outputs;
+    StringItem **outputs, **cached_outputs = NULL;
     EditState *e;
     EditBuffer *b;
     int w, h, h1, w1;
@@ -8035,13 +9181,16 @@ void do_minibuffer_complete(EditState *s, int type, int key, int argval) {
         mb->completion_stage++;
         if (mb->completion->flags & CF_NO_FUZZY)
             mb->completion_stage = 2;
-    } else {
+    } else
+    if (type != COMPLETION_OTHER) {
+        /* keep the fuzzy stage while filtering the popup list */
         mb->completion_stage = 0;
     }
 
     /* check completion window */
     qe_check_window(s->qs, &mb->completion_popup_window);
-    if (mb->completion_popup_window && mb->completion_stage > 1) {
+    if (mb->completion_popup_window && mb->completion_stage > 1
+    &&  type != COMPLETION_OTHER) {
         /* toggle completion popup on TAB */
         mb->completion_stage = 0;
         qs->this_cmd_func = 0;
@@ -8067,11 +9216,17 @@ void do_minibuffer_complete(EditState *s, int type, int key, int argval) {
     cs.completion = mb->completion;
     if (!(mb->completion->flags & CF_NO_FUZZY))
         cs.fuzzy = mb->completion_stage;
-    (*mb->completion->enumerate)(&cs, complete_test);
-    sort_strings(&cs.cs, mb->completion->sort_func);
-    remove_duplicate_strings(&cs.cs);
-    count = cs.cs.nb_items;
-    outputs = cs.cs.items;
+    if (mb->completion->flags & CF_CACHE_LIST) {
+        count = 0;
+        cached_outputs = complete_cached(mb, &cs, &count);
+        outputs = cached_outputs;
+    } else {
+        (*mb->completion->enumerate)(&cs, complete_test);
+        sort_strings(&cs.cs, mb->completion->sort_func);
+        remove_duplicate_strings(&cs.cs);
+        count = cs.cs.nb_items;
+        outputs = cs.cs.items;
+    }
     mb->completion_count = count;
 #if 0
     printf("count=%d\n", count);
@@ -8081,6 +9236,13 @@ void do_minibuffer_complete(EditState *s, int type, int key, int argval) {
     /* compute the longest match len */
     match_len = cs.len;
 
+    for (i = 0; i < count; i++) {
+        if (outputs[i]->group >= COMPLETION_GROUP_FUZZY)
+            break;
+    }
+    if (i < count && (count > 1 || type == COMPLETION_OTHER)) {
+        /* fuzzy matches do not necessarily extend the input */
+    } else
     if (count > 0) {
         /* find the longest common prefix */
         match_len = strlen(outputs[0]->str);
@@ -8098,7 +9260,6 @@ void do_minibuffer_complete(EditState *s, int type, int key, int argval) {
         // XXX: potential UTF-8 issue?
         // XXX: replace the completed part, not necessarily at the start (use mark?)
         // XXX: should delete region and insert as UTF-8
-        // XXX: should not replace if fuzzy match?
         eb_replace(s->b, cs.start, cs.end - cs.start, outputs[0]->str, match_len);
         s->offset = cs.start + match_len;
         mb->completion_end = s->offset;
@@ -8116,7 +9277,7 @@ void do_minibuffer_complete(EditState *s, int type, int key, int argval) {
                 b = qe_new_buffer(qs, "*completion*",
                                   BF_SYSTEM | BF_UTF8 | BF_TRANSIENT | BF_STYLE_COMP);
                 if (!b)
-                    return;
+                    goto done;
                 b->default_mode = &list_mode;
                 w1 = qs->screen->width;
                 h1 = qs->screen->height - qs->status_height;
@@ -8124,7 +9285,7 @@ void do_minibuffer_complete(EditState *s, int type, int key, int argval) {
                 h = (h1 * 3) / 4;
                 e = qe_new_window(b, (w1 - w) / 2, (h1 - h) / 2, w, h, WF_POPUP);
                 if (!e)
-                    return;
+                    goto done;
                 snprintf(buf, sizeof buf, "Select a %s:", mb->completion->name);
                 e->caption = qe_strdup(buf);
                 e->target_window = s;
@@ -8160,6 +9321,8 @@ void do_minibuffer_complete(EditState *s, int type, int key, int argval) {
             memset(&cs.cs, 0, sizeof(cs.cs));
         }
     }
+  done:
+    qe_free(&cached_outputs);
     complete_end(&cs);
 }
 
@@ -8474,6 +9637,10 @@ void minibuffer_edit(EditState *e, const char *input, const char *prompt,
     EditBuffer *b;
     int len;
 
+    /* only command arguments can be recorded in a compiled macro */
+    if (cb != arg_edit_cb || qs->macro_step_depth)
+        qe_macro_compile_fail(qs);
+
     /* check if already in minibuffer editing */
     if (e->flags & WF_MINIBUF) {
         put_status(e, "|Already editing in minibuffer");
@@ -8542,6 +9709,9 @@ static void minibuffer_mode_free(EditBuffer *b, void *state)
 
     if (qe_check_window(b->qs, &mb->completion_popup_window))
         edit_close(&mb->completion_popup_window);
+    free_strings(&mb->completion_cache);
+    qe_free(&mb->completion_hits);
+    qe_free(&mb->completion_pattern);
 
     cb = mb->cb;
     opaque = mb->opaque;
@@ -9188,7 +10358,7 @@ static int probe_mode(EditState *s, EditBuffer *b,
     char fname[MAX_FILENAME_SIZE];
     ModeDef *m;
     ModeProbeData probe_data;
-    int found_modes;
+    int found_modes, use_index;
     const uint8_t *p;
 
     if (!modes || !scores || nb_modes < 1)
@@ -9256,9 +10426,20 @@ static int probe_mode(EditState *s, EditBuffer *b,
     p = memchr(probe_data.buf, '\n', probe_data.buf_size);
     probe_data.line_len = p ? p - probe_data.buf : probe_data.buf_size;
 
+    /* generic_mode_probe() returns 1 for non matching files: only
+     * call it for the candidate modes found in the mode index.
+     */
+    use_index = (min_score >= 1 && !qs->mode_index_failed);
+    if (use_index)
+        qe_mode_index_lookup(qs, probe_data.filename, cs8(probe_data.buf));
+
     for (m = qs->first_mode; m != NULL; m = m->next) {
         if (m->mode_probe) {
-            int score = m->mode_probe(m, &probe_data);
+            int score;
+            if (use_index && m->mode_probe == generic_mode_probe
+            &&  m->probe_serial != qs->mode_probe_serial)
+                continue;
+            score = m->mode_probe(m, &probe_data);
             if (score > min_score) {
                 int i;
                 /* sort appropriate modes by insertion in modes array */
@@ -9849,6 +11030,11 @@ int qe_check_buffer_file(EditBuffer *b, int mode)
     if (b->data_type && b->data_type != &raw_data_type)
         return CBF_NOT_RAW;
 
+    /* watched files are only checked after a change notification */
+    if (b->file_watch && !b->file_changed && mode != CBF_SAVE)
+        return CBF_SAME;
+    b->file_changed = 0;
+
     if (stat(b->filename, &st) < 0 || !S_ISREG(st.st_mode))
         return CBF_NO_ACCESS;
 
@@ -9910,6 +11096,20 @@ int qe_check_buffer_file(EditBuffer *b, int mode)
         fclose(fp);
     }
     // file contents differs
+    if (mode == CBF_CHECK && qs->auto_revert && !b->modified) {
+        EditState *e = qs->active_window;
+        int nb;
+
+        if (e->b != b && !(e = eb_find_window(b, NULL)))
+            e = qs->active_window;
+        b->file_ignore++;
+        nb = reload_buffer(e, b, TRUE);
+        b->file_ignore--;
+        if (nb < 0)
+            return CBF_OPEN_FAILED;
+        put_status(e, "Reverted buffer from %s", b->filename);
+        return CBF_UPDATED;
+    }
     qe_stop_macro(qs);
 
     // XXX: should open a popup with information and key description
@@ -9931,6 +11131,64 @@ int qe_check_buffer_file(EditBuffer *b, int mode)
     return CBF_PROMPT;
 }
 
+/* Check the buffers whose file changed on disk: the current buffer is
+ * checked right away, other buffers when they are used again, unless
+ * `auto-revert` is set and they are visible and unmodified.
+ */
+static void qe_check_changed_files(void *opaque)
+{
+    QEmacsState *qs = opaque;
+    EditState *s = qs->active_window;
+    EditState *e;
+
+    if (qs->key_ctx.grab_key_cb)
+        return;
+
+    if (s && !(s->flags & (WF_MINIBUF | WF_POPUP)) && s->b->file_changed)
+        qe_check_buffer_file(s->b, CBF_CHECK);
+
+    if (qs->auto_revert && !qs->key_ctx.grab_key_cb) {
+        for (e = qs->first_window; e; e = e->next_window) {
+            if (e->b->file_changed && !e->b->modified)
+                qe_check_buffer_file(e->b, CBF_CHECK);
+        }
+    }
+    qe_display(qs);
+}
+
+static void qe_buffer_file_event(void *opaque, int events, const char *name)
+{
+    EditBuffer *b = opaque;
+    QEmacsState *qs = b->qs;
+
+    if (events & URL_WATCH_GONE) {
+        /* directory is gone: fall back to checking the file every time */
+        url_remove_watch(qs->up, &b->file_watch);
+    } else
+    if (!(events & URL_WATCH_OVERFLOW)
+    &&  !strequal(name, get_basename(b->filename))) {
+        return;
+    }
+    b->file_changed = 1;
+    /* delay the check to coalesce the events of a sequence of writes */
+    if (!qs->file_check_timer)
+        url_set_timer(qs->up, &qs->file_check_timer, 100, qs, qe_check_changed_files);
+}
+
+/* Track changes on disk of the file associated with buffer `b` */
+void eb_watch_file(EditBuffer *b)
+{
+    QEmacsState *qs = b->qs;
+    char dir[MAX_FILENAME_SIZE];
+
+    url_remove_watch(qs->up, &b->file_watch);
+    b->file_changed = 0;
+    if (*b->filename) {
+        get_dirname(dir, sizeof(dir), b->filename);
+        b->file_watch = url_add_watch(qs->up, dir, qe_buffer_file_event, b);
+    }
+}
+
 static void do_suspend_qemacs(EditState *s, int argval)
 {
     QEditScreen *sp = s->screen;
@@ -11241,6 +12499,13 @@ void qe_handle_event(QEmacsState *qs, QEEvent *ev)
             buf_put_byte(out, ' ');
             qe_trace_bytes(qs, buf, out->len, EB_TRACE_KEY);
         }
+#ifndef CONFIG_TINY
+        if (!qs->perf.key_pending) {
+            /* measure latency from the first key not yet displayed */
+            qs->perf.key_pending = 1;
+            qs->perf.key_time = get_clock_usec();
+        }
+#endif
         qe_key_process(qs, ev->key_event.key);
         break;
     case QE_EXPOSE_EVENT:
@@ -11693,6 +12958,8 @@ static CmdLineOptionDef cmd_options[] = {
     CMD_LINE_BOOL("", "free-all", &free_everything,
                   "free all structures upon exit"),
 #endif
+    CMD_LINE_BOOL("", "startup-profile", &startup_profile,
+                  "show the time spent in each startup phase"),
     CMD_LINE_INT("mk", "modify-other-keys", "VAL", &tty_mk,
                  "set the modifyOtherKeys tty configuration (0,1,2)"),
     CMD_LINE_INT("", "clipboard", "VAL", &tty_clipboard,
@@ -12426,8 +13693,78 @@ static void qe_load_all_modules(QEmacsState *qs)
 static CompletionDef charset_completion = {
     .name = "charset",
     .enumerate = charset_complete,
+    .flags = CF_CACHE_LIST,
 };
 
+/* startup profile: time elapsed in each initialization phase */
+typedef struct QEStartupPhase {
+    const char *name;
+    int usec;
+    int is_module;
+} QEStartupPhase;
+
+static QEStartupPhase startup_phases[256];
+static int startup_phase_count;
+static int startup_clock, startup_start;
+
+static void qe_startup_mark(const char *name, int is_module) {
+    int now = get_clock_usec();
+    if (startup_phase_count < countof(startup_phases)) {
+        QEStartupPhase *p = &startup_phases[startup_phase_count++];
+        p->name = name;
+        p->usec = now - startup_clock;
+        p->is_module = is_module;
+    }
+    startup_clock = now;
+}
+
+/* called from the generated qe_init_all_modules() for each module */
+int qe_init_module(QEmacsState *qs, const char *name,
+                   int (*init)(QEmacsState *qs))
+{
+    int res = init(qs);
+    qe_startup_mark(name, 1);
+    return res;
+}
+
+static void qe_show_startup_profile(EditState *s) {
+    EditBuffer *b;
+    const QEStartupPhase *p;
+    int i, total, modules, nb_modules, permille;
+
+    total = startup_clock - startup_start;
+    if (total <= 0)
+        total = 1;
+    modules = nb_modules = 0;
+    for (i = 0, p = startup_phases; i < startup_phase_count; i++, p++) {
+        if (p->is_module) {
+            modules += p->usec;
+            nb_modules++;
+        }
+    }
+    b = qe_new_buffer(s->qs, "*startup*", BF_SYSTEM | BF_UTF8 | BF_STYLE1);
+    if (!b)
+        return;
+    eb_printf(b, "Startup profile: %d.%03d ms to first display\n\n",
+              total / 1000, total % 1000);
+    eb_printf(b, "%10s %6s  %s\n", "msec", "%", "phase");
+    /* usec * 1000 overflows an int after 2 seconds */
+    for (i = 0, p = startup_phases; i < startup_phase_count; i++, p++) {
+        permille = (int)((long long)p->usec * 1000 / total);
+        eb_printf(b, "%6d.%03d %5d.%d  %s%s\n",
+                  p->usec / 1000, p->usec % 1000,
+                  permille / 10, permille % 10,
+                  p->is_module ? "  " : "", p->name);
+    }
+    permille = (int)((long long)modules * 1000 / total);
+    eb_printf(b, "\n%6d.%03d %5d.%d  %d modules\n",
+              modules / 1000, modules % 1000,
+              permille / 10, permille % 10, nb_modules);
+    b->modified = 0;
+    b->offset = 0;
+    show_popup(s, b, "Startup profile");
+}
+
 /* init function */
 static int qe_init(QEmacsState *qs, int argc, char **argv)
 {
@@ -12442,11 +13779,15 @@ static int qe_init(QEmacsState *qs, int argc, char **argv)
     char filename[MAX_FILENAME_SIZE];
 #endif
 
+    startup_clock = startup_start = get_clock_usec();
     qs->up = url_init();
     if (!qs->up)
         return -1;
     qs->ec.function = "qe-init";
     qs->macro_key_index = -1; /* no macro executing */
+#ifndef CONFIG_TINY
+    qs->perf.reset_time = get_clock_ms();
+#endif
     qs->ungot_key = -1; /* no unget key */
 
     qs->argc = argc;
@@ -12467,6 +13808,14 @@ static int qe_init(QEmacsState *qs, int argc, char **argv)
     qs->double_click_threshold = DEFAULT_DOUBLE_CLICK_THRESHOLD;
     qs->screen = &global_screen;
 
+    /* name lookup tables, see qe_register_mode() and
+       qe_register_variables() for the precedence rules */
+    qs->mode_table.flags = SYM_ICASE;
+    qs->mode_extension_table.flags = SYM_ICASE | SYM_COPY | SYM_REPLACE;
+    qs->mode_filename_table.flags = SYM_ICASE | SYM_COPY | SYM_REPLACE;
+    qs->mode_shell_table.flags = SYM_COPY | SYM_REPLACE;
+    qs->variable_table.flags = SYM_REPLACE;
+
     // FIXME: Achtung Minen! qs->active_window is NULL until
     //        the first window is created for the "*scratch*" buffer
 
@@ -12517,6 +13866,8 @@ static int qe_init(QEmacsState *qs, int argc, char **argv)
     list_init(qs);
     popup_init(qs);
 
+    qe_startup_mark("core initialization", 0);
+
     /* init all external modules in link order */
     qe_init_all_modules(qs);
 
@@ -12540,14 +13891,17 @@ static int qe_init(QEmacsState *qs, int argc, char **argv)
      * else many commands such as put_status would crash.
      */
     qe_screen_init(qs, qs->screen, NULL, screen_width, screen_height);
+    qe_startup_mark("scratch buffer", 0);
 
     /* handle options */
     _optind = qe_parse_command_line(qs, argc, argv);
+    qe_startup_mark("command line", 0);
 
     /* load config file unless command line option given */
     if (!no_init_file) {
         do_load_config_file(s, NULL);
         s = qs->active_window;
+        qe_startup_mark("config files", 0);
     }
 
     qe_key_init(&qs->key_ctx);
@@ -12573,11 +13927,13 @@ static int qe_init(QEmacsState *qs, int argc, char **argv)
                dpy->name, qs->screen->width, qs->screen->height);
 
     qe_event_init(qs);
+    qe_startup_mark("display initialization", 0);
 
 #ifdef CONFIG_SESSION
     if (use_session_file) {
         session_loaded = !qe_load_session(s);
         s = qs->active_window;
+        qe_startup_mark("session", 0);
     }
 #endif
     do_refresh(s);
@@ -12619,6 +13975,8 @@ static int qe_init(QEmacsState *qs, int argc, char **argv)
         if (line_num)
             do_goto_line(s, line_num, col_num);
     }
+    if (_optind < argc)
+        qe_startup_mark("file loading", 0);
 
 #if !defined(CONFIG_TINY)
 #if defined(CONFIG_FFMPEG)
@@ -12642,6 +14000,11 @@ static int qe_init(QEmacsState *qs, int argc, char **argv)
     }
 #endif
     qe_display(qs);
+    qe_startup_mark("first display", 0);
+    if (startup_profile) {
+        qe_show_startup_profile(s);
+        qe_display(qs);
+    }
     qs->ec.function = NULL;
     return 0;
 }
@@ -12706,12 +14069,33 @@ int main(int argc, char **argv)
             }
             qe_free(&qs->cmd_array);
         }
+        symbol_table_free(&qs->cmd_table);
+        symbol_table_free(&qs->mode_table);
+        qe_mode_index_free(&qs->mode_extension_table);
+        qe_mode_index_free(&qs->mode_filename_table);
+        qe_mode_index_free(&qs->mode_shell_table);
+        file_prefetch_stop(qs);
+        dir_listing_free(&qs->dir_listings);
+        qe_perf_free(qs);
+        symbol_table_free(&qs->completion_table);
         qe_free_bindings(&qs->first_key);
+        qe_free_key_trie(&qs->key_trie);
+        while (qs->pending_bindings) {
+            struct ModeBindings *p = qs->pending_bindings;
+            qs->pending_bindings = p->next;
+            qe_free(&p);
+        }
         while (qs->first_mode) {
             ModeDef *m = qs->first_mode;
             qs->first_mode = m->next;
 
             qe_free_bindings(&m->first_key);
+            qe_free_key_trie(&m->key_trie);
+            while (m->pending_bindings) {
+                struct ModeBindings *p = m->pending_bindings;
+                m->pending_bindings = p->next;
+                qe_free(&p);
+            }
             // XXX: should free allocated ModeDef structures
         }
         while (qs->first_variable) {
@@ -12724,6 +14108,8 @@ int main(int argc, char **argv)
                 qe_free(&vp);
             }
         }
+        symbol_table_free(&qs->variable_table);
+        charset_close(qs);
         css_free_colors();
         qe_free(&qs->buffer_cache);
         qs->buffer_cache_size = qs->buffer_cache_len = 0;
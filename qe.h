@@ -108,6 +108,8 @@ extern const char str_credits[];
 /* Asynchronous I/O handling modelled after liburlio */
 typedef struct URLState URLState;
 typedef struct URLTimer URLTimer;
+typedef struct URLWatch URLWatch;
+typedef struct URLJob URLJob;
 
 URLState *url_init(void);
 int url_main_loop(URLState *up);
@@ -119,7 +121,30 @@ int url_set_tail_handler(URLState *up, void (*cb)(void *opaque), void *opaque);
 int url_register_bottom_half(URLState *up, void (*cb)(void *opaque), void *opaque);
 void url_unregister_bottom_half(URLState *up, void (*cb)(void *opaque), void *opaque);
 URLTimer *url_add_timer(URLState *up, int delay, void *opaque, void (*cb)(void *opaque));
+void url_set_timer(URLState *up, URLTimer **tip, int delay,
+                   void *opaque, void (*cb)(void *opaque));
 void url_kill_timer(URLState *up, URLTimer **tip);
+enum {            // url_add_watch event flags
+    URL_WATCH_CREATE   = 0x01,  // entry created or moved into the directory
+    URL_WATCH_DELETE   = 0x02,  // entry deleted or moved out of the directory
+    URL_WATCH_MODIFY   = 0x04,  // entry contents or attributes changed
+    URL_WATCH_GONE     = 0x08,  // watched directory deleted or moved
+    URL_WATCH_OVERFLOW = 0x10,  // events were lost, rescan needed
+};
+URLWatch *url_add_watch(URLState *up, const char *dir,
+                        void (*cb)(void *opaque, int events, const char *name),
+                        void *opaque);
+void url_remove_watch(URLState *up, URLWatch **wp);
+URLJob *url_submit_job(URLState *up,
+                       void (*run)(URLJob *job, void *opaque),
+                       void (*done)(void *opaque, int canceled),
+                       void *opaque);
+void url_cancel_job(URLState *up, URLJob **jobp);
+int url_job_canceled(URLJob *job);
+int url_pending_jobs(URLState *up);
+int url_post_bottom_half(URLState *up, void (*cb)(void *opaque), void *opaque);
+int url_post_job_bottom_half(URLJob *job, int max_pending,
+                             void (*cb)(void *opaque), void *opaque);
 
 int get_clock_ms(void);
 int get_clock_usec(void);
@@ -335,6 +360,7 @@ enum LogOperation {
     LOGOP_WRITE,
     LOGOP_INSERT,
     LOGOP_DELETE,
+    LOGOP_REPLACE,  /* only in undo records, see eb_replace_ranges() */
 };
 
 /* Each buffer modification can be caught with this callback */
@@ -476,6 +502,8 @@ struct EditBuffer {
     int ctime;               /* buffer creation time, get_clock_ms() */
     int mtime;               /* buffer last modification time */
     int file_ignore;         /* disable qe_check_buffer_file */
+    int file_changed;        /* file change notified since last check */
+    URLWatch *file_watch;    /* change notifications for the file directory */
     mode_t file_mode;        /* unix file mode */
     time_t file_mtime;       /* file last modification time */
     off_t file_size;         /* file size at load time */
@@ -506,6 +534,9 @@ EditBuffer *qe_find_buffer_filename(QEmacsState *qs, const char *filename);
 EditBuffer *qe_new_buffer(QEmacsState *qs, const char *name, int flags);
 void eb_clear(EditBuffer *b);
 void eb_free(EditBuffer **ep);
+/* private copies of buffer contents for jobs, see buffer.c */
+EditBuffer *eb_snapshot_file(QEmacsState *qs, const char *filename);
+void eb_free_snapshot(EditBuffer **bp);
 EditState *eb_find_window(EditBuffer *b, EditState *def);
 
 int eb_read_one_byte(EditBuffer *b, int offset);
@@ -517,6 +548,8 @@ int eb_insert_buffer(EditBuffer *dest, int dest_offset,
 int eb_insert(EditBuffer *b, int offset, const void *buf, int size);
 int eb_delete(EditBuffer *b, int offset, int size);
 int eb_replace(EditBuffer *b, int offset, int size, const void *buf, int size1);
+int eb_replace_ranges(EditBuffer *b, const int *ranges, int nb_ranges,
+                      const void *buf, int size1);
 void eb_free_log_buffer(EditBuffer *b);
 
 void eb_set_charset(EditBuffer *b, QECharset *charset, EOLType eol_type);
@@ -677,6 +710,8 @@ void eb_delete_properties(EditBuffer *b, int offset, int offset2, int mask);
 
 void qe_init_all_modules(QEmacsState *qs);
 void qe_exit_all_modules(QEmacsState *qs);
+int qe_init_module(QEmacsState *qs, const char *name,
+                   int (*init)(QEmacsState *qs));
 
 #define qe_module_init(fn) \
         extern int qe_module_##fn(QEmacsState *qs); \
@@ -886,6 +921,8 @@ struct ModeDef {
     int (*mode_init)(EditState *s, EditBuffer *b, int flags);
     void (*mode_close)(EditState *s);
     void (*mode_free)(EditBuffer *b, void *state);
+    /* print mode specific buffer state for describe-buffer */
+    void (*mode_describe)(EditBuffer *b1, EditBuffer *b, void *state);
 
     /* low level display functions (must be NULL to use text related
        functions)*/
@@ -934,6 +971,10 @@ struct ModeDef {
 
     // XXX: should have a separate list to allow for constant data
     struct KeyDef *first_key;
+    struct KeyTrie *key_trie;   /* compiled bindings with fallbacks */
+    struct ModeBindings *pending_bindings;  /* registered on first use */
+    int bindings_loaded;
+    unsigned int probe_serial;  /* last mode index lookup matching this mode */
     ModeDef *next;
 };
 
@@ -997,6 +1038,47 @@ struct CmdDefArray {
     int allocated;
 };
 
+#ifndef CONFIG_TINY
+/* Performance counters shown in the *perf* buffer.  Latencies are
+   counted in microseconds in log-linear histograms: values below 16
+   have their own bucket, larger ones use 4 buckets per power of 2. */
+#define PERF_HIST_SIZE  128
+
+typedef struct QEPerfHist {
+    int count;
+    int max;
+    long long total;
+    int buckets[PERF_HIST_SIZE];
+} QEPerfHist;
+
+typedef struct QEPerfCommand {
+    unsigned long long allocs;
+    QEPerfHist hist;
+    char name[1];
+} QEPerfCommand;
+
+typedef struct QEPerfStats {
+    int reset_time;         /* get_clock_ms() at last reset */
+    int key_pending;        /* a keystroke has not been painted yet */
+    int key_time;           /* get_clock_usec() of that keystroke */
+    int cmd_depth;          /* nesting level of commands */
+    int in_display;
+    int colorize_time;      /* time spent colorizing in this redisplay */
+    QEPerfHist commands;    /* top level commands */
+    QEPerfHist display;     /* qe_display() */
+    QEPerfHist colorize;    /* phases of qe_display() */
+    QEPerfHist layout;
+    QEPerfHist flush;
+    QEPerfHist key_to_paint;
+    unsigned long long command_allocs;
+    unsigned long long display_allocs;
+    SymbolTable cmd_table;  /* QEPerfCommand by command name */
+} QEPerfStats;
+
+void qe_perf_add(QEPerfHist *h, int usec);
+void qe_perf_reset(QEmacsState *qs);
+#endif
+
 struct QEmacsState {
     QEditScreen *screen;
     URLState *up;
@@ -1004,6 +1086,10 @@ struct QEmacsState {
     struct ModeDef *first_mode;
     struct KeyDef *first_key;
     struct KeyDef *first_transient_key;
+    struct KeyTrie *key_trie;   /* compiled global bindings */
+    struct ModeBindings *pending_bindings;  /* registered on first use */
+    int bindings_loaded;
+    int bindings_serial;        /* incremented when bindings change */
     struct CmdDefArray *cmd_array;
     int cmd_array_count;
     int cmd_array_size;
@@ -1011,6 +1097,19 @@ struct QEmacsState {
     struct HistoryEntry *first_history;
     //struct QECharset *first_charset;
     struct VarDef *first_variable;
+    /* name lookup tables for the registration lists above */
+    SymbolTable mode_table;
+    SymbolTable cmd_table;
+    SymbolTable completion_table;
+    SymbolTable variable_table;
+    /* mode index by file extension, file name and shell interpreter */
+    SymbolTable mode_extension_table;
+    SymbolTable mode_filename_table;
+    SymbolTable mode_shell_table;
+    unsigned int mode_probe_serial;
+    int mode_index_failed;      /* index incomplete: probe all modes */
+    DirListing *dir_listings;   /* directory listings for file completion */
+    struct FilePrefetch *file_prefetch; /* pending read ahead of listings */
     InputMethod *input_methods;
     EditState *first_window;
     EditState *first_hidden_window;
@@ -1022,6 +1121,9 @@ struct QEmacsState {
     EditBuffer **buffer_cache;
     int buffer_cache_size;
     int buffer_cache_len;
+#endif
+#ifndef CONFIG_TINY
+    QEPerfStats perf;
 #endif
     EditBuffer *trace_buffer;
     int trace_flags;
@@ -1070,6 +1172,16 @@ struct QEmacsState {
     int nb_macro_keys_run;
     int macro_keys_size;
     int macro_key_index; /* -1 means no macro is being executed */
+    struct MacroStep *macro_steps; /* last macro compiled to commands */
+    int nb_macro_steps;
+    int macro_steps_size;
+    int macro_compile_state;
+    int macro_bindings_serial; /* bindings_serial when compiled */
+    int macro_nb_cmds;    /* commands dispatched while compiling */
+    int macro_key_start;  /* index of the first key of the command */
+    int macro_step_depth; /* nesting level inside a compiled step */
+    const struct MacroStep *macro_step; /* step being replayed */
+    int macro_cmd_count;  /* commands dispatched by the macro */
     int macro_counter;
     char *macro_format;
     int ungot_key;
@@ -1114,6 +1226,8 @@ struct QEmacsState {
     int emulation_flags;
     int backspace_is_control_h;
     int backup_inhibited;  /* prevent qemacs from backing up files */
+    int auto_revert;       /* reload unmodified buffers changed on disk */
+    URLTimer *file_check_timer;
     //int fuzzy_search;    /* use fuzzy search for completion matcher */
     int c_label_indent;
     const char *user_option;
@@ -1258,6 +1372,7 @@ void qe_register_mode(QEmacsState *qs, ModeDef *m, int flags);
 void mode_complete(CompleteState *cp, CompleteFunc enumerate);
 int qe_register_commands(QEmacsState *qs, ModeDef *m, const CmdDef *cmds, int len);
 int qe_register_bindings(QEmacsState *qs, KeyDef **lp, const char *cmd_name, const char *keys);
+void qe_load_mode_bindings(QEmacsState *qs, ModeDef *m);
 int qe_register_transient_binding(QEmacsState *qs, const char *cmd_name, const char *keys);
 const CmdDef *qe_find_cmd(QEmacsState *qs, const char *cmd_name);
 int qe_get_prototype(const CmdDef *d, char *buf, int size);
@@ -1461,6 +1576,7 @@ typedef struct CompletionDef {
 #define CF_DIRNAME         16
 #define CF_RESOURCE        32
 #define CF_SAVE_LIST       64
+#define CF_CACHE_LIST      128  /* candidates do not depend on the input */
     int flags;
     /* custom handlers to start and end minibuffer edit session */
     void (*start_edit)(EditState *s);
@@ -1526,9 +1642,9 @@ enum {
     CBF_SAME_CONTENTS,      // same contents (time updated)
     CBF_APPENDED,           // file data was appended
     CBF_PROMPT,
+    CBF_UPDATED,            // buffer contents updated
     //CBF_ABORT,            // abort command
     //CBF_IGNORE,           // file modifications ignored
-    //CBF_UPDATED,          // buffer contents updated
     //CBF_MERGE,            // buffer and file data merged
 };
 enum {            // check_buffer_file mode values
@@ -1537,6 +1653,7 @@ enum {            // check_buffer_file mode values
     CBF_SAVE,
 };
 int qe_check_buffer_file(EditBuffer *b, int mode);
+void eb_watch_file(EditBuffer *b);
 
 /* config file support */
 void do_load_config_file(EditState *e, const char *file);
@@ -1607,12 +1724,17 @@ void isearch_toggle_regexp(EditState *s);
 void isearch_toggle_word_match(EditState *s);
 void isearch_colorize_matches(EditState *s, char32_t *buf, int len,
                               QETermStyle *sbuf, int offset);
+void isearch_mode_line(EditState *s, buf_t *out);
 void do_isearch(EditState *s, int argval, int dir);
 void do_query_replace(EditState *s, const char *search_str,
                       const char *replace_str, int argval);
 void do_replace_string(EditState *s, const char *search_str,
                        const char *replace_str, int argval);
 void do_search_string(EditState *s, const char *search_str, int dir);
+int eb_search_string(EditBuffer *b, const char *search_str, int dir,
+                     int start_offset, int end_offset,
+                     CSSAbortFunc *abort_func, void *abort_opaque,
+                     int *found_offset, int *found_end);
 void do_refresh_complete(EditState *s);
 void do_kill_buffer(EditState *s, const char *bufname, int force);
 void switch_to_buffer(EditState *s, EditBuffer *b);
@@ -1940,6 +2062,32 @@ void do_mark_sentence(EditState *s, int n);
 void do_kill_sentence(EditState *s, int n);
 #endif
 
+/* diff.c */
+
+#ifndef CONFIG_TINY
+typedef struct QEDiffHunk {
+    int line1, count1;      /* changed lines in the first buffer */
+    int line2, count2;      /* changed lines in the second buffer */
+} QEDiffHunk;
+
+typedef struct QEDiff {
+    EditBuffer *b1, *b2;
+    int nb_lines1, nb_lines2;
+    int *offsets1, *offsets2;   /* line offsets, nb_lines + 1 entries */
+    int nb_hunks;
+    QEDiffHunk *hunks;
+} QEDiff;
+
+#define DIFF_IGNORE_SPACES  1
+#define DIFF_IGNORE_CASE    2
+
+QEDiff *qe_diff_buffers(EditBuffer *b1, int start1, int end1,
+                        EditBuffer *b2, int start2, int end2, int flags);
+void qe_diff_free(QEDiff **dpp);
+int qe_diff_print(EditBuffer *out, const QEDiff *dp, int context);
+void qe_diff_buffer_with_file(EditState *s, EditBuffer *b);
+#endif
+
 /* hex.c */
 
 void hex_write_char(EditState *s, int key);
@@ -2022,5 +2170,4 @@ EditBuffer *qe_new_shell_buffer(QEmacsState *qs, EditBuffer *b0, EditState *e,
                                 const char *bufname, const char *caption,
                                 const char *path, const char *cmd,
                                 int shell_flags);
-void qe_diff_buffer_with_file(EditState *s, EditBuffer *b);
 #endif
@@ -32,6 +32,8 @@
  * displayed as a popup upon start.
  */
 
+typedef struct QEScript QEScript;
+
 typedef struct QEmacsDataSource {
     EditState *s;
     const char *filename;   // source filename
@@ -47,8 +49,12 @@ typedef struct QEmacsDataSource {
     int len;                // length of TOK_STRING and TOK_ID string
     int str_size;
     char *str;
-    QEValue *sp_max;
-    QEValue stack[16];
+    QEScript *prog;         // script being compiled
+    SymbolTable idents;     // constant index + 1 of identifiers
+    int compiling;          // errors are compiled as OP_WARN instructions
+    int depth;              // number of values on the stack
+    int lvalue;             // index of the OP_VAR of an assignable expression
+    QEValue stack[32];      // stack[0] receives the statement values
     char str_buf[256];      // token string (XXX: should use local buffer?)
 } QEmacsDataSource;
 
@@ -135,9 +141,160 @@ static const struct opdef ops[] = {
 #undef OP
 #undef op
 
+/* Scripts are compiled to bytecode for a small stack machine: the
+ * compiler follows the structure of the expression parser and emits
+ * instructions instead of computing values. Values are converted and
+ * combined at run time by the qe_cfg_tonum(), qe_cfg_op()... helpers.
+ * Errors detected during compilation become OP_WARN instructions so
+ * they are reported in sequence when the code is run, and statements
+ * that fail to compile are replaced by OP_FAIL.
+ */
+enum {
+    OP_CONST,       /* push constant `arg` */
+    OP_VAR,         /* push the value of variable `arg` */
+    OP_SETVAR,      /* assign to variable `arg` with operator `n` */
+    OP_POSTINC,     /* post increment variable `arg` with operator `n` */
+    OP_POP,         /* drop the top of stack */
+    OP_RESULT,      /* pop the statement value into stack[0] */
+    OP_NEG,
+    OP_PLUS,
+    OP_BITNOT,
+    OP_NOT,
+    OP_BINOP,       /* binary operator `n` */
+    OP_LENGTH,      /* `.length` property */
+    OP_CALL,        /* call command `arg` with `n` arguments */
+    OP_JUMP,        /* jump to `arg` */
+    OP_JUMPF,       /* pop and jump to `arg` if false */
+    OP_STMT,        /* start of statement, skip to `arg` on error */
+    OP_WARN,        /* report error message `arg` */
+    OP_FAIL,        /* abort statement */
+};
+
+typedef struct QEScriptInsn {
+    unsigned char op;
+    unsigned char n;        /* operator or argument count */
+    int line;               /* source line number */
+    int arg;                /* constant index or jump target */
+} QEScriptInsn;
+
+typedef struct QEScriptConst {
+    QEValue v;              /* TOK_NUMBER, TOK_CHAR, TOK_STRING or TOK_ID */
+    const CmdDef *d;        /* command bound to a TOK_ID */
+} QEScriptConst;
+
+struct QEScript {
+    QEScript *next;         /* in the list of cached scripts */
+    char *filename;         /* cache key with the file attributes */
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    time_t cache_time;      /* when the file was read */
+    int refcount;
+    int oom;                /* memory allocation failed while compiling */
+    int nb_insns, insns_size;
+    QEScriptInsn *insns;
+    int nb_consts, consts_size;
+    QEScriptConst *consts;
+};
+
+static void qe_cfg_free_script(QEScript **pp) {
+    QEScript *prog = *pp;
+    int i;
+
+    if (prog) {
+        for (i = 0; i < prog->nb_consts; i++)
+            qe_cfg_set_void(&prog->consts[i].v);
+        qe_free(&prog->consts);
+        qe_free(&prog->insns);
+        qe_free(&prog->filename);
+        qe_free(pp);
+    }
+}
+
+/* store a constant value, the script takes ownership of the string */
+static int qe_cfg_add_const(QEmacsDataSource *ds, QEValue *val) {
+    QEScript *prog = ds->prog;
+    QEScriptConst *cp;
+
+    if (prog->nb_consts >= prog->consts_size) {
+        int size = prog->consts_size + (prog->consts_size >> 1) + 16;
+        if (!qe_realloc_array(&prog->consts, size)) {
+            qe_cfg_set_void(val);
+            prog->oom = 1;
+            return -1;
+        }
+        prog->consts_size = size;
+    }
+    cp = &prog->consts[prog->nb_consts];
+    cp->v = *val;
+    cp->d = NULL;
+    val->alloc = 0;
+    val->type = TOK_VOID;
+    return prog->nb_consts++;
+}
+
+/* store the current identifier once per script */
+static int qe_cfg_add_ident(QEmacsDataSource *ds) {
+    QEValue val;
+    intptr_t k = (intptr_t)symbol_find(&ds->idents, ds->str);
+
+    if (k)
+        return k - 1;
+
+    val.alloc = 0;
+    qe_cfg_set_str(&val, ds->str, ds->len);
+    val.type = TOK_ID;
+    k = qe_cfg_add_const(ds, &val);
+    if (k >= 0)
+        symbol_add(&ds->idents, ds->prog->consts[k].v.u.str, (void *)(k + 1));
+    return k;
+}
+
+static int qe_cfg_emit(QEmacsDataSource *ds, int op, int n, int arg, int line) {
+    QEScript *prog = ds->prog;
+    QEScriptInsn *ip;
+
+    if (prog->nb_insns >= prog->insns_size) {
+        int size = prog->insns_size + (prog->insns_size >> 1) + 64;
+        if (!qe_realloc_array(&prog->insns, size)) {
+            prog->oom = 1;
+            return -1;
+        }
+        prog->insns_size = size;
+    }
+    ip = &prog->insns[prog->nb_insns];
+    ip->op = op;
+    ip->n = n;
+    ip->line = line;
+    ip->arg = arg;
+    ds->lvalue = -1;
+    return prog->nb_insns++;
+}
+
+/* set the target of the jump at `pc` to the current position */
+static void qe_cfg_patch(QEmacsDataSource *ds, int pc) {
+    if (pc >= 0)
+        ds->prog->insns[pc].arg = ds->prog->nb_insns;
+}
+
+/* remove the code emitted from `pc`, optionally keeping error reports */
+static void qe_cfg_discard(QEmacsDataSource *ds, int pc, int keep_warnings) {
+    QEScript *prog = ds->prog;
+    int i, j = pc;
+
+    if (pc < 0)
+        return;
+    for (i = pc; keep_warnings && i < prog->nb_insns; i++) {
+        if (prog->insns[i].op == OP_WARN)
+            prog->insns[j++] = prog->insns[i];
+    }
+    prog->nb_insns = j;
+    ds->lvalue = -1;
+}
+
 static void qe_cfg_init(QEmacsDataSource *ds) {
     memset(ds, 0, sizeof(*ds));
-    ds->sp_max = ds->stack;
     ds->str = ds->str_buf;
     ds->str_size = sizeof(ds->str_buf);
 }
@@ -145,7 +302,7 @@ static void qe_cfg_init(QEmacsDataSource *ds) {
 static void qe_cfg_release(QEmacsDataSource *ds) {
     // XXX: should free ds->allocated_buf ?
     QEValue *sp;
-    for (sp = ds->stack; sp < ds->sp_max; sp++)
+    for (sp = ds->stack; sp < ds->stack + countof(ds->stack); sp++)
         qe_cfg_set_void(sp);
 }
 
@@ -191,6 +348,14 @@ static void qe_cfg_error(QEmacsDataSource *ds, const char *fmt, ...) {
     vsnprintf(buf, sizeof(buf), fmt, ap);
     va_end(ap);
 
+    if (ds->compiling) {
+        /* report the error when the code is run */
+        QEValue msg;
+        msg.alloc = 0;
+        qe_cfg_set_str(&msg, buf, strlen(buf));
+        qe_cfg_emit(ds, OP_WARN, 0, qe_cfg_add_const(ds, &msg), ds->line_num);
+        return;
+    }
     put_status(ds->s, "!\007\006script error: %s", buf);
 }
 
@@ -301,7 +466,7 @@ static int qe_cfg_next_token(QEmacsDataSource *ds) {
     const u8 *p = (const u8 *)ds->p;
     ds->newline_seen = 0;
     for (;;) {
-        int len;
+        int len, lo, hi, mid;
         u8 c;
         const struct opdef *op;
 
@@ -427,9 +592,16 @@ static int qe_cfg_next_token(QEmacsDataSource *ds) {
             }
             return ds->tok = (c == '\'') ? TOK_CHAR : TOK_STRING;
         }
-        // XXX: use binary search?
-        op = ops + countof(ops);
-        while (op --> ops) {
+        /* find the operators starting with `c`: the longest ones come
+           last in the sorted table and are tried first */
+        for (lo = 0, hi = countof(ops); lo < hi;) {
+            mid = (lo + hi) >> 1;
+            if ((u8)ops[mid].str[0] <= c)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        for (op = ops + lo; op-- > ops && (u8)op->str[0] == c;) {
             for (len = 0; p[len - 1] == op->str[len]; len++) {
                 if (op->str[len + 1] == '\0') {
                     ds->p = cs8(p + len);
@@ -633,11 +805,9 @@ static int qe_cfg_format(QEmacsDataSource *ds, QEValue *sp) {
     return 0;
 }
 
-static int qe_cfg_get_args(QEmacsDataSource *ds, QEValue *sp, int n1, int n2);
 static int qe_cfg_op(QEmacsDataSource *ds, QEValue *sp, int op);
 #endif
 
-static int qe_cfg_call(QEmacsDataSource *ds, QEValue *sp, const CmdDef *d);
 static int qe_cfg_assign(QEmacsDataSource *ds, QEValue *sp, int op);
 static int qe_cfg_skip_expr(QEmacsDataSource *ds);
 
@@ -649,230 +819,6 @@ static int qe_cfg_check_lvalue(QEmacsDataSource *ds, QEValue *sp) {
     return 0;
 }
 
-static int qe_cfg_expr(QEmacsDataSource *ds, QEValue *sp, int prec0, int skip) {
-    /* Parse and evaluate an expression upto and including operators with
-       precedence prec0.
-     */
-    /* in CONFIG_TINY, only support function calls and setting variables */
-    const char *start_p = ds->start_p;
-    int start_line = ds->line_num;
-    int tok = ds->tok;
-
-    if (skip)
-        return qe_cfg_skip_expr(ds);
-
-    if (sp >= ds->sp_max) {
-        if (sp >= ds->stack + countof(ds->stack)) {
-            qe_cfg_error(ds, "stack overflow");
-            return qe_cfg_skip_expr(ds);
-        }
-        ds->sp_max = sp + 1;
-    }
-again:
-    /* handle prefix operators (ignoring precedence) */
-    switch (tok) {
-    case '(':   /* parenthesized expression, including if expression */
-        qe_cfg_next_token(ds);
-        if (qe_cfg_expr(ds, sp, PREC_EXPRESSION, 0) || !expect_token(ds, ')'))
-            goto fail;
-        break;
-    case '-':
-        qe_cfg_next_token(ds);
-        if (qe_cfg_expr(ds, sp, PREC_POSTFIX, 0) || qe_cfg_tonum(ds, sp))
-            goto fail;
-        sp->u.value = -sp->u.value;
-        break;
-#ifndef CONFIG_TINY
-    case '+':
-        qe_cfg_next_token(ds);
-        if (qe_cfg_expr(ds, sp, PREC_POSTFIX, 0) || qe_cfg_tonum(ds, sp))
-            goto fail;
-        break;
-    case '~':
-        qe_cfg_next_token(ds);
-        if (qe_cfg_expr(ds, sp, PREC_POSTFIX, 0) || qe_cfg_tonum(ds, sp))
-            goto fail;
-        sp->u.value = ~sp->u.value;
-        break;
-    case '!':
-        qe_cfg_next_token(ds);
-        if (qe_cfg_expr(ds, sp, PREC_POSTFIX, 0) || qe_cfg_getvalue(ds, sp))
-            goto fail;
-        qe_cfg_set_num(sp, (sp->type == TOK_STRING) ? 0 : !sp->u.value);
-        break;
-    case TOK_INC: /* convert to x += 1 */
-    case TOK_DEC: /* convert to x -= 1 */
-        qe_cfg_next_token(ds);
-        if (qe_cfg_expr(ds, sp, PREC_POSTFIX, 0))
-            goto fail;
-        if (qe_cfg_check_lvalue(ds, sp))
-            goto fail;
-        qe_cfg_set_num(sp + 1, 1);
-        if (qe_cfg_assign(ds, sp, tok))
-            goto fail;
-        if (qe_cfg_getvalue(ds, sp))
-            goto fail;
-        break;
-    // case TOK_SIZEOF:
-#endif
-    case TOK_NUMBER:
-        qe_cfg_set_num(sp, strtoll(ds->start_p, NULL, 0));
-        qe_cfg_next_token(ds);
-        break;
-    case TOK_STRING:
-    case TOK_ID:
-        /* XXX: could either parse here or delay parse till qe_cfg_getvalue() */
-        qe_cfg_set_str(sp, ds->str, ds->len);
-        sp->type = tok;
-        qe_cfg_next_token(ds);
-        break;
-    case TOK_CHAR: {
-            const char *p = ds->str;
-            char32_t c = utf8_decode(&p);  // XXX: should check for extra characters
-            qe_cfg_set_char(sp, c);
-            qe_cfg_next_token(ds);
-            break;
-        }
-    default:
-        qe_cfg_set_void(sp);
-        qe_cfg_error(ds, "invalid expression");
-        goto fail;
-    }
-
-    for (;;) {
-        int op = ds->tok;
-        int prec = ds->prec;
-
-        if (prec < prec0)
-            return 0;
-        qe_cfg_next_token(ds);
-        if (op == ',')
-            goto again;
-#ifndef CONFIG_TINY
-        if (op == '?') {
-            int truth;
-            if (qe_cfg_getvalue(ds, sp))
-                goto again;
-            truth = (sp->type == TOK_STRING) || (sp->u.value != 0);
-            if (qe_cfg_expr(ds, sp, PREC_EXPRESSION, !truth) != !truth)
-                goto again;
-            if (!has_token(ds, ':'))
-                goto again;
-            if (qe_cfg_expr(ds, sp, PREC_CONDITIONAL, truth) != truth)
-                goto again;
-            continue;
-        }
-#endif
-        if (prec == PREC_POSTFIX) {
-            switch (op) {
-            case '(': /* function call */
-                /* XXX: should move this code to qe_cfg_call() */
-                if (sp->type == TOK_ID) {
-                    const CmdDef *d = qe_find_cmd(ds->s->qs, sp->u.str);
-                    if (!d) {
-#ifndef CONFIG_TINY
-                        if (strequal(sp->u.str, "char")) {
-                            if (qe_cfg_get_args(ds, sp, 1, 1) < 0)
-                                goto fail;
-                            qe_cfg_tochar(ds, sp);
-                            continue;
-                        } else
-                        if (strequal(sp->u.str, "int")) {
-                            if (qe_cfg_get_args(ds, sp, 1, 1) < 0)
-                                goto fail;
-                            qe_cfg_tonum(ds, sp);
-                            continue;
-                        } else
-                        if (strequal(sp->u.str, "string")) {
-                            if (qe_cfg_get_args(ds, sp, 1, 1) < 0)
-                                goto fail;
-                            qe_cfg_tostr(ds, sp);
-                            continue;
-                        } else
-#endif
-                        {
-                            qe_cfg_error(ds, "unknown command '%s'", sp->u.str);
-                            goto fail;
-                        }
-                    }
-                    if (qe_cfg_call(ds, sp, d))
-                        goto fail;
-                    continue;
-                }
-                qe_cfg_error(ds, "invalid function call");
-                goto fail;
-#ifndef CONFIG_TINY
-            case TOK_INC: /* post increment: convert to first(x, x += 1) */
-            case TOK_DEC: /* post decrement: convert to first(x, x -= 1) */
-                if (qe_cfg_check_lvalue(ds, sp))
-                    goto fail;
-                qe_cfg_set_void(sp + 1);
-                sp[1] = sp[0];
-                sp->alloc = 0;
-                if (qe_cfg_getvalue(ds, sp))
-                    goto fail;
-                qe_cfg_set_num(sp + 2, 1);
-                if (qe_cfg_assign(ds, sp + 1, op))
-                    goto fail;
-                continue;
-            case '[': /* subscripting */
-                if (qe_cfg_expr(ds, sp + 1, PREC_EXPRESSION, 0) || !expect_token(ds, ']'))
-                    goto fail;
-                if (qe_cfg_op(ds, sp, op))
-                    return 1;
-                continue;
-            case '.': /* property / method accessor */
-                if (ds->tok != TOK_ID) {
-                    qe_cfg_error(ds, "expected property name");
-                    goto fail;
-                }
-                if (qe_cfg_getvalue(ds, sp))
-                    return 1;
-                if (sp->type == TOK_STRING && strequal(ds->str, "length")) {
-                    // XXX: use sp->len?
-                    qe_cfg_set_num(sp, strlen(sp->u.str));  // utf8?
-                    qe_cfg_next_token(ds);
-                    continue;
-                }
-                qe_cfg_error(ds, "no such property '%s'", ds->str);
-                goto fail;
-#endif
-            default:
-                qe_cfg_error(ds, "unsupported operator '%c'", op);
-                goto fail;
-            }
-            //continue; // never reached
-        }
-        if (prec == PREC_ASSIGNMENT) {
-            /* assignments are right associative */
-            if (qe_cfg_expr(ds, sp + 1, PREC_ASSIGNMENT, 0))
-                goto fail;
-            if (qe_cfg_assign(ds, sp, op))
-                goto fail;
-            continue;
-        }
-#ifndef CONFIG_TINY
-        // XXX: should implement shortcut evaluation for || and &&
-        /* other operators are left associative */
-        if (qe_cfg_expr(ds, sp + 1, prec + 1, 0))
-            goto fail;
-        // XXX: may need to delay for qe_cfg_op() to decide if qe_cfg_getvalue is OK
-        if (qe_cfg_getvalue(ds, sp))
-            goto fail;
-        if (qe_cfg_op(ds, sp, op))
-            goto fail;
-#else
-        qe_cfg_error(ds, "unsupported operator '%c'", op);
-        goto fail;
-#endif
-    }
-fail:
-    ds->p = start_p;
-    ds->line_num = start_line;
-    qe_cfg_next_token(ds);
-    return qe_cfg_skip_expr(ds);
-}
-
 #ifndef CONFIG_TINY
 static int qe_cfg_op(QEmacsDataSource *ds, QEValue *sp, int op) {
     if (sp->type == TOK_STRING) {
@@ -1091,31 +1037,6 @@ static int qe_cfg_skip_expr(QEmacsDataSource *ds) {
     }
 }
 
-#ifndef CONFIG_TINY
-static int qe_cfg_get_args(QEmacsDataSource *ds, QEValue *sp, int n1, int n2) {
-    int nargs = 0;
-    int sep = 0;
-    for (nargs = 0; !has_token(ds, ')'); nargs++) {
-        if (sep && !expect_token(ds, sep))
-            return -1;
-        sep = ',';
-        if (qe_cfg_expr(ds, sp + nargs, PREC_ASSIGNMENT, 0)) {
-            qe_cfg_error(ds, "invalid argument");     // need function name
-            return -1;
-        }
-    }
-    if (nargs < n1) {
-        qe_cfg_error(ds, "missing arguments");     // need function name
-        return -1;
-    }
-    if (nargs > n2) {
-        qe_cfg_error(ds, "extra arguments");     // need function name
-        return -1;
-    }
-    return nargs;
-}
-#endif
-
 static void qe_cfg_free_args(QEmacsDataSource *ds, int nb_args,
                              CmdArg *args, unsigned char *args_type)
 {
@@ -1126,23 +1047,64 @@ static void qe_cfg_free_args(QEmacsDataSource *ds, int nb_args,
     }
 }
 
-static int qe_cfg_call(QEmacsDataSource *ds, QEValue *sp, const CmdDef *d) {
+static int qe_cfg_call(QEmacsDataSource *ds, QEValue *sp, int nargs,
+                       QEScriptConst *cp)
+{
     EditState *s = ds->s;
     QEmacsState *qs = s->qs;
+    const CmdDef *d = cp->d;
     const char *r;
-    int nb_args, sep, i, ret;
+    int nb_args, i, j, ret;
     CmdArgSpec cas;
     CmdArg args[MAX_CMD_ARGS];
     unsigned char args_type[MAX_CMD_ARGS];
 
+    if (!d) {
+        /* commands cannot be unregistered: cache the lookup */
+        d = cp->d = qe_find_cmd(qs, cp->v.u.str);
+        if (!d) {
+#ifndef CONFIG_TINY
+            if (strequal(cp->v.u.str, "char")
+            ||  strequal(cp->v.u.str, "int")
+            ||  strequal(cp->v.u.str, "string")) {
+                if (nargs < 1) {
+                    qe_cfg_error(ds, "missing arguments");
+                    return -1;
+                }
+                if (nargs > 1) {
+                    qe_cfg_error(ds, "extra arguments");
+                    return -1;
+                }
+                if (cp->v.u.str[0] == 'c')
+                    return qe_cfg_tochar(ds, sp);
+                if (cp->v.u.str[0] == 'i')
+                    return qe_cfg_tonum(ds, sp);
+                return qe_cfg_tostr(ds, sp);
+            }
+#endif
+            qe_cfg_error(ds, "unknown command '%s'", cp->v.u.str);
+            return -1;
+        }
+    }
+
     nb_args = 0;
 
     /* construct argument type list */
     r = d->spec;
-    if (*r == '*') {
-        r++;
-        if (check_read_only(s))
-            return -1;
+    /* handle buffer modification indicator and popup inhibitor */
+    for (;; r++) {
+        if (*r == '*') {
+            if (check_read_only(s))
+                return -1;
+        } else
+        if (*r == '#') {
+            if (s->flags & (WF_POPUP | WF_MINIBUF)) {
+                qe_cfg_error(ds, "command '%s' requires a regular window", d->name);
+                return -1;
+            }
+        } else {
+            break;
+        }
     }
 
     /* This argument is always the window */
@@ -1157,9 +1119,7 @@ static int qe_cfg_call(QEmacsDataSource *ds, QEValue *sp, const CmdDef *d) {
         args_type[nb_args++] = cas.arg_type;
     }
 
-    sep = '\0';
-
-    for (i = 0; i < nb_args; i++) {
+    for (i = j = 0; i < nb_args; i++) {
         /* pseudo arguments: skip them */
         switch (args_type[i]) {
         case CMD_ARG_WINDOW:
@@ -1174,7 +1134,7 @@ static int qe_cfg_call(QEmacsDataSource *ds, QEValue *sp, const CmdDef *d) {
             args[i].p = cas.prompt;
             continue;
         }
-        if (ds->tok == ')') {
+        if (j >= nargs) {
             /* no more arguments: handle default values */
             switch (args_type[i]) {
             case CMD_ARG_INT | CMD_ARG_RAW_ARGVAL:
@@ -1200,20 +1160,6 @@ static int qe_cfg_call(QEmacsDataSource *ds, QEValue *sp, const CmdDef *d) {
                 continue;
             }
             /* CG: Could supply default arguments. */
-            /* source stays in front of the ')'. */
-            /* Let the expression parser complain about the missing argument */
-        } else {
-            if (sep && !expect_token(ds, sep)) {
-                qe_cfg_free_args(ds, i, args, args_type);
-                return -1;
-            }
-            sep = ',';
-        }
-
-        /* XXX: should parse and evaluate all arguments and
-           then match actual command arguments */
-
-        if (qe_cfg_expr(ds, sp, PREC_ASSIGNMENT, 0)) {
             qe_cfg_error(ds, "missing arguments for %s", d->name);
             qe_cfg_free_args(ds, i, args, args_type);
             return -1;
@@ -1221,25 +1167,26 @@ static int qe_cfg_call(QEmacsDataSource *ds, QEValue *sp, const CmdDef *d) {
 
         switch (args_type[i] & CMD_ARG_TYPE_MASK) {
         case CMD_ARG_INT:
-            qe_cfg_tonum(ds, sp); // XXX: should complain about type mismatch?
-            args[i].n = sp->u.value;
+            qe_cfg_tonum(ds, sp + j); // XXX: should complain about type mismatch?
+            args[i].n = sp[j].u.value;
             if (args_type[i] == (CMD_ARG_INT | CMD_ARG_NEG_ARGVAL))
                 args[i].n *= -1;
             break;
         case CMD_ARG_STRING:
-            qe_cfg_tostr(ds, sp); // XXX: should complain about type mismatch?
+            qe_cfg_tostr(ds, sp + j); // XXX: should complain about type mismatch?
             /* use allocated string pointer or duplicate it */
-            if (sp->alloc) {
-                args[i].p = sp->u.str;
-                sp->alloc = 0;
-                sp->type = TOK_VOID;
+            if (sp[j].alloc) {
+                args[i].p = sp[j].u.str;
+                sp[j].alloc = 0;
+                sp[j].type = TOK_VOID;
             } else {
-                args[i].p = qe_strdup(sp->u.str);
+                args[i].p = qe_strdup(sp[j].u.str);
             }
             break;
         }
+        j++;
     }
-    if (!has_token(ds, ')')) {
+    if (j < nargs) {
         qe_cfg_error(ds, "too many arguments for %s", d->name);
         qe_cfg_free_args(ds, nb_args, args, args_type);
         return -1;
@@ -1254,14 +1201,259 @@ static int qe_cfg_call(QEmacsDataSource *ds, QEValue *sp, const CmdDef *d) {
         s = qs->active_window;
     qe_check_window(qs, &s);
     ds->s = s;
+    for (j = 0; j < nargs; j++)
+        qe_cfg_set_void(sp + j);
     sp->type = TOK_VOID;
     qe_cfg_free_args(ds, nb_args, args, args_type);
     return 0;
 }
 
-static int qe_cfg_stmt(QEmacsDataSource *ds, QEValue *sp, int skip) {
-    int res = 0;
+/* If the code just emitted loads a variable, remove it and return
+   the constant index of the variable name, otherwise return -1. */
+static int qe_cfg_lvalue(QEmacsDataSource *ds) {
+    QEScript *prog = ds->prog;
+
+    if (ds->lvalue < 0 || ds->lvalue != prog->nb_insns - 1)
+        return -1;
+    prog->nb_insns--;
+    ds->lvalue = -1;
+    return prog->insns[prog->nb_insns].arg;
+}
+
+static int qe_cfg_compile_expr(QEmacsDataSource *ds, int prec0);
+
+static int qe_cfg_compile_call(QEmacsDataSource *ds, int k, int line) {
+    /* compile the arguments of a command call after the `(` */
+    int depth = ds->depth;
+    int nargs, sep = 0;
+
+    for (nargs = 0; !has_token(ds, ')'); nargs++) {
+        if (sep && !expect_token(ds, sep))
+            return 1;
+        sep = ',';
+        ds->depth = depth + nargs;
+        if (qe_cfg_compile_expr(ds, PREC_ASSIGNMENT)) {
+            qe_cfg_error(ds, "missing arguments for %s",
+                         ds->prog->consts[k].v.u.str);
+            return 1;
+        }
+    }
+    qe_cfg_emit(ds, OP_CALL, nargs, k, line);
+    ds->depth = depth + 1;
+    return 0;
+}
 
+static int qe_cfg_compile_expr(QEmacsDataSource *ds, int prec0) {
+    /* Compile an expression upto and including operators with
+       precedence prec0. The code pushes a single value on the stack.
+     */
+    /* in CONFIG_TINY, only support function calls and setting variables */
+    const char *start_p = ds->start_p;
+    int start_line = ds->start_line;
+    int depth = ds->depth;
+    int line, k;
+#ifndef CONFIG_TINY
+    int tok, pc, pc1;
+#endif
+    QEValue val;
+
+    /* OP_SETVAR and OP_POSTINC use 2 extra slots */
+    if (depth + 3 >= countof(ds->stack)) {
+        qe_cfg_error(ds, "stack overflow");
+        return qe_cfg_skip_expr(ds);
+    }
+    val.alloc = 0;
+again:
+    /* handle prefix operators (ignoring precedence) */
+    line = ds->start_line;
+    switch (ds->tok) {
+    case '(':   /* parenthesized expression, including if expression */
+        qe_cfg_next_token(ds);
+        if (qe_cfg_compile_expr(ds, PREC_EXPRESSION) || !expect_token(ds, ')'))
+            goto fail;
+        break;
+    case '-':
+        qe_cfg_next_token(ds);
+        if (qe_cfg_compile_expr(ds, PREC_POSTFIX))
+            goto fail;
+        qe_cfg_emit(ds, OP_NEG, 0, 0, line);
+        break;
+#ifndef CONFIG_TINY
+    case '+':
+        qe_cfg_next_token(ds);
+        if (qe_cfg_compile_expr(ds, PREC_POSTFIX))
+            goto fail;
+        qe_cfg_emit(ds, OP_PLUS, 0, 0, line);
+        break;
+    case '~':
+        qe_cfg_next_token(ds);
+        if (qe_cfg_compile_expr(ds, PREC_POSTFIX))
+            goto fail;
+        qe_cfg_emit(ds, OP_BITNOT, 0, 0, line);
+        break;
+    case '!':
+        qe_cfg_next_token(ds);
+        if (qe_cfg_compile_expr(ds, PREC_POSTFIX))
+            goto fail;
+        qe_cfg_emit(ds, OP_NOT, 0, 0, line);
+        break;
+    case TOK_INC: /* convert to x += 1 */
+    case TOK_DEC: /* convert to x -= 1 */
+        tok = ds->tok;
+        qe_cfg_next_token(ds);
+        if (qe_cfg_compile_expr(ds, PREC_POSTFIX))
+            goto fail;
+        if ((k = qe_cfg_lvalue(ds)) < 0) {
+            qe_cfg_error(ds, "not a variable");
+            goto fail;
+        }
+        qe_cfg_set_num(&val, 1);
+        qe_cfg_emit(ds, OP_CONST, 0, qe_cfg_add_const(ds, &val), line);
+        qe_cfg_emit(ds, OP_SETVAR, tok, k, line);
+        break;
+    // case TOK_SIZEOF:
+#endif
+    case TOK_NUMBER:
+        qe_cfg_set_num(&val, strtoll(ds->start_p, NULL, 0));
+        qe_cfg_emit(ds, OP_CONST, 0, qe_cfg_add_const(ds, &val), line);
+        qe_cfg_next_token(ds);
+        break;
+    case TOK_STRING:
+        qe_cfg_set_str(&val, ds->str, ds->len);
+        qe_cfg_emit(ds, OP_CONST, 0, qe_cfg_add_const(ds, &val), line);
+        qe_cfg_next_token(ds);
+        break;
+    case TOK_ID:
+        /* the load is removed if the variable is assigned or called */
+        k = qe_cfg_emit(ds, OP_VAR, 0, qe_cfg_add_ident(ds), line);
+        qe_cfg_next_token(ds);
+        if (ds->prog->nb_insns == k + 1)
+            ds->lvalue = k;
+        break;
+    case TOK_CHAR: {
+            const char *p = ds->str;
+            char32_t c = utf8_decode(&p);  // XXX: should check for extra characters
+            qe_cfg_set_char(&val, c);
+            qe_cfg_emit(ds, OP_CONST, 0, qe_cfg_add_const(ds, &val), line);
+            qe_cfg_next_token(ds);
+            break;
+        }
+    default:
+        qe_cfg_error(ds, "invalid expression");
+        goto fail;
+    }
+    ds->depth = depth + 1;
+
+    for (;;) {
+        int op = ds->tok;
+        int prec = ds->prec;
+
+        if (prec < prec0)
+            return 0;
+        line = ds->start_line;
+        qe_cfg_next_token(ds);
+        if (op == ',') {
+            qe_cfg_emit(ds, OP_POP, 0, 0, line);
+            ds->depth = depth;
+            goto again;
+        }
+#ifndef CONFIG_TINY
+        if (op == '?') {
+            pc = qe_cfg_emit(ds, OP_JUMPF, 0, 0, line);
+            ds->depth = depth;
+            if (qe_cfg_compile_expr(ds, PREC_EXPRESSION) || !expect_token(ds, ':'))
+                goto fail;
+            pc1 = qe_cfg_emit(ds, OP_JUMP, 0, 0, line);
+            qe_cfg_patch(ds, pc);
+            ds->depth = depth;
+            if (qe_cfg_compile_expr(ds, PREC_CONDITIONAL))
+                goto fail;
+            qe_cfg_patch(ds, pc1);
+            ds->lvalue = -1;
+            continue;
+        }
+#endif
+        if (prec == PREC_POSTFIX) {
+            switch (op) {
+            case '(': /* function call */
+                if ((k = qe_cfg_lvalue(ds)) < 0) {
+                    qe_cfg_error(ds, "invalid function call");
+                    goto fail;
+                }
+                ds->depth = depth;
+                if (qe_cfg_compile_call(ds, k, line))
+                    goto fail;
+                continue;
+#ifndef CONFIG_TINY
+            case TOK_INC: /* post increment: convert to first(x, x += 1) */
+            case TOK_DEC: /* post decrement: convert to first(x, x -= 1) */
+                if (ds->lvalue < 0 || ds->lvalue != ds->prog->nb_insns - 1) {
+                    qe_cfg_error(ds, "not a variable");
+                    goto fail;
+                }
+                k = ds->prog->insns[ds->lvalue].arg;
+                qe_cfg_emit(ds, OP_POSTINC, op, k, line);
+                continue;
+            case '[': /* subscripting */
+                if (qe_cfg_compile_expr(ds, PREC_EXPRESSION) || !expect_token(ds, ']'))
+                    goto fail;
+                qe_cfg_emit(ds, OP_BINOP, op, 0, line);
+                ds->depth = depth + 1;
+                continue;
+            case '.': /* property / method accessor */
+                if (ds->tok != TOK_ID) {
+                    qe_cfg_error(ds, "expected property name");
+                    goto fail;
+                }
+                if (!strequal(ds->str, "length")) {
+                    qe_cfg_error(ds, "no such property '%s'", ds->str);
+                    goto fail;
+                }
+                qe_cfg_emit(ds, OP_LENGTH, 0, 0, line);
+                qe_cfg_next_token(ds);
+                continue;
+#endif
+            default:
+                qe_cfg_error(ds, "unsupported operator '%c'", op);
+                goto fail;
+            }
+            //continue; // never reached
+        }
+        if (prec == PREC_ASSIGNMENT) {
+            /* assignments are right associative */
+            if ((k = qe_cfg_lvalue(ds)) < 0) {
+                qe_cfg_error(ds, "not a variable");
+                goto fail;
+            }
+            ds->depth = depth;
+            if (qe_cfg_compile_expr(ds, PREC_ASSIGNMENT))
+                goto fail;
+            qe_cfg_emit(ds, OP_SETVAR, op, k, line);
+            continue;
+        }
+#ifndef CONFIG_TINY
+        // XXX: should implement shortcut evaluation for || and &&
+        /* other operators are left associative */
+        if (qe_cfg_compile_expr(ds, prec + 1))
+            goto fail;
+        qe_cfg_emit(ds, OP_BINOP, op, 0, line);
+        ds->depth = depth + 1;
+#else
+        qe_cfg_error(ds, "unsupported operator '%c'", op);
+        goto fail;
+#endif
+    }
+fail:
+    ds->p = start_p;
+    ds->line_num = start_line;
+    qe_cfg_next_token(ds);
+    return qe_cfg_skip_expr(ds);
+}
+
+static int qe_cfg_compile_stmt(QEmacsDataSource *ds) {
+    int res = 0, line, start, pc, pc1;
+
+    ds->depth = 0;
     if (has_token(ds, '{')) {
         /* handle blocks */
         while (!has_token(ds, '}')) {
@@ -1269,29 +1461,50 @@ static int qe_cfg_stmt(QEmacsDataSource *ds, QEValue *sp, int skip) {
                 qe_cfg_error(ds, "missing '}'");
                 return 1;
             }
-            res |= qe_cfg_stmt(ds, sp, skip);
+            res |= qe_cfg_compile_stmt(ds);
         }
         return res;
     }
 
+    line = ds->start_line;
     // XXX: should also parse do / while?
     if (has_token(ds, TOK_IF)) {
-        int truth = 0;
-
-        if (qe_cfg_expr(ds, sp, PREC_EXPRESSION, skip) || qe_cfg_getvalue(ds, sp)) {
-            res = skip = 1;
-        } else {
-            truth = (sp->type == TOK_STRING) || (sp->u.value != 0);
+        start = qe_cfg_emit(ds, OP_STMT, 0, 0, line);
+        if (qe_cfg_compile_expr(ds, PREC_EXPRESSION)) {
+            /* skip both branches */
+            qe_cfg_discard(ds, start + 1, 1);
+            qe_cfg_emit(ds, OP_FAIL, 0, 0, line);
+            qe_cfg_patch(ds, start);
+            pc = ds->prog->nb_insns;
+            qe_cfg_compile_stmt(ds);
+            if (has_token(ds, TOK_ELSE))
+                qe_cfg_compile_stmt(ds);
+            qe_cfg_discard(ds, pc, 0);
+            return 1;
         }
-        res |= qe_cfg_stmt(ds, sp, skip | !truth);
-        if (has_token(ds, TOK_ELSE))
-            res |= qe_cfg_stmt(ds, sp, skip | truth);
+        pc = qe_cfg_emit(ds, OP_JUMPF, 0, 0, line);
+        res |= qe_cfg_compile_stmt(ds);
+        if (has_token(ds, TOK_ELSE)) {
+            pc1 = qe_cfg_emit(ds, OP_JUMP, 0, 0, line);
+            qe_cfg_patch(ds, pc);
+            res |= qe_cfg_compile_stmt(ds);
+            pc = pc1;
+        }
+        qe_cfg_patch(ds, pc);
+        qe_cfg_patch(ds, start);
         return res;
     }
     if (ds->tok != ';') {   /* test for empty statement */
         /*  accept comma expressions */
-        if (qe_cfg_expr(ds, sp, PREC_EXPRESSION, skip) || qe_cfg_getvalue(ds, sp))
+        start = qe_cfg_emit(ds, OP_STMT, 0, 0, line);
+        if (qe_cfg_compile_expr(ds, PREC_EXPRESSION)) {
+            qe_cfg_discard(ds, start + 1, 1);
+            qe_cfg_emit(ds, OP_FAIL, 0, 0, line);
             res = 1;
+        } else {
+            qe_cfg_emit(ds, OP_RESULT, 0, 0, line);
+        }
+        qe_cfg_patch(ds, start);
     }
     /* consume `;` if any or is current token first on line */
     if (!has_token(ds, ';') && ds->tok != TOK_EOF && ds->tok != '}' && !ds->newline_seen) {
@@ -1301,30 +1514,237 @@ static int qe_cfg_stmt(QEmacsDataSource *ds, QEValue *sp, int skip) {
     return res;
 }
 
-static int qe_parse_script(EditState *s, QEmacsDataSource *ds) {
+static QEScript *qe_cfg_compile(QEmacsDataSource *ds) {
+    QEScript *prog = qe_mallocz(QEScript);
+
+    if (!prog)
+        return NULL;
+
+    prog->refcount = 1;
+    ds->prog = prog;
+    ds->compiling = 1;
+    ds->lvalue = -1;
+    ds->p = ds->buf;
+    ds->line_num = 1;
+    qe_cfg_next_token(ds);
+    while (ds->tok != TOK_EOF && ds->tok != TOK_ERR) {
+        qe_cfg_compile_stmt(ds);
+    }
+    ds->compiling = 0;
+    ds->prog = NULL;
+    symbol_table_free(&ds->idents);
+    if (prog->oom)
+        qe_cfg_free_script(&prog);
+    return prog;
+}
+
+static int qe_cfg_run(QEmacsDataSource *ds, QEScript *prog) {
+    QEmacsState *qs = ds->s->qs;
+    QEValue *sp = ds->stack;    /* stack[0] receives the statement values */
+    const QEScriptInsn *ip;
+    int pc, err_pc = prog->nb_insns, truth;
+
+    for (pc = 0; pc < prog->nb_insns; pc++) {
+        ip = &prog->insns[pc];
+        qs->ec.lineno = ip->line;
+        switch (ip->op) {
+        case OP_STMT:
+            err_pc = ip->arg;
+            continue;
+        case OP_CONST:
+            /* constant strings are not copied */
+            *++sp = prog->consts[ip->arg].v;
+            sp->alloc = 0;
+            continue;
+        case OP_VAR:
+            *++sp = prog->consts[ip->arg].v;
+            sp->alloc = 0;
+            if (qe_cfg_getvalue(ds, sp))
+                break;
+            continue;
+        case OP_SETVAR:
+            /* the variable name goes below the value to assign */
+            sp[1] = *sp;
+            *sp = prog->consts[ip->arg].v;
+            sp->alloc = 0;
+            if (qe_cfg_assign(ds, sp, ip->n))
+                break;
+            qe_cfg_set_void(sp + 1);
+            if (qe_cfg_getvalue(ds, sp))
+                break;
+            continue;
+        case OP_POP:
+            qe_cfg_set_void(sp--);
+            continue;
+        case OP_RESULT:
+            if (sp->type == TOK_STRING && !sp->alloc)
+                qe_cfg_set_str(sp, sp->u.str, sp->len);
+            qe_cfg_move(ds->stack, sp--);
+            continue;
+        case OP_NEG:
+            if (qe_cfg_tonum(ds, sp))
+                break;
+            sp->u.value = -sp->u.value;
+            continue;
+#ifndef CONFIG_TINY
+        case OP_POSTINC:
+            sp[1] = prog->consts[ip->arg].v;
+            sp[1].alloc = 0;
+            qe_cfg_set_num(sp + 2, 1);
+            if (qe_cfg_assign(ds, sp + 1, ip->n))
+                break;
+            qe_cfg_set_void(sp + 1);
+            qe_cfg_set_void(sp + 2);
+            continue;
+        case OP_PLUS:
+            if (qe_cfg_tonum(ds, sp))
+                break;
+            continue;
+        case OP_BITNOT:
+            if (qe_cfg_tonum(ds, sp))
+                break;
+            sp->u.value = ~sp->u.value;
+            continue;
+        case OP_NOT:
+            qe_cfg_set_num(sp, (sp->type == TOK_STRING) ? 0 : !sp->u.value);
+            continue;
+        case OP_BINOP:
+            sp--;
+            if (qe_cfg_op(ds, sp, ip->n))
+                break;
+            qe_cfg_set_void(sp + 1);
+            continue;
+        case OP_LENGTH:
+            if (sp->type != TOK_STRING) {
+                qe_cfg_error(ds, "no such property 'length'");
+                break;
+            }
+            // XXX: use sp->len?
+            qe_cfg_set_num(sp, strlen(sp->u.str));  // utf8?
+            continue;
+#endif
+        case OP_CALL:
+            /* arguments are replaced with the command value */
+            sp -= ip->n - 1;
+            if (qe_cfg_call(ds, sp, ip->n, &prog->consts[ip->arg]))
+                break;
+            continue;
+        case OP_JUMP:
+            pc = ip->arg - 1;
+            continue;
+        case OP_JUMPF:
+            truth = (sp->type == TOK_STRING) || (sp->u.value != 0);
+            qe_cfg_set_void(sp--);
+            if (!truth)
+                pc = ip->arg - 1;
+            continue;
+        case OP_WARN:
+            qe_cfg_error(ds, "%s", prog->consts[ip->arg].v.u.str);
+            continue;
+        case OP_FAIL:
+        default:
+            break;
+        }
+        /* abort the current statement */
+        for (sp = ds->stack + countof(ds->stack); sp-- > ds->stack;)
+            qe_cfg_set_void(sp);
+        sp = ds->stack;
+        pc = err_pc - 1;
+    }
+    return ds->stack[0].type;
+}
+
+/* compiled configuration files, most recently used first */
+#define QE_SCRIPT_CACHE_SIZE  8
+static QEScript *qe_script_cache;
+
+static void qe_cfg_unref_script(QEScript **pp) {
+    if (*pp && --(*pp)->refcount <= 0)
+        qe_cfg_free_script(pp);
+    *pp = NULL;
+}
+
+static QEScript *qe_cfg_find_script(const char *filename, const struct stat *st) {
+    QEScript **pp, *prog;
+
+    for (pp = &qe_script_cache; (prog = *pp) != NULL; pp = &prog->next) {
+        if (strequal(prog->filename, filename)) {
+            *pp = prog->next;
+            if (prog->dev == st->st_dev && prog->ino == st->st_ino
+            &&  prog->size == st->st_size && prog->mtime == st->st_mtime
+            &&  prog->cache_time > prog->mtime) {
+                prog->next = qe_script_cache;
+                qe_script_cache = prog;
+                prog->refcount++;
+                return prog;
+            }
+            /* stale entry: mtime has a one second resolution, a file
+               modified in the second it was read may have changed since */
+            qe_cfg_unref_script(&prog);
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void qe_cfg_cache_script(QEScript *prog, const char *filename,
+                                const struct stat *st, time_t cache_time)
+{
+    QEScript **pp;
+    int n;
+
+    prog->filename = qe_strdup(filename);
+    if (!prog->filename)
+        return;
+    prog->dev = st->st_dev;
+    prog->ino = st->st_ino;
+    prog->size = st->st_size;
+    prog->mtime = st->st_mtime;
+    prog->cache_time = cache_time;
+    prog->refcount++;
+    prog->next = qe_script_cache;
+    qe_script_cache = prog;
+    for (n = 0, pp = &qe_script_cache; *pp; pp = &(*pp)->next) {
+        if (++n > QE_SCRIPT_CACHE_SIZE) {
+            QEScript *p = *pp;
+            *pp = NULL;
+            while (p) {
+                QEScript *next = p->next;
+                qe_cfg_unref_script(&p);
+                p = next;
+            }
+            break;
+        }
+    }
+}
+
+static int qe_parse_script(EditState *s, QEmacsDataSource *ds, QEScript *prog) {
     QEmacsState *qs = s->qs;
     QErrorContext ec_save = qs->ec;
-    QEValue *sp = &ds->stack[0];
+    QEScript *tmp = NULL;
+    int res = TOK_ERR;
 
     ds->s = s;
-    ds->p = ds->buf;
-    sp->type = TOK_VOID;
+    ds->stack[0].type = TOK_VOID;
 
     qs->ec.filename = ds->filename;
     qs->ec.function = NULL;
-    qs->ec.lineno = ds->line_num = 1;
+    qs->ec.lineno = 1;
 
-    qe_cfg_next_token(ds);
-    while (ds->tok != TOK_EOF && ds->tok != TOK_ERR) {
-        if (qe_cfg_stmt(ds, sp, 0))
-            sp->type = TOK_VOID;
-    }
+    if (!prog)
+        prog = tmp = qe_cfg_compile(ds);
     if (ds->allocated_buf) {
         qe_free(&ds->allocated_buf);
         ds->p = ds->buf = NULL;
     }
+    if (prog) {
+        res = qe_cfg_run(ds, prog);
+    } else {
+        put_error(s, "Out of memory");
+    }
+    qe_cfg_unref_script(&tmp);
     qs->ec = ec_save;
-    return sp->type;
+    return res;
 }
 
 static void qe_cfg_postprocess(EditState *s, QEmacsDataSource *ds, int argval) {
@@ -1389,7 +1809,7 @@ void do_eval_expression(EditState *s, const char *expression, int argval)
     qe_cfg_init(&ds);
     ds.buf = expression;
     ds.filename = "<string>";
-    if (qe_parse_script(s, &ds) == TOK_ERR) {
+    if (qe_parse_script(s, &ds, NULL) == TOK_ERR) {
         // error already reported
     } else {
         qe_cfg_postprocess(s, &ds, argval);
@@ -1420,7 +1840,7 @@ static int do_eval_buffer_region(EditState *s, int start, int stop, int argval)
     length = eb_get_region_contents(s->b, start, stop, buf, length + 1, 0);
     ds.buf = ds.allocated_buf = buf;
     ds.filename = s->b->name;
-    if (qe_parse_script(s, &ds) == TOK_ERR) {
+    if (qe_parse_script(s, &ds, NULL) == TOK_ERR) {
         // error already reported
         res = 1;
     } else {
@@ -1448,21 +1868,42 @@ void do_eval_buffer(EditState *s, int argval) {
 
 int parse_config_file(EditState *s, const char *filename) {
     QEmacsDataSource ds;
+    QEScript *prog;
+    struct stat st;
+    time_t now;
     int res;
 
+    /* read the clock first: the file may change while it is read */
+    now = time(NULL);
+    if (stat(filename, &st) < 0)
+        return -1;
+
     qe_cfg_init(&ds);
+    ds.filename = filename;
 
-    ds.allocated_buf = file_load(filename, MAX_SCRIPT_LENGTH + 1, NULL);
-    if (!ds.allocated_buf) {
-        if (errno == ERANGE || errno == ENOMEM) {
-            put_error(s, "File too large");
+    /* reuse the bytecode if the file has not changed */
+    prog = qe_cfg_find_script(filename, &st);
+    if (!prog) {
+        ds.allocated_buf = file_load(filename, MAX_SCRIPT_LENGTH + 1, NULL);
+        if (!ds.allocated_buf) {
+            if (errno == ERANGE || errno == ENOMEM) {
+                put_error(s, "File too large");
+            }
+            return -1;
         }
-        return -1;
+        ds.buf = ds.allocated_buf;
+        ds.s = s;
+        prog = qe_cfg_compile(&ds);
+        qe_free(&ds.allocated_buf);
+        ds.p = ds.buf = NULL;
+        if (!prog) {
+            put_error(s, "Out of memory");
+            return -1;
+        }
+        qe_cfg_cache_script(prog, filename, &st, now);
     }
-
-    ds.filename = filename;
-    ds.buf = ds.allocated_buf;
-    res = qe_parse_script(s, &ds);
+    res = qe_parse_script(s, &ds, prog);
+    qe_cfg_unref_script(&prog);
     qe_cfg_release(&ds);
     return res;
 }
@@ -1487,7 +1928,7 @@ static CompletionDef symbol_completion = {
     .enumerate = symbol_complete,
     .print_entry = symbol_print_entry,
     .get_entry = command_get_entry,
-    .flags = CF_SPACE_OK | CF_NO_AUTO_SUBMIT,
+    .flags = CF_SPACE_OK | CF_NO_AUTO_SUBMIT | CF_CACHE_LIST,
 };
 #endif
 
@@ -1514,4 +1955,13 @@ static int parser_init(QEmacsState *qs) {
     return 0;
 }
 
+static void parser_exit(QEmacsState *qs) {
+    while (qe_script_cache) {
+        QEScript *prog = qe_script_cache;
+        qe_script_cache = prog->next;
+        qe_cfg_unref_script(&prog);
+    }
+}
+
 qe_module_init(parser_init);
+qe_module_exit(parser_exit);
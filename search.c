@@ -77,13 +77,58 @@ struct ISearchState {
     /* common */
     char search_str[SEARCH_LENGTH * 3];     /* may be in hex */
     char32_t search_u32[SEARCH_LENGTH];
+    /* time sliced search job: the search runs from the event loop in
+       slices of ISEARCH_SLICE_MS milliseconds, there is no match of the
+       scan_u32 string between scan_origin and scan_pos */
+    QEmacsState *qs;
+    URLTimer *scan_timer;
+    int scanning;               /* search in progress */
+    int scan_deadline;          /* end of the current time slice */
+    int scan_origin, scan_pos, scan_dir, scan_flags;
+    int scan_u32_len;
+    char32_t scan_u32[SEARCH_LENGTH];
+    /* match cache for highlighting: the matches in the visible part
+       of window `s` plus a margin are computed once per search string
+       and reused for redisplay and scrolling until the buffer changes */
+    EditBuffer *match_b;        /* buffer the cache is attached to */
+    int match_valid;
+    int match_start, match_end; /* range covered, at line boundaries */
+    int match_flags;
+    int match_u32_len;
+    int nb_matches, size_matches;
+    int *matches;               /* pairs of match start and end offsets */
+    char32_t match_u32[SEARCH_LENGTH];
 };
 
+#define ISEARCH_MATCH_MARGIN  4096  /* minimum bytes cached around the window */
+#define ISEARCH_SLICE_MS      20    /* duration of a search time slice */
+#define ISEARCH_REGEX_CHUNK   (1 << 20)  /* regex search chunk size */
+
 static ModeDef isearch_mode;
 
 /* XXX: should store to screen */
 static ISearchState global_isearch_state;
 
+/* return non zero if a search with `flags` for `buf` ignores case */
+static int search_folds_case(int flags, const char32_t *buf, int len)
+{
+    int pos, upper_count = 0, lower_count = 0;
+
+    switch (flags & SEARCH_FLAG_CASE_MASK) {
+    case SEARCH_FLAG_IGNORECASE:
+        return 1;
+    case SEARCH_FLAG_SMARTCASE:
+        /* case fold unless upper case is present */
+        for (pos = 0; pos < len; pos++) {
+            lower_count += qe_iswlower(buf[pos]);
+            upper_count += qe_iswupper(buf[pos]);
+        }
+        return lower_count > 0 && upper_count == 0;
+    default:
+        return 0;
+    }
+}
+
 static int eb_search(EditBuffer *b, int dir, int flags,
                      int start_offset, int end_offset,
                      const char32_t *buf, int len,
@@ -96,7 +141,9 @@ static int eb_search(EditBuffer *b, int dir, int flags,
        @argument `dir` search direction: -1 for backward, 1 for forward
        @argument `flags` a combination of SEARCH_FLAG_xxx values
        @argument `start_offset` the starting offset in buffer
-       @argument `end_offset` the maximum offset in buffer
+       @argument `end_offset` the maximum offset in buffer: for a backward
+         search, matches must end before `end_offset`, which is usually
+         the same as `start_offset`
        @argument `buf` a valid pointer to an array of `char32_t`
        @argument `len` the length of the array `buf`
        @argument `abort_func` a function pointer to test for abort request
@@ -108,7 +155,8 @@ static int eb_search(EditBuffer *b, int dir, int flags,
        @return non zero if the search was successful. Match starting and
        ending offsets are stored to `start_offset` and `end_offset`.
        Return `0` if search failed or `len` is zero.
-       Return `-1` if search was aborted.
+       Return `-1` if search was aborted, the offset where to resume the
+       search is then stored to `found_end`, or `-1` upon error.
      */
     int total_size = b->total_size;
     int offset = start_offset, offset1, offset2, offset3, pos;
@@ -117,8 +165,6 @@ static int eb_search(EditBuffer *b, int dir, int flags,
     if (len == 0)
         return 0;
 
-    if (dir < 0)
-        end_offset = offset;
     if (end_offset > total_size)
         end_offset = total_size;
 
@@ -126,15 +172,9 @@ static int eb_search(EditBuffer *b, int dir, int flags,
     *found_end = -1;
 
     /* analyze buffer if smart case */
-    if ((flags & SEARCH_FLAG_CASE_MASK) == SEARCH_FLAG_SMARTCASE) {
-        int upper_count = 0;
-        int lower_count = 0;
-        for (pos = 0; pos < len; pos++) {
-            lower_count += qe_iswlower(buf[pos]);
-            upper_count += qe_iswupper(buf[pos]);
-        }
-        if (lower_count > 0 && upper_count == 0)
-            flags |= SEARCH_FLAG_IGNORECASE;
+    if ((flags & SEARCH_FLAG_CASE_MASK) == SEARCH_FLAG_SMARTCASE
+    &&  search_folds_case(flags, buf, len)) {
+        flags |= SEARCH_FLAG_IGNORECASE;
     }
 
     if (flags & SEARCH_FLAG_HEX) {
@@ -152,10 +192,12 @@ static int eb_search(EditBuffer *b, int dir, int flags,
                 if (offset >= end_offset)
                     return 0;
             }
-            if ((offset & 0xfffff) == 0) {
-                /* check for search abort every megabyte */
-                if (abort_func && (*abort_func)(abort_opaque))
+            if ((offset & 0xffff) == 0) {
+                /* check for search abort every 64K */
+                if (abort_func && (*abort_func)(abort_opaque)) {
+                    *found_end = (dir < 0) ? offset + 1 : offset;
                     return -1;
+                }
             }
 
             pos = 0;
@@ -166,7 +208,7 @@ static int eb_search(EditBuffer *b, int dir, int flags,
                 if (c != c2)
                     break;
                 if (pos >= len) {
-                    if (dir >= 0 || offset2 <= start_offset) {
+                    if (dir >= 0 || offset2 <= end_offset) {
                         *found_offset = offset;
                         *found_end = offset2;
                         return 1;
@@ -226,6 +268,7 @@ static int eb_search(EditBuffer *b, int dir, int flags,
             if ((offset & 0xffff) == 0) {
                 /* check for search abort every 64K */
                 if (abort_func && (*abort_func)(abort_opaque)) {
+                    *found_end = (dir < 0) ? eb_next(b, offset) : offset;
                     res = -1;
                     break;
                 }
@@ -273,10 +316,12 @@ static int eb_search(EditBuffer *b, int dir, int flags,
             if (offset >= end_offset)
                 return 0;
         }
-        if ((offset & 0xfffff) == 0) {
-            /* check for search abort every megabyte */
-            if (abort_func && (*abort_func)(abort_opaque))
+        if ((offset & 0xffff) == 0) {
+            /* check for search abort every 64K */
+            if (abort_func && (*abort_func)(abort_opaque)) {
+                *found_end = (dir < 0) ? eb_next(b, offset) : offset;
                 return -1;
+            }
         }
 
         /* CG: XXX: Should use buffer specific accelerator */
@@ -298,7 +343,7 @@ static int eb_search(EditBuffer *b, int dir, int flags,
                     ||  qe_isword(eb_nextc(b, offset2, &offset3)))
                         break;
                 }
-                if (dir >= 0 || offset2 <= start_offset) {
+                if (dir >= 0 || offset2 <= end_offset) {
                     *found_offset = offset;
                     *found_end = offset2;
                     return 1;
@@ -312,11 +357,11 @@ static int eb_search(EditBuffer *b, int dir, int flags,
 }
 
 static void isearch_exit(EditState *s, int key);
-
-static int search_abort_func(qe__unused__ void *opaque)
-{
-    return is_user_input_pending();
-}
+static void isearch_match_reset(QEmacsState *qs, ISearchState *is);
+static void isearch_scan_start(ISearchState *is, int search_offset);
+static void isearch_scan_stop(ISearchState *is);
+static void isearch_scan_cb(void *opaque);
+static void isearch_show(ISearchState *is);
 
 #if 0
 static void buf_encode_search_u32(buf_t *out, const char32_t *str, int len)
@@ -392,7 +437,10 @@ static void buf_disp_search_flags(buf_t *out, int search_flags) {
 static void isearch_run(ISearchState *is) {
     /* Incremental search engine: this function is run after all
        incremental search commands. It updates the search flags
-       and search string and searches for the next match.
+       and search string and starts the search for the next match.
+       Long searches proceed in time slices from the event loop and
+       resume where the previous search stopped if the search string
+       was extended, see isearch_scan_start().
        Fields updated:
        - is->search_flags: the current search mode and matching options
        - is->search_str: the string representation of the search string
@@ -486,6 +534,7 @@ static void isearch_run(ISearchState *is) {
         s->region_style = 0;
         s->multi_cursor_active = 0;
         is->found_offset = -1;
+        isearch_scan_stop(is);
     } else {
         if (search_offset == is->found_offset
         &&  search_offset == is->found_end) {
@@ -493,25 +542,154 @@ static void isearch_run(ISearchState *is) {
             if (is->dir > 0)
                 search_offset = eb_next(s->b, search_offset);
         }
-        if (eb_search(s->b, is->dir, flags,
-                      search_offset, s->b->total_size,
-                      is->search_u32, is->search_u32_len,
-                      search_abort_func, NULL,
-                      &is->found_offset, &is->found_end) > 0) {
-            s->region_style = QE_STYLE_SEARCH_MATCH;
-            if (is->dir >= 0) {
-                s->b->mark = is->found_offset;
-                s->offset = is->found_end;
-            } else {
-                s->b->mark = is->found_end;
-                s->offset = is->found_offset;
-            }
+        isearch_scan_start(is, search_offset);
+    }
+    isearch_show(is);
+    elapsed_time = get_clock_ms() - start_time;
+    if (elapsed_time >= 100)
+        put_status(s, "&|isearch_run: %dms", elapsed_time);
+}
+
+static int isearch_abort_func(void *opaque)
+{
+    ISearchState *is = opaque;
+
+    /* do not interrupt searches from keyboard macros */
+    if (!is->scan_deadline)
+        return 0;
+    return get_clock_ms() - is->scan_deadline >= 0 || is_user_input_pending();
+}
+
+static void isearch_scan_stop(ISearchState *is)
+{
+    is->scanning = 0;
+    if (is->scan_timer)
+        url_kill_timer(is->qs->up, &is->scan_timer);
+}
+
+/* search for the current string for a time slice, update the match
+   or schedule the next slice */
+static void isearch_scan(ISearchState *is)
+{
+    EditBuffer *b = is->s->b;
+    int flags = is->search_flags;
+    int end_offset, found_offset, found_end, res;
+
+    is->scan_deadline = 0;
+    if (is->qs->macro_key_index < 0)
+        is->scan_deadline = get_clock_ms() + ISEARCH_SLICE_MS;
+
+    for (;;) {
+        end_offset = b->total_size;
+        if (is->dir < 0) {
+            end_offset = is->scan_origin;
+        } else
+        if (flags & SEARCH_FLAG_REGEX) {
+            /* a forward regex search is not interruptible: cut the
+               buffer in chunks at line boundaries */
+            if (end_offset - is->scan_pos > ISEARCH_REGEX_CHUNK)
+                end_offset = eb_next_line(b, is->scan_pos + ISEARCH_REGEX_CHUNK);
+        }
+        res = eb_search(b, is->dir, flags, is->scan_pos, end_offset,
+                        is->search_u32, is->search_u32_len,
+                        isearch_abort_func, is, &found_offset, &found_end);
+        if (res > 0) {
+            is->scanning = 0;
+            is->found_offset = found_offset;
+            is->found_end = found_end;
+            /* the next search for a longer string will start here */
+            is->scan_pos = (is->dir < 0) ? eb_next(b, found_offset) : found_offset;
+            return;
+        }
+        if (res == 0 && end_offset < b->total_size && is->dir > 0) {
+            /* continue with the next chunk */
+            is->scan_pos = end_offset;
+            if (!isearch_abort_func(is))
+                continue;
+            found_end = end_offset;
+            res = -1;
+        }
+        if (res < 0 && found_end >= 0) {
+            /* time slice expired or user input pending */
+            is->scan_pos = found_end;
+            if (!is->scan_timer)
+                url_set_timer(is->qs->up, &is->scan_timer, 1, is, isearch_scan_cb);
+            return;
+        }
+        /* search failed */
+        is->scanning = 0;
+        is->found_offset = is->found_end = -1;
+        is->scan_pos = (is->dir < 0) ? 0 : b->total_size;
+        return;
+    }
+}
+
+static void isearch_scan_cb(void *opaque)
+{
+    ISearchState *is = opaque;
+
+    if (!is->scanning || !(is->search_flags & SEARCH_FLAG_ACTIVE)
+    ||  !qe_check_window(is->qs, &is->s)) {
+        is->scanning = 0;
+        return;
+    }
+    isearch_scan(is);
+    isearch_show(is);
+}
+
+static void isearch_scan_start(ISearchState *is, int search_offset)
+{
+    int flags = is->search_flags & SEARCH_FLAG_MASK;
+
+    /* A literal search for a string extending the previous one from the
+       same position cannot match before the position already reached,
+       unless the new search folds case where the previous one did not,
+       for instance after toggling case folding or with smart case.
+     */
+    if (is->scan_origin == search_offset
+    &&  is->scan_dir == is->dir
+    &&  !(flags & (SEARCH_FLAG_REGEX | SEARCH_FLAG_WORD))
+    &&  (flags & ~SEARCH_FLAG_CASE_MASK) == (is->scan_flags & ~SEARCH_FLAG_CASE_MASK)
+    &&  (!search_folds_case(flags, is->search_u32, is->search_u32_len)
+    ||   search_folds_case(is->scan_flags, is->scan_u32, is->scan_u32_len))
+    &&  is->scan_u32_len > 0
+    &&  is->search_u32_len >= is->scan_u32_len
+    &&  !memcmp(is->search_u32, is->scan_u32,
+                is->scan_u32_len * sizeof(*is->scan_u32))) {
+        /* resume from the position reached */
+    } else {
+        is->scan_pos = search_offset;
+    }
+    is->scan_origin = search_offset;
+    is->scan_dir = is->dir;
+    is->scan_flags = flags;
+    is->scan_u32_len = is->search_u32_len;
+    blockcpy(is->scan_u32, is->search_u32, is->search_u32_len);
+    is->scanning = 1;
+    isearch_scan(is);
+}
+
+/* update the window and the status line after a search step */
+static void isearch_show(ISearchState *is)
+{
+    EditState *s = is->s;
+    char ubuf[SEARCH_LENGTH * 3];
+    buf_t outbuf, *out;
+
+    if (!is->scanning && is->found_offset >= 0 && is->search_u32_len > 0) {
+        s->region_style = QE_STYLE_SEARCH_MATCH;
+        if (is->dir >= 0) {
+            s->b->mark = is->found_offset;
+            s->offset = is->found_end;
+        } else {
+            s->b->mark = is->found_end;
+            s->offset = is->found_offset;
         }
     }
 
     /* display search string */
     out = buf_init(&outbuf, ubuf, sizeof(ubuf));
-    if (is->found_offset < 0 && len > 0) {
+    if (!is->scanning && is->found_offset < 0 && is->search_u32_len > 0) {
         if (is->s->qs->macro_key_index >= 0) {
             /* if macro is running, abort search and macro */
             isearch_exit(is->s, KEY_RET);
@@ -537,9 +715,20 @@ static void isearch_run(ISearchState *is) {
     do_center_cursor(s, 0);
     put_status(s, "%s", out->buf);   /* XXX: why NULL? */
     qe_display(s->qs);
-    elapsed_time = get_clock_ms() - start_time;
-    if (elapsed_time >= 100)
-        put_status(s, "&|isearch_run: %dms", elapsed_time);
+}
+
+void isearch_mode_line(EditState *s, buf_t *out)
+{
+    /* show the progress of a search in progress */
+    ISearchState *is = s->isearch_state;
+
+    if (is && is->scanning) {
+        int total = (is->dir < 0) ? is->scan_origin :
+            s->b->total_size - is->scan_origin;
+        int done = (is->dir < 0) ? is->scan_origin - is->scan_pos :
+            is->scan_pos - is->scan_origin;
+        buf_printf(out, "--Searching %d%%", compute_percent(done, total));
+    }
 }
 
 static int isearch_grab(ISearchState *is, EditBuffer *b, int from, int to) {
@@ -636,7 +825,7 @@ static void isearch_addpos(EditState *s, int dir) {
      */
     int curdir;
     ISearchState *is = s->isearch_state;
-    if (!is)
+    if (!is || is->scanning)
         return;
 
     curdir = is->dir;
@@ -768,6 +957,8 @@ static void isearch_end(ISearchState *is) {
         add_string(hist, is->search_str, 0);
     }
     is->search_flags &= ~SEARCH_FLAG_ACTIVE;
+    isearch_scan_stop(is);
+    isearch_match_reset(qs, is);
     qe_display(qs);
 }
 
@@ -826,7 +1017,10 @@ static void isearch_key(QEmacsState *qs, void *opaque, int key) {
             isearch_printing_char(s, key);
         }
     } else {
-        KeyDef *kd = qe_find_binding(keys, 1, isearch_mode.first_key, 1);
+        KeyDef *kd;
+
+        qe_load_mode_bindings(s->qs, &isearch_mode);
+        kd = qe_find_binding(keys, 1, isearch_mode.first_key, 1);
         if (kd) {
             exec_command(s, kd->cmd, NO_ARG, key);
         } else {
@@ -860,8 +1054,11 @@ static ISearchState *set_search_state(EditState *s, int argval, int dir) {
     if (s == NULL)
         return NULL;
 
+    isearch_scan_stop(is);
+    isearch_match_reset(s->qs, is);
     memset(is, 0, sizeof(*is));
     s->isearch_state = is;
+    is->qs = s->qs;
     is->s = s;
     is->saved_mark = s->b->mark;
     is->start_offset = s->offset;
@@ -939,13 +1136,118 @@ static int search_to_u32(char32_t *buf, int size,
     }
 }
 
+int eb_search_string(EditBuffer *b, const char *search_str, int dir,
+                     int start_offset, int end_offset,
+                     CSSAbortFunc *abort_func, void *abort_opaque,
+                     int *found_offset, int *found_end)
+{
+    /*@API search
+       Search a buffer for a search string.
+       @argument `b` a valid EditBuffer pointer
+       @argument `search_str` the search string, optionally prefixed with
+         search tags such as `[Regex] ` or `[Word] `
+       @argument `dir` search direction: -1 for backward, 1 for forward
+       @argument `start_offset` the starting offset in buffer
+       @argument `end_offset` the maximum offset in buffer, matches
+         must end before `end_offset` for a backward search
+       @argument `abort_func` a function pointer to test for abort request
+       @argument `abort_opaque` an opaque argument for `abort_func`
+       @argument `found_offset` a valid pointer to store the match
+         starting offset
+       @argument `found_end` a valid pointer to store the match
+         ending offset
+       @return the same values as `eb_search`.
+       @note this function is used by modules that do not have access to
+       the search engine internals, such as the built-in grep command.
+       It only uses the buffer functions allowed on snapshots, so a job
+       can call it on a snapshot from a worker thread.
+     */
+    char32_t search_u32[SEARCH_LENGTH];
+    int flags, len;
+
+    flags = search_string_get_flags(search_str, SEARCH_FLAG_DEFAULT, &search_str);
+    len = search_to_u32(search_u32, countof(search_u32), search_str, flags);
+    return eb_search(b, dir, flags, start_offset, end_offset,
+                     search_u32, len, abort_func, abort_opaque,
+                     found_offset, found_end);
+}
+
+static void isearch_match_callback(EditBuffer *b, void *opaque, int arg,
+                                   enum LogOperation op, int offset, int size)
+{
+    ISearchState *is = opaque;
+
+    /* any modification invalidates the cached matches */
+    is->match_valid = 0;
+}
+
+static void isearch_match_reset(QEmacsState *qs, ISearchState *is)
+{
+    if (qe_check_buffer(qs, &is->match_b))
+        eb_free_callback(is->match_b, isearch_match_callback, is);
+    is->match_b = NULL;
+    is->match_valid = 0;
+    is->nb_matches = 0;
+    qe_free(&is->matches);
+    is->size_matches = 0;
+}
+
+/* compute the matches in the visible range of `s` plus a margin,
+   `offset` must be in the range */
+static void isearch_match_update(EditState *s, ISearchState *is,
+                                 int flags, int offset)
+{
+    EditBuffer *b = s->b;
+    int start, end, span, found_offset, found_end;
+
+    if (is->match_b != b) {
+        isearch_match_reset(s->qs, is);
+        is->match_b = b;
+        eb_add_callback(b, isearch_match_callback, is, 0);
+    }
+    start = min_offset(s->offset_top, offset);
+    end = max_offset(s->offset_bottom, offset);
+    span = max_offset(end - start, ISEARCH_MATCH_MARGIN);
+    start = eb_goto_bol(b, max_offset(start - span, 0));
+    end = eb_next_line(b, min_offset(end + span, b->total_size));
+
+    is->nb_matches = 0;
+    for (offset = start;
+         eb_search(b, 1, flags, offset, end, is->search_u32, is->search_u32_len,
+                   NULL, NULL, &found_offset, &found_end) > 0;
+         offset = found_end)
+    {
+        if (found_end <= found_offset) {
+            /* zero width match: skip one character.
+             * for example `a*` finds matches everywhere but should highlight
+             * all sequences of letters a
+             */
+            found_end = eb_next(b, found_end);
+            continue;
+        }
+        if (is->nb_matches + 2 > is->size_matches) {
+            int new_size = is->size_matches + (is->size_matches >> 1) + 64;
+            if (!qe_realloc_array(&is->matches, new_size))
+                break;
+            is->size_matches = new_size;
+        }
+        is->matches[is->nb_matches++] = found_offset;
+        is->matches[is->nb_matches++] = found_end;
+    }
+    is->match_start = start;
+    is->match_end = end;
+    is->match_flags = flags;
+    is->match_u32_len = is->search_u32_len;
+    blockcpy(is->match_u32, is->search_u32, is->search_u32_len);
+    is->match_valid = 1;
+}
+
 void isearch_colorize_matches(EditState *s, char32_t *buf, int len,
                               QETermStyle *sbuf, int offset_start)
 {
     ISearchState *is = s->isearch_state;
     EditBuffer *b = s->b;
-    int offset, char_offset, found_offset, found_end, offset_end;
-    int search_flags;
+    int search_flags, lo, hi, i, offset, pos, start, stop;
 
     if (!is)
         return;
@@ -966,43 +1268,43 @@ void isearch_colorize_matches(EditState *s, char32_t *buf, int len,
     if (is->search_u32_len <= 0)
         return;
 
-    char_offset = eb_get_char_offset(b, offset_start);
-    offset_end = eb_goto_char(b, char_offset + len);
-    offset = 0;
-    if (char_offset > is->search_u32_len + 1)
-        offset = eb_goto_char(b, char_offset - is->search_u32_len - 1);
+    search_flags &= SEARCH_FLAG_MASK;
+    if (!is->match_valid || is->match_b != b
+    ||  offset_start < is->match_start || offset_start >= is->match_end
+    ||  is->match_flags != search_flags
+    ||  is->match_u32_len != is->search_u32_len
+    ||  memcmp(is->match_u32, is->search_u32,
+               is->search_u32_len * sizeof(*is->search_u32))) {
+        isearch_match_update(s, is, search_flags, offset_start);
+    }
 
-    while (eb_search(b, 1, search_flags, offset, offset_end,
-                     is->search_u32, is->search_u32_len, NULL, NULL,
-                     &found_offset, &found_end) > 0) {
-        int line, start, stop, i;
+    /* find the first match ending after the start of the line */
+    lo = 0;
+    hi = is->nb_matches >> 1;
+    while (lo < hi) {
+        int mid = (lo + hi) >> 1;
+        if (is->matches[2 * mid + 1] <= offset_start)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
 
-        if (found_offset >= offset_end)
-            break;
-        if (found_end <= found_offset) {
-            /* zero width match: skip one character.
-             * for example `a*` finds matches everywhere but should highlight
-             * all sequences of letters a
-             */
-            offset = eb_next(b, found_end);
-            continue;
+    /* map match offsets to character positions in a single pass */
+    offset = offset_start;
+    pos = 0;
+    for (i = 2 * lo; i < is->nb_matches && pos < len; i += 2) {
+        while (offset < is->matches[i] && pos < len) {
+            offset = eb_next(b, offset);
+            pos++;
         }
-        if (found_end > offset_start) {
-            /* Compute character positions */
-            start = 0;
-            if (found_offset > offset_start)
-                eb_get_pos(b, &line, &start, found_offset);
-            stop = len;
-            if (found_end < offset_end) {
-                eb_get_pos(b, &line, &stop, found_end);
-                if (stop > len)
-                    stop = len;
-            }
-            for (i = start; i < stop; i++) {
-                sbuf[i] = QE_STYLE_SEARCH_HILITE;
-            }
+        start = pos;
+        while (offset < is->matches[i + 1] && pos < len) {
+            offset = eb_next(b, offset);
+            pos++;
+        }
+        for (stop = pos; start < stop; start++) {
+            sbuf[start] = QE_STYLE_SEARCH_HILITE;
         }
-        offset = found_end;
     }
 }
 
@@ -1084,6 +1386,62 @@ static void query_replace_replace(QueryReplaceState *is)
                                              is->replace_u32, is->replace_u32_len);
 }
 
+/* minimum number of matches to use bulk replacement */
+#define REPLACE_BULK_MIN  64
+
+static void query_replace_all(QueryReplaceState *is)
+{
+    /* Replace all remaining matches in a single buffer operation.
+       Matches are collected first without modifying the buffer, then
+       replaced by eb_replace_ranges().  If there are only a few matches,
+       let the caller replace them one at a time.
+     */
+    EditState *s = is->s;
+    EditBuffer *b = s->b;
+    int *ranges = NULL;
+    int nb_ranges = 0, size_ranges = 0;
+    int offset, found_offset, found_end, len, i, end;
+    char *buf;
+
+    for (offset = is->found_offset;
+         eb_search(b, 1, is->search_flags, offset, b->total_size,
+                   is->search_u32, is->search_u32_len,
+                   NULL, NULL, &found_offset, &found_end) > 0;
+         offset = found_end)
+    {
+        if (2 * nb_ranges + 2 > size_ranges) {
+            int new_size = size_ranges + (size_ranges >> 1) + 256;
+            if (!qe_realloc_array(&ranges, new_size)) {
+                nb_ranges = 0;
+                break;
+            }
+            size_ranges = new_size;
+        }
+        ranges[2 * nb_ranges] = found_offset;
+        ranges[2 * nb_ranges + 1] = found_end;
+        nb_ranges++;
+        if (found_end <= found_offset) {
+            /* zero width match: skip one character */
+            if (found_end >= b->total_size)
+                break;
+            found_end = eb_next(b, found_end);
+        }
+    }
+    if (nb_ranges >= REPLACE_BULK_MIN
+    &&  (buf = qe_malloc_array(char, is->replace_u32_len * MAX_CHAR_BYTES + 1)) != NULL) {
+        for (len = i = 0; i < is->replace_u32_len; i++) {
+            len += eb_encode_char32(b, buf + len, is->replace_u32[i]);
+        }
+        end = eb_replace_ranges(b, ranges, nb_ranges, buf, len);
+        if (end >= 0) {
+            is->nb_reps += nb_ranges;
+            is->found_offset = end;
+        }
+        qe_free(&buf);
+    }
+    qe_free(&ranges);
+}
+
 static void query_replace_run(QueryReplaceState *is)
 {
     EditState *s = is->s;
@@ -1098,6 +1456,9 @@ static void query_replace_run(QueryReplaceState *is)
                                         countof(is->replace_u32),
                                         is->replace_str, is->search_flags);
 
+    if (is->replace_all)
+        query_replace_all(is);
+
     for (;;) {
         if (eb_search(s->b, 1, is->search_flags,
                       is->found_offset, s->b->total_size,
@@ -1387,7 +1748,8 @@ void do_search_string(EditState *s, const char *search_str, int mode)
     }
 
     while (eb_search(s->b, mode == CMD_SEARCH_BACKWARD ? -1 : 1,
-                     flags, offset, max_offset,
+                     flags, offset,
+                     mode == CMD_SEARCH_BACKWARD ? offset : max_offset,
                      search_u32, search_u32_len,
                      NULL, NULL, &found_offset, &found_end) > 0
        &&  found_offset >= min_offset)
@@ -1474,6 +1836,442 @@ void do_search_string(EditState *s, const char *search_str, int mode)
     }
 }
 
+/* occur mode: the match list buffer only contains a newline per
+ * matching line, the index maps each line to the beginning of the
+ * matching line in the source buffer and the lines are rendered on
+ * the fly from the source buffer.  Memory usage is thus bounded to 9
+ * bytes per match.  The index is kept up to date with a buffer
+ * callback: offsets are shifted immediately and the modified lines
+ * are searched again from a bottom half.  Line numbers are computed
+ * when entries are displayed, from the previous entry if known, and
+ * cached until the source buffer is modified before them.
+ */
+
+typedef struct OccurState {
+    QEModeData base;
+    EditBuffer *src;    /* source buffer */
+    int *offsets;       /* beginning of matching lines in source buffer */
+    int *lines;         /* cached line numbers or -1, may be NULL */
+    int nb_offsets, size_offsets;
+    int dirty_start;    /* range of source buffer to search again */
+    int dirty_end;      /* dirty_start < 0 if no changes */
+    int update_pending;
+    int search_flags;
+    int search_u32_len;
+    char32_t search_u32[SEARCH_LENGTH];
+    char search_str[SEARCH_LENGTH * 3];
+} OccurState;
+
+#define OCCUR_MAX_WIDTH  1024   /* maximum number of characters displayed */
+#define OCCUR_LINE_STEP  4096   /* maximum distance to count lines from */
+
+static ModeDef occur_mode;
+
+static inline OccurState *occur_get_state(EditState *e, int status)
+{
+    return qe_get_buffer_mode_data(e->b, &occur_mode, status ? e : NULL);
+}
+
+/* collect the beginning of matching lines in range [start, end) */
+static int occur_scan(OccurState *os, int start, int end,
+                      int **tabp, int *nbp, int *sizep)
+{
+    EditBuffer *b = os->src;
+    int offset, found_offset, found_end, p1, p2, p3, count = 0;
+
+    for (offset = start; offset < end;) {
+        if (eb_search(b, 1, os->search_flags, offset, end,
+                      os->search_u32, os->search_u32_len,
+                      NULL, NULL, &found_offset, &found_end) <= 0)
+            break;
+        p1 = eb_goto_bol(b, found_offset);
+        p2 = found_end;
+        if (p2 == p1 || eb_prevc(b, p2, &p3) != '\n')
+            p2 = eb_next_line(b, p2);
+        if (*nbp >= *sizep) {
+            int new_size = *sizep + (*sizep >> 1) + 256;
+            if (!qe_realloc_array(tabp, new_size))
+                break;
+            *sizep = new_size;
+        }
+        (*tabp)[(*nbp)++] = p1;
+        count++;
+        if (p2 <= offset)
+            break;
+        offset = p2;
+    }
+    return count;
+}
+
+/* index of the first entry at or after `offset` */
+static int occur_find_index(OccurState *os, int offset)
+{
+    int lo = 0, hi = os->nb_offsets;
+
+    while (lo < hi) {
+        int mid = (lo + hi) >> 1;
+        if (os->offsets[mid] < offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* replace entries [i0, i1) with `n` entries from `tab` and update the
+   occur buffer accordingly */
+static void occur_replace_entries(OccurState *os, int i0, int i1,
+                                  const int *tab, int n)
+{
+    EditBuffer *b = os->base.b;
+    int i, old = i1 - i0;
+    int flags = b->flags & BF_READONLY;
+
+    if (n > old) {
+        int new_size = os->nb_offsets + n - old;
+        if (new_size > os->size_offsets) {
+            if (!qe_realloc_array(&os->offsets, new_size))
+                return;
+            if (os->lines && !qe_realloc_array(&os->lines, new_size))
+                qe_free(&os->lines);
+            os->size_offsets = new_size;
+        }
+    }
+    memmove(os->offsets + i0 + n, os->offsets + i1,
+            (os->nb_offsets - i1) * sizeof(*os->offsets));
+    if (n > 0)
+        memcpy(os->offsets + i0, tab, n * sizeof(*tab));
+    if (os->lines) {
+        memmove(os->lines + i0 + n, os->lines + i1,
+                (os->nb_offsets - i1) * sizeof(*os->lines));
+        for (i = i0; i < i0 + n; i++)
+            os->lines[i] = -1;
+    }
+    os->nb_offsets += n - old;
+
+    /* one line per entry in the occur buffer */
+    b->flags &= ~BF_READONLY;
+    if (n > old)
+        eb_insert_char32_n(b, i0, '\n', n - old);
+    else
+    if (n < old)
+        eb_delete(b, i0, old - n);
+    b->flags |= flags;
+}
+
+static void occur_update(void *opaque)
+{
+    OccurState *os = opaque;
+    QEmacsState *qs = os->base.qs;
+    EditBuffer *b;
+    int start, end, i0, i1, nb = 0, size = 0;
+    int *tab = NULL;
+
+    os->update_pending = 0;
+    b = qe_check_buffer(qs, &os->src);
+    if (!b || os->dirty_start < 0)
+        return;
+
+    start = eb_goto_bol(b, os->dirty_start);
+    end = eb_next_line(b, os->dirty_end);
+    os->dirty_start = os->dirty_end = -1;
+
+    i0 = occur_find_index(os, start);
+    i1 = (end >= b->total_size) ? os->nb_offsets : occur_find_index(os, end);
+    occur_scan(os, start, end, &tab, &nb, &size);
+    occur_replace_entries(os, i0, i1, tab, nb);
+    qe_free(&tab);
+}
+
+static void occur_callback(EditBuffer *b, void *opaque, int arg,
+                           enum LogOperation op, int offset, int size)
+{
+    OccurState *os = opaque;
+    int i, i0, n = os->nb_offsets;
+    int *tab = os->offsets;
+
+    /* called before the modification: shift the index and extend the
+       dirty range, lines are searched again from a bottom half */
+    switch (op) {
+    case LOGOP_INSERT:
+        for (i = i0 = occur_find_index(os, offset + 1); i < n; i++)
+            tab[i] += size;
+        if (os->dirty_start > offset)
+            os->dirty_start += size;
+        if (os->dirty_end >= offset)
+            os->dirty_end += size;
+        break;
+    case LOGOP_DELETE:
+        /* entries inside the deleted range collapse to `offset` and
+           will be removed when the range is searched again */
+        for (i = i0 = occur_find_index(os, offset + 1); i < n; i++)
+            tab[i] = max_offset(tab[i] - size, offset);
+        if (os->dirty_start > offset)
+            os->dirty_start = max_offset(os->dirty_start - size, offset);
+        if (os->dirty_end > offset)
+            os->dirty_end = max_offset(os->dirty_end - size, offset);
+        size = 0;
+        break;
+    case LOGOP_WRITE:
+        i0 = n;
+        break;
+    default:
+        return;
+    }
+    /* line numbers of the shifted entries may have changed */
+    if (os->lines) {
+        for (i = i0; i < n; i++)
+            os->lines[i] = -1;
+    }
+    if (os->dirty_start < 0 || os->dirty_start > offset)
+        os->dirty_start = offset;
+    if (os->dirty_end < offset + size)
+        os->dirty_end = offset + size;
+    if (!os->update_pending) {
+        os->update_pending = 1;
+        url_register_bottom_half(os->base.qs->up, occur_update, os);
+    }
+}
+
+static void occur_display_hook(EditState *s)
+{
+    OccurState *os = occur_get_state(s, 0);
+
+    /* bring the index up to date before the window is displayed */
+    if (os && os->update_pending) {
+        url_unregister_bottom_half(s->qs->up, occur_update, os);
+        occur_update(os);
+    }
+}
+
+/* line number of entry `i`, counted from the previous entry if known */
+static int occur_line_number(OccurState *os, EditBuffer *b, int i)
+{
+    int line, col, pos, end;
+
+    if (os->lines && os->lines[i] >= 0)
+        return os->lines[i];
+    end = os->offsets[i];
+    if (os->lines && i > 0 && os->lines[i - 1] >= 0
+    &&  end - os->offsets[i - 1] <= OCCUR_LINE_STEP) {
+        line = os->lines[i - 1];
+        for (pos = os->offsets[i - 1]; pos < end; pos = eb_next_line(b, pos))
+            line++;
+    } else {
+        eb_get_pos(b, &line, &col, end);
+    }
+    if (os->lines)
+        os->lines[i] = line;
+    return line;
+}
+
+static int occur_display_line(EditState *s, DisplayState *ds, int offset)
+{
+    QEmacsState *qs = s->qs;
+    OccurState *os = occur_get_state(s, 0);
+    EditBuffer *b;
+    int pos, stop, line_num, col_num, offset1;
+    int match_start, match_end;
+    char32_t c;
+
+    display_bol(ds);
+
+    if (!os || !(b = qe_check_buffer(qs, &os->src))
+    ||  offset >= os->nb_offsets || offset >= s->b->total_size) {
+        display_eol(ds, offset, offset + 1);
+        return -1;
+    }
+    if (s->offset == offset && (qs->active_window == s || s->force_highlight))
+        ds->line_style = QE_STYLE_HIGHLIGHT;
+
+    pos = os->offsets[offset];
+    line_num = occur_line_number(os, b, offset);
+    ds->style = QE_STYLE_GUTTER;
+    display_printf(ds, offset, offset + 1, "%7d:", line_num + 1);
+    ds->style = 0;
+    display_char(ds, -1, -1, ' ');
+
+    /* render the source line, highlighting the matches */
+    stop = min_offset(eb_goto_eol(b, pos), pos + OCCUR_MAX_WIDTH);
+    match_start = match_end = pos;
+    for (col_num = 0; pos < stop && col_num < OCCUR_MAX_WIDTH; col_num++) {
+        if (pos >= match_end) {
+            if (eb_search(b, 1, os->search_flags, pos, stop,
+                          os->search_u32, os->search_u32_len, NULL, NULL,
+                          &match_start, &match_end) <= 0) {
+                match_start = match_end = INT_MAX;
+            }
+        }
+        ds->style = (pos >= match_start && pos < match_end) ?
+            QE_STYLE_SEARCH_HILITE : 0;
+        c = eb_nextc(b, pos, &pos);
+        if ((c < ' ' && c != '\t') || c == 127) {
+            display_printf(ds, -1, -1, "^%c", (int)(('@' + c) & 127));
+        } else {
+            display_char(ds, -1, -1, c);
+        }
+    }
+    ds->style = 0;
+    offset1 = offset + 1;
+    display_eol(ds, -1, -1);
+    return offset1;
+}
+
+static void occur_mode_line(EditState *s, buf_t *out)
+{
+    OccurState *os = occur_get_state(s, 0);
+
+    basic_mode_line(s, out, 'T');
+    if (os) {
+        EditBuffer *b = qe_check_buffer(s->qs, &os->src);
+        buf_printf(out, "--%d/%d", min_int(s->offset + 1, os->nb_offsets),
+                   os->nb_offsets);
+        buf_printf(out, "--%s", b ? b->name : "(killed)");
+        buf_printf(out, "--\"%s\"", os->search_str);
+    }
+}
+
+static void occur_mode_free(EditBuffer *b, void *state)
+{
+    OccurState *os = state;
+    QEmacsState *qs = os->base.qs;
+
+    if (qe_check_buffer(qs, &os->src))
+        eb_free_callback(os->src, occur_callback, os);
+    if (os->update_pending)
+        url_unregister_bottom_half(qs->up, occur_update, os);
+    qe_free(&os->offsets);
+    qe_free(&os->lines);
+    os->nb_offsets = os->size_offsets = 0;
+}
+
+static void do_occur(EditState *s, const char *search_str)
+{
+    QEmacsState *qs = s->qs;
+    const char *str;
+    EditBuffer *b;
+    EditState *e = NULL;
+    OccurState *os;
+    int start_time = get_clock_ms();
+
+    /* discard the previous occur list and its callback, reuse its window.
+       list-matching-lines uses "*occur*" for a plain copy of the lines */
+    b = qe_find_buffer_name(qs, "*Occur*");
+    if (b) {
+        e = eb_find_window(b, NULL);
+        qe_kill_buffer(qs, b);
+        e = qe_check_window(qs, &e);
+    }
+    b = qe_new_buffer(qs, "*Occur*", BC_CLEAR | BF_UTF8);
+    if (!b)
+        return;
+    os = (OccurState *)qe_create_buffer_mode_data(b, &occur_mode);
+    if (!os) {
+        qe_kill_buffer(qs, b);
+        return;
+    }
+    os->src = s->b;
+    os->dirty_start = os->dirty_end = -1;
+    pstrcpy(os->search_str, sizeof(os->search_str), search_str);
+    os->search_flags = search_string_get_flags(search_str, SEARCH_FLAG_DEFAULT, &str);
+    os->search_u32_len = search_to_u32(os->search_u32, countof(os->search_u32),
+                                       str, os->search_flags);
+    if (os->search_u32_len > 0) {
+        occur_scan(os, 0, s->b->total_size,
+                   &os->offsets, &os->nb_offsets, &os->size_offsets);
+    }
+    if (os->nb_offsets == 0) {
+        qe_kill_buffer(qs, b);
+        put_status(s, "No matches");
+        return;
+    }
+    os->lines = qe_malloc_array(int, os->size_offsets);
+    if (os->lines)
+        memset(os->lines, -1, os->size_offsets * sizeof(*os->lines));
+    eb_insert_char32_n(b, 0, '\n', os->nb_offsets);
+    eb_add_callback(s->b, occur_callback, os, 0);
+    b->flags |= BF_READONLY;
+    b->default_mode = &occur_mode;
+
+    /* show the match list below the source window so it can be
+       edited while the list is updated */
+    if (!e || e == s)
+        e = qe_split_window(s, SW_STACKED, 66);
+    if (e) {
+        switch_to_buffer(e, b);
+        e->target_window = s;
+        qs->active_window = e;
+    } else {
+        e = show_popup(s, b, "Occur");
+        if (!e)
+            return;
+    }
+    edit_set_mode(e, &occur_mode);
+    /* select the first match at or after point */
+    e->offset = min_offset(occur_find_index(os, eb_goto_bol(s->b, s->offset)),
+                           os->nb_offsets - 1);
+    put_status(e, "%d matching lines (%d ms)", os->nb_offsets,
+               get_clock_ms() - start_time);
+}
+
+/* show the source line for the current entry in the target window */
+static void occur_show(EditState *s, int activate)
+{
+    OccurState *os = occur_get_state(s, 1);
+    EditBuffer *b;
+    EditState *e;
+    int offset;
+
+    if (!os)
+        return;
+    if (!(b = qe_check_buffer(s->qs, &os->src))) {
+        put_error(s, "Source buffer was killed");
+        return;
+    }
+    if (s->offset >= os->nb_offsets) {
+        put_error(s, "No occurrence on this line");
+        return;
+    }
+    offset = os->offsets[s->offset];
+    if (s->flags & WF_POPUP) {
+        /* the popup and the occur state are freed if activate is set */
+        e = qe_find_target_window(s, activate);
+    } else {
+        e = qe_check_window(s->qs, &s->target_window);
+        if (!e || e->b != b)
+            e = eb_find_window(b, s);
+        if (!e)
+            e = s;
+        if (activate)
+            s->qs->active_window = e;
+    }
+    if (e->b != b)
+        switch_to_buffer(e, b);
+    e->offset = offset;
+    do_center_cursor(e, 0);
+}
+
+static void do_occur_goto(EditState *s)
+{
+    occur_show(s, 1);
+}
+
+static void do_occur_next(EditState *s, int dir)
+{
+    OccurState *os = occur_get_state(s, 1);
+    int offset;
+
+    if (!os)
+        return;
+    offset = s->offset + dir;
+    if (offset < 0 || offset >= os->nb_offsets) {
+        put_error(s, "No more occurrences");
+        return;
+    }
+    s->offset = offset;
+    occur_show(s, 0);
+}
+
 static void minibuffer_search_bindings(EditState *s, int enable)
 {
     /* bindings used to configure search flags */
@@ -1508,6 +2306,8 @@ static void minibuffer_search_end_edit(EditState *s, char *dest, int size) {
     if ((s1 = s->target_window) != NULL && s1->isearch_state) {
         // XXX: prefix the output string with search flags?
         s1->isearch_state->minibuffer = NULL;
+        isearch_scan_stop(s1->isearch_state);
+        isearch_match_reset(s->qs, s1->isearch_state);
         s1->isearch_state = NULL;
         // XXX: should free the ISearchState structure
         minibuffer_search_bindings(s, FALSE);
@@ -1656,12 +2456,10 @@ static const CmdDef search_commands[] = {
           do_search_string, ESsi, "*"
           "s{List lines containing: }[search]|search|"
           "v", CMD_LIST_MATCHING_LINES)
-    /* list-matching-lines and occur are aliases */
-    CMD3( "occur", "",
-          "List lines containing a string in popup window",
-          do_search_string, ESsi, "*"
-          "s{List lines containing: }[search]|search|"
-          "v", CMD_LIST_MATCHING_LINES)
+    CMD2( "occur", "",
+          "Show an updated list of the lines containing a string",
+          do_occur, ESs,
+          "s{List lines containing: }[search]|search|")
     /* passing argument should switch to regex incremental search */
     CMD3( "isearch-backward", "C-r",
           "Search backward incrementally",
@@ -1690,11 +2488,42 @@ static ModeDef isearch_mode = {
     //.desc = "";
 };
 
+/* additional mode specific bindings */
+static const char * const occur_bindings[] = {
+    "q", "delete-window",
+    NULL
+};
+
+static const CmdDef occur_commands[] = {
+    CMD0( "occur-goto-occurrence", "RET, SPC",
+          "Go to the source line of the current occurrence",
+          do_occur_goto)
+    CMD3( "occur-next", "n, TAB",
+          "Show the next occurrence in the target window",
+          do_occur_next, ESi, "v", 1)
+    CMD3( "occur-previous", "p, S-TAB",
+          "Show the previous occurrence in the target window",
+          do_occur_next, ESi, "v", -1)
+};
+
 static int search_init(QEmacsState *qs) {
     qe_register_mode(qs, &isearch_mode, MODEF_NOCMD);
     qe_register_commands(qs, &isearch_mode, isearch_commands, countof(isearch_commands));
     qe_register_commands(qs, NULL, search_commands, countof(search_commands));
     qe_register_completion(qs, &search_completion);
+
+    /* occur mode inherits from text mode */
+    memcpy(&occur_mode, &text_mode, offsetof(ModeDef, first_key));
+    occur_mode.name = "occur";
+    occur_mode.mode_probe = NULL;
+    occur_mode.buffer_instance_size = sizeof(OccurState);
+    occur_mode.mode_free = occur_mode_free;
+    occur_mode.display_hook = occur_display_hook;
+    occur_mode.display_line = occur_display_line;
+    occur_mode.get_mode_line = occur_mode_line;
+    occur_mode.bindings = occur_bindings;
+    qe_register_mode(qs, &occur_mode, MODEF_NOCMD | MODEF_VIEW);
+    qe_register_commands(qs, &occur_mode, occur_commands, countof(occur_commands));
     return 0;
 }
 
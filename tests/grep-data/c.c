@@ -0,0 +1 @@
+needle in a .c file
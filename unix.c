@@ -32,8 +32,14 @@
 typedef u_int fdesc_t;
 #else
 #include <sys/wait.h>
+#include <pthread.h>
 typedef int fdesc_t;
 #endif
+#ifdef CONFIG_LINUX
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#endif
 
 /* NOTE: it is strongly inspirated from the 'links' browser API */
 
@@ -42,11 +48,17 @@ typedef struct IOHandler {
     void (*read_cb)(void *opaque);
     void *write_opaque;
     void (*write_cb)(void *opaque);
+    unsigned int gen;   /* incremented when the handlers change */
+    int registered;     /* 1 if registered with epoll, -1 if not pollable */
 } IOHandler;
 
+#define URL_MAX_EVENTS  64
+
 typedef struct PidHandler {
     struct PidHandler *next, *prev;
+    URLState *up;
     int pid;
+    int pidfd;  /* process descriptor, -1 if the pid must be polled */
     void (*cb)(void *opaque, int status);
     void *opaque;
 } PidHandler;
@@ -55,25 +67,92 @@ typedef struct BottomHalfEntry {
     struct BottomHalfEntry *next, *prev;
     void (*cb)(void *opaque);
     void *opaque;
+    URLJob *job;    /* job that posted the callback with a bound */
 } BottomHalfEntry;
 
 struct URLTimer {
     void *opaque;
     void (*cb)(void *opaque);
+    URLTimer **handle;  /* cleared when the timer fires, may be NULL */
     int timeout;
-    struct URLTimer *next;
+    int index;  /* position in the timer heap */
+};
+
+struct URLWatch {
+    struct URLWatch *next;
+    int wd;     /* watch descriptor, -1 if removed by the kernel */
+    void (*cb)(void *opaque, int events, const char *name);
+    void *opaque;
 };
 
+enum {
+    URL_JOB_PENDING,
+    URL_JOB_RUNNING,
+    URL_JOB_DONE,
+};
+
+struct URLJob {
+    struct URLJob *next;
+    URLState *up;
+    void (*run)(URLJob *job, void *opaque);
+    void (*done)(void *opaque, int canceled);
+    void *opaque;
+    int state;      /* protected by job_lock */
+    int canceled;   /* protected by job_lock */
+    int nb_posted;  /* protected by job_lock: bounded posts not called yet */
+};
+
+#define URL_MAX_WORKERS  8
+
+/* Timers are kept in a binary min-heap ordered by timeout, so adding,
+ * firing and killing a timer cost O(log n) and the next timeout is
+ * found at the root. Each timer knows its position in the heap and the
+ * handle it is stored to, which is cleared when the timer fires.
+ * Child processes are tracked with process descriptors (pidfd) that
+ * become readable when the process terminates. Where pidfd_open() is
+ * not available, terminated children are polled with waitpid() after
+ * each wake-up.
+ */
+
+/* I/O readiness is polled with epoll when available and select()
+ * otherwise. With epoll, the cost of a wake-up is proportional to the
+ * number of ready descriptors and there is no FD_SETSIZE limit.
+ * In both cases, a generation number is recorded with each ready
+ * descriptor: events are ignored if its handlers were changed by a
+ * previous callback, for example if the descriptor was closed and its
+ * number reused for a different resource.
+ */
 struct URLState {
     fd_set rfds, wfds;
     int nfds;
-    IOHandler handlers[256];
+    IOHandler *handlers;
+    int nb_handlers;
+    int epoll_fd;
+    int nb_unpollable;  /* regular files are always ready */
     int exit_request;
     void (*tail_cb)(void *opaque);
     void *tail_opaque;
     struct list_head pid_handlers;
+    int nb_polled_pids;     /* pid handlers without a pidfd */
     struct list_head bottom_halves;
-    URLTimer *first_timer;
+    URLTimer **timers;      /* min-heap of pending timers */
+    int nb_timers;
+    int timers_size;
+    int watch_fd;
+    int watch_dispatch;     /* watch callbacks are being called */
+    URLWatch *first_watch;
+#ifndef CONFIG_WIN32
+    pthread_mutex_t job_lock;
+    pthread_cond_t job_cond;
+    pthread_cond_t post_cond;   /* a bounded post was called */
+#endif
+    URLJob *first_job, **last_job;      /* jobs waiting for a worker */
+    URLJob *first_done, **last_done;    /* jobs waiting for completion */
+    BottomHalfEntry *first_post, **last_post;   /* posted by workers */
+    int job_wakeup;         /* a byte is pending in job_pipe */
+    int nb_workers;         /* 0 until the first job, -1 if no threads */
+    int nb_jobs;            /* jobs whose `done` callback was not called */
+    int job_pipe[2];        /* wakes up the main loop on job completion */
 };
 
 URLState *url_init(void) {
@@ -83,44 +162,168 @@ URLState *url_init(void) {
         FD_ZERO(&up->wfds);
         QE_LIST_INIT(up->pid_handlers);
         QE_LIST_INIT(up->bottom_halves);
+        up->watch_fd = -1;
+        up->epoll_fd = -1;
+        up->last_job = &up->first_job;
+        up->last_done = &up->first_done;
+        up->last_post = &up->first_post;
+        up->job_pipe[0] = up->job_pipe[1] = -1;
+#ifndef CONFIG_WIN32
+        pthread_mutex_init(&up->job_lock, NULL);
+        pthread_cond_init(&up->job_cond, NULL);
+        pthread_cond_init(&up->post_cond, NULL);
+#endif
+#ifdef CONFIG_LINUX
+        up->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+#endif
     }
     return up;
 }
 
-int url_set_read_handler(URLState *up, int fd, void (*cb)(void *opaque), void *opaque)
+#ifdef CONFIG_LINUX
+static void url_epoll_update(URLState *up, int fd, IOHandler *uh)
 {
-    if (fd < 0 || fd >= countof(up->handlers))
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof ev);
+    if (uh->read_cb)
+        ev.events |= EPOLLIN;
+    if (uh->write_cb)
+        ev.events |= EPOLLOUT;
+    ev.data.u64 = (unsigned int)fd | ((uint64_t)uh->gen << 32);
+
+    if (uh->registered < 0) {
+        up->nb_unpollable--;
+        uh->registered = 0;
+    }
+    if (!ev.events) {
+        if (uh->registered)
+            epoll_ctl(up->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+        uh->registered = 0;
+        return;
+    }
+    /* the fd may have been closed and reused without unregistering */
+    if (!uh->registered
+    ||  epoll_ctl(up->epoll_fd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+        if (epoll_ctl(up->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            if (errno == EPERM) {
+                /* regular files cannot be polled: select() would
+                   always report them as ready */
+                up->nb_unpollable++;
+                uh->registered = -1;
+                return;
+            }
+            if (errno == EEXIST)
+                epoll_ctl(up->epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+        }
+    }
+    uh->registered = 1;
+}
+#endif
+
+static int url_set_handler(URLState *up, int fd, int write,
+                           void (*cb)(void *opaque), void *opaque)
+{
+    IOHandler *uh;
+
+    if (fd < 0)
+        return -1;
+    if (up->epoll_fd < 0 && fd >= FD_SETSIZE)
         return -1;
 
-    up->handlers[fd].read_cb = cb;
-    up->handlers[fd].read_opaque = opaque;
+    if (fd >= up->nb_handlers) {
+        int n = max_int(fd + 1, up->nb_handlers * 2);
+        if (!cb)
+            return 0;
+        if (!qe_realloc_array(&up->handlers, n))
+            return -1;
+        memset(up->handlers + up->nb_handlers, 0,
+               (n - up->nb_handlers) * sizeof(*up->handlers));
+        up->nb_handlers = n;
+    }
+    uh = &up->handlers[fd];
+    if (write) {
+        if (uh->write_cb != cb || uh->write_opaque != opaque)
+            uh->gen++;
+        uh->write_cb = cb;
+        uh->write_opaque = opaque;
+    } else {
+        if (uh->read_cb != cb || uh->read_opaque != opaque)
+            uh->gen++;
+        uh->read_cb = cb;
+        uh->read_opaque = opaque;
+    }
+#ifdef CONFIG_LINUX
+    if (up->epoll_fd >= 0) {
+        url_epoll_update(up, fd, uh);
+        return 0;
+    }
+#endif
     if (cb) {
         if (fd >= up->nfds)
             up->nfds = fd + 1;
-        FD_SET((fdesc_t)fd, &up->rfds);
+        FD_SET((fdesc_t)fd, write ? &up->wfds : &up->rfds);
     } else {
-        FD_CLR((fdesc_t)fd, &up->rfds);
+        FD_CLR((fdesc_t)fd, write ? &up->wfds : &up->rfds);
     }
     return 0;
 }
 
+int url_set_read_handler(URLState *up, int fd, void (*cb)(void *opaque), void *opaque)
+{
+    return url_set_handler(up, fd, 0, cb, opaque);
+}
+
 int url_set_write_handler(URLState *up, int fd, void (*cb)(void *opaque), void *opaque)
 {
-    if (fd < 0 || fd >= countof(up->handlers))
-        return -1;
+    return url_set_handler(up, fd, 1, cb, opaque);
+}
 
-    up->handlers[fd].write_cb = cb;
-    up->handlers[fd].write_opaque = opaque;
-    if (cb) {
-        if (fd >= up->nfds)
-            up->nfds = fd + 1;
-        FD_SET((fdesc_t)fd, &up->wfds);
-    } else {
-        FD_CLR((fdesc_t)fd, &up->wfds);
+static void url_free_pid_handler(URLState *up, PidHandler *p)
+{
+#ifndef CONFIG_WIN32
+    if (p->pidfd >= 0) {
+        url_set_read_handler(up, p->pidfd, NULL, NULL);
+        close(p->pidfd);
+    } else
+#endif
+    {
+        up->nb_polled_pids--;
     }
-    return 0;
+    list_del(p);
+    qe_free(&p);
+}
+
+/* remove the handler before calling the callback, which may register
+   a new handler for the same pid */
+static void url_pid_exited(URLState *up, PidHandler *p, int status)
+{
+    void (*cb)(void *opaque, int status) = p->cb;
+    void *opaque = p->opaque;
+
+    url_free_pid_handler(up, p);
+    cb(opaque, status);
 }
 
+#ifndef CONFIG_WIN32
+static void url_pidfd_read(void *opaque)
+{
+    PidHandler *p = opaque;
+    URLState *up = p->up;
+    int pid, status;
+
+    pid = waitpid(p->pid, &status, WNOHANG);
+    if (pid == 0)
+        return;
+    if (pid < 0) {
+        /* the process was reaped elsewhere */
+        url_free_pid_handler(up, p);
+        return;
+    }
+    url_pid_exited(up, p, status);
+}
+#endif
+
 /* register a callback which is called when process 'pid'
    terminates. When the callback is set to NULL, it is deleted */
 /* XXX: add consistency check ? */
@@ -131,8 +334,7 @@ int url_set_pid_handler(URLState *up, int pid, void (*cb)(void *opaque, int stat
     if (cb == NULL) {
         list_for_each(p, &up->pid_handlers) {
             if (p->pid == pid) {
-                list_del(p);
-                qe_free(&p);
+                url_free_pid_handler(up, p);
                 break;
             }
         }
@@ -140,14 +342,44 @@ int url_set_pid_handler(URLState *up, int pid, void (*cb)(void *opaque, int stat
         p = qe_mallocz(PidHandler);
         if (!p)
             return -1;
+        p->up = up;
         p->pid = pid;
+        p->pidfd = -1;
         p->cb = cb;
         p->opaque = opaque;
+#if defined(CONFIG_LINUX) && defined(SYS_pidfd_open)
+        /* the descriptor is created with the close-on-exec flag */
+        p->pidfd = syscall(SYS_pidfd_open, pid, 0);
+        if (p->pidfd >= 0
+        &&  url_set_read_handler(up, p->pidfd, url_pidfd_read, p) < 0) {
+            close(p->pidfd);
+            p->pidfd = -1;
+        }
+#endif
+        if (p->pidfd < 0)
+            up->nb_polled_pids++;
         list_add(p, &up->pid_handlers);
     }
     return 0;
 }
 
+/* free a bottom half entry, waking up the job that posted it if it
+   is waiting for room */
+static void url_bottom_half_free(URLState *up, BottomHalfEntry **bhp)
+{
+#ifndef CONFIG_WIN32
+    URLJob *job = (*bhp)->job;
+
+    if (job) {
+        pthread_mutex_lock(&up->job_lock);
+        job->nb_posted--;
+        pthread_cond_broadcast(&up->post_cond);
+        pthread_mutex_unlock(&up->job_lock);
+    }
+#endif
+    qe_free(bhp);
+}
+
 /*
  * add an explicit call back to avoid recursions
  */
@@ -175,42 +407,525 @@ void url_unregister_bottom_half(URLState *up, void (*cb)(void *opaque), void *op
     list_for_each_safe(bh, bh1, &up->bottom_halves) {
         if (bh->cb == cb && bh->opaque == opaque) {
             list_del(bh);
-            qe_free(&bh);
+            url_bottom_half_free(up, &bh);
         }
     }
 }
 
+static inline int url_timer_before(const URLTimer *a, const URLTimer *b) {
+    /* timeouts may wrap around */
+    return (a->timeout - b->timeout) < 0;
+}
+
+static inline void url_timer_place(URLState *up, URLTimer *ti, int i) {
+    up->timers[i] = ti;
+    ti->index = i;
+}
+
+static void url_timer_sift_up(URLState *up, int i)
+{
+    URLTimer *ti = up->timers[i];
+    int parent;
+
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (!url_timer_before(ti, up->timers[parent]))
+            break;
+        url_timer_place(up, up->timers[parent], i);
+        i = parent;
+    }
+    url_timer_place(up, ti, i);
+}
+
+static void url_timer_sift_down(URLState *up, int i)
+{
+    URLTimer *ti = up->timers[i];
+    int child;
+
+    for (;;) {
+        child = 2 * i + 1;
+        if (child >= up->nb_timers)
+            break;
+        if (child + 1 < up->nb_timers
+        &&  url_timer_before(up->timers[child + 1], up->timers[child]))
+            child++;
+        if (!url_timer_before(up->timers[child], ti))
+            break;
+        url_timer_place(up, up->timers[child], i);
+        i = child;
+    }
+    url_timer_place(up, ti, i);
+}
+
+static void url_timer_remove(URLState *up, URLTimer *ti)
+{
+    int i = ti->index;
+    URLTimer *last = up->timers[--up->nb_timers];
+
+    if (last != ti) {
+        url_timer_place(up, last, i);
+        url_timer_sift_up(up, i);
+        url_timer_sift_down(up, last->index);
+    }
+    ti->index = -1;
+}
+
 URLTimer *url_add_timer(URLState *up, int delay, void *opaque, void (*cb)(void *opaque))
 {
     URLTimer *ti;
 
+    if (up->nb_timers >= up->timers_size) {
+        int n = max_int(16, up->timers_size * 2);
+        if (!qe_realloc_array(&up->timers, n))
+            return NULL;
+        up->timers_size = n;
+    }
     ti = qe_mallocz(URLTimer);
     if (!ti)
         return NULL;
     ti->timeout = get_clock_ms() + delay;
     ti->opaque = opaque;
     ti->cb = cb;
-    ti->next = up->first_timer;
-    up->first_timer = ti;
+    url_timer_place(up, ti, up->nb_timers++);
+    url_timer_sift_up(up, ti->index);
     return ti;
 }
 
+/* Arm a timer whose handle is stored to `*tip`, replacing a pending
+   one. The timer is freed after its callback is called and `*tip` is
+   cleared just before, so the handle can always be passed to
+   url_kill_timer(). The timers returned by url_add_timer() are only
+   valid until they fire. */
+void url_set_timer(URLState *up, URLTimer **tip, int delay,
+                   void *opaque, void (*cb)(void *opaque))
+{
+    url_kill_timer(up, tip);
+    *tip = url_add_timer(up, delay, opaque, cb);
+    if (*tip)
+        (*tip)->handle = tip;
+}
+
 void url_kill_timer(URLState *up, URLTimer **tip)
 {
-    if (*tip) {
-        URLTimer **pt;
+    URLTimer *ti = *tip;
 
-        /* remove timer from list of active timers and free it */
-        for (pt = &up->first_timer; *pt != NULL; pt = &(*pt)->next) {
-            if (*pt == (*tip)) {
-                *pt = (*tip)->next;
-                qe_free(tip);
-                return;
+    if (ti) {
+        /* remove timer from the heap of active timers and free it */
+        url_timer_remove(up, ti);
+        qe_free(tip);
+    }
+}
+
+/* File system change notification.
+ * Directories are watched rather than files so that files replaced by
+ * rename() keep being tracked. Watches for the same directory share
+ * the kernel watch descriptor. Removed watches are only unlinked after
+ * the callbacks for the current batch of events have been called.
+ */
+#ifdef CONFIG_LINUX
+static void url_watch_dispatch(URLState *up, int wd, int events, const char *name)
+{
+    URLWatch *w;
+
+    for (w = up->first_watch; w; w = w->next) {
+        if (w->cb && (w->wd == wd || wd < 0))
+            w->cb(w->opaque, events, name);
+    }
+}
+
+static void url_watch_read(void *opaque)
+{
+    URLState *up = opaque;
+    URLWatch **wp, *w;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    ssize_t len;
+    char *p;
+    int events;
+
+    up->watch_dispatch++;
+    while ((len = read(up->watch_fd, buf, sizeof buf)) > 0) {
+        for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+            ev = (const struct inotify_event *)(void *)p;
+            events = 0;
+            if (ev->mask & IN_Q_OVERFLOW)
+                events |= URL_WATCH_OVERFLOW;
+            if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+                events |= URL_WATCH_CREATE;
+            if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+                events |= URL_WATCH_DELETE;
+            if (ev->mask & (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB))
+                events |= URL_WATCH_MODIFY;
+            if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+                events |= URL_WATCH_GONE;
+            if (events)
+                url_watch_dispatch(up, ev->wd, events, ev->len ? ev->name : "");
+            if (ev->mask & IN_IGNORED) {
+                /* the kernel removed the watch descriptor */
+                for (w = up->first_watch; w; w = w->next) {
+                    if (w->wd == ev->wd)
+                        w->wd = -1;
+                }
+            }
+        }
+    }
+    up->watch_dispatch--;
+
+    /* unlink the watches removed by the callbacks */
+    for (wp = &up->first_watch; (w = *wp) != NULL;) {
+        if (!w->cb) {
+            *wp = w->next;
+            qe_free(&w);
+        } else {
+            wp = &w->next;
+        }
+    }
+}
+#endif
+
+/* Watch directory `dir` for changes: `cb` is called from the main loop
+ * with a combination of URL_WATCH_xxx flags and the name of the
+ * directory entry concerned. Return NULL if file system notifications
+ * are not supported for `dir`.
+ */
+URLWatch *url_add_watch(URLState *up, const char *dir,
+                        void (*cb)(void *opaque, int events, const char *name),
+                        void *opaque)
+{
+#ifdef CONFIG_LINUX
+    URLWatch *w;
+    int wd;
+
+    if (up->watch_fd < 0) {
+        up->watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (up->watch_fd < 0)
+            return NULL;
+        if (url_set_read_handler(up, up->watch_fd, url_watch_read, up) < 0) {
+            close(up->watch_fd);
+            up->watch_fd = -1;
+            return NULL;
+        }
+    }
+    wd = inotify_add_watch(up->watch_fd, dir,
+                           IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                           IN_MOVED_TO | IN_MODIFY | IN_CLOSE_WRITE |
+                           IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF |
+                           IN_ONLYDIR);
+    if (wd < 0)
+        return NULL;
+    w = qe_mallocz(URLWatch);
+    if (!w)
+        return NULL;
+    w->wd = wd;
+    w->cb = cb;
+    w->opaque = opaque;
+    w->next = up->first_watch;
+    up->first_watch = w;
+    return w;
+#else
+    return NULL;
+#endif
+}
+
+void url_remove_watch(URLState *up, URLWatch **wp)
+{
+#ifdef CONFIG_LINUX
+    URLWatch **pw, *w1;
+    URLWatch *w = *wp;
+
+    if (!w)
+        return;
+    *wp = NULL;
+    if (w->wd >= 0) {
+        /* release the descriptor if no other watch shares it */
+        for (w1 = up->first_watch; w1; w1 = w1->next) {
+            if (w1 != w && w1->cb && w1->wd == w->wd)
+                break;
+        }
+        if (!w1)
+            inotify_rm_watch(up->watch_fd, w->wd);
+        w->wd = -1;
+    }
+    w->cb = NULL;
+    if (up->watch_dispatch)
+        return;
+    for (pw = &up->first_watch; *pw; pw = &(*pw)->next) {
+        if (*pw == w) {
+            *pw = w->next;
+            qe_free(&w);
+            break;
+        }
+    }
+#else
+    *wp = NULL;
+#endif
+}
+
+/* Jobs run on a fixed pool of worker threads started on demand.
+ * The `run` callback is called on a worker thread: it must not call
+ * any editor function and may only read buffer snapshots as described
+ * in buffer.c. The `done` callback is called exactly once on the main
+ * thread from a bottom half after `run` returns, with `canceled` set
+ * if url_cancel_job() was called. It should free the opaque data and
+ * clear the job pointer kept by the caller. If the job was canceled
+ * before a worker picked it up, `run` is not called.
+ * `run` can hand partial results to the main thread with
+ * url_post_bottom_half(): posted callbacks are called in order and
+ * before the `done` callback of the job that posted them.
+ * url_post_job_bottom_half() also blocks the worker while too many of
+ * its callbacks are pending, when the main thread falls behind.
+ * Without thread support, jobs are run synchronously by url_submit_job.
+ */
+static void url_job_complete(void *opaque)
+{
+    URLJob *job = opaque;
+
+    job->up->nb_jobs--;
+    job->done(job->opaque, job->canceled);
+    qe_free(&job);
+}
+
+#ifndef CONFIG_WIN32
+/* must be called with job_lock held */
+static void url_job_wakeup(URLState *up)
+{
+    if (!up->job_wakeup) {
+        /* the main loop drains the pipe and the lists together */
+        up->job_wakeup = 1;
+        if (write(up->job_pipe[1], "", 1) < 0) {
+            /* pipe is full: a wake-up is already pending */
+        }
+    }
+}
+
+static void *url_job_worker(void *opaque)
+{
+    URLState *up = opaque;
+    URLJob *job;
+
+    pthread_mutex_lock(&up->job_lock);
+    for (;;) {
+        while ((job = up->first_job) == NULL)
+            pthread_cond_wait(&up->job_cond, &up->job_lock);
+        if ((up->first_job = job->next) == NULL)
+            up->last_job = &up->first_job;
+        job->state = URL_JOB_RUNNING;
+        pthread_mutex_unlock(&up->job_lock);
+
+        job->run(job, job->opaque);
+
+        pthread_mutex_lock(&up->job_lock);
+        job->state = URL_JOB_DONE;
+        job->next = NULL;
+        *up->last_done = job;
+        up->last_done = &job->next;
+        url_job_wakeup(up);
+    }
+    return NULL;
+}
+
+static void url_job_read(void *opaque)
+{
+    URLState *up = opaque;
+    URLJob *job, *next;
+    BottomHalfEntry *bh, *bh_next;
+    char buf[64];
+
+    while (read(up->job_pipe[0], buf, sizeof buf) > 0)
+        continue;
+    pthread_mutex_lock(&up->job_lock);
+    up->job_wakeup = 0;
+    bh = up->first_post;
+    up->first_post = NULL;
+    up->last_post = &up->first_post;
+    job = up->first_done;
+    up->first_done = NULL;
+    up->last_done = &up->first_done;
+    pthread_mutex_unlock(&up->job_lock);
+    /* bottom halves are called in registration order: posted
+       callbacks run before the completion of the jobs that posted them */
+    for (; bh; bh = bh_next) {
+        bh_next = bh->next;
+        list_add(bh, &up->bottom_halves);
+    }
+    for (; job; job = next) {
+        next = job->next;
+        url_register_bottom_half(up, url_job_complete, job);
+    }
+}
+
+static int url_start_workers(URLState *up)
+{
+    sigset_t set, oldset;
+    pthread_attr_t attr;
+    pthread_t tid;
+    int i, n;
+
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+    n = clamp_int(n, 1, URL_MAX_WORKERS);
+    if (pipe(up->job_pipe) < 0) {
+        up->job_pipe[0] = up->job_pipe[1] = -1;
+        return -1;
+    }
+    for (i = 0; i < 2; i++) {
+        fcntl(up->job_pipe[i], F_SETFD, FD_CLOEXEC);
+        fcntl(up->job_pipe[i], F_SETFL, O_NONBLOCK);
+    }
+    url_set_read_handler(up, up->job_pipe[0], url_job_read, up);
+
+    /* signals must be delivered to the main thread to interrupt the
+       event loop: block them in the workers */
+    sigfillset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, &oldset);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (i = 0; i < n; i++) {
+        if (pthread_create(&tid, &attr, url_job_worker, up))
+            break;
+    }
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    return i;
+}
+#endif
+
+URLJob *url_submit_job(URLState *up,
+                       void (*run)(URLJob *job, void *opaque),
+                       void (*done)(void *opaque, int canceled),
+                       void *opaque)
+{
+    URLJob *job;
+
+    job = qe_mallocz(URLJob);
+    if (!job)
+        return NULL;
+    job->up = up;
+    job->run = run;
+    job->done = done;
+    job->opaque = opaque;
+    up->nb_jobs++;
+#ifndef CONFIG_WIN32
+    if (up->nb_workers == 0) {
+        up->nb_workers = url_start_workers(up);
+        if (up->nb_workers <= 0)
+            up->nb_workers = -1;
+    }
+    if (up->nb_workers > 0) {
+        pthread_mutex_lock(&up->job_lock);
+        *up->last_job = job;
+        up->last_job = &job->next;
+        pthread_cond_signal(&up->job_cond);
+        pthread_mutex_unlock(&up->job_lock);
+        return job;
+    }
+#endif
+    job->state = URL_JOB_RUNNING;
+    job->run(job, job->opaque);
+    job->state = URL_JOB_DONE;
+    url_register_bottom_half(up, url_job_complete, job);
+    return job;
+}
+
+/* Cancel a job: a pending job is removed from the queue, a running job
+   can check url_job_canceled() to stop early. The `done` callback is
+   called in all cases. */
+void url_cancel_job(URLState *up, URLJob **jobp)
+{
+    URLJob *job = *jobp;
+    URLJob **pj;
+
+    if (!job)
+        return;
+    *jobp = NULL;
+#ifndef CONFIG_WIN32
+    pthread_mutex_lock(&up->job_lock);
+#endif
+    job->canceled = 1;
+#ifndef CONFIG_WIN32
+    /* a job waiting in url_post_job_bottom_half() must stop waiting */
+    pthread_cond_broadcast(&up->post_cond);
+#endif
+    if (job->state == URL_JOB_PENDING) {
+        for (pj = &up->first_job; *pj; pj = &(*pj)->next) {
+            if (*pj == job) {
+                if ((*pj = job->next) == NULL)
+                    up->last_job = pj;
+                break;
             }
         }
-        /* timer not found, was probably alread freed */
-        *tip = NULL;
+        job->state = URL_JOB_DONE;
+        url_register_bottom_half(up, url_job_complete, job);
+    }
+#ifndef CONFIG_WIN32
+    pthread_mutex_unlock(&up->job_lock);
+#endif
+}
+
+/* number of jobs submitted whose `done` callback was not called yet */
+int url_pending_jobs(URLState *up)
+{
+    return up->nb_jobs;
+}
+
+/* can be called from the `run` callback */
+int url_job_canceled(URLJob *job)
+{
+    int canceled;
+
+#ifndef CONFIG_WIN32
+    pthread_mutex_lock(&job->up->job_lock);
+    canceled = job->canceled;
+    pthread_mutex_unlock(&job->up->job_lock);
+#else
+    canceled = job->canceled;
+#endif
+    return canceled;
+}
+
+static int url_post(URLState *up, URLJob *job, int max_pending,
+                    void (*cb)(void *opaque), void *opaque)
+{
+#ifndef CONFIG_WIN32
+    BottomHalfEntry *bh;
+
+    if (up->nb_workers > 0) {
+        bh = qe_mallocz(BottomHalfEntry);
+        if (!bh)
+            return -1;
+        bh->cb = cb;
+        bh->opaque = opaque;
+        bh->job = job;
+        pthread_mutex_lock(&up->job_lock);
+        if (job) {
+            while (job->nb_posted >= max_pending && !job->canceled)
+                pthread_cond_wait(&up->post_cond, &up->job_lock);
+            job->nb_posted++;
+        }
+        *up->last_post = bh;
+        up->last_post = &bh->next;
+        url_job_wakeup(up);
+        pthread_mutex_unlock(&up->job_lock);
+        return 0;
     }
+#endif
+    return url_register_bottom_half(up, cb, opaque);
+}
+
+/* Register a bottom half from any thread. This is the only event loop
+   function that can be called from the `run` callback of a job. */
+int url_post_bottom_half(URLState *up, void (*cb)(void *opaque), void *opaque)
+{
+    return url_post(up, NULL, 0, cb, opaque);
+}
+
+/* Post a callback from the `run` callback of `job`, waiting while
+   `max_pending` callbacks posted this way by the job have not been
+   called yet: this bounds the memory held by results the main thread
+   has not consumed. A canceled job does not wait. */
+int url_post_job_bottom_half(URLJob *job, int max_pending,
+                             void (*cb)(void *opaque), void *opaque)
+{
+    return url_post(job->up, job, max_pending, cb, opaque);
 }
 
 int url_set_tail_handler(URLState *up, void (*cb)(void *opaque), void *opaque)
@@ -229,7 +944,7 @@ static inline void url_call_bottom_halves(URLState *up)
         bh = (BottomHalfEntry *)up->bottom_halves.prev;
         list_del(bh);
         bh->cb(bh->opaque);
-        qe_free(&bh);
+        url_bottom_half_free(up, &bh);
     }
 }
 
@@ -237,48 +952,77 @@ static inline void url_call_bottom_halves(URLState *up)
    check_timers() */
 static inline int url_check_timers(URLState *up, int max_delay)
 {
-    URLTimer *ti, **pt;
+    URLTimer *ti;
     int timeout, cur_time;
 
     cur_time = get_clock_ms();
     timeout = cur_time + max_delay;
-    pt = &up->first_timer;
-    for (;;) {
-        ti = *pt;
-        if (ti == NULL)
-            break;
-        if ((ti->timeout - cur_time) <= 0) {
-            /* timer expired : suppress it from timer list and call callback */
-            *pt = ti->next;
-            /* warning: a new timer can be added in the callback */
-            ti->cb(ti->opaque);
-            qe_free(&ti);
-            url_call_bottom_halves(up);
-        } else {
+    while (up->nb_timers > 0) {
+        ti = up->timers[0];
+        if ((ti->timeout - cur_time) > 0) {
             if ((ti->timeout - timeout) < 0)
                 timeout = ti->timeout;
-            pt = &ti->next;
+            break;
         }
+        /* timer expired : suppress it from timer heap and call callback.
+           Timers added by the callback with a 0 delay are called in the
+           same pass, unless the clock advanced since `cur_time` was read. */
+        url_timer_remove(up, ti);
+        if (ti->handle)
+            *ti->handle = NULL;
+        ti->cb(ti->opaque);
+        qe_free(&ti);
+        url_call_bottom_halves(up);
     }
     return timeout - cur_time;
 }
 
 #define MAX_DELAY 500  /* milliseconds */
 
-/* block until one event */
-static void url_block(URLState *up)
+typedef struct URLReadyEvent {
+    int fd;
+    unsigned int gen;
+    int read, write;
+} URLReadyEvent;
+
+/* wait for I/O events for at most `delay` ms, return the number of
+   ready descriptors stored into `ready` */
+static int url_poll(URLState *up, int delay, URLReadyEvent *ready)
 {
-    IOHandler *uh;
-    int ret, i, delay;
     fd_set rfds, wfds;
     struct timeval tv;
+    int i, n, ret;
 
-    delay = url_check_timers(up, MAX_DELAY);
-#if 0
-    {
-        static int count;
+    if (delay < 0)
+        delay = 0;
+#ifdef CONFIG_LINUX
+    if (up->epoll_fd >= 0) {
+        struct epoll_event events[URL_MAX_EVENTS];
 
-        printf("%5d: delay=%d\n", count++, delay);
+        n = 0;
+        if (up->nb_unpollable) {
+            for (i = 0; i < up->nb_handlers && n < URL_MAX_EVENTS / 2; i++) {
+                IOHandler *uh = &up->handlers[i];
+                if (uh->registered < 0) {
+                    ready[n].fd = i;
+                    ready[n].gen = uh->gen;
+                    ready[n].read = (uh->read_cb != NULL);
+                    ready[n].write = (uh->write_cb != NULL);
+                    n++;
+                }
+            }
+            delay = 0;
+        }
+        ret = epoll_wait(up->epoll_fd, events, URL_MAX_EVENTS - n, delay);
+        for (i = 0; i < ret; i++) {
+            ready[n].fd = (int)(events[i].data.u64 & 0xffffffff);
+            ready[n].gen = (unsigned int)(events[i].data.u64 >> 32);
+            /* select() reports errors and hang-ups as readiness too */
+            ready[n].read = (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0;
+            ready[n].write = (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) != 0;
+            n++;
+        }
+        return n;
     }
 #endif
     tv.tv_sec = delay / 1000;
@@ -287,50 +1031,68 @@ static void url_block(URLState *up)
     rfds = up->rfds;
     wfds = up->wfds;
     ret = select(up->nfds, &rfds, &wfds, NULL, &tv);
+    n = 0;
+    for (i = 0; i < up->nfds && n < ret && n < URL_MAX_EVENTS; i++) {
+        int r = FD_ISSET(i, &rfds), w = FD_ISSET(i, &wfds);
+        if (r || w) {
+            ready[n].fd = i;
+            ready[n].gen = up->handlers[i].gen;
+            ready[n].read = r;
+            ready[n].write = w;
+            n++;
+        }
+    }
+    return n;
+}
+
+/* block until one event */
+static void url_block(URLState *up)
+{
+    URLReadyEvent ready[URL_MAX_EVENTS];
+    IOHandler *uh;
+    int i, n, delay;
+
+    delay = url_check_timers(up, MAX_DELAY);
+#if 0
+    {
+        static int count;
 
-    /* call each handler */
-    /* extra checks on callback function pointers because a callback
-     * may unregister another callback.  This was causing crash bugs
-     * when deleting a running shell output buffer such as a buffer
-     * with a huge compressed file while it decompresses.
-     * XXX: should break from the loop if callback changed the
-     *      structures but need further investigation.
-     * Here is an example of a problem: if a callback closes a resource
-     * and opens another one that happens to get the same unix handle hd,
-     * the state of FD_ISSET(hd) will refer to the original resource and
-     * may erroneously call the new handler on a blocking event.
-     * Similarly, if a callback consumes a resource for a different handle
-     * the FD_ISSET will also be incorrect.
+        printf("%5d: delay=%d\n", count++, delay);
+    }
+#endif
+    n = url_poll(up, delay, ready);
+
+    /* call the handlers of the ready descriptors.
+     * A callback may unregister another callback, or close a
+     * resource and open another one that gets the same descriptor:
+     * the handlers are checked again before each call and the event
+     * is dropped if the generation number has changed.
      */
-    if (ret > 0) {
-        uh = up->handlers;
-        for (i = 0; i < up->nfds; i++) {
-            if (FD_ISSET(i, &rfds) && uh->read_cb) {
-                uh->read_cb(uh->read_opaque);
-                url_call_bottom_halves(up);
-            }
-            if (FD_ISSET(i, &wfds) && uh->write_cb) {
-                uh->write_cb(uh->write_opaque);
-                url_call_bottom_halves(up);
-            }
-            uh++;
+    for (i = 0; i < n; i++) {
+        uh = &up->handlers[ready[i].fd];
+        if (ready[i].read && uh->read_cb && uh->gen == ready[i].gen) {
+            uh->read_cb(uh->read_opaque);
+            url_call_bottom_halves(up);
+            uh = &up->handlers[ready[i].fd];
+        }
+        if (ready[i].write && uh->write_cb && uh->gen == ready[i].gen) {
+            uh->write_cb(uh->write_opaque);
+            url_call_bottom_halves(up);
         }
     }
 
 #ifndef CONFIG_WIN32
-    /* handle terminated children */
-    for (;;) {
+    /* poll terminated children that do not have a pidfd */
+    while (up->nb_polled_pids > 0) {
         int pid, status;
         PidHandler *ph, *ph1;
 
-        if (list_empty(&up->pid_handlers))
-            break;
         pid = waitpid(-1, &status, WNOHANG);
         if (pid <= 0)
             break;
         list_for_each_safe(ph, ph1, &up->pid_handlers) {
-            if (ph->pid == pid && ph->cb) {
-                ph->cb(ph->opaque, status);
+            if (ph->pid == pid) {
+                url_pid_exited(up, ph, status);
                 url_call_bottom_halves(up);
                 break;
             }
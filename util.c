@@ -32,6 +32,7 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <pwd.h>
 #include <unistd.h>
 
@@ -98,6 +99,8 @@ FindFileState *find_file_open(const char *path, const char *pattern, int flags)
        - `FF_NODIR`: do not match directory names
        - `FF_NOXXDIR`: do not match `.` or `..`
        - `FF_ONLYDIR`: do not match non directories
+       - `FF_NODOT`: skip hidden files and directories (names starting
+         with `.`), except `.` and `..` unless `FF_NOXXDIR` is also given
        - 0 ... 15: maximum subdirectory depth for recursive matching
        @return a pointer to an opaque FindFileState structure.
      */
@@ -184,6 +187,9 @@ int find_file_next(FindFileState *s, char *filename, int filename_size) {
                 &&  (strequal(dirent->d_name, ".") || strequal(dirent->d_name, ".."))) {
                     if (s->flags & FF_NOXXDIR)
                         continue;
+                } else
+                if (*dirent->d_name == '.' && (s->flags & FF_NODOT)) {
+                    continue;
                 } else {
                     if (s->depth < (s->flags & FF_DEPTH)) {
                         s->parent_dir[s->depth] = s->dir;
@@ -199,6 +205,8 @@ int find_file_next(FindFileState *s, char *filename, int filename_size) {
             } else {
                 if (s->flags & FF_ONLYDIR)
                     continue;
+                if (*dirent->d_name == '.' && (s->flags & FF_NODOT))
+                    continue;
             }
             if (s->flags & FF_NOPAT)
                 continue;
@@ -230,6 +238,207 @@ void find_file_close(FindFileState **sp) {
     }
 }
 
+struct DirListing {
+    DirListing *next;
+    time_t mtime;       /* directory modification time at scan time */
+    time_t scan_time;
+    dev_t dev;
+    ino_t ino;
+    StringArray entries;
+    char path[1];
+};
+
+static void dir_listing_free1(DirListing **dlp) {
+    if (*dlp) {
+        free_strings(&(*dlp)->entries);
+        qe_free(dlp);
+    }
+}
+
+static DirListing *dir_listing_scan(const char *path, const struct stat *st) {
+    DirListing *dl;
+    DIR *dir;
+    struct dirent *dirent;
+    const char *name;
+    int type;
+
+    dir = opendir(path);
+    if (!dir)
+        return NULL;
+    dl = qe_mallocz_hack(DirListing, strlen(path));
+    if (!dl) {
+        closedir(dir);
+        return NULL;
+    }
+    strcpy(dl->path, path);
+    dl->mtime = st->st_mtime;
+    dl->dev = st->st_dev;
+    dl->ino = st->st_ino;
+    while ((dirent = readdir(dir)) != NULL) {
+        name = dirent->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+            continue;
+#ifdef __MINT__ // only glibc defines _DIRENT_HAVE_D_TYPE
+        {
+            char tmppath[MAX_FILENAME_SIZE];
+            makepath(tmppath, sizeof(tmppath), path, name);
+            type = is_directory(tmppath) ? DL_DIR : 0;
+        }
+#else
+        /* only stat symbolic links and file systems without d_type */
+        if (dirent->d_type == DT_LNK || dirent->d_type == DT_UNKNOWN) {
+            char tmppath[MAX_FILENAME_SIZE];
+            struct stat st1;
+            makepath(tmppath, sizeof(tmppath), path, name);
+            type = is_directory(tmppath) ? DL_DIR : 0;
+            if (dirent->d_type == DT_LNK
+            ||  (!lstat(tmppath, &st1) && S_ISLNK(st1.st_mode))) {
+                type |= DL_LINK;
+            }
+        } else {
+            type = (dirent->d_type == DT_DIR) ? DL_DIR : 0;
+        }
+#endif
+        add_string(&dl->entries, name, type);
+    }
+    closedir(dir);
+    dl->scan_time = time(NULL);
+    return dl;
+}
+
+DirListing *dir_listing_read(const char *path) {
+    /*@API utils
+       Read the entries of a directory into a new listing, outside of
+       any cache.  This function does not access any editor state and
+       can be called from the `run` callback of a job.
+       @argument `path` the directory path.
+       @return a pointer to the listing, to be passed to
+       `dir_listing_add()` or freed with `dir_listing_free()`, or `NULL`
+       if the directory cannot be read.
+     */
+    struct stat st;
+
+    if (stat(path, &st) || !S_ISDIR(st.st_mode))
+        return NULL;
+    return dir_listing_scan(path, &st);
+}
+
+/* move a listing to the front of the cache and drop the oldest listings */
+static void dir_listing_push(DirListing **cachep, DirListing *dl, int max_count) {
+    DirListing **pp;
+    int count;
+
+    dl->next = *cachep;
+    *cachep = dl;
+    for (count = 1, pp = &dl->next; *pp; count++) {
+        if (count >= max_count) {
+            DirListing *dl1 = *pp;
+            *pp = dl1->next;
+            dir_listing_free1(&dl1);
+        } else {
+            pp = &(*pp)->next;
+        }
+    }
+}
+
+DirListing *dir_listing_get(DirListing **cachep, const char *path, int max_count) {
+    /*@API utils
+       Get the list of entries of a directory from a cache of listings,
+       reading the directory only if it is not cached or if it was
+       modified since it was read.
+       @argument `cachep` a valid pointer to the head of the cache list.
+       @argument `path` the directory path.
+       @argument `max_count` the maximum number of listings to keep,
+       the least recently used listings are freed.
+       @return a pointer to the listing or `NULL` if the directory cannot
+       be read.  The pointer is valid until the next call on the same
+       cache.
+       @note a directory modified in the second it was read is read again
+       on the next call, as its modification time cannot tell later
+       changes apart.
+     */
+    struct stat st;
+    DirListing **pp, *dl;
+
+    if (stat(path, &st) || !S_ISDIR(st.st_mode))
+        return NULL;
+
+    for (pp = cachep; (dl = *pp) != NULL; pp = &dl->next) {
+        if (strequal(dl->path, path)) {
+            *pp = dl->next;
+            if (dl->mtime != st.st_mtime || dl->dev != st.st_dev
+            ||  dl->ino != st.st_ino || dl->scan_time <= dl->mtime) {
+                dir_listing_free1(&dl);
+            }
+            break;
+        }
+    }
+    if (!dl) {
+        dl = dir_listing_scan(path, &st);
+        if (!dl)
+            return NULL;
+    }
+    dir_listing_push(cachep, dl, max_count);
+    return dl;
+}
+
+void dir_listing_add(DirListing **cachep, DirListing *dl, int max_count) {
+    /*@API utils
+       Add a listing read by `dir_listing_read()` to a cache of listings.
+       The listing is freed if the cache already has one for the same
+       directory.
+       @argument `cachep` a valid pointer to the head of the cache list.
+       @argument `dl` a valid pointer to a listing, the cache takes
+       ownership of it.
+       @argument `max_count` the maximum number of listings to keep,
+       the least recently used listings are freed.
+     */
+    if (dir_listing_cached(*cachep, dl->path)) {
+        dir_listing_free1(&dl);
+        return;
+    }
+    dir_listing_push(cachep, dl, max_count);
+}
+
+int dir_listing_cached(const DirListing *cache, const char *path) {
+    /*@API utils
+       Check if a cache of listings has a listing for a directory,
+       without checking if the directory was modified.
+       @argument `cache` the head of the cache list.
+       @argument `path` the directory path.
+       @return non zero if the cache has a listing for `path`.
+     */
+    for (; cache; cache = cache->next) {
+        if (strequal(cache->path, path))
+            return 1;
+    }
+    return 0;
+}
+
+const StringArray *dir_listing_entries(const DirListing *dl) {
+    /*@API utils
+       Get the entries of a directory listing, excluding `.` and `..`.
+       The `group` member of each entry has `DL_DIR` set for directories
+       and symbolic links to directories and `DL_LINK` set for symbolic
+       links.
+       @argument `dl` a valid pointer to a directory listing.
+       @return a pointer to the array of entries in directory order.
+     */
+    return &dl->entries;
+}
+
+void dir_listing_free(DirListing **cachep) {
+    /*@API utils
+       Free a cache of directory listings.
+       @argument `cachep` a valid pointer to the head of the cache list.
+     */
+    while (*cachep) {
+        DirListing *dl = *cachep;
+        *cachep = dl->next;
+        dir_listing_free1(&dl);
+    }
+}
+
 int is_directory(const char *path) {
     /*@API utils
        Check if the string pointed to by `path` is the name of a
@@ -1058,6 +1267,92 @@ const char *qe_stristr(const char *s1, const char *s2) {
     return NULL;
 }
 
+static const u8 *fuzzy_scan(const u8 *p, const u8 *end, u8 c) {
+    /* find the first occurrence of `c` in [p, end), ignoring ASCII case */
+    const u8 *p1 = memchr(p, c, end - p);
+    u8 c1 = qe_isupper(c) ? qe_tolower(c) : qe_toupper(c);
+    if (c1 != c) {
+        const u8 *p2 = memchr(p, c1, (p1 ? p1 : end) - p);
+        if (p2)
+            p1 = p2;
+    }
+    return p1;
+}
+
+static int fuzzy_equal(u8 c1, u8 c2) {
+    return c1 == c2 || qe_tolower(c1) == qe_tolower(c2);
+}
+
+int fuzzy_match(const char *str, const char *pat, int len) {
+    /*@API utils.string
+       Score `str` as a fuzzy match for the first `len` bytes of `pat`:
+       every byte of the pattern must appear in `str` in order, ignoring
+       ASCII case.  Matches on word boundaries and consecutive matches
+       score higher, gaps between matched characters score lower.
+       @argument `str` a valid string pointer to the candidate.
+       @argument `pat` a pointer to the pattern bytes.
+       @argument `len` the length in bytes of the pattern.
+       @return `0` if `str` does not match, otherwise a score between
+       `1` and `100`, higher for better matches.
+       @note only the shortest window ending on the earliest complete
+       match is scored, as in a single pass fzf style matcher.
+     */
+    const u8 *s = (const u8 *)str;
+    const u8 *p = (const u8 *)pat;
+    const u8 *end, *start, *q;
+    int i, score, gap, consecutive;
+
+    if (len <= 0)
+        return 100;
+
+    /* forward scan: find the earliest end of a complete match */
+    end = s + strlen(str);
+    q = s;
+    for (i = 0; i < len; i++) {
+        if ((q = fuzzy_scan(q, end, p[i])) == NULL)
+            return 0;
+        q++;
+    }
+    end = q;
+
+    /* backward scan: find the latest start for this end */
+    start = end;
+    for (i = len; i-- > 0;) {
+        while (!fuzzy_equal(*--start, p[i]))
+            continue;
+    }
+
+    /* score the window [start, end) */
+    score = 0;
+    gap = 0;
+    consecutive = 0;
+    for (i = 0, q = start; q < end; q++) {
+        if (i < len && fuzzy_equal(*q, p[i])) {
+            int bonus = 0;
+            if (q == s || !qe_isalnum(q[-1])
+            ||  (qe_islower(q[-1]) && qe_isupper(*q))) {
+                bonus = (i == 0) ? 16 : 8;
+            } else
+            if (consecutive) {
+                bonus = 8;
+            }
+            score += 16 + bonus;
+            consecutive = 1;
+            gap = 0;
+            i++;
+        } else {
+            score -= gap ? 1 : 3;
+            consecutive = 0;
+            gap = 1;
+        }
+    }
+    /* prefer matches closer to the start of the string */
+    score -= min_int(start - s, 8);
+    /* normalize: each pattern byte scores at most 32 */
+    score = score * 100 / (len * 32);
+    return clamp_int(score, 1, 100);
+}
+
 int stristart(const char *str, const char *val, const char **ptr) {
     /*@API utils.string
        Test if `val` is a prefix of `str` (case independent for ASCII).
@@ -2138,7 +2433,7 @@ StringItem *add_string(StringArray *cs, const char *str, int group) {
     if (!cs)
         return NULL;
     if (cs->nb_items >= cs->nb_allocated) {
-        int n = cs->nb_allocated + 32;
+        int n = cs->nb_allocated + (cs->nb_allocated >> 1) + 32;
         if (!qe_realloc_array(&cs->items, n))
             return NULL;
         cs->nb_allocated = n;
@@ -2192,6 +2487,129 @@ void free_strings(StringArray *cs) {
     memset(cs, 0, sizeof(StringArray));
 }
 
+/*---- Symbol tables ----*/
+
+static unsigned int symbol_hash(const SymbolTable *st, const char *name) {
+    /* FNV-1a, consistent with the comparison selected by st->flags */
+    unsigned int h = 2166136261U;
+    const u8 *p = (const u8 *)name;
+    int c;
+
+    while ((c = *p++) != '\0') {
+        if (st->flags & (SYM_ICASE | SYM_XCASE)) {
+            if ((st->flags & SYM_XCASE) && (c == '-' || c == '_' || c == ' '))
+                continue;
+            c = qe_tolower(c);
+        }
+        h = (h ^ c) * 16777619U;
+    }
+    return h;
+}
+
+static int symbol_equal(const SymbolTable *st, const char *s1, const char *s2) {
+    if (st->flags & SYM_XCASE)
+        return !strxcmp(s1, s2);
+    if (st->flags & SYM_ICASE)
+        return !strcasecmp(s1, s2);
+    return strequal(s1, s2);
+}
+
+static SymbolEntry *symbol_lookup(const SymbolTable *st, const char *name,
+                                  unsigned int h) {
+    SymbolEntry *ep;
+    unsigned int mask = st->nb_allocated - 1;
+    unsigned int i;
+
+    for (i = h & mask;; i = (i + 1) & mask) {
+        ep = &st->entries[i];
+        if (!ep->name
+        ||  (ep->hash == h && symbol_equal(st, ep->name, name)))
+            return ep;
+    }
+}
+
+void *symbol_find(const SymbolTable *st, const char *name) {
+    /*@API utils
+       Find a named object in a symbol table.
+       @argument `st` a valid pointer to a symbol table.
+       @argument `name` a valid string pointer.
+       @return the value associated with `name` or `NULL` if not found.
+     */
+    SymbolEntry *ep;
+
+    if (st->nb_items == 0)
+        return NULL;
+    ep = symbol_lookup(st, name, symbol_hash(st, name));
+    return ep->name ? ep->value : NULL;
+}
+
+int symbol_add(SymbolTable *st, const char *name, void *value) {
+    /*@API utils
+       Register a named object in a symbol table.
+       The table grows to keep the load factor below 1/2.
+       @argument `st` a valid pointer to a symbol table.
+       @argument `name` a valid string pointer, it must stay valid as
+       long as the table unless `SYM_COPY` is set in `st->flags`.
+       @argument `value` the object to associate with `name`.
+       @return 1 if the symbol was added, 0 if `name` was already
+       present, -1 if memory could not be allocated.
+       @note: an existing entry is kept unless `SYM_REPLACE` is set in
+       `st->flags`.
+     */
+    SymbolEntry *ep;
+    unsigned int h;
+
+    if (2 * (st->nb_items + 1) > st->nb_allocated) {
+        SymbolEntry *entries = st->entries;
+        int i, n = st->nb_allocated;
+
+        st->nb_allocated = n ? n * 2 : 64;
+        st->entries = qe_mallocz_array(SymbolEntry, st->nb_allocated);
+        if (!st->entries) {
+            st->entries = entries;
+            st->nb_allocated = n;
+            return -1;
+        }
+        for (i = 0; i < n; i++) {
+            if (entries[i].name)
+                *symbol_lookup(st, entries[i].name, entries[i].hash) = entries[i];
+        }
+        qe_free(&entries);
+    }
+    h = symbol_hash(st, name);
+    ep = symbol_lookup(st, name, h);
+    if (ep->name) {
+        if (st->flags & SYM_REPLACE)
+            ep->value = value;
+        return 0;
+    }
+    if (st->flags & SYM_COPY) {
+        name = qe_strdup(name);
+        if (!name)
+            return -1;
+    }
+    ep->name = name;
+    ep->value = value;
+    ep->hash = h;
+    st->nb_items++;
+    return 1;
+}
+
+void symbol_table_free(SymbolTable *st) {
+    /*@API utils
+       Free the entries of a symbol table, but not the named objects.
+       @argument `st` a valid pointer to a symbol table.
+     */
+    int i;
+
+    if (st->flags & SYM_COPY) {
+        for (i = 0; i < st->nb_allocated; i++)
+            qe_free(unconst(char **)&st->entries[i].name);
+    }
+    qe_free(&st->entries);
+    st->nb_items = st->nb_allocated = 0;
+}
+
 /*---- Dynamic buffers with static allocation ----*/
 
 int buf_write(buf_t *bp, const void *src, int size)
@@ -2538,6 +2956,11 @@ void *qe_decode64(const char *src, size_t len, size_t *sizep)
 
 /*---------------- allocation routines ----------------*/
 
+#ifndef CONFIG_TINY
+/* number of blocks allocated by the wrappers below */
+unsigned long long qe_alloc_count;
+#endif
+
 void *qe_malloc_bytes(size_t size) {
     /*@API memory
        Allocate an uninitialized block of memory of a given size in
@@ -2546,6 +2969,7 @@ void *qe_malloc_bytes(size_t size) {
        @return a pointer to allocated memory, aligned on the maximum
        alignment size.
      */
+    qe_alloc_count_inc();
     return (malloc)(size);
 }
 
@@ -2557,7 +2981,10 @@ void *qe_mallocz_bytes(size_t size) {
        @return a pointer to allocated memory, aligned on the maximum
        alignment size.
      */
-    void *p = (malloc)(size);
+    void *p;
+
+    qe_alloc_count_inc();
+    p = (malloc)(size);
     if (p)
         memset(p, 0, size);
     return p;
@@ -2572,7 +2999,10 @@ void *qe_malloc_dup_bytes(const void *src, size_t size) {
        @return a pointer to allocated memory, aligned on the maximum
        alignment size.
      */
-    void *p = (malloc)(size);
+    void *p;
+
+    qe_alloc_count_inc();
+    p = (malloc)(size);
     if (p)
         memcpy(p, src, size);
     return p;
@@ -2586,7 +3016,10 @@ char *qe_strdup(const char *str) {
        alignment size.
      */
     size_t size = strlen(str) + 1;
-    char *p = (malloc)(size);
+    char *p;
+
+    qe_alloc_count_inc();
+    p = (malloc)(size);
     if (p)
         memcpy(p, str, size);
     return p;
@@ -2601,7 +3034,10 @@ char *qe_strndup(const char *str, size_t n) {
        alignment size.
      */
     size_t len = strnlen(str, n);
-    char *p = (malloc)(len + 1);
+    char *p;
+
+    qe_alloc_count_inc();
+    p = (malloc)(len + 1);
     if (p) {
         memcpy(p, str, len);
         p[len] = '\0';
@@ -2628,6 +3064,7 @@ void *qe_realloc_bytes(void *pp, size_t size) {
      */
     void *p;
     memcpy(&p, pp, sizeof(p));
+    qe_alloc_count_inc();
     p = (realloc)(p, size);
     if (p || !size)
         memcpy(pp, &p, sizeof(p));
@@ -48,12 +48,14 @@
 #define MAX_FILENAME_SIZE 1024
 
 typedef struct FindFileState FindFileState;
+typedef struct DirListing DirListing;
 
 #define FF_PATH     0x010  /* enumerate path argument */
 #define FF_NODIR    0x020  /* only match regular files */
 #define FF_NOXXDIR  0x040  /* do not match . or .. */
 #define FF_ONLYDIR  0x080  /* do not match non directories */
 #define FF_NOPAT    0x100  /* do not use shell matching */
+#define FF_NODOT    0x200  /* skip hidden files and directories */
 #define FF_DEPTH    0x00f  /* max recursion depth */
 
 FindFileState *find_file_open(const char *path, const char *pattern, int flags);
@@ -383,6 +385,7 @@ const char *strmem(const char *str, const void *mem, int size);
 const void *memstr(const void *buf, int size, const char *str);
 int qe_memicmp(const void *p1, const void *p2, size_t count);
 const char *qe_stristr(const char *s1, const char *s2);
+int fuzzy_match(const char *str, const char *pat, int len);
 #define stristart(str, val, ptr)   qe_stristart(str, val, ptr)
 int stristart(const char *str, const char *val, const char **ptr);
 int strxstart(const char *str, const char *val, const char **ptr);
@@ -446,6 +449,22 @@ void *qe_decode64(const char *src, size_t len, size_t *sizep);
 
 /*---- Allocation wrappers and utilities ----*/
 
+#ifndef CONFIG_TINY
+/* number of blocks allocated by these wrappers.
+   Worker threads allocate too: use relaxed atomic accesses. */
+extern unsigned long long qe_alloc_count;
+#ifdef __ATOMIC_RELAXED
+#define qe_alloc_count_inc()  __atomic_fetch_add(&qe_alloc_count, 1, __ATOMIC_RELAXED)
+#define qe_alloc_count_get()  __atomic_load_n(&qe_alloc_count, __ATOMIC_RELAXED)
+#else
+#define qe_alloc_count_inc()  (qe_alloc_count++)
+#define qe_alloc_count_get()  (qe_alloc_count)
+#endif
+#else
+#define qe_alloc_count_inc()  ((void)0)
+#define qe_alloc_count_get()  0ULL
+#endif
+
 void *qe_malloc_bytes(size_t size);
 void *qe_mallocz_bytes(size_t size);
 void *qe_malloc_dup_bytes(const void *src, size_t size);
@@ -589,6 +608,41 @@ void sort_strings(StringArray *cs, int (*sort_func)(const void *p1, const void *
 int remove_duplicate_strings(StringArray *cs);
 void free_strings(StringArray *cs);
 
+/* cached directory listings */
+#define DL_DIR   1  /* entry group flags: directory */
+#define DL_LINK  2  /* symbolic link */
+DirListing *dir_listing_read(const char *path);
+DirListing *dir_listing_get(DirListing **cachep, const char *path, int max_count);
+void dir_listing_add(DirListing **cachep, DirListing *dl, int max_count);
+int dir_listing_cached(const DirListing *cache, const char *path);
+const StringArray *dir_listing_entries(const DirListing *dl);
+void dir_listing_free(DirListing **cachep);
+
+/*---- Symbol tables ----*/
+
+/* open addressing hash table of named objects */
+typedef struct SymbolEntry {
+    const char *name;
+    void *value;
+    unsigned int hash;
+} SymbolEntry;
+
+typedef struct SymbolTable {
+    int nb_items;
+    int nb_allocated;   /* 0 or a power of 2 */
+    int flags;
+    SymbolEntry *entries;
+} SymbolTable;
+
+#define SYM_ICASE   0x01    /* ignore case for ASCII letters */
+#define SYM_XCASE   0x02    /* also ignore spaces, dashes and underscores */
+#define SYM_COPY    0x04    /* the table owns a copy of the names */
+#define SYM_REPLACE 0x08    /* symbol_add() replaces existing entries */
+
+void *symbol_find(const SymbolTable *st, const char *name);
+int symbol_add(SymbolTable *st, const char *name, void *value);
+void symbol_table_free(SymbolTable *st);
+
 /*---- Dynamic buffers with static allocation ----*/
 
 typedef struct buf_t buf_t;
@@ -100,6 +100,8 @@ static VarDef var_table[] = {
            "Default value of `fill-column` for buffers that do not override it" )
     S_VAR( "backup-inhibited", backup_inhibited, VAR_NUMBER, VAR_RW_SAVE,
            "Set to prevent automatic backups of modified files" )
+    S_VAR( "auto-revert", auto_revert, VAR_NUMBER, VAR_RW_SAVE,
+           "Set to reload unmodified buffers when their file changes on disk" )
     S_VAR( "c-label-indent", c_label_indent, VAR_NUMBER, VAR_RW_SAVE,
            "Number of columns to adjust indentation of C labels." )
     S_VAR( "macro-counter", macro_counter, VAR_NUMBER, VAR_RW_SAVE,
@@ -180,16 +182,10 @@ static VarDef var_table[] = {
 
 static VarDef *qe_find_variable(QEmacsState *qs, const char *name)
 {
-    VarDef *vp;
-
-    for (vp = qs->first_variable; vp; vp = vp->next) {
-        if (strequal(vp->name, name))
-              return vp;
-    }
     /* Should have a list of local variables for buffer/window/mode
      * instances
      */
-    return NULL;
+    return symbol_find(&qs->variable_table, name);
 }
 
 void variable_complete(CompleteState *cp, CompleteFunc enumerate) {
@@ -533,6 +529,13 @@ void qe_register_variables(QEmacsState *qs, VarDef *vars, int count)
     }
     vp[-1].next = qs->first_variable;
     qs->first_variable = vars;
+
+    /* arrays are prepended to the variable list: a later array shadows
+       the variables registered before it, and within an array the first
+       entry with a given name wins. The table replaces existing entries,
+       hence the reverse order. */
+    while (vp-- > vars)
+        symbol_add(&qs->variable_table, vp->name, vp);
 }
 
 /* should register this as help function */
@@ -671,6 +674,7 @@ static CompletionDef variable_completion = {
     .enumerate = variable_complete,
     .print_entry = variable_print_entry,
     .get_entry = command_get_entry,
+    .flags = CF_CACHE_LIST,
 };
 
 static void value_complete(CompleteState *cp, CompleteFunc enumerate) {